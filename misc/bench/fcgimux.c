@@ -0,0 +1,768 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_bench.h>
+
+#include <poll.h>
+
+
+/*
+ * A FastCGI application multiplexing requests on its connections, and
+ * HTTP clients requesting it through a running nginx and checking the
+ * responses:
+ *
+ *     objs/bench/fcgimux [fastcgi port [http port [requests
+ *                        [concurrency [multiplexing]]]]]
+ *
+ * with an nginx instance with a single worker process on 127.0.0.1:
+ *
+ *     location / {
+ *         fastcgi_pass 127.0.0.1:9000;
+ *         fastcgi_param REQUEST_URI $request_uri;
+ *         fastcgi_multiplex 4;
+ *     }
+ *
+ * The response to "/<n>" is n bytes long, it is sent in records of random
+ * sizes and padding which interleave with the records of other requests.
+ * With "multiplexing" set to 0 the application reports FCGI_MPXS_CONNS 0,
+ * and each connection is expected to carry one request at a time.
+ */
+
+
+#define NGX_BENCH_FCGI_BEGIN_REQUEST      1
+#define NGX_BENCH_FCGI_ABORT_REQUEST      2
+#define NGX_BENCH_FCGI_END_REQUEST        3
+#define NGX_BENCH_FCGI_PARAMS             4
+#define NGX_BENCH_FCGI_STDIN              5
+#define NGX_BENCH_FCGI_STDOUT             6
+#define NGX_BENCH_FCGI_GET_VALUES         9
+#define NGX_BENCH_FCGI_GET_VALUES_RESULT  10
+
+#define NGX_BENCH_FCGI_MAX_ID             1024
+#define NGX_BENCH_FCGI_MAX_CONNS          256
+#define NGX_BENCH_FCGI_MAX_RECORD         4096
+#define NGX_BENCH_FCGI_IN                 (8 + 65535 + 255)
+#define NGX_BENCH_FCGI_OUT                (256 * 1024)
+#define NGX_BENCH_FCGI_TIMEOUT            10000      /* ms */
+
+
+typedef struct {
+    ngx_uint_t                 state;
+    size_t                     len;
+    size_t                     sent;
+    size_t                     nparams;
+    u_char                     params[2048];
+} ngx_bench_fcgi_request_t;
+
+
+typedef struct {
+    int                        fd;
+    size_t                     in_len;
+    size_t                     out_pos;
+    size_t                     out_len;
+    ngx_uint_t                 active;
+    ngx_uint_t                 next;
+    ngx_bench_fcgi_request_t  *requests;
+    u_char                    *in;
+    u_char                    *out;
+} ngx_bench_fcgi_conn_t;
+
+
+typedef struct {
+    int                        fd;
+    size_t                     len;
+    size_t                     received;
+    size_t                     head_len;
+    ngx_uint_t                 body;
+    u_char                     head[1024];
+} ngx_bench_http_t;
+
+
+static ngx_int_t ngx_bench_fcgi_read(ngx_bench_fcgi_conn_t *bc);
+static ngx_int_t ngx_bench_fcgi_record(ngx_bench_fcgi_conn_t *bc,
+    ngx_uint_t type, ngx_uint_t id, u_char *p, size_t len);
+static void ngx_bench_fcgi_output(ngx_bench_fcgi_conn_t *bc);
+static u_char *ngx_bench_fcgi_header(u_char *p, ngx_uint_t type,
+    ngx_uint_t id, size_t len, size_t padding);
+static ngx_int_t ngx_bench_fcgi_send(ngx_bench_fcgi_conn_t *bc);
+static ngx_int_t ngx_bench_http_request(ngx_bench_http_t *hc,
+    ngx_uint_t port);
+static ngx_int_t ngx_bench_http_read(ngx_bench_http_t *hc);
+static ngx_int_t ngx_bench_nonblocking(int s);
+
+
+static size_t      sizes[] = { 0, 100, 4000, 50000, 500000 };
+static char        header[] = "Content-Type: text/plain" CRLF CRLF;
+
+static ngx_uint_t  multiplexing;
+static ngx_uint_t  max_active;
+static ngx_uint_t  aborted;
+static uint64_t    bytes;
+
+
+#define ngx_bench_fcgi_byte(o, len)  (u_char) ('a' + ((o) + (len)) % 26)
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    int                     s, fd, one;
+    double                  start, progress;
+    ngx_int_t               rc;
+    ngx_uint_t              i, n, nfds, fcgi_port, http_port, requests;
+    ngx_uint_t              concurrency, started, completed, connections;
+    ngx_uint_t              nconns, nclients;
+    struct pollfd           fds[1 + 2 * NGX_BENCH_FCGI_MAX_CONNS];
+    struct sockaddr_in      sin;
+    ngx_bench_http_t        clients[NGX_BENCH_FCGI_MAX_CONNS];
+    ngx_bench_fcgi_conn_t   conns[NGX_BENCH_FCGI_MAX_CONNS];
+
+    fcgi_port = (argc > 1) ? (ngx_uint_t) atoi(argv[1]) : 9000;
+    http_port = (argc > 2) ? (ngx_uint_t) atoi(argv[2]) : 8000;
+    requests = (argc > 3) ? (ngx_uint_t) atoi(argv[3]) : 1000;
+    concurrency = (argc > 4) ? (ngx_uint_t) atoi(argv[4]) : 64;
+    multiplexing = (argc > 5) ? (ngx_uint_t) atoi(argv[5]) : 1;
+
+    if (requests == 0 || concurrency == 0
+        || concurrency > NGX_BENCH_FCGI_MAX_CONNS)
+    {
+        fprintf(stderr, "usage: %s [fastcgi port [http port [requests "
+                "[concurrency [multiplexing]]]]]\n", argv[0]);
+        return 1;
+    }
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        return 1;
+    }
+
+    one = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) == -1) {
+        perror("setsockopt");
+        return 1;
+    }
+
+    ngx_memzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((in_port_t) fcgi_port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(s, (struct sockaddr *) &sin, sizeof(sin)) == -1
+        || listen(s, 128) == -1
+        || ngx_bench_nonblocking(s) != NGX_OK)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    nconns = 0;
+    nclients = 0;
+    started = 0;
+    completed = 0;
+    connections = 0;
+
+    start = ngx_bench_now();
+    progress = start;
+
+    while (completed < requests) {
+
+        while (nclients < concurrency && started < requests) {
+            clients[nclients].len = sizes[ngx_random()
+                                          % (sizeof(sizes) / sizeof(size_t))];
+
+            if (ngx_bench_http_request(&clients[nclients], http_port)
+                != NGX_OK)
+            {
+                return 1;
+            }
+
+            nclients++;
+            started++;
+        }
+
+        fds[0].fd = s;
+        fds[0].events = POLLIN;
+        nfds = 1;
+
+        for (i = 0; i < nconns; i++) {
+            ngx_bench_fcgi_output(&conns[i]);
+
+            fds[nfds].fd = conns[i].fd;
+            fds[nfds].events = POLLIN;
+
+            if (conns[i].out_pos < conns[i].out_len) {
+                fds[nfds].events |= POLLOUT;
+            }
+
+            nfds++;
+        }
+
+        for (i = 0; i < nclients; i++) {
+            fds[nfds].fd = clients[i].fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, 100) == -1) {
+            perror("poll");
+            return 1;
+        }
+
+        if (ngx_bench_now() - progress > NGX_BENCH_FCGI_TIMEOUT * 1e6) {
+            fprintf(stderr, "stalled, %lu of %lu requests completed\n",
+                    (unsigned long) completed, (unsigned long) requests);
+            return 1;
+        }
+
+        /* the connections are processed before they are rearranged */
+
+        for (i = 0, n = 1; i < nconns; i++, n++) {
+
+            if (fds[n].revents & POLLOUT) {
+                if (ngx_bench_fcgi_send(&conns[i]) != NGX_OK) {
+                    return 1;
+                }
+            }
+
+            if (fds[n].revents & (POLLIN|POLLHUP|POLLERR)) {
+                rc = ngx_bench_fcgi_read(&conns[i]);
+
+                if (rc == NGX_ERROR) {
+                    return 1;
+                }
+
+                if (rc == NGX_DONE) {
+                    close(conns[i].fd);
+                    conns[i].fd = -1;
+                }
+
+                progress = ngx_bench_now();
+            }
+        }
+
+        for (i = 0; i < nclients; i++, n++) {
+
+            if (!(fds[n].revents & (POLLIN|POLLHUP|POLLERR))) {
+                continue;
+            }
+
+            rc = ngx_bench_http_read(&clients[i]);
+
+            if (rc == NGX_ERROR) {
+                return 1;
+            }
+
+            if (rc == NGX_DONE) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+                completed++;
+            }
+
+            progress = ngx_bench_now();
+        }
+
+        for (i = 0; i < nclients; /* void */ ) {
+            if (clients[i].fd == -1) {
+                clients[i] = clients[--nclients];
+                continue;
+            }
+
+            i++;
+        }
+
+        for (i = 0; i < nconns; /* void */ ) {
+            if (conns[i].fd == -1) {
+                free(conns[i].in);
+                free(conns[i].out);
+                free(conns[i].requests);
+                conns[i] = conns[--nconns];
+                continue;
+            }
+
+            i++;
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        for ( ;; ) {
+            fd = accept(s, NULL, NULL);
+
+            if (fd == -1) {
+                if (ngx_errno != NGX_EAGAIN) {
+                    perror("accept");
+                    return 1;
+                }
+
+                break;
+            }
+
+            if (nconns == NGX_BENCH_FCGI_MAX_CONNS
+                || ngx_bench_nonblocking(fd) != NGX_OK)
+            {
+                fprintf(stderr, "too many connections\n");
+                return 1;
+            }
+
+            ngx_memzero(&conns[nconns], sizeof(ngx_bench_fcgi_conn_t));
+
+            conns[nconns].fd = fd;
+            conns[nconns].in = malloc(NGX_BENCH_FCGI_IN);
+            conns[nconns].out = malloc(NGX_BENCH_FCGI_OUT);
+            conns[nconns].requests = calloc(NGX_BENCH_FCGI_MAX_ID,
+                                            sizeof(ngx_bench_fcgi_request_t));
+
+            if (conns[nconns].in == NULL
+                || conns[nconns].out == NULL
+                || conns[nconns].requests == NULL)
+            {
+                return 1;
+            }
+
+            nconns++;
+            connections++;
+        }
+    }
+
+    printf("%lu requests, %llu bytes in %.1f ms: %lu connections, "
+           "up to %lu requests per connection, %lu aborted\n",
+           (unsigned long) completed, (unsigned long long) bytes,
+           (ngx_bench_now() - start) / 1e6, (unsigned long) connections,
+           (unsigned long) max_active, (unsigned long) aborted);
+
+    if (!multiplexing && max_active > 1) {
+        fprintf(stderr, "requests multiplexed without FCGI_MPXS_CONNS\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_fcgi_read(ngx_bench_fcgi_conn_t *bc)
+{
+    u_char   *p, *last;
+    size_t    len, size;
+    ssize_t   n;
+
+    n = recv(bc->fd, bc->in + bc->in_len, NGX_BENCH_FCGI_IN - bc->in_len, 0);
+
+    if (n == -1) {
+        if (ngx_errno == NGX_EAGAIN) {
+            return NGX_OK;
+        }
+
+        perror("recv");
+        return NGX_ERROR;
+    }
+
+    if (n == 0) {
+        return NGX_DONE;
+    }
+
+    bc->in_len += n;
+
+    p = bc->in;
+    last = bc->in + bc->in_len;
+
+    while (last - p >= 8) {
+        len = (p[4] << 8) + p[5];
+        size = 8 + len + p[6];
+
+        if ((size_t) (last - p) < size) {
+            break;
+        }
+
+        if (p[0] != 1) {
+            fprintf(stderr, "invalid record version %d\n", p[0]);
+            return NGX_ERROR;
+        }
+
+        if (ngx_bench_fcgi_record(bc, p[1], (p[2] << 8) + p[3], p + 8, len)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        p += size;
+    }
+
+    bc->in_len = ngx_movemem(bc->in, p, last - p) - bc->in;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_bench_fcgi_record(ngx_bench_fcgi_conn_t *bc, ngx_uint_t type,
+    ngx_uint_t id, u_char *p, size_t len)
+{
+    u_char                    *last, *name, *value;
+    size_t                     name_len, value_len;
+    u_char                     values[64];
+    ngx_bench_fcgi_request_t  *r;
+
+    if (type == NGX_BENCH_FCGI_GET_VALUES) {
+        last = ngx_sprintf(values, "\15\4" "FCGI_MAX_REQS" "%d"
+                                   "\17\1" "FCGI_MPXS_CONNS" "%d",
+                           NGX_BENCH_FCGI_MAX_ID, multiplexing ? 1 : 0);
+
+        if (NGX_BENCH_FCGI_OUT - bc->out_len < 8 + (size_t) (last - values)) {
+            fprintf(stderr, "output buffer overflow\n");
+            return NGX_ERROR;
+        }
+
+        p = ngx_bench_fcgi_header(bc->out + bc->out_len,
+                                  NGX_BENCH_FCGI_GET_VALUES_RESULT, 0,
+                                  last - values, 0);
+        p = ngx_cpymem(p, values, last - values);
+
+        bc->out_len = p - bc->out;
+
+        return NGX_OK;
+    }
+
+    if (id == 0 || id >= NGX_BENCH_FCGI_MAX_ID) {
+        fprintf(stderr, "unexpected record type %lu, id %lu\n",
+                (unsigned long) type, (unsigned long) id);
+        return NGX_ERROR;
+    }
+
+    r = &bc->requests[id];
+
+    switch (type) {
+
+    case NGX_BENCH_FCGI_BEGIN_REQUEST:
+
+        if (r->state) {
+            fprintf(stderr, "request id %lu in use\n", (unsigned long) id);
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(r, sizeof(ngx_bench_fcgi_request_t));
+        r->state = 1;
+
+        if (++bc->active > max_active) {
+            max_active = bc->active;
+        }
+
+        break;
+
+    case NGX_BENCH_FCGI_PARAMS:
+
+        if (len) {
+            len = ngx_min(len, sizeof(r->params) - r->nparams);
+            ngx_memcpy(r->params + r->nparams, p, len);
+            r->nparams += len;
+            break;
+        }
+
+        p = r->params;
+        last = r->params + r->nparams;
+
+        /* short names and values are enough */
+
+        while (last - p >= 2) {
+            name_len = p[0];
+            value_len = p[1];
+            name = p + 2;
+            value = name + name_len;
+            p = value + value_len;
+
+            if (p > last) {
+                break;
+            }
+
+            if (name_len == sizeof("REQUEST_URI") - 1
+                && ngx_strncmp(name, "REQUEST_URI", name_len) == 0
+                && value_len > 1)
+            {
+                r->len = ngx_atoi(value + 1, value_len - 1);
+            }
+        }
+
+        break;
+
+    case NGX_BENCH_FCGI_STDIN:
+
+        if (len == 0 && r->state == 1) {
+            r->state = 2;
+        }
+
+        break;
+
+    case NGX_BENCH_FCGI_ABORT_REQUEST:
+
+        if (r->state) {
+            r->state = 3;
+            aborted++;
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_bench_fcgi_output(ngx_bench_fcgi_conn_t *bc)
+{
+    u_char                    *p;
+    size_t                     o, chunk, total, padding;
+    ngx_uint_t                 i, id;
+    ngx_bench_fcgi_request_t  *r;
+
+    /* one record of each request in turn */
+
+    while (NGX_BENCH_FCGI_OUT - bc->out_len
+           >= 8 + NGX_BENCH_FCGI_MAX_RECORD + 7 + 8 + 16)
+    {
+        for (i = 0; i < NGX_BENCH_FCGI_MAX_ID; i++) {
+            id = (bc->next + i) % NGX_BENCH_FCGI_MAX_ID;
+
+            if (bc->requests[id].state >= 2) {
+                break;
+            }
+        }
+
+        if (i == NGX_BENCH_FCGI_MAX_ID) {
+            return;
+        }
+
+        bc->next = id + 1;
+
+        r = &bc->requests[id];
+        p = bc->out + bc->out_len;
+
+        total = sizeof(header) - 1 + r->len;
+        chunk = 1 + (size_t) ngx_random() % NGX_BENCH_FCGI_MAX_RECORD;
+        chunk = ngx_min(chunk, total - r->sent);
+
+        if (r->state == 2 && chunk) {
+            padding = chunk % 8;
+
+            p = ngx_bench_fcgi_header(p, NGX_BENCH_FCGI_STDOUT, id, chunk,
+                                      padding);
+
+            for (o = r->sent; o < r->sent + chunk; o++) {
+                *p++ = (o < sizeof(header) - 1)
+                       ? header[o]
+                       : ngx_bench_fcgi_byte(o - (sizeof(header) - 1),
+                                             r->len);
+            }
+
+            ngx_memzero(p, padding);
+            p += padding;
+
+            r->sent += chunk;
+
+        } else {
+            p = ngx_bench_fcgi_header(p, NGX_BENCH_FCGI_STDOUT, id, 0, 0);
+            p = ngx_bench_fcgi_header(p, NGX_BENCH_FCGI_END_REQUEST, id, 8,
+                                      0);
+            ngx_memzero(p, 8);
+            p += 8;
+
+            r->state = 0;
+            bc->active--;
+        }
+
+        bc->out_len = p - bc->out;
+    }
+}
+
+
+static u_char *
+ngx_bench_fcgi_header(u_char *p, ngx_uint_t type, ngx_uint_t id, size_t len,
+    size_t padding)
+{
+    *p++ = 1;
+    *p++ = (u_char) type;
+    *p++ = (u_char) (id >> 8);
+    *p++ = (u_char) id;
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) padding;
+    *p++ = 0;
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_bench_fcgi_send(ngx_bench_fcgi_conn_t *bc)
+{
+    ssize_t  n;
+
+    while (bc->out_pos < bc->out_len) {
+        n = send(bc->fd, bc->out + bc->out_pos, bc->out_len - bc->out_pos, 0);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EAGAIN) {
+                break;
+            }
+
+            perror("send");
+            return NGX_ERROR;
+        }
+
+        bc->out_pos += n;
+    }
+
+    bc->out_len = ngx_movemem(bc->out, bc->out + bc->out_pos,
+                              bc->out_len - bc->out_pos) - bc->out;
+    bc->out_pos = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_bench_http_request(ngx_bench_http_t *hc, ngx_uint_t port)
+{
+    int                  s;
+    u_char              *last;
+    u_char               buf[128];
+    struct sockaddr_in   sin;
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((in_port_t) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(s, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("connect");
+        return NGX_ERROR;
+    }
+
+    last = ngx_sprintf(buf, "GET /%uz HTTP/1.0" CRLF
+                            "Host: localhost" CRLF CRLF, hc->len);
+
+    if (send(s, buf, last - buf, 0) != last - buf) {
+        perror("send");
+        return NGX_ERROR;
+    }
+
+    if (ngx_bench_nonblocking(s) != NGX_OK) {
+        perror("fcntl");
+        return NGX_ERROR;
+    }
+
+    hc->fd = s;
+    hc->received = 0;
+    hc->head_len = 0;
+    hc->body = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_bench_http_read(ngx_bench_http_t *hc)
+{
+    u_char   *p, *last;
+    ssize_t   n;
+    u_char    buf[16384];
+
+    for ( ;; ) {
+        n = recv(hc->fd, buf, sizeof(buf), 0);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EAGAIN) {
+                return NGX_OK;
+            }
+
+            perror("recv");
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            if (!hc->body || hc->received != hc->len) {
+                fprintf(stderr, "/%lu: %lu of %lu bytes received\n",
+                        (unsigned long) hc->len, (unsigned long) hc->received,
+                        (unsigned long) hc->len);
+                return NGX_ERROR;
+            }
+
+            bytes += hc->received;
+
+            return NGX_DONE;
+        }
+
+        p = buf;
+        last = buf + n;
+
+        if (!hc->body) {
+            n = ngx_min((size_t) n, sizeof(hc->head) - hc->head_len);
+            ngx_memcpy(hc->head + hc->head_len, buf, n);
+            hc->head_len += n;
+
+            p = ngx_strlcasestrn(hc->head, hc->head + hc->head_len,
+                                 (u_char *) CRLF CRLF, 4 - 1);
+
+            if (p == NULL) {
+                if (hc->head_len == sizeof(hc->head)) {
+                    fprintf(stderr, "/%lu: response header too long\n",
+                            (unsigned long) hc->len);
+                    return NGX_ERROR;
+                }
+
+                continue;
+            }
+
+            if (ngx_strncmp(hc->head, "HTTP/1.1 200 ", 13) != 0) {
+                fprintf(stderr, "/%lu: %.*s\n", (unsigned long) hc->len,
+                        (int) (ngx_strlchr(hc->head, p, CR) - hc->head),
+                        hc->head);
+                return NGX_ERROR;
+            }
+
+            /* the body after the header in buf */
+
+            p = buf + (p + 4 - hc->head) - (hc->head_len - n);
+            hc->body = 1;
+        }
+
+        for ( /* void */ ; p < last; p++) {
+            if (*p != ngx_bench_fcgi_byte(hc->received, hc->len)) {
+                fprintf(stderr, "/%lu: invalid byte at %lu\n",
+                        (unsigned long) hc->len,
+                        (unsigned long) hc->received);
+                return NGX_ERROR;
+            }
+
+            hc->received++;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_bench_nonblocking(int s)
+{
+    int  flags;
+
+    flags = fcntl(s, F_GETFL);
+
+    if (flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,337 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_bench.h>
+
+
+/*
+ * The time to the first byte of a small response while bulk responses
+ * are downloaded on the same HTTP/2 connection by a client reading at
+ * a limited rate:
+ *
+ *     objs/bench/h2prio [port [bulk [bulk weight [weight [MB/s]]]]]
+ *
+ * with an nginx instance serving a large "/bulk" file and a 20k "/small"
+ * file on 127.0.0.1, with a small send buffer so that the frames are
+ * queued in nginx rather than in the socket:
+ *
+ *     server {
+ *         listen 8000 http2 sndbuf=32k;
+ *         root html;
+ *     }
+ *
+ * The bulk streams are requested first, and the small one 0.5s later.
+ */
+
+
+#define NGX_BENCH_H2_DATA           0
+#define NGX_BENCH_H2_HEADERS        1
+#define NGX_BENCH_H2_SETTINGS       4
+#define NGX_BENCH_H2_GOAWAY         7
+#define NGX_BENCH_H2_WINDOW_UPDATE  8
+
+#define NGX_BENCH_H2_END_STREAM     0x01
+#define NGX_BENCH_H2_ACK            0x01
+#define NGX_BENCH_H2_END_HEADERS    0x04
+#define NGX_BENCH_H2_PADDED         0x08
+#define NGX_BENCH_H2_PRIORITY       0x20
+
+#define NGX_BENCH_H2_MAX_STREAMS    64
+#define NGX_BENCH_H2_TICK           2      /* ms */
+
+
+static u_char *ngx_bench_h2_frame(u_char *p, size_t len, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_bench_h2_request(int s, ngx_uint_t sid, char *path,
+    ngx_uint_t weight);
+static ngx_int_t ngx_bench_h2_send(int s, u_char *buf, size_t len);
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    int                  s, rcvbuf;
+    u_char              *p, *last, type, flags;
+    size_t               size, len, chunk;
+    ssize_t              n;
+    double               start, small_start, first, done;
+    uint64_t             received[NGX_BENCH_H2_MAX_STREAMS];
+    uint64_t             min, max;
+    ngx_uint_t           i, sid, port, bulk, bulk_weight, weight, rate;
+    ngx_uint_t           small;
+    struct timespec      tick;
+    struct sockaddr_in   sin;
+    u_char               out[256], buf[256 * 1024];
+
+    port = (argc > 1) ? (ngx_uint_t) atoi(argv[1]) : 8000;
+    bulk = (argc > 2) ? (ngx_uint_t) atoi(argv[2]) : 8;
+    bulk_weight = (argc > 3) ? (ngx_uint_t) atoi(argv[3]) : 16;
+    weight = (argc > 4) ? (ngx_uint_t) atoi(argv[4]) : 16;
+    rate = (argc > 5) ? (ngx_uint_t) atoi(argv[5]) : 20;
+
+    if (bulk == 0 || bulk >= NGX_BENCH_H2_MAX_STREAMS
+        || bulk_weight == 0 || bulk_weight > 256
+        || weight == 0 || weight > 256
+        || rate == 0)
+    {
+        fprintf(stderr, "usage: %s [port [bulk [bulk weight [weight "
+                "[MB/s]]]]]\n", argv[0]);
+        return 1;
+    }
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        return 1;
+    }
+
+    /* a small receive buffer, so the client rate limits the server */
+
+    rcvbuf = 65536;
+
+    if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) == -1) {
+        perror("setsockopt");
+        return 1;
+    }
+
+    ngx_memzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((in_port_t) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(s, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("connect");
+        return 1;
+    }
+
+    /* the preface, unlimited windows, and the bulk requests */
+
+    p = ngx_cpymem(out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",
+                   sizeof("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") - 1);
+
+    p = ngx_bench_h2_frame(p, 6, NGX_BENCH_H2_SETTINGS, 0, 0);
+    *p++ = 0; *p++ = 4;
+    *p++ = 0x7f; *p++ = 0xff; *p++ = 0xff; *p++ = 0xff;
+
+    p = ngx_bench_h2_frame(p, 4, NGX_BENCH_H2_WINDOW_UPDATE, 0, 0);
+    *p++ = 0x7f; *p++ = 0xfe; *p++ = 0x00; *p++ = 0x00;
+
+    if (ngx_bench_h2_send(s, out, p - out) != NGX_OK) {
+        return 1;
+    }
+
+    ngx_memzero(received, sizeof(received));
+
+    for (i = 0; i < bulk; i++) {
+        if (ngx_bench_h2_request(s, 2 * i + 1, "/bulk", bulk_weight)
+            != NGX_OK)
+        {
+            return 1;
+        }
+    }
+
+    small = 2 * bulk + 1;
+
+    start = ngx_bench_now();
+    small_start = 0;
+    first = 0;
+    done = 0;
+
+    chunk = rate * 1000 * NGX_BENCH_H2_TICK;
+
+    if (chunk > sizeof(buf) / 2) {
+        chunk = sizeof(buf) / 2;
+    }
+
+    tick.tv_sec = 0;
+    tick.tv_nsec = NGX_BENCH_H2_TICK * 1000000;
+
+    last = buf;
+
+    while (done == 0) {
+
+        if (small_start == 0 && ngx_bench_now() - start > 500e6) {
+            if (ngx_bench_h2_request(s, small, "/small", weight) != NGX_OK) {
+                return 1;
+            }
+
+            small_start = ngx_bench_now();
+        }
+
+        n = recv(s, last, chunk, 0);
+
+        if (n == -1) {
+            perror("recv");
+            return 1;
+        }
+
+        if (n == 0) {
+            fprintf(stderr, "connection closed\n");
+            return 1;
+        }
+
+        last += n;
+        p = buf;
+
+        while (last - p >= 9) {
+            size = (p[0] << 16) + (p[1] << 8) + p[2];
+
+            if ((size_t) (last - p) < 9 + size) {
+                break;
+            }
+
+            type = p[3];
+            flags = p[4];
+            sid = ((p[5] & 0x7f) << 24) + (p[6] << 16) + (p[7] << 8) + p[8];
+
+            p += 9;
+
+            switch (type) {
+
+            case NGX_BENCH_H2_DATA:
+
+                len = size;
+
+                if (flags & NGX_BENCH_H2_PADDED) {
+                    len -= 1 + p[0];
+                }
+
+                if (sid < 2 * NGX_BENCH_H2_MAX_STREAMS) {
+                    received[sid / 2] += len;
+                }
+
+                if (sid == small) {
+                    if (first == 0) {
+                        first = ngx_bench_now() - small_start;
+                    }
+
+                    if (flags & NGX_BENCH_H2_END_STREAM) {
+                        done = ngx_bench_now() - small_start;
+                    }
+                }
+
+                break;
+
+            case NGX_BENCH_H2_SETTINGS:
+
+                if (!(flags & NGX_BENCH_H2_ACK)) {
+                    ngx_bench_h2_frame(out, 0, NGX_BENCH_H2_SETTINGS,
+                                       NGX_BENCH_H2_ACK, 0);
+
+                    if (ngx_bench_h2_send(s, out, 9) != NGX_OK) {
+                        return 1;
+                    }
+                }
+
+                break;
+
+            case NGX_BENCH_H2_GOAWAY:
+                fprintf(stderr, "GOAWAY received\n");
+                return 1;
+            }
+
+            p += size;
+        }
+
+        last = ngx_movemem(buf, p, last - p);
+
+        (void) nanosleep(&tick, NULL);
+    }
+
+    min = (uint64_t) -1;
+    max = 0;
+
+    for (i = 0; i < bulk; i++) {
+        min = ngx_min(min, received[i]);
+        max = ngx_max(max, received[i]);
+    }
+
+    printf("bulk %lu x %lu, weight %lu: first byte %.1f ms, "
+           "complete %.1f ms, bulk received %llu..%llu\n",
+           (unsigned long) bulk, (unsigned long) bulk_weight,
+           (unsigned long) weight, first / 1e6, done / 1e6,
+           (unsigned long long) min, (unsigned long long) max);
+
+    close(s);
+
+    return 0;
+}
+
+
+static u_char *
+ngx_bench_h2_frame(u_char *p, size_t len, ngx_uint_t type, ngx_uint_t flags,
+    ngx_uint_t sid)
+{
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) type;
+    *p++ = (u_char) flags;
+    *p++ = (u_char) (sid >> 24);
+    *p++ = (u_char) (sid >> 16);
+    *p++ = (u_char) (sid >> 8);
+    *p++ = (u_char) sid;
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_bench_h2_request(int s, ngx_uint_t sid, char *path, ngx_uint_t weight)
+{
+    u_char  *p, *block;
+    size_t   len;
+    u_char   buf[128];
+
+    /* the header block is sent with the priority: no dependency, weight */
+
+    block = buf + 9;
+    p = block;
+
+    *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 0;
+    *p++ = (u_char) (weight - 1);
+
+    *p++ = 0x82;                                   /* :method: GET */
+    *p++ = 0x86;                                   /* :scheme: http */
+
+    len = ngx_strlen(path);
+    *p++ = 0x04;                                   /* :path */
+    *p++ = (u_char) len;
+    p = ngx_cpymem(p, path, len);
+
+    *p++ = 0x01;                                   /* :authority */
+    *p++ = sizeof("localhost") - 1;
+    p = ngx_cpymem(p, "localhost", sizeof("localhost") - 1);
+
+    ngx_bench_h2_frame(buf, p - block, NGX_BENCH_H2_HEADERS,
+                       NGX_BENCH_H2_END_STREAM|NGX_BENCH_H2_END_HEADERS
+                       |NGX_BENCH_H2_PRIORITY, sid);
+
+    return ngx_bench_h2_send(s, buf, p - buf);
+}
+
+
+static ngx_int_t
+ngx_bench_h2_send(int s, u_char *buf, size_t len)
+{
+    ssize_t  n;
+
+    while (len) {
+        n = send(s, buf, len, 0);
+
+        if (n == -1) {
+            perror("send");
+            return NGX_ERROR;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,134 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_BENCH_H_INCLUDED_
+#define _NGX_BENCH_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * A benchmark runs a case for the given number of iterations, best of
+ * NGX_BENCH_RUNS runs, and prints the time per iteration.
+ */
+
+#define NGX_BENCH_RUNS  10
+
+
+typedef struct {
+    const char       *name;
+    ngx_uint_t        n;
+    ngx_uint_t        run;
+    double            start;
+    double            elapsed;
+    double            best;
+} ngx_bench_t;
+
+
+static ngx_open_file_t  ngx_bench_log_file;
+static ngx_log_t        ngx_bench_log;
+
+
+static ngx_inline ngx_uint_t
+ngx_bench_init(int argc, char *const *argv, ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    ngx_bench_log_file.fd = ngx_stderr;
+    ngx_bench_log.file = &ngx_bench_log_file;
+    ngx_bench_log.log_level = NGX_LOG_NOTICE;
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    for (i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_time_init();
+    ngx_cpuinfo();
+
+    if (argc > 1) {
+        n = atoi(argv[1]);
+    }
+
+    return n;
+}
+
+
+static ngx_inline double
+ngx_bench_now(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * usage:
+ *
+ *     for (ngx_bench_start(&b, "case", n); ngx_bench_run(&b); ) {
+ *         for (i = 0; i < n; i++) { ... }
+ *     }
+ */
+
+static ngx_inline void
+ngx_bench_start(ngx_bench_t *b, const char *name, ngx_uint_t n)
+{
+    b->name = name;
+    b->n = n;
+    b->run = 0;
+    b->best = 0;
+}
+
+
+/* the setup of a run can be excluded from its time */
+
+static ngx_inline void
+ngx_bench_pause(ngx_bench_t *b)
+{
+    b->elapsed += ngx_bench_now() - b->start;
+}
+
+
+static ngx_inline void
+ngx_bench_resume(ngx_bench_t *b)
+{
+    b->start = ngx_bench_now();
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_bench_run(ngx_bench_t *b)
+{
+    double  t;
+
+    t = ngx_bench_now();
+
+    if (b->run) {
+        t += b->elapsed - b->start;
+
+        if (b->best == 0 || t < b->best) {
+            b->best = t;
+        }
+    }
+
+    if (b->run++ == NGX_BENCH_RUNS) {
+        printf("%-40s %10.1f ns\n", b->name, b->best / b->n);
+        return 0;
+    }
+
+    b->elapsed = 0;
+    b->start = ngx_bench_now();
+
+    return 1;
+}
+
+
+#endif /* _NGX_BENCH_H_INCLUDED_ */
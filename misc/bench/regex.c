@@ -0,0 +1,265 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_bench.h>
+
+
+/*
+ * The first matching regex of a list, like regex locations or the
+ * regexes of a map, is found with one pcre_exec() per regex and with
+ * a regex set, for lists of different sizes.  Half of the regexes are
+ * anchored at the start of a URI, and half are floating extensions:
+ *
+ *     objs/bench/regex [iterations [jit]]
+ *
+ * The URIs match no regex, the first one, or the last one.
+ */
+
+
+#define NGX_BENCH_REGEX_MAX  256
+
+
+typedef struct {
+    ngx_regex_elt_t   *elts;
+    ngx_uint_t         n;
+    ngx_regex_set_t   *set;
+} ngx_bench_regex_list_t;
+
+
+static ngx_int_t ngx_bench_regex_list(ngx_pool_t *pool,
+    ngx_bench_regex_list_t *list, ngx_uint_t n, ngx_uint_t jit);
+static ngx_int_t ngx_bench_regex_exec(ngx_bench_regex_list_t *list,
+    ngx_str_t *s);
+static ngx_int_t ngx_bench_regex_set_exec(ngx_bench_regex_list_t *list,
+    ngx_str_t *s);
+
+
+static ngx_uint_t  sizes[] = { 2, 4, 8, 16, 64, 256 };
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    char                     name[64];
+    u_char                   buf[3][64];
+    ngx_int_t                rc;
+    ngx_str_t                uri[3];
+    ngx_uint_t               n, i, k, u, jit;
+    ngx_pool_t              *pool;
+    ngx_bench_t              b;
+    ngx_bench_regex_list_t   list;
+
+    static char  *cases[] = { "none", "first", "last" };
+
+    n = ngx_bench_init(argc, argv, 100000);
+    jit = (argc > 2) ? (ngx_uint_t) atoi(argv[2]) : 0;
+
+    ngx_regex_init();
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &ngx_bench_log);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+
+        if (ngx_bench_regex_list(pool, &list, sizes[k], jit) != NGX_OK) {
+            return 1;
+        }
+
+        uri[0].data = (u_char *) "/static/images/logo.png";
+        uri[0].len = ngx_strlen(uri[0].data);
+
+        uri[1].data = buf[1];
+        uri[1].len = ngx_sprintf(buf[1], "/app0/users/profile/edit")
+                     - buf[1];
+
+        /* the last regex is a floating one */
+
+        uri[2].data = buf[2];
+        uri[2].len = ngx_sprintf(buf[2], "/static/images/logo.e%ui",
+                                 sizes[k] - 1)
+                     - buf[2];
+
+        for (u = 0; u < 3; u++) {
+
+            rc = ngx_bench_regex_exec(&list, &uri[u]);
+
+            if (rc != ngx_bench_regex_set_exec(&list, &uri[u])) {
+                fprintf(stderr, "regex set mismatch on \"%s\"\n",
+                        uri[u].data);
+                return 1;
+            }
+
+            ngx_sprintf((u_char *) name, "regex %ui %s one by one%Z",
+                        sizes[k], cases[u]);
+
+            for (ngx_bench_start(&b, name, n); ngx_bench_run(&b); ) {
+                for (i = 0; i < n; i++) {
+                    (void) ngx_bench_regex_exec(&list, &uri[u]);
+                }
+            }
+
+            ngx_sprintf((u_char *) name, "regex %ui %s set%Z",
+                        sizes[k], cases[u]);
+
+            for (ngx_bench_start(&b, name, n); ngx_bench_run(&b); ) {
+                for (i = 0; i < n; i++) {
+                    (void) ngx_bench_regex_set_exec(&list, &uri[u]);
+                }
+            }
+        }
+    }
+
+    ngx_destroy_pool(pool);
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_regex_list(ngx_pool_t *pool, ngx_bench_regex_list_t *list,
+    ngx_uint_t n, ngx_uint_t jit)
+{
+    int                   opt;
+    u_char               *p;
+    ngx_uint_t            i;
+    const char           *errstr;
+    ngx_regex_compile_t   rc;
+    u_char                errbuf[NGX_MAX_CONF_ERRSTR];
+
+    list->n = n;
+
+    list->elts = ngx_palloc(pool, n * sizeof(ngx_regex_elt_t));
+    if (list->elts == NULL) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_PCRE_JIT)
+    opt = jit ? PCRE_STUDY_JIT_COMPILE : 0;
+#else
+    opt = 0;
+#endif
+
+    for (i = 0; i < n; i++) {
+
+        p = ngx_pnalloc(pool, 64);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (i % 2) {
+            ngx_sprintf(p, "\\.e%ui$%Z", i);
+
+        } else {
+            ngx_sprintf(p, "^/app%ui/users/\\w+/edit$%Z", i);
+        }
+
+        ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+        rc.pattern.data = p;
+        rc.pattern.len = ngx_strlen(p);
+        rc.pool = pool;
+        rc.err.len = NGX_MAX_CONF_ERRSTR;
+        rc.err.data = errbuf;
+
+        if (ngx_regex_compile(&rc) != NGX_OK) {
+            fprintf(stderr, "%.*s\n", (int) rc.err.len, rc.err.data);
+            return NGX_ERROR;
+        }
+
+        rc.regex->extra = pcre_study(rc.regex->code, opt, &errstr);
+
+        list->elts[i].regex = rc.regex;
+        list->elts[i].name = p;
+    }
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pool = pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errbuf;
+
+    list->set = ngx_regex_set_compile(&rc, list->elts, n);
+
+    if (list->set == NULL) {
+        fprintf(stderr, "%.*s\n", (int) rc.err.len, rc.err.data);
+        return NGX_ERROR;
+    }
+
+    if (list->set->anchored.regex) {
+        list->set->anchored.regex->extra =
+                    pcre_study(list->set->anchored.regex->code, opt, &errstr);
+    }
+
+    if (list->set->floating.regex) {
+        list->set->floating.regex->extra =
+                    pcre_study(list->set->floating.regex->code, opt, &errstr);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_bench_regex_exec(ngx_bench_regex_list_t *list, ngx_str_t *s)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < list->n; i++) {
+        if (ngx_regex_exec(list->elts[i].regex, s, NULL, 0) >= 0) {
+            return i;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/* as ngx_http_regex_set_exec() does */
+
+static ngx_int_t
+ngx_bench_regex_set_exec(ngx_bench_regex_list_t *list, ngx_str_t *s)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  i, n, first;
+
+    for (i = 0; i < list->n; i++) {
+
+        if (list->set->combined[i]) {
+            break;
+        }
+
+        if (ngx_regex_exec(list->elts[i].regex, s, NULL, 0) >= 0) {
+            return i;
+        }
+    }
+
+    if (i == list->n) {
+        return NGX_DECLINED;
+    }
+
+    first = i;
+
+    rc = ngx_regex_set_exec(list->set, s);
+
+    n = (rc >= 0) ? (ngx_uint_t) rc : list->n;
+
+    for (i = first; i < n; i++) {
+
+        if (list->set->combined[i]) {
+            continue;
+        }
+
+        if (ngx_regex_exec(list->elts[i].regex, s, NULL, 0) >= 0) {
+            return i;
+        }
+    }
+
+    return (n == list->n) ? NGX_DECLINED : (ngx_int_t) n;
+}
@@ -0,0 +1,508 @@
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_bench.h>
+
+
+/*
+ * The request header to an upstream server is created the way it is
+ * for each proxied request: the configuration of a location is parsed
+ * from the "proxy_set_header" and "fastcgi_param" directives below and
+ * merged by the modules, and the upstream request is set up by the
+ * content handler of the location.  The request is marked as waiting
+ * for aio, so the upstream stops before it connects, and the benchmark
+ * then calls the create_request() handler it has been given.  The
+ * variables of the request are reset before each call, like they are
+ * for each new request.
+ *
+ *     objs/bench/script [iterations [print]]
+ *
+ * With the second argument, the request headers created are printed.
+ */
+
+
+typedef struct {
+    char                  *name;
+    char                  *conf;
+    ngx_http_conf_ctx_t    ctx;
+} ngx_bench_script_case_t;
+
+
+static ngx_int_t ngx_bench_script_conf(ngx_conf_t *cf,
+    ngx_bench_script_case_t *bc);
+static ngx_int_t ngx_bench_script_request(ngx_pool_t *pool,
+    ngx_http_request_t *r);
+
+
+static ngx_bench_script_case_t  cases[] = {
+
+    { "proxy default headers",
+      "proxy_pass http://127.0.0.1:8080;", { NULL, NULL, NULL } },
+
+    { "proxy_set_header x5",
+      "proxy_pass http://127.0.0.1:8080;"
+      "proxy_set_header Host $host;"
+      "proxy_set_header X-Real-IP $remote_addr;"
+      "proxy_set_header X-Forwarded-For $proxy_add_x_forwarded_for;"
+      "proxy_set_header X-Forwarded-Proto $scheme;"
+      "proxy_set_header X-Original-URI $request_uri;", { NULL, NULL, NULL } },
+
+    { "proxy_set_header composite",
+      "proxy_pass http://127.0.0.1:8080;"
+      "proxy_set_header Forwarded"
+      " \"for=$remote_addr;host=$host;proto=$scheme\";"
+      "proxy_set_header X-Original-URL $scheme://$host$request_uri;"
+      "proxy_set_header X-Request \"$request_method $uri $args\";",
+      { NULL, NULL, NULL } },
+
+    { "fastcgi_params",
+      "fastcgi_pass 127.0.0.1:9000;"
+      "fastcgi_param SCRIPT_FILENAME $document_root$fastcgi_script_name;"
+      "fastcgi_param QUERY_STRING $query_string;"
+      "fastcgi_param REQUEST_METHOD $request_method;"
+      "fastcgi_param CONTENT_TYPE $content_type;"
+      "fastcgi_param CONTENT_LENGTH $content_length;"
+      "fastcgi_param SCRIPT_NAME $fastcgi_script_name;"
+      "fastcgi_param REQUEST_URI $request_uri;"
+      "fastcgi_param DOCUMENT_URI $document_uri;"
+      "fastcgi_param DOCUMENT_ROOT $document_root;"
+      "fastcgi_param SERVER_PROTOCOL $server_protocol;"
+      "fastcgi_param REQUEST_SCHEME $scheme;"
+      "fastcgi_param HTTPS $https if_not_empty;"
+      "fastcgi_param GATEWAY_INTERFACE CGI/1.1;"
+      "fastcgi_param SERVER_SOFTWARE nginx/$nginx_version;"
+      "fastcgi_param REMOTE_ADDR $remote_addr;"
+      "fastcgi_param REMOTE_PORT $remote_port;"
+      "fastcgi_param SERVER_ADDR $server_addr;"
+      "fastcgi_param SERVER_PORT $server_port;"
+      "fastcgi_param SERVER_NAME $server_name;"
+      "fastcgi_param REDIRECT_STATUS 200;", { NULL, NULL, NULL } },
+
+    { NULL, NULL, { NULL, NULL, NULL } }
+};
+
+
+static ngx_connection_t    c;
+static ngx_event_t         rev, wev;
+static struct sockaddr_in  local, remote;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  n, i, k, m, nvars;
+    ngx_conf_t                  cf;
+    ngx_pool_t                 *pool, *rpool;
+    ngx_cycle_t                 cycle;
+    ngx_bench_t                 b;
+    ngx_http_module_t          *module;
+    ngx_http_request_t          r;
+    ngx_http_upstream_t        *u;
+    ngx_http_conf_ctx_t         ctx;
+    ngx_bench_script_case_t    *bc;
+    ngx_http_core_loc_conf_t   *clcf;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    n = ngx_bench_init(argc, argv, 200000);
+
+    pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, &ngx_bench_log);
+    rpool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &ngx_bench_log);
+
+    if (pool == NULL || rpool == NULL) {
+        return 1;
+    }
+
+    ngx_memzero(&cycle, sizeof(ngx_cycle_t));
+    cycle.pool = pool;
+    cycle.log = &ngx_bench_log;
+    ngx_str_set(&cycle.prefix, "/tmp/");
+    ngx_str_set(&cycle.conf_prefix, "/tmp/");
+
+    if (ngx_array_init(&cycle.paths, pool, 4, sizeof(ngx_path_t *))
+        != NGX_OK
+        || ngx_list_init(&cycle.open_files, pool, 4, sizeof(ngx_open_file_t))
+           != NGX_OK
+        || ngx_list_init(&cycle.shared_memory, pool, 1, sizeof(ngx_shm_zone_t))
+           != NGX_OK)
+    {
+        return 1;
+    }
+
+    ngx_cycle = &cycle;
+
+    if (ngx_preinit_modules() != NGX_OK
+        || ngx_cycle_modules(&cycle) != NGX_OK)
+    {
+        return 1;
+    }
+
+    ngx_http_max_module = ngx_count_modules(&cycle, NGX_HTTP_MODULE);
+
+    /* the http main configuration, as in the "http" block */
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+    cf.ctx = &ctx;
+    cf.cycle = &cycle;
+    cf.pool = pool;
+    cf.temp_pool = pool;
+    cf.log = &ngx_bench_log;
+    cf.module_type = NGX_HTTP_MODULE;
+    cf.cmd_type = NGX_HTTP_MAIN_CONF;
+
+    cf.args = ngx_array_create(pool, 10, sizeof(ngx_str_t));
+    if (cf.args == NULL) {
+        return 1;
+    }
+
+    ctx.main_conf = ngx_pcalloc(pool, sizeof(void *) * ngx_http_max_module);
+    ctx.srv_conf = ngx_pcalloc(pool, sizeof(void *) * ngx_http_max_module);
+    ctx.loc_conf = ngx_pcalloc(pool, sizeof(void *) * ngx_http_max_module);
+
+    if (ctx.main_conf == NULL || ctx.srv_conf == NULL || ctx.loc_conf == NULL)
+    {
+        return 1;
+    }
+
+    for (m = 0; cycle.modules[m]; m++) {
+        if (cycle.modules[m]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        module = cycle.modules[m]->ctx;
+        k = cycle.modules[m]->ctx_index;
+
+        if (module->create_main_conf) {
+            ctx.main_conf[k] = module->create_main_conf(&cf);
+            if (ctx.main_conf[k] == NULL) {
+                return 1;
+            }
+        }
+
+        if (module->create_srv_conf) {
+            ctx.srv_conf[k] = module->create_srv_conf(&cf);
+            if (ctx.srv_conf[k] == NULL) {
+                return 1;
+            }
+        }
+
+        if (module->create_loc_conf) {
+            ctx.loc_conf[k] = module->create_loc_conf(&cf);
+            if (ctx.loc_conf[k] == NULL) {
+                return 1;
+            }
+        }
+    }
+
+    for (m = 0; cycle.modules[m]; m++) {
+        if (cycle.modules[m]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        module = cycle.modules[m]->ctx;
+
+        if (module->preconfiguration
+            && module->preconfiguration(&cf) != NGX_OK)
+        {
+            return 1;
+        }
+    }
+
+    for (bc = cases; bc->name; bc++) {
+        bc->ctx = ctx;
+
+        if (ngx_bench_script_conf(&cf, bc) != NGX_OK) {
+            fprintf(stderr, "\"%s\": invalid configuration\n", bc->name);
+            return 1;
+        }
+    }
+
+    cf.ctx = &ctx;
+    cf.cmd_type = NGX_HTTP_MAIN_CONF;
+
+    for (m = 0; cycle.modules[m]; m++) {
+        if (cycle.modules[m]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        module = cycle.modules[m]->ctx;
+        k = cycle.modules[m]->ctx_index;
+
+        if (module->init_main_conf
+            && module->init_main_conf(&cf, ctx.main_conf[k]) != NGX_CONF_OK)
+        {
+            return 1;
+        }
+    }
+
+    for (bc = cases; bc->name; bc++) {
+        cf.ctx = &bc->ctx;
+
+        for (m = 0; cycle.modules[m]; m++) {
+            if (cycle.modules[m]->type != NGX_HTTP_MODULE) {
+                continue;
+            }
+
+            module = cycle.modules[m]->ctx;
+            k = cycle.modules[m]->ctx_index;
+
+            if (module->merge_loc_conf
+                && module->merge_loc_conf(&cf, ctx.loc_conf[k],
+                                          bc->ctx.loc_conf[k])
+                   != NGX_CONF_OK)
+            {
+                fprintf(stderr, "\"%s\": merge failed\n", bc->name);
+                return 1;
+            }
+        }
+    }
+
+    cf.ctx = &ctx;
+
+    if (ngx_http_variables_init_vars(&cf) != NGX_OK) {
+        return 1;
+    }
+
+    cmcf = ctx.main_conf[ngx_http_core_module.ctx_index];
+    nvars = cmcf->variables.nelts;
+
+    for (bc = cases; bc->name; bc++) {
+
+        if (ngx_bench_script_request(pool, &r) != NGX_OK) {
+            return 1;
+        }
+
+        r.main_conf = bc->ctx.main_conf;
+        r.srv_conf = bc->ctx.srv_conf;
+        r.loc_conf = bc->ctx.loc_conf;
+
+        r.ctx = ngx_pcalloc(pool, sizeof(void *) * ngx_http_max_module);
+        r.variables = ngx_pcalloc(pool,
+                                  nvars * sizeof(ngx_http_variable_value_t));
+
+        if (r.ctx == NULL || r.variables == NULL) {
+            return 1;
+        }
+
+        /* the upstream stops in ngx_http_upstream_init_request() */
+
+        r.aio = 1;
+
+        clcf = r.loc_conf[ngx_http_core_module.ctx_index];
+
+        rc = clcf->handler(&r);
+
+        u = r.upstream;
+
+        if (rc != NGX_DONE || u == NULL || u->create_request == NULL) {
+            fprintf(stderr, "\"%s\": no upstream request\n", bc->name);
+            return 1;
+        }
+
+        r.pool = rpool;
+
+        u->request_bufs = NULL;
+
+        if (u->create_request(&r) != NGX_OK) {
+            return 1;
+        }
+
+        if (argc > 2) {
+            printf("%s:\n", bc->name);
+            fwrite(u->request_bufs->buf->pos, 1,
+                   u->request_bufs->buf->last - u->request_bufs->buf->pos,
+                   stdout);
+            printf("\n");
+        }
+
+        /* the pool is reset often enough to stay in a few blocks */
+
+        for (ngx_bench_start(&b, bc->name, n); ngx_bench_run(&b); ) {
+            for (i = 0; i < n; i++) {
+                if ((i & 7) == 0) {
+                    ngx_reset_pool(rpool);
+                }
+
+                ngx_memzero(r.variables,
+                            nvars * sizeof(ngx_http_variable_value_t));
+
+                u->request_bufs = NULL;
+
+                (void) u->create_request(&r);
+            }
+        }
+
+        ngx_reset_pool(rpool);
+    }
+
+    ngx_destroy_pool(rpool);
+    ngx_destroy_pool(pool);
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_script_conf(ngx_conf_t *cf, ngx_bench_script_case_t *bc)
+{
+    char                      *rv;
+    ngx_uint_t                 m, k;
+    ngx_http_module_t         *module;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    /* the "location /" block */
+
+    bc->ctx.loc_conf = ngx_pcalloc(cf->pool,
+                                   sizeof(void *) * ngx_http_max_module);
+    if (bc->ctx.loc_conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (m = 0; cf->cycle->modules[m]; m++) {
+        if (cf->cycle->modules[m]->type != NGX_HTTP_MODULE) {
+            continue;
+        }
+
+        module = cf->cycle->modules[m]->ctx;
+        k = cf->cycle->modules[m]->ctx_index;
+
+        if (module->create_loc_conf) {
+            bc->ctx.loc_conf[k] = module->create_loc_conf(cf);
+            if (bc->ctx.loc_conf[k] == NULL) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    clcf = bc->ctx.loc_conf[ngx_http_core_module.ctx_index];
+    clcf->loc_conf = bc->ctx.loc_conf;
+    ngx_str_set(&clcf->name, "/");
+
+    cf->ctx = &bc->ctx;
+    cf->cmd_type = NGX_HTTP_LOC_CONF;
+
+    cf->cycle->conf_param.data = (u_char *) bc->conf;
+    cf->cycle->conf_param.len = ngx_strlen(bc->conf);
+
+    rv = ngx_conf_param(cf);
+
+    ngx_str_null(&cf->cycle->conf_param);
+
+    return (rv == NGX_CONF_OK) ? NGX_OK : NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_bench_script_request(ngx_pool_t *pool, ngx_http_request_t *r)
+{
+    ngx_uint_t         i;
+    ngx_table_elt_t   *h, **ph;
+
+    static char  *headers[][2] = {
+        { "Host", "example.com" },
+        { "User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0)" },
+        { "Accept", "text/html,application/xhtml+xml,*/*;q=0.8" },
+        { "Accept-Encoding", "gzip, deflate, br" },
+        { "Accept-Language", "en-US,en;q=0.5" },
+        { "Cookie", "session=5f2b7c9e1d3a4b6c8e0f; theme=dark" },
+        { "X-Forwarded-For", "198.51.100.7" },
+        { NULL, NULL }
+    };
+
+    local.sin_family = AF_INET;
+    local.sin_port = htons(80);
+    local.sin_addr.s_addr = htonl(0x7f000001);
+
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(50123);
+    remote.sin_addr.s_addr = htonl(0xc0000201);
+
+    ngx_memzero(&c, sizeof(ngx_connection_t));
+
+    c.fd = (ngx_socket_t) -1;
+    c.log = &ngx_bench_log;
+    c.read = &rev;
+    c.write = &wev;
+    c.sockaddr = (struct sockaddr *) &remote;
+    c.socklen = sizeof(struct sockaddr_in);
+    c.local_sockaddr = (struct sockaddr *) &local;
+    c.local_socklen = sizeof(struct sockaddr_in);
+    ngx_str_set(&c.addr_text, "192.0.2.1");
+
+    ngx_memzero(r, sizeof(ngx_http_request_t));
+
+    r->connection = &c;
+    r->pool = pool;
+    r->main = r;
+    r->count = 1;
+
+    r->method = NGX_HTTP_GET;
+    ngx_str_set(&r->method_name, "GET");
+    r->http_version = NGX_HTTP_VERSION_11;
+    ngx_str_set(&r->http_protocol, "HTTP/1.1");
+
+    ngx_str_set(&r->unparsed_uri, "/old/path/to.php?a=1&b=2");
+    ngx_str_set(&r->uri, "/old/path/to.php");
+    ngx_str_set(&r->args, "a=1&b=2");
+    ngx_str_set(&r->exten, "php");
+
+    r->valid_location = 1;
+    r->valid_unparsed_uri = 1;
+
+    r->headers_in.content_length_n = -1;
+    r->headers_in.keep_alive_n = -1;
+
+    if (ngx_list_init(&r->headers_in.headers, pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&r->headers_in.x_forwarded_for, pool, 1,
+                       sizeof(ngx_table_elt_t *))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; headers[i][0]; i++) {
+        h = ngx_list_push(&r->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->key.data = (u_char *) headers[i][0];
+        h->key.len = ngx_strlen(h->key.data);
+        h->value.data = (u_char *) headers[i][1];
+        h->value.len = ngx_strlen(h->value.data);
+
+        h->lowcase_key = ngx_pnalloc(pool, h->key.len);
+        if (h->lowcase_key == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = ngx_hash_strlow(h->lowcase_key, h->key.data, h->key.len);
+
+        if (i == 0) {
+            r->headers_in.host = h;
+            r->headers_in.server = h->value;
+        }
+
+        if (ngx_strcmp(headers[i][0], "X-Forwarded-For") == 0) {
+            ph = ngx_array_push(&r->headers_in.x_forwarded_for);
+            if (ph == NULL) {
+                return NGX_ERROR;
+            }
+
+            *ph = h;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,142 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_bench.h>
+
+
+/*
+ * The event timers are added, re-armed, and expired with the rbtree and
+ * with the timer wheel.  The timeouts are spread over 1-61 seconds, like
+ * keepalive and proxy read timeouts, and the expiration advances the time
+ * by 1 ms, as a busy worker does.
+ */
+
+
+#define NGX_BENCH_TIMEOUT_MIN  1000
+#define NGX_BENCH_TIMEOUT_MAX  61000
+
+
+static void ngx_bench_timers_reset(ngx_event_t *ev, ngx_uint_t n,
+    ngx_uint_t add);
+static void ngx_bench_timer_handler(ngx_event_t *ev);
+
+
+static char             *impls[] = { "rbtree", "wheel" };
+
+static ngx_msec_t       *timeouts;
+static ngx_uint_t        expired;
+static ngx_connection_t  c;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    char          name[64];
+    ngx_uint_t    n, i, wheel;
+    ngx_bench_t   b;
+    ngx_event_t  *ev;
+
+    n = ngx_bench_init(argc, argv, 1000000);
+
+    ev = ngx_calloc(n * sizeof(ngx_event_t), &ngx_bench_log);
+    timeouts = ngx_alloc(n * sizeof(ngx_msec_t), &ngx_bench_log);
+
+    if (ev == NULL || timeouts == NULL) {
+        return 1;
+    }
+
+    c.fd = (ngx_socket_t) -1;
+
+    for (i = 0; i < n; i++) {
+        ev[i].data = &c;
+        ev[i].log = &ngx_bench_log;
+        ev[i].handler = ngx_bench_timer_handler;
+
+        timeouts[i] = NGX_BENCH_TIMEOUT_MIN
+                      + ngx_random() % (NGX_BENCH_TIMEOUT_MAX
+                                        - NGX_BENCH_TIMEOUT_MIN);
+    }
+
+    for (wheel = 0; wheel < 2; wheel++) {
+
+        ngx_event_timer_wheel = wheel;
+
+        ngx_sprintf((u_char *) name, "timers add %s%Z", impls[wheel]);
+
+        for (ngx_bench_start(&b, name, n); ngx_bench_run(&b); ) {
+            ngx_bench_pause(&b);
+            ngx_bench_timers_reset(ev, n, 0);
+            ngx_bench_resume(&b);
+
+            for (i = 0; i < n; i++) {
+                ngx_event_add_timer(&ev[i], timeouts[i]);
+            }
+        }
+
+        /* the time advances beyond NGX_TIMER_LAZY_DELAY */
+
+        ngx_sprintf((u_char *) name, "timers re-arm %s%Z", impls[wheel]);
+
+        for (ngx_bench_start(&b, name, n); ngx_bench_run(&b); ) {
+            ngx_bench_pause(&b);
+            ngx_bench_timers_reset(ev, n, 1);
+            ngx_current_msec += 1000;
+            ngx_bench_resume(&b);
+
+            for (i = 0; i < n; i++) {
+                ngx_event_add_timer(&ev[i], timeouts[i]);
+            }
+        }
+
+        ngx_sprintf((u_char *) name, "timers expire %s%Z", impls[wheel]);
+
+        for (ngx_bench_start(&b, name, n); ngx_bench_run(&b); ) {
+            ngx_bench_pause(&b);
+            ngx_bench_timers_reset(ev, n, 1);
+            expired = 0;
+            ngx_bench_resume(&b);
+
+            while (expired < n) {
+                ngx_current_msec++;
+                ngx_event_expire_timers();
+            }
+        }
+
+        if (!ngx_event_timers_empty()) {
+            fprintf(stderr, "timers left after expiration\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_bench_timers_reset(ngx_event_t *ev, ngx_uint_t n, ngx_uint_t add)
+{
+    ngx_uint_t  i;
+
+    (void) ngx_event_timer_init(&ngx_bench_log);
+
+    for (i = 0; i < n; i++) {
+        ev[i].timer_set = 0;
+
+        if (add) {
+            ngx_event_add_timer(&ev[i], timeouts[i]);
+        }
+    }
+}
+
+
+static void
+ngx_bench_timer_handler(ngx_event_t *ev)
+{
+    expired++;
+}
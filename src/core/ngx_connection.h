@@ -189,6 +189,10 @@ struct ngx_connection_s {
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t  *sendfile_task;
 #endif
+
+#if (NGX_HAVE_IO_URING)
+    void               *uring;
+#endif
 };
 
 
@@ -100,8 +100,19 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 #define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
 #define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
 
+
+#define NGX_CPU_SSE42        0x0001
+#define NGX_CPU_AVX2         0x0002
+#define NGX_CPU_PCLMUL       0x0004
+#define NGX_CPU_AESNI        0x0008
+#define NGX_CPU_CRC32        0x0010
+#define NGX_CPU_NEON         0x0020
+
 void ngx_cpuinfo(void);
 
+extern ngx_uint_t  ngx_cpu_features;
+
+
 #if (NGX_HAVE_OPENAT)
 #define NGX_DISABLE_SYMLINKS_OFF        0
 #define NGX_DISABLE_SYMLINKS_ON         1
@@ -9,10 +9,36 @@
 #include <ngx_core.h>
 
 
+/*
+ * The CPU features are detected at run time, so that a single binary
+ * uses the SIMD implementations of the hot primitives where available:
+ * ngx_cpuinfo() sets ngx_cpu_features and then lets the modules install
+ * the matching functions in place of the generic ones.
+ */
+
+
+static void ngx_cpu_detect(void);
+
+
+ngx_uint_t  ngx_cpu_features;
+
+
+void
+ngx_cpuinfo(void)
+{
+    ngx_cpu_detect();
+
+    ngx_crc32_cpu_init();
+    ngx_hash_cpu_init();
+    ngx_string_cpu_init();
+}
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
 static ngx_inline void ngx_cpuid(uint32_t i, uint32_t *buf);
+static ngx_inline uint32_t ngx_xgetbv(void);
 
 
 #if ( __i386__ )
@@ -20,6 +46,11 @@ static ngx_inline void ngx_cpuid(uint32_t i, uint32_t *buf);
 static ngx_inline void
 ngx_cpuid(uint32_t i, uint32_t *buf)
 {
+    uint32_t  sub;
+
+    /* the subleaf 0 is requested for the leaves that have subleaves */
+
+    sub = 0;
 
     /*
      * we could not use %ebx as output parameter if gcc builds PIC,
@@ -32,14 +63,14 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
     "    mov    %%ebx, %%esi;  "
 
     "    cpuid;                "
-    "    mov    %%eax, (%1);   "
-    "    mov    %%ebx, 4(%1);  "
-    "    mov    %%edx, 8(%1);  "
-    "    mov    %%ecx, 12(%1); "
+    "    mov    %%eax, (%2);   "
+    "    mov    %%ebx, 4(%2);  "
+    "    mov    %%edx, 8(%2);  "
+    "    mov    %%ecx, 12(%2); "
 
     "    mov    %%esi, %%ebx;  "
 
-    : : "a" (i), "D" (buf) : "ecx", "edx", "esi", "memory" );
+    : "+a" (i), "+c" (sub) : "D" (buf) : "edx", "esi", "memory" );
 }
 
 
@@ -55,7 +86,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
         "cpuid"
 
-    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i) );
+    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i), "c" (0) );
 
     buf[0] = eax;
     buf[1] = ebx;
@@ -67,13 +98,30 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 #endif
 
 
+static ngx_inline uint32_t
+ngx_xgetbv(void)
+{
+    uint32_t  eax, edx;
+
+    /* xgetbv, not known to old assemblers */
+
+    __asm__ (
+
+        ".byte 0x0f, 0x01, 0xd0"
+
+    : "=a" (eax), "=d" (edx) : "c" (0) );
+
+    return eax;
+}
+
+
 /* auto detect the L2 cache line size of modern and widespread CPUs */
 
-void
-ngx_cpuinfo(void)
+static void
+ngx_cpu_detect(void)
 {
     u_char    *vendor;
-    uint32_t   vbuf[5], cpu[4], model;
+    uint32_t   vbuf[5], cpu[4], ext[4], model;
 
     vbuf[0] = 0;
     vbuf[1] = 0;
@@ -125,14 +173,86 @@ ngx_cpuinfo(void)
     } else if (ngx_strcmp(vendor, "AuthenticAMD") == 0) {
         ngx_cacheline_size = 64;
     }
+
+    /* the features are reported in ecx of the leaf 1 and ebx of the leaf 7 */
+
+    if (cpu[3] & (1 << 20)) {
+        ngx_cpu_features |= NGX_CPU_SSE42|NGX_CPU_CRC32;
+    }
+
+    if (cpu[3] & (1 << 1)) {
+        ngx_cpu_features |= NGX_CPU_PCLMUL;
+    }
+
+    if (cpu[3] & (1 << 25)) {
+        ngx_cpu_features |= NGX_CPU_AESNI;
+    }
+
+    /* AVX2 also requires the OS to save the ymm registers, see OSXSAVE */
+
+    if (vbuf[0] >= 7
+        && (cpu[3] & (1 << 27))
+        && (cpu[3] & (1 << 28))
+        && (ngx_xgetbv() & 6) == 6)
+    {
+        ngx_cpuid(7, ext);
+
+        if (ext[1] & (1 << 5)) {
+            ngx_cpu_features |= NGX_CPU_AVX2;
+        }
+    }
+}
+
+
+#elif (( __arm__ || __aarch64__ ) && NGX_HAVE_GETAUXVAL)
+
+
+static void
+ngx_cpu_detect(void)
+{
+    unsigned long  hwcap;
+
+    hwcap = getauxval(AT_HWCAP);
+
+#if ( __aarch64__ )
+
+    /* Advanced SIMD is mandatory in ARMv8-A */
+
+    ngx_cpu_features |= NGX_CPU_NEON;
+
+    /* HWCAP_CRC32 */
+
+    if (hwcap & (1 << 7)) {
+        ngx_cpu_features |= NGX_CPU_CRC32;
+    }
+
+#else
+
+    /* HWCAP_NEON */
+
+    if (hwcap & (1 << 12)) {
+        ngx_cpu_features |= NGX_CPU_NEON;
+    }
+
+    /* HWCAP2_CRC32 */
+
+    if (getauxval(AT_HWCAP2) & (1 << 4)) {
+        ngx_cpu_features |= NGX_CPU_CRC32;
+    }
+
+#endif
 }
 
+
 #else
 
 
-void
-ngx_cpuinfo(void)
+static void
+ngx_cpu_detect(void)
 {
+#if ( __aarch64__ )
+    ngx_cpu_features |= NGX_CPU_NEON;
+#endif
 }
 
 
@@ -8,6 +8,14 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+#if (NGX_HAVE_X86_TARGET)
+#include <immintrin.h>
+#endif
+
+#if (NGX_HAVE_ARM_CRC32)
+#include <arm_acle.h>
+#endif
+
 
 /*
  * The code and lookup tables are based on the algorithm
@@ -99,8 +107,20 @@ uint32_t  ngx_crc32_table256[] = {
 };
 
 
+static uint32_t ngx_crc32_block_table(uint32_t crc, u_char *p, size_t len);
+#if (NGX_HAVE_X86_TARGET)
+static uint32_t ngx_crc32_block_pclmul(uint32_t crc, u_char *p, size_t len);
+#endif
+#if (NGX_HAVE_ARM_CRC32)
+static uint32_t ngx_crc32_block_armv8(uint32_t crc, u_char *p, size_t len);
+#endif
+
+
 uint32_t *ngx_crc32_table_short = ngx_crc32_table16;
 
+uint32_t (*ngx_crc32_block)(uint32_t crc, u_char *p, size_t len) =
+    ngx_crc32_block_table;
+
 
 ngx_int_t
 ngx_crc32_table_init(void)
@@ -127,3 +147,182 @@ ngx_crc32_table_init(void)
 
     return NGX_OK;
 }
+
+
+void
+ngx_crc32_cpu_init(void)
+{
+#if (NGX_HAVE_X86_TARGET)
+    if ((ngx_cpu_features & (NGX_CPU_PCLMUL|NGX_CPU_SSE42))
+        == (NGX_CPU_PCLMUL|NGX_CPU_SSE42))
+    {
+        ngx_crc32_block = ngx_crc32_block_pclmul;
+    }
+#endif
+
+#if (NGX_HAVE_ARM_CRC32)
+    if (ngx_cpu_features & NGX_CPU_CRC32) {
+        ngx_crc32_block = ngx_crc32_block_armv8;
+    }
+#endif
+}
+
+
+static uint32_t
+ngx_crc32_block_table(uint32_t crc, u_char *p, size_t len)
+{
+    while (len--) {
+        crc = ngx_crc32_table256[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if (NGX_HAVE_X86_TARGET)
+
+/*
+ * The carry-less multiplication folding is described in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * The constants are x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32),
+ * x^64 mod P(x) and the Barrett reduction constants, all bit-reflected.
+ * The SSE4.2 crc32 instruction is not used: it implements CRC-32C,
+ * while ngx_crc32() is the IEEE 802.3 CRC.
+ */
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+ngx_crc32_block_pclmul(uint32_t crc, u_char *p, size_t len)
+{
+    __m128i  k, x1, x2, x3, x4, x5, x6, x7, x8, mask;
+
+    if (len < 64) {
+        return ngx_crc32_block_table(crc, p, len);
+    }
+
+    x1 = _mm_loadu_si128((__m128i *) p);
+    x2 = _mm_loadu_si128((__m128i *) (p + 16));
+    x3 = _mm_loadu_si128((__m128i *) (p + 32));
+    x4 = _mm_loadu_si128((__m128i *) (p + 48));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+    p += 64;
+    len -= 64;
+
+    /* fold 4 x 128 bits in parallel */
+
+    k = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((__m128i *) p));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((__m128i *) (p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((__m128i *) (p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((__m128i *) (p + 48)));
+
+        p += 64;
+        len -= 64;
+    }
+
+    /* fold into 128 bits */
+
+    k = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((__m128i *) p));
+
+        p += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits to 64 bits */
+
+    mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    k = _mm_set_epi64x(0, 0x0163cd6124);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+
+    k = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t) _mm_extract_epi32(x1, 1);
+
+    return ngx_crc32_block_table(crc, p, len);
+}
+
+#endif
+
+
+#if (NGX_HAVE_ARM_CRC32)
+
+/* the ARMv8 crc32 instructions implement the IEEE 802.3 polynomial */
+
+__attribute__((target("+crc")))
+static uint32_t
+ngx_crc32_block_armv8(uint32_t crc, u_char *p, size_t len)
+{
+    uint64_t  v;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        ngx_memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __crc32b(crc, *p++);
+    }
+
+    return crc;
+}
+
+#endif
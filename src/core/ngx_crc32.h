@@ -16,6 +16,10 @@
 extern uint32_t  *ngx_crc32_table_short;
 extern uint32_t   ngx_crc32_table256[];
 
+/* the CRC register is passed and returned without the final inversion */
+
+extern uint32_t (*ngx_crc32_block)(uint32_t crc, u_char *p, size_t len);
+
 
 static ngx_inline uint32_t
 ngx_crc32_short(u_char *p, size_t len)
@@ -38,15 +42,7 @@ ngx_crc32_short(u_char *p, size_t len)
 static ngx_inline uint32_t
 ngx_crc32_long(u_char *p, size_t len)
 {
-    uint32_t  crc;
-
-    crc = 0xffffffff;
-
-    while (len--) {
-        crc = ngx_crc32_table256[(crc ^ *p++) & 0xff] ^ (crc >> 8);
-    }
-
-    return crc ^ 0xffffffff;
+    return ngx_crc32_block(0xffffffff, p, len) ^ 0xffffffff;
 }
 
 
@@ -57,15 +53,7 @@ ngx_crc32_long(u_char *p, size_t len)
 static ngx_inline void
 ngx_crc32_update(uint32_t *crc, u_char *p, size_t len)
 {
-    uint32_t  c;
-
-    c = *crc;
-
-    while (len--) {
-        c = ngx_crc32_table256[(c ^ *p++) & 0xff] ^ (c >> 8);
-    }
-
-    *crc = c;
+    *crc = ngx_crc32_block(*crc, p, len);
 }
 
 
@@ -74,6 +62,7 @@ ngx_crc32_update(uint32_t *crc, u_char *p, size_t len)
 
 
 ngx_int_t ngx_crc32_table_init(void);
+void ngx_crc32_cpu_init(void);
 
 
 #endif /* _NGX_CRC32_H_INCLUDED_ */
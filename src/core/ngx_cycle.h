@@ -25,11 +25,14 @@
 typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
 
 typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+typedef ngx_uint_t (*ngx_shm_zone_unlock_pt) (ngx_shm_zone_t *zone,
+    ngx_pid_t pid);
 
 struct ngx_shm_zone_s {
     void                     *data;
     ngx_shm_t                 shm;
     ngx_shm_zone_init_pt      init;
+    ngx_shm_zone_unlock_pt    unlock;
     void                     *tag;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
 };
@@ -94,6 +97,8 @@ typedef struct {
     ngx_int_t                 rlimit_nofile;
     off_t                     rlimit_core;
 
+    size_t                    pool_cache;
+
     int                       priority;
 
     ngx_uint_t                cpu_affinity_auto;
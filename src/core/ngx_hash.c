@@ -8,6 +8,20 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+#if (NGX_HAVE_X86_TARGET && NGX_PTR_SIZE == 8)
+#include <immintrin.h>
+#endif
+
+
+static ngx_uint_t ngx_hash_key_lc_generic(u_char *data, size_t len);
+#if (NGX_HAVE_X86_TARGET && NGX_PTR_SIZE == 8)
+static ngx_uint_t ngx_hash_key_lc_avx2(u_char *data, size_t len);
+#endif
+
+
+ngx_uint_t (*ngx_hash_key_lc)(u_char *data, size_t len) =
+    ngx_hash_key_lc_generic;
+
 
 void *
 ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
@@ -621,8 +635,8 @@ ngx_hash_key(u_char *data, size_t len)
 }
 
 
-ngx_uint_t
-ngx_hash_key_lc(u_char *data, size_t len)
+static ngx_uint_t
+ngx_hash_key_lc_generic(u_char *data, size_t len)
 {
     ngx_uint_t  i, key;
 
@@ -636,6 +650,102 @@ ngx_hash_key_lc(u_char *data, size_t len)
 }
 
 
+#if (NGX_HAVE_X86_TARGET && NGX_PTR_SIZE == 8)
+
+/*
+ * ngx_hash() of 16 bytes is key * 31^16 + c[0] * 31^15 + ... + c[15],
+ * the terms are computed in 64-bit lanes as c * lo + (c * hi << 32),
+ * where lo and hi are the halves of the powers of 31
+ */
+
+static uint64_t    ngx_hash_pow_lo[16];
+static uint64_t    ngx_hash_pow_hi[16];
+static ngx_uint_t  ngx_hash_pow16;
+
+
+__attribute__((target("avx2")))
+static ngx_uint_t
+ngx_hash_key_lc_avx2(u_char *data, size_t len)
+{
+    ngx_uint_t  i, key;
+    __m128i     v, m;
+    __m256i     c, s;
+
+    key = 0;
+
+    while (len >= 16) {
+        v = _mm_loadu_si128((__m128i *) data);
+
+        m = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                          _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+        v = _mm_add_epi8(v, _mm_and_si128(m, _mm_set1_epi8(0x20)));
+
+        s = _mm256_setzero_si256();
+
+        for (i = 0; i < 16; i += 4) {
+            c = _mm256_cvtepu8_epi64(v);
+            v = _mm_srli_si128(v, 4);
+
+            s = _mm256_add_epi64(s, _mm256_mul_epu32(c,
+                      _mm256_loadu_si256((__m256i *) &ngx_hash_pow_lo[i])));
+            s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_mul_epu32(c,
+                      _mm256_loadu_si256((__m256i *) &ngx_hash_pow_hi[i])),
+                                                     32));
+        }
+
+        m = _mm_add_epi64(_mm256_castsi256_si128(s),
+                          _mm256_extracti128_si256(s, 1));
+
+        key = key * ngx_hash_pow16
+              + (ngx_uint_t) _mm_cvtsi128_si64(m)
+              + (ngx_uint_t) _mm_extract_epi64(m, 1);
+
+        data += 16;
+        len -= 16;
+    }
+
+    /* avoid AVX to SSE transition penalties in the callers */
+
+    _mm256_zeroupper();
+
+    for (i = 0; i < len; i++) {
+        key = ngx_hash(key, ngx_tolower(data[i]));
+    }
+
+    return key;
+}
+
+#endif
+
+
+void
+ngx_hash_cpu_init(void)
+{
+#if (NGX_HAVE_X86_TARGET && NGX_PTR_SIZE == 8)
+
+    ngx_int_t   i;
+    ngx_uint_t  pow;
+
+    if (!(ngx_cpu_features & NGX_CPU_AVX2)) {
+        return;
+    }
+
+    pow = 1;
+
+    for (i = 15; i >= 0; i--) {
+        ngx_hash_pow_lo[i] = pow & 0xffffffff;
+        ngx_hash_pow_hi[i] = pow >> 32;
+        pow *= 31;
+    }
+
+    ngx_hash_pow16 = pow;
+
+    ngx_hash_key_lc = ngx_hash_key_lc_avx2;
+
+#endif
+}
+
+
 ngx_uint_t
 ngx_hash_strlow(u_char *dst, u_char *src, size_t n)
 {
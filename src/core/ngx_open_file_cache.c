@@ -9,18 +9,103 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 /*
  * open file cache caches
  *    open file handles with stat() info;
  *    directories stat() info;
  *    files and directories errors: not found, access denied, etc.
+ *
+ * the optional shared zone keeps stat() info and errors for all workers,
+ * while the open file handles remain in the per-worker cache;  if inotify
+ * is available, the parent directories of the shared entries are watched
+ * and the entries stay valid until an event invalidates them, otherwise
+ * a worker entry taken from the zone expires when the shared one does
+ *
+ * if of->thread_handler is set, open() and stat() are done in a thread
+ * pool: ngx_open_cached_file() returns NGX_AGAIN, and the caller repeats
+ * the call after the task completion to get the result
  */
 
 
 #define NGX_MIN_READ_AHEAD  (128 * 1024)
 
 
+typedef struct {
+    ngx_rbtree_node_t        node;
+    ngx_queue_t              queue;
+
+    ngx_file_uniq_t          uniq;
+    time_t                   mtime;
+    off_t                    size;
+    off_t                    fs_size;
+    ngx_err_t                err;
+
+    time_t                   validated;
+    ngx_uint_t               generation;
+
+#if (NGX_HAVE_INOTIFY)
+    int                      wd;
+#endif
+
+#if (NGX_HAVE_OPENAT)
+    size_t                   disable_symlinks_from;
+    unsigned                 disable_symlinks:2;
+#endif
+
+    unsigned                 watched:1;
+
+    unsigned                 is_dir:1;
+    unsigned                 is_file:1;
+    unsigned                 is_link:1;
+    unsigned                 is_exec:1;
+
+    u_short                  len;
+    u_char                   name[1];
+} ngx_open_file_cache_node_t;
+
+
+#if (NGX_HAVE_INOTIFY)
+
+#define NGX_OPEN_FILE_CACHE_INOTIFY_MASK                                      \
+    (IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MODIFY    \
+     |IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+
+typedef struct {
+    ngx_rbtree_node_t        node;
+    ngx_atomic_uint_t        seq;
+    ngx_uint_t               count;
+    u_short                  len;
+    u_char                   name[1];
+} ngx_open_file_cache_watch_t;
+
+#endif
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_str_t                name;
+    ngx_open_file_info_t     of;
+    ngx_int_t                rc;
+
+    ngx_fd_t                 fd;
+    ngx_file_uniq_t          uniq;
+    ngx_atomic_uint_t        seq;
+    ngx_log_t               *log;
+
+    unsigned                 test_dir:1;
+    unsigned                 opened:1;
+} ngx_open_file_thread_ctx_t;
+
+#endif
+
+
 static void ngx_open_file_cache_cleanup(void *data);
 #if (NGX_HAVE_OPENAT)
 static ngx_fd_t ngx_openat_file_owner(ngx_fd_t at_fd, const u_char *name,
@@ -37,6 +122,14 @@ static ngx_int_t ngx_file_info_wrapper(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_file_info_t *fi, ngx_log_t *log);
 static ngx_int_t ngx_open_and_stat_file(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_log_t *log);
+static ngx_int_t ngx_open_and_stat_file_aio(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_atomic_uint_t *seq, ngx_pool_t *pool);
+#if (NGX_THREADS)
+static ngx_int_t ngx_thread_open_and_stat_file(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_atomic_uint_t *seq, ngx_pool_t *pool);
+static void ngx_thread_open_and_stat_file_handler(void *data, ngx_log_t *log);
+static void ngx_thread_open_file_cleanup(void *data);
+#endif
 static void ngx_open_file_add_event(ngx_open_file_cache_t *cache,
     ngx_cached_open_file_t *file, ngx_open_file_info_t *of, ngx_log_t *log);
 static void ngx_open_file_cleanup(void *data);
@@ -52,6 +145,45 @@ static ngx_cached_open_file_t *
     uint32_t hash);
 static void ngx_open_file_cache_remove(ngx_event_t *ev);
 
+static ngx_int_t ngx_open_file_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_uint_t ngx_open_file_shared_test(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_cached_open_file_t *file,
+    ngx_open_file_info_t *of, time_t now);
+static ngx_int_t ngx_open_file_shared_get(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_open_file_info_t *of, time_t now,
+    time_t *created);
+static void ngx_open_file_shared_update(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_open_file_info_t *of, time_t now,
+    ngx_atomic_uint_t seq, ngx_log_t *log);
+static ngx_uint_t ngx_open_file_shared_valid(ngx_open_file_cache_zone_t *zone,
+    ngx_open_file_cache_node_t *node, ngx_open_file_info_t *of, time_t now);
+static time_t ngx_open_file_shared_created(ngx_open_file_cache_node_t *node,
+    ngx_open_file_info_t *of, time_t now);
+static ngx_open_file_cache_node_t *ngx_open_file_shared_lookup(
+    ngx_open_file_cache_sh_t *sh, u_char *name, size_t len, uint32_t hash);
+static void ngx_open_file_shared_delete(ngx_open_file_cache_zone_t *zone,
+    ngx_open_file_cache_node_t *node);
+static void ngx_open_file_shared_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+#if (NGX_HAVE_INOTIFY)
+static void ngx_open_file_cache_inotify_cleanup(void *data);
+static int ngx_open_file_cache_add_watch(ngx_open_file_cache_zone_t *zone,
+    ngx_str_t *name, ngx_log_t *log);
+static void ngx_open_file_cache_release_watch(ngx_open_file_cache_zone_t *zone,
+    int wd);
+static void ngx_open_file_cache_add_reader(ngx_open_file_cache_zone_t *zone,
+    ngx_log_t *log);
+static void ngx_open_file_cache_inotify_handler(ngx_event_t *ev);
+static void ngx_open_file_cache_inotify_event(ngx_open_file_cache_zone_t *zone,
+    struct inotify_event *ie);
+static ngx_open_file_cache_watch_t *ngx_open_file_cache_watch_lookup(
+    ngx_open_file_cache_sh_t *sh, int wd);
+#endif
+
+
+static ngx_uint_t  ngx_open_file_cache_tag;
+
 
 ngx_open_file_cache_t *
 ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
@@ -73,6 +205,8 @@ ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
     cache->max = max;
     cache->inactive = inactive;
 
+    cache->zone = NULL;
+
     cln = ngx_pool_cleanup_add(pool, 0);
     if (cln == NULL) {
         return NULL;
@@ -144,10 +278,12 @@ ngx_int_t
 ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_pool_t *pool)
 {
-    time_t                          now;
+    time_t                          now, created;
     uint32_t                        hash;
     ngx_int_t                       rc;
+    ngx_uint_t                      shared;
     ngx_file_info_t                 fi;
+    ngx_atomic_uint_t               seq;
     ngx_pool_cleanup_t             *cln;
     ngx_cached_open_file_t         *file;
     ngx_pool_cleanup_file_t        *clnf;
@@ -183,7 +319,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
             return NGX_ERROR;
         }
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        rc = ngx_open_and_stat_file_aio(name, of, NULL, pool);
 
         if (rc == NGX_OK && !of->is_dir) {
             cln->handler = ngx_pool_cleanup_file;
@@ -203,9 +339,25 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     }
 
     now = ngx_time();
+    created = now;
 
     hash = ngx_crc32_long(name->data, name->len);
 
+    shared = 0;
+    seq = 0;
+
+    if (cache->zone) {
+
+#if (NGX_HAVE_INOTIFY)
+        if (cache->zone->connection == NULL) {
+            ngx_open_file_cache_add_reader(cache->zone, pool->log);
+        }
+#endif
+
+        /* events after this point prevent trusting our own stat() */
+        seq = cache->zone->sh->seq;
+    }
+
     file = ngx_open_file_lookup(cache, name, hash);
 
     if (file) {
@@ -218,7 +370,11 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
             /* file was not used often enough to keep open */
 
-            rc = ngx_open_and_stat_file(name, of, pool->log);
+            rc = ngx_open_and_stat_file_aio(name, of, &seq, pool);
+
+            if (rc == NGX_AGAIN) {
+                goto again;
+            }
 
             if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
                 goto failed;
@@ -230,7 +386,9 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
         if (file->use_event
             || (file->event == NULL
                 && (of->uniq == 0 || of->uniq == file->uniq)
-                && now - file->created < of->valid
+                && (now - file->created < of->valid
+                    || ngx_open_file_shared_test(cache, name, hash, file, of,
+                                                 now))
 #if (NGX_HAVE_OPENAT)
                 && of->disable_symlinks == file->disable_symlinks
                 && of->disable_symlinks_from == file->disable_symlinks_from
@@ -286,7 +444,11 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
         of->fd = file->fd;
         of->uniq = file->uniq;
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        rc = ngx_open_and_stat_file_aio(name, of, &seq, pool);
+
+        if (rc == NGX_AGAIN) {
+            goto again;
+        }
 
         if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
             goto failed;
@@ -351,7 +513,19 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     /* not found */
 
-    rc = ngx_open_and_stat_file(name, of, pool->log);
+    if (cache->zone
+        && ngx_open_file_shared_get(cache, name, hash, of, now, &created)
+           == NGX_OK)
+    {
+        shared = 1;
+        goto create;
+    }
+
+    rc = ngx_open_and_stat_file_aio(name, of, &seq, pool);
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
 
     if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
         goto failed;
@@ -421,7 +595,12 @@ update:
         }
     }
 
-    file->created = now;
+    if (cache->zone && !shared) {
+        ngx_open_file_shared_update(cache, name, hash, of, now, seq,
+                                    pool->log);
+    }
+
+    file->created = created;
 
 found:
 
@@ -450,6 +629,17 @@ found:
 
     return NGX_ERROR;
 
+again:
+
+    /* the request will repeat the lookup when the task is done */
+
+    file->uses--;
+    file->accessed = now;
+
+    ngx_queue_insert_head(&cache->expire_queue, &file->queue);
+
+    return NGX_AGAIN;
+
 failed:
 
     if (file) {
@@ -945,6 +1135,164 @@ done:
 }
 
 
+static ngx_int_t
+ngx_open_and_stat_file_aio(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_atomic_uint_t *seq, ngx_pool_t *pool)
+{
+#if (NGX_THREADS)
+
+    if (of->thread_handler) {
+        return ngx_thread_open_and_stat_file(name, of, seq, pool);
+    }
+
+#endif
+
+    return ngx_open_and_stat_file(name, of, pool->log);
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_thread_open_and_stat_file(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_atomic_uint_t *seq, ngx_pool_t *pool)
+{
+    ngx_pool_cleanup_t          *cln;
+    ngx_thread_task_t           *task;
+    ngx_open_file_thread_ctx_t  *ctx;
+
+    task = of->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(pool, sizeof(ngx_open_file_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_thread_open_file_cleanup;
+        cln->data = task->ctx;
+
+        of->thread_task = task;
+    }
+
+    ctx = task->ctx;
+
+    if (task->event.complete) {
+        task->event.complete = 0;
+
+        if (ctx->fd == of->fd
+            && ctx->uniq == of->uniq
+            && ctx->test_dir == of->test_dir
+            && ctx->name.len == name->len
+            && ngx_strncmp(ctx->name.data, name->data, name->len) == 0)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, pool->log, 0,
+                           "thread open: \"%V\" done, fd:%d",
+                           name, ctx->of.fd);
+
+            ctx->opened = 0;
+
+            if (seq) {
+                *seq = ctx->seq;
+            }
+
+            of->fd = ctx->of.fd;
+            of->uniq = ctx->of.uniq;
+            of->mtime = ctx->of.mtime;
+            of->size = ctx->of.size;
+            of->fs_size = ctx->of.fs_size;
+
+            of->err = ctx->of.err;
+            of->failed = ctx->of.failed;
+
+            of->is_dir = ctx->of.is_dir;
+            of->is_file = ctx->of.is_file;
+            of->is_link = ctx->of.is_link;
+            of->is_exec = ctx->of.is_exec;
+            of->is_directio = ctx->of.is_directio;
+
+            return ctx->rc;
+        }
+
+        /*
+         * the cached file was changed while the task was running,
+         * the result is stale, so fall back to a synchronous call
+         */
+
+        ngx_thread_open_file_cleanup(ctx);
+
+        return ngx_open_and_stat_file(name, of, pool->log);
+    }
+
+    ctx->name.data = ngx_pnalloc(pool, name->len + 1);
+    if (ctx->name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(ctx->name.data, name->data, name->len + 1);
+    ctx->name.len = name->len;
+
+    ctx->of = *of;
+    ctx->fd = of->fd;
+    ctx->uniq = of->uniq;
+    ctx->test_dir = of->test_dir;
+    ctx->seq = seq ? *seq : 0;
+    ctx->log = pool->log;
+
+    task->handler = ngx_thread_open_and_stat_file_handler;
+
+    if (of->thread_handler(task, of) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_thread_open_and_stat_file_handler(void *data, ngx_log_t *log)
+{
+    ngx_open_file_thread_ctx_t *ctx = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "thread open handler: \"%V\"", &ctx->name);
+
+    /* of->fd is only used as an "already opened" flag here */
+
+    ctx->rc = ngx_open_and_stat_file(&ctx->name, &ctx->of, log);
+
+    ctx->opened = (ctx->rc == NGX_OK
+                   && ctx->of.fd != NGX_INVALID_FILE
+                   && (ctx->fd == NGX_INVALID_FILE
+                       || ctx->of.uniq != ctx->uniq));
+}
+
+
+static void
+ngx_thread_open_file_cleanup(void *data)
+{
+    ngx_open_file_thread_ctx_t *ctx = data;
+
+    if (!ctx->opened) {
+        return;
+    }
+
+    ctx->opened = 0;
+
+    if (ngx_close_file(ctx->of.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->name);
+    }
+}
+
+#endif
+
+
 /*
  * we ignore any possible event setting error and
  * fallback to usual periodic file retests
@@ -1251,3 +1599,896 @@ ngx_open_file_cache_remove(ngx_event_t *ev)
     ngx_free(ev->data);
     ngx_free(ev);
 }
+
+
+ngx_int_t
+ngx_open_file_cache_shared(ngx_conf_t *cf, ngx_open_file_cache_t *cache,
+    ngx_str_t *name, size_t size)
+{
+    ngx_shm_zone_t              *shm_zone;
+    ngx_open_file_cache_zone_t  *zone;
+#if (NGX_HAVE_INOTIFY)
+    ngx_pool_cleanup_t          *cln;
+#endif
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_open_file_cache_tag);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (shm_zone->data) {
+        cache->zone = shm_zone->data;
+        return NGX_OK;
+    }
+
+    zone = ngx_pcalloc(cf->pool, sizeof(ngx_open_file_cache_zone_t));
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the zone is not reused on reconfiguration as the watch descriptors
+     * it keeps belong to the inotify instance of the particular cycle
+     */
+
+    shm_zone->init = ngx_open_file_cache_init_zone;
+    shm_zone->data = zone;
+    shm_zone->noreuse = 1;
+
+    cache->zone = zone;
+
+#if (NGX_HAVE_INOTIFY)
+
+    zone->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+    if (zone->fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           "inotify_init1() failed, shared open file cache "
+                           "entries will be revalidated periodically");
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_open_file_cache_inotify_cleanup;
+    cln->data = zone;
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_open_file_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_open_file_cache_zone_t  *zone = shm_zone->data;
+
+    size_t                     len;
+    ngx_open_file_cache_sh_t  *sh;
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_alloc(zone->shpool, sizeof(ngx_open_file_cache_sh_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->sh = sh;
+    zone->shpool->data = sh;
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                    ngx_open_file_shared_rbtree_insert_value);
+
+    ngx_rbtree_init(&sh->watches, &sh->watches_sentinel,
+                    ngx_rbtree_insert_value);
+
+    ngx_queue_init(&sh->queue);
+
+    sh->seq = 0;
+    sh->generation = 0;
+
+    len = sizeof(" in open file cache zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in open file cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    zone->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_open_file_shared_test(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_cached_open_file_t *file, ngx_open_file_info_t *of,
+    time_t now)
+{
+    ngx_uint_t                   valid;
+    ngx_open_file_cache_node_t  *node;
+    ngx_open_file_cache_zone_t  *zone;
+
+    zone = cache->zone;
+
+    if (zone == NULL) {
+        return 0;
+    }
+
+    valid = 0;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = ngx_open_file_shared_lookup(zone->sh, name->data, name->len, hash);
+
+    if (node
+        && ngx_open_file_shared_valid(zone, node, of, now)
+        && node->err == file->err
+        && (file->err
+            || (node->uniq == file->uniq
+                && node->mtime == file->mtime
+                && node->size == file->size
+                && node->is_dir == file->is_dir)))
+    {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+
+        valid = 1;
+
+        file->created = ngx_open_file_shared_created(node, of, now);
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    if (valid) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "shared open file is valid: %s", file->name);
+    }
+
+    return valid;
+}
+
+
+static ngx_int_t
+ngx_open_file_shared_get(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_open_file_info_t *of, time_t now, time_t *created)
+{
+    ngx_open_file_cache_node_t  *node;
+    ngx_open_file_cache_zone_t  *zone;
+
+    zone = cache->zone;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = ngx_open_file_shared_lookup(zone->sh, name->data, name->len, hash);
+
+    /* regular files are to be opened by each worker anyway */
+
+    if (node == NULL
+        || !ngx_open_file_shared_valid(zone, node, of, now)
+        || (node->err == 0 && !node->is_dir)
+        || (node->err && !of->errors))
+    {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+
+    *created = ngx_open_file_shared_created(node, of, now);
+
+    if (node->err) {
+        of->err = node->err;
+#if (NGX_HAVE_OPENAT)
+        of->failed = node->disable_symlinks ? ngx_openat_file_n
+                                            : ngx_open_file_n;
+#else
+        of->failed = ngx_open_file_n;
+#endif
+
+    } else {
+        of->uniq = node->uniq;
+        of->mtime = node->mtime;
+        of->size = node->size;
+        of->fs_size = node->fs_size;
+        of->is_dir = node->is_dir;
+        of->is_file = node->is_file;
+        of->is_link = node->is_link;
+        of->is_exec = node->is_exec;
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "shared open file: %V, e:%d", name, of->err);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_open_file_shared_update(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_open_file_info_t *of, time_t now,
+    ngx_atomic_uint_t seq, ngx_log_t *log)
+{
+    size_t                        n;
+    ngx_uint_t                    i;
+    ngx_queue_t                  *q;
+    ngx_open_file_cache_sh_t     *sh;
+    ngx_open_file_cache_node_t   *node;
+    ngx_open_file_cache_zone_t   *zone;
+#if (NGX_HAVE_INOTIFY)
+    int                           wd;
+    u_char                       *p;
+    ngx_open_file_cache_watch_t  *watch;
+#endif
+
+    if (name->len > 0xffff) {
+        return;
+    }
+
+    zone = cache->zone;
+    sh = zone->sh;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = ngx_open_file_shared_lookup(sh, name->data, name->len, hash);
+
+    if (node
+        && node->watched
+        && node->generation == sh->generation
+        && node->err == of->err
+        && node->uniq == of->uniq
+        && node->mtime == of->mtime
+        && node->size == of->size
+        && node->is_dir == of->is_dir
+#if (NGX_HAVE_OPENAT)
+        && node->disable_symlinks == of->disable_symlinks
+        && node->disable_symlinks_from == of->disable_symlinks_from
+#endif
+        )
+    {
+        /* nothing changed and the directory is still watched */
+
+        node->validated = now;
+
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&sh->queue, &node->queue);
+
+        goto done;
+    }
+
+#if (NGX_HAVE_INOTIFY)
+
+    wd = -1;
+
+    if (zone->fd != NGX_INVALID_FILE) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+
+        wd = ngx_open_file_cache_add_watch(zone, name, log);
+
+        ngx_shmtx_lock(&zone->shpool->mutex);
+
+        node = ngx_open_file_shared_lookup(sh, name->data, name->len, hash);
+    }
+
+#endif
+
+    if (node == NULL) {
+        n = offsetof(ngx_open_file_cache_node_t, name) + name->len;
+
+        node = ngx_slab_alloc_locked(zone->shpool, n);
+
+        for (i = 0; node == NULL && i < 16; i++) {
+
+            if (ngx_queue_empty(&sh->queue)) {
+                break;
+            }
+
+            q = ngx_queue_last(&sh->queue);
+
+            ngx_open_file_shared_delete(zone,
+                     ngx_queue_data(q, ngx_open_file_cache_node_t, queue));
+
+            node = ngx_slab_alloc_locked(zone->shpool, n);
+        }
+
+        if (node == NULL) {
+            goto done;
+        }
+
+        node->node.key = hash;
+        node->len = (u_short) name->len;
+        ngx_memcpy(node->name, name->data, name->len);
+
+#if (NGX_HAVE_INOTIFY)
+        node->wd = -1;
+#endif
+
+        ngx_rbtree_insert(&sh->rbtree, &node->node);
+
+    } else {
+        ngx_queue_remove(&node->queue);
+    }
+
+    node->uniq = of->uniq;
+    node->mtime = of->mtime;
+    node->size = of->size;
+    node->fs_size = of->fs_size;
+    node->err = of->err;
+
+    node->validated = now;
+    node->generation = sh->generation;
+
+#if (NGX_HAVE_OPENAT)
+    node->disable_symlinks = of->disable_symlinks;
+    node->disable_symlinks_from = of->disable_symlinks_from;
+#endif
+
+    node->watched = 0;
+
+    node->is_dir = of->is_dir;
+    node->is_file = of->is_file;
+    node->is_link = of->is_link;
+    node->is_exec = of->is_exec;
+
+#if (NGX_HAVE_INOTIFY)
+
+    if (wd != -1) {
+
+        for (p = name->data + name->len - 1; *p != '/'; p--) {
+            /* void */
+        }
+
+        n = (p == name->data) ? 1 : (size_t) (p - name->data);
+
+        watch = ngx_open_file_cache_watch_lookup(sh, wd);
+
+        if (watch == NULL) {
+
+            /*
+             * events before the watch was added are lost, so
+             * the entry is trusted only after the next stat()
+             */
+
+            watch = ngx_slab_alloc_locked(zone->shpool,
+                              offsetof(ngx_open_file_cache_watch_t, name) + n);
+
+            if (watch) {
+                watch->node.key = wd;
+                watch->seq = ++sh->seq;
+                watch->count = 0;
+                watch->len = (u_short) n;
+                ngx_memcpy(watch->name, name->data, n);
+
+                ngx_rbtree_insert(&sh->watches, &watch->node);
+
+            } else {
+                (void) inotify_rm_watch(zone->fd, wd);
+                wd = -1;
+            }
+
+        } else if (watch->seq <= seq
+                   && watch->len == n
+                   && ngx_strncmp(watch->name, name->data, n) == 0)
+        {
+            node->watched = 1;
+        }
+
+        if (watch) {
+            watch->count++;
+        }
+    }
+
+    /* the reference is taken first, as the directory may be the same */
+
+    if (node->wd != -1) {
+        ngx_open_file_cache_release_watch(zone, node->wd);
+    }
+
+    node->wd = wd;
+
+#endif
+
+    ngx_queue_insert_head(&sh->queue, &node->queue);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "shared open file update: %V, w:%d", name, node->watched);
+
+done:
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+}
+
+
+static ngx_uint_t
+ngx_open_file_shared_valid(ngx_open_file_cache_zone_t *zone,
+    ngx_open_file_cache_node_t *node, ngx_open_file_info_t *of, time_t now)
+{
+#if (NGX_HAVE_OPENAT)
+    if (node->disable_symlinks != of->disable_symlinks
+        || node->disable_symlinks_from != of->disable_symlinks_from)
+    {
+        return 0;
+    }
+#endif
+
+#if (NGX_HAVE_INOTIFY)
+
+    /*
+     * a worker which does not read inotify events itself
+     * revalidates the entries periodically
+     */
+
+    if (node->watched
+        && node->generation == zone->sh->generation
+        && zone->connection)
+    {
+        return 1;
+    }
+
+#endif
+
+    return (now - node->validated < of->valid);
+}
+
+
+static time_t
+ngx_open_file_shared_created(ngx_open_file_cache_node_t *node,
+    ngx_open_file_info_t *of, time_t now)
+{
+    /*
+     * a worker entry taken from a periodically revalidated shared one
+     * expires along with it rather than "valid" seconds later
+     */
+
+    if (now - node->validated < of->valid) {
+        return node->validated;
+    }
+
+    return now;
+}
+
+
+static ngx_open_file_cache_node_t *
+ngx_open_file_shared_lookup(ngx_open_file_cache_sh_t *sh, u_char *name,
+    size_t len, uint32_t hash)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_open_file_cache_node_t  *fn;
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        fn = (ngx_open_file_cache_node_t *) node;
+
+        rc = ngx_memn2cmp(name, fn->name, len, (size_t) fn->len);
+
+        if (rc == 0) {
+            return fn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_open_file_shared_delete(ngx_open_file_cache_zone_t *zone,
+    ngx_open_file_cache_node_t *node)
+{
+#if (NGX_HAVE_INOTIFY)
+    if (node->wd != -1) {
+        ngx_open_file_cache_release_watch(zone, node->wd);
+    }
+#endif
+
+    ngx_queue_remove(&node->queue);
+
+    ngx_rbtree_delete(&zone->sh->rbtree, &node->node);
+
+    ngx_slab_free_locked(zone->shpool, node);
+}
+
+
+static void
+ngx_open_file_shared_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_open_file_cache_node_t   *fn, *fnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            fn = (ngx_open_file_cache_node_t *) node;
+            fnt = (ngx_open_file_cache_node_t *) temp;
+
+            p = (ngx_memn2cmp(fn->name, fnt->name, fn->len, fnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+#if (NGX_HAVE_INOTIFY)
+
+static void
+ngx_open_file_cache_inotify_cleanup(void *data)
+{
+    ngx_open_file_cache_zone_t  *zone = data;
+
+    if (zone->fd != NGX_INVALID_FILE && close(zone->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "inotify close() failed");
+    }
+}
+
+
+static int
+ngx_open_file_cache_add_watch(ngx_open_file_cache_zone_t *zone,
+    ngx_str_t *name, ngx_log_t *log)
+{
+    int         wd;
+    u_char      *p, c;
+    ngx_err_t   err;
+
+    static ngx_uint_t  logged;
+
+    for (p = name->data + name->len - 1; p >= name->data; p--) {
+        if (*p == '/') {
+            break;
+        }
+    }
+
+    if (p < name->data) {
+        return -1;
+    }
+
+    if (p == name->data) {
+        p++;
+    }
+
+    c = *p;
+    *p = '\0';
+
+    wd = inotify_add_watch(zone->fd, (char *) name->data,
+                           NGX_OPEN_FILE_CACHE_INOTIFY_MASK);
+
+    if (wd == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOSPC && !logged) {
+            ngx_log_error(NGX_LOG_WARN, log, err,
+                          "inotify_add_watch(\"%s\") failed, "
+                          "consider raising fs.inotify.max_user_watches",
+                          name->data);
+            logged = 1;
+
+        } else {
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, err,
+                           "inotify_add_watch(\"%s\"): %d", name->data, wd);
+        }
+    }
+
+    *p = c;
+
+    return wd;
+}
+
+
+static void
+ngx_open_file_cache_release_watch(ngx_open_file_cache_zone_t *zone, int wd)
+{
+    ngx_open_file_cache_watch_t  *watch;
+
+    /*
+     * the directory is no longer watched after its last entry is gone;
+     * a worker which has just added the same watch outside of the mutex
+     * finds no record, and the entry is not trusted until it is added
+     * again, now to a new watch descriptor
+     */
+
+    watch = ngx_open_file_cache_watch_lookup(zone->sh, wd);
+
+    if (watch == NULL || --watch->count) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "inotify_rm_watch: %d", wd);
+
+    ngx_rbtree_delete(&zone->sh->watches, &watch->node);
+    ngx_slab_free_locked(zone->shpool, watch);
+
+    /* the watch may be already removed by the kernel */
+
+    (void) inotify_rm_watch(zone->fd, wd);
+}
+
+
+static void
+ngx_open_file_cache_add_reader(ngx_open_file_cache_zone_t *zone,
+    ngx_log_t *log)
+{
+    ngx_connection_t  *c;
+
+    /*
+     * the inotify descriptor is inherited by all workers, each of them
+     * reads the events it gets and updates the shared zone accordingly
+     */
+
+    if (zone->fd == NGX_INVALID_FILE || zone->failed || ngx_exiting) {
+        return;
+    }
+
+    c = ngx_get_connection(zone->fd, log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->data = zone;
+    c->idle = 1;
+
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->read->handler = ngx_open_file_cache_inotify_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        c->fd = (ngx_socket_t) -1;
+        goto failed;
+    }
+
+    zone->connection = c;
+
+    return;
+
+failed:
+
+    /* the entries are revalidated periodically by this worker */
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "could not read inotify events, shared open file cache "
+                  "entries will be revalidated periodically");
+
+    zone->failed = 1;
+}
+
+
+static void
+ngx_open_file_cache_inotify_handler(ngx_event_t *ev)
+{
+    u_char                      *p;
+    ssize_t                      n;
+    ngx_err_t                    err;
+    ngx_connection_t            *c;
+    struct inotify_event        *ie;
+    ngx_open_file_cache_zone_t  *zone;
+    union {
+        struct inotify_event     ie;
+        u_char                   buf[4096];
+    } u;
+
+    c = ev->data;
+    zone = c->data;
+
+    if (c->close) {
+        ngx_close_connection(c);
+
+        zone->connection = NULL;
+        zone->fd = NGX_INVALID_FILE;
+
+        return;
+    }
+
+    for ( ;; ) {
+
+        n = read(c->fd, u.buf, sizeof(u.buf));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN) {
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() from inotify failed");
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "inotify read: %z", n);
+
+        if (n == 0) {
+            break;
+        }
+
+        ngx_shmtx_lock(&zone->shpool->mutex);
+
+        for (p = u.buf; p < u.buf + n; p += sizeof(struct inotify_event)
+                                            + ie->len)
+        {
+            ie = (struct inotify_event *) p;
+            ngx_open_file_cache_inotify_event(zone, ie);
+        }
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+    }
+
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "could not handle inotify events");
+    }
+}
+
+
+static void
+ngx_open_file_cache_inotify_event(ngx_open_file_cache_zone_t *zone,
+    struct inotify_event *ie)
+{
+    u_char                       *p, path[NGX_MAX_PATH];
+    size_t                        len;
+    uint32_t                      hash;
+    ngx_open_file_cache_sh_t     *sh;
+    ngx_open_file_cache_node_t   *node;
+    ngx_open_file_cache_watch_t  *watch;
+
+    sh = zone->sh;
+
+    if (ie->mask & IN_Q_OVERFLOW) {
+        sh->generation++;
+        return;
+    }
+
+    watch = ngx_open_file_cache_watch_lookup(sh, ie->wd);
+
+    if (watch == NULL) {
+        return;
+    }
+
+    watch->seq = ++sh->seq;
+
+    if (ie->len == 0) {
+
+        /* the directory itself was changed, moved, or removed */
+
+        sh->generation++;
+
+        if (ie->mask & IN_IGNORED) {
+            ngx_rbtree_delete(&sh->watches, &watch->node);
+            ngx_slab_free_locked(zone->shpool, watch);
+        }
+
+        return;
+    }
+
+    len = ngx_strlen(ie->name);
+
+    if (watch->len + 1 + len > NGX_MAX_PATH) {
+        sh->generation++;
+        return;
+    }
+
+    p = ngx_cpymem(path, watch->name, watch->len);
+
+    if (p[-1] != '/') {
+        *p++ = '/';
+    }
+
+    p = ngx_cpymem(p, ie->name, len);
+
+    len = p - path;
+    hash = ngx_crc32_long(path, len);
+
+    node = ngx_open_file_shared_lookup(sh, path, len, hash);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "inotify event: %*s, mask:%xD", len, path, ie->mask);
+
+    /*
+     * entries below a subdirectory, or a symbolic link which
+     * may point to a directory, are not watched from here
+     */
+
+    if ((ie->mask & IN_ISDIR)
+        || ((ie->mask & (IN_DELETE|IN_MOVED_FROM))
+            && (node == NULL || !node->is_file)))
+    {
+        sh->generation++;
+    }
+
+    if (node) {
+        ngx_open_file_shared_delete(zone, node);
+    }
+}
+
+
+static ngx_open_file_cache_watch_t *
+ngx_open_file_cache_watch_lookup(ngx_open_file_cache_sh_t *sh, int wd)
+{
+    ngx_rbtree_key_t    key;
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    key = (ngx_rbtree_key_t) wd;
+
+    node = sh->watches.root;
+    sentinel = sh->watches.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        return (ngx_open_file_cache_watch_t *) node;
+    }
+
+    return NULL;
+}
+
+#endif
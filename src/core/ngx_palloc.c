@@ -9,10 +9,53 @@
 #include <ngx_core.h>
 
 
+/*
+ * pool blocks and large allocations up to NGX_POOL_CACHE_MAX_SIZE are
+ * allocated in power of two size classes; in worker processes freed
+ * blocks are kept on per-class free lists up to "worker_pool_cache"
+ * bytes, and the blocks that stay unused for NGX_POOL_CACHE_TRIM
+ * milliseconds are gradually returned to the system
+ */
+
+#define NGX_POOL_CACHE_MIN_SHIFT  7
+#define NGX_POOL_CACHE_MAX_SHIFT  16
+#define NGX_POOL_CACHE_MAX_SIZE   ((size_t) 1 << NGX_POOL_CACHE_MAX_SHIFT)
+#define NGX_POOL_CACHE_SLOTS                                                  \
+    (NGX_POOL_CACHE_MAX_SHIFT - NGX_POOL_CACHE_MIN_SHIFT + 1)
+#define NGX_POOL_CACHE_TRIM       1000
+
+
+typedef struct ngx_pool_cache_block_s  ngx_pool_cache_block_t;
+
+struct ngx_pool_cache_block_s {
+    ngx_pool_cache_block_t  *next;
+};
+
+
+typedef struct {
+    ngx_pool_cache_block_t  *free;
+    ngx_uint_t               nfree;
+    ngx_uint_t               low;
+} ngx_pool_cache_slot_t;
+
+
+typedef struct {
+    ngx_pool_cache_slot_t    slots[NGX_POOL_CACHE_SLOTS];
+    size_t                   size;
+    size_t                   max;
+    ngx_msec_t               trimmed;
+} ngx_pool_cache_t;
+
+
 static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static void *ngx_pool_cache_alloc(size_t *size, ngx_log_t *log);
+static void ngx_pool_cache_free(void *p, size_t size);
+
+
+static ngx_pool_cache_t  ngx_pool_cache;
 
 
 ngx_pool_t *
@@ -20,7 +63,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_cache_alloc(&size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -82,12 +125,12 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, p->d.end - (u_char *) p);
 
         if (n == NULL) {
             break;
@@ -104,7 +147,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
@@ -183,7 +226,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_cache_alloc(&psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -217,7 +260,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    p = ngx_pool_cache_alloc(&size, pool->log);
     if (p == NULL) {
         return NULL;
     }
@@ -227,6 +270,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -237,11 +281,12 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, size);
         return NULL;
     }
 
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -267,6 +312,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -283,7 +329,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -401,6 +447,144 @@ ngx_pool_delete_file(void *data)
 }
 
 
+void
+ngx_pool_cache_init(size_t max)
+{
+    ngx_pool_cache.max = max;
+    ngx_pool_cache.trimmed = ngx_current_msec;
+}
+
+
+void
+ngx_pool_cache_trim(void)
+{
+    size_t                   size;
+    ngx_uint_t               i, n;
+    ngx_pool_cache_slot_t   *slot;
+    ngx_pool_cache_block_t  *b;
+
+    if (ngx_pool_cache.size == 0
+        || ngx_current_msec - ngx_pool_cache.trimmed < NGX_POOL_CACHE_TRIM)
+    {
+        return;
+    }
+
+    ngx_pool_cache.trimmed = ngx_current_msec;
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        slot = &ngx_pool_cache.slots[i];
+        size = (size_t) 1 << (i + NGX_POOL_CACHE_MIN_SHIFT);
+
+        /* free a half of the blocks not used since the last trim */
+
+        for (n = (slot->low + 1) / 2; n; n--) {
+            b = slot->free;
+            slot->free = b->next;
+            slot->nfree--;
+
+            ngx_pool_cache.size -= size;
+
+            ngx_free(b);
+        }
+
+        slot->low = slot->nfree;
+    }
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_pool_cache_slot(size_t size)
+{
+    ngx_uint_t  n;
+
+    size = (size - 1) >> NGX_POOL_CACHE_MIN_SHIFT;
+
+    for (n = 0; size; n++) {
+        size >>= 1;
+    }
+
+    return n;
+}
+
+
+/*
+ * the size is rounded up to the size class if the cache is enabled,
+ * and only blocks of exactly a class size are cached when freed, so
+ * the blocks allocated without the cache, e.g., in the master process,
+ * are never taken for larger ones
+ */
+
+static void *
+ngx_pool_cache_alloc(size_t *size, ngx_log_t *log)
+{
+#if !(NGX_DEBUG_PALLOC)
+
+    ngx_uint_t               n;
+    ngx_pool_cache_slot_t   *slot;
+    ngx_pool_cache_block_t  *b;
+
+    if (ngx_pool_cache.max && *size <= NGX_POOL_CACHE_MAX_SIZE) {
+        n = ngx_pool_cache_slot(*size);
+        *size = (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT);
+
+        slot = &ngx_pool_cache.slots[n];
+        b = slot->free;
+
+        if (b) {
+            slot->free = b->next;
+
+            if (--slot->nfree < slot->low) {
+                slot->low = slot->nfree;
+            }
+
+            ngx_pool_cache.size -= *size;
+
+            return b;
+        }
+    }
+
+#endif
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, *size, log);
+}
+
+
+static void
+ngx_pool_cache_free(void *p, size_t size)
+{
+#if !(NGX_DEBUG_PALLOC)
+
+    ngx_uint_t               n;
+    ngx_pool_cache_slot_t   *slot;
+    ngx_pool_cache_block_t  *b;
+
+    if (size >= sizeof(ngx_pool_cache_block_t)
+        && size <= NGX_POOL_CACHE_MAX_SIZE)
+    {
+        n = ngx_pool_cache_slot(size);
+
+        if (size == (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT)
+            && ngx_pool_cache.size + size <= ngx_pool_cache.max)
+        {
+            slot = &ngx_pool_cache.slots[n];
+
+            b = p;
+            b->next = slot->free;
+            slot->free = b;
+            slot->nfree++;
+
+            ngx_pool_cache.size += size;
+
+            return;
+        }
+    }
+
+#endif
+
+    ngx_free(p);
+}
+
+
 #if 0
 
 static void *
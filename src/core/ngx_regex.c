@@ -14,6 +14,30 @@ typedef struct {
 } ngx_regex_conf_t;
 
 
+typedef struct {
+    ngx_regex_branches_t  *branches;
+    ngx_uint_t             best;
+} ngx_regex_set_ctx_t;
+
+
+#define NGX_REGEX_SET_ANCHORED  1
+#define NGX_REGEX_SET_FLOATING  2
+
+/*
+ * the number of regexes a set is worth compiling for, see misc/bench/regex
+ */
+
+#define NGX_REGEX_SET_MIN       8
+
+
+static ngx_int_t ngx_regex_set_check(ngx_regex_elt_t *elt,
+    unsigned long *options);
+static ngx_int_t ngx_regex_set_compile_branches(ngx_regex_compile_t *rc,
+    ngx_regex_set_t *set, ngx_regex_elt_t *elts, ngx_uint_t type,
+    ngx_regex_branches_t *br);
+static ngx_int_t ngx_regex_set_exec_branches(ngx_regex_branches_t *br,
+    ngx_str_t *s, ngx_uint_t *best);
+static int ngx_libc_cdecl ngx_regex_set_callout(pcre_callout_block *cb);
 static void * ngx_libc_cdecl ngx_regex_malloc(size_t size);
 static void ngx_libc_cdecl ngx_regex_free(void *p);
 #if (NGX_HAVE_PCRE_JIT)
@@ -227,6 +251,387 @@ ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log)
 }
 
 
+/*
+ * A regex set combines the patterns of a list into alternations, so that
+ * the first pattern of the list matching a string is found in one pass.
+ * Each branch ends with a callout followed by (*PRUNE)(*F): the callout
+ * records the lowest matching index, and the match then fails at the
+ * current start position, so that PCRE continues with the next position
+ * where a lower branch may still match.  Anchored patterns are combined
+ * separately, so that the anchored alternation is tried at the start of
+ * a string only.
+ *
+ * Patterns which cannot be wrapped into a group safely, e.g. with
+ * backreferences, recursion, verbs, callouts, "\Q" or "(?x)", are left
+ * out of the set and marked as such in the set->combined array, they
+ * have to be tested individually by the caller.  So is the first pattern:
+ * an early match of a floating pattern in the set still scans the rest of
+ * the string for the preceding branches, while most matches are expected
+ * to be of the first pattern.  Less than NGX_REGEX_SET_MIN patterns are
+ * not combined at all, as one pcre_exec() per pattern is faster then.
+ */
+
+ngx_regex_set_t *
+ngx_regex_set_compile(ngx_regex_compile_t *rc, ngx_regex_elt_t *elts,
+    ngx_uint_t n)
+{
+    ngx_uint_t        i, combined;
+    unsigned long     options;
+    ngx_regex_set_t  *set;
+
+    set = ngx_pcalloc(rc->pool, sizeof(ngx_regex_set_t));
+    if (set == NULL) {
+        goto nomem;
+    }
+
+    set->combined = ngx_pcalloc(rc->pool, n);
+    if (set->combined == NULL) {
+        goto nomem;
+    }
+
+    set->nelts = n;
+    combined = 0;
+
+    for (i = 1; i < n; i++) {
+
+        if (ngx_regex_set_check(&elts[i], &options) != NGX_OK) {
+            continue;
+        }
+
+        set->combined[i] = (options & PCRE_ANCHORED) ? NGX_REGEX_SET_ANCHORED
+                                                     : NGX_REGEX_SET_FLOATING;
+        combined++;
+    }
+
+    if (combined < NGX_REGEX_SET_MIN - 1) {
+        ngx_memzero(set->combined, n);
+        return set;
+    }
+
+    if (ngx_regex_set_compile_branches(rc, set, elts, NGX_REGEX_SET_ANCHORED,
+                                       &set->anchored)
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_regex_set_compile_branches(rc, set, elts, NGX_REGEX_SET_FLOATING,
+                                       &set->floating)
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return set;
+
+nomem:
+
+    rc->err.len = ngx_snprintf(rc->err.data, rc->err.len,
+                               "regex set compilation failed: no memory")
+                  - rc->err.data;
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_regex_set_check(ngx_regex_elt_t *elt, unsigned long *options)
+{
+    u_char  *p, *q;
+
+    if (pcre_fullinfo(elt->regex->code, NULL, PCRE_INFO_OPTIONS, options)
+        != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (*options & ~(PCRE_CASELESS|PCRE_ANCHORED)) {
+        return NGX_DECLINED;
+    }
+
+    for (p = elt->name; *p; p++) {
+
+        if (*p == '\\') {
+            p++;
+
+            if ((*p >= '1' && *p <= '9')
+                || *p == 'g' || *p == 'k' || *p == 'Q')
+            {
+                return NGX_DECLINED;
+            }
+
+            if (*p == '\0') {
+                break;
+            }
+
+            continue;
+        }
+
+        if (*p != '(') {
+            continue;
+        }
+
+        if (p[1] == '*') {
+            return NGX_DECLINED;
+        }
+
+        if (p[1] != '?') {
+            continue;
+        }
+
+        switch (p[2]) {
+
+        case 'C': case 'R': case '(': case '&': case '+':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return NGX_DECLINED;
+
+        case 'P':
+            if (p[3] == '=' || p[3] == '>') {
+                return NGX_DECLINED;
+            }
+            break;
+
+        case '-':
+            if (p[3] >= '0' && p[3] <= '9') {
+                return NGX_DECLINED;
+            }
+            break;
+        }
+
+        /* "(?x)" would turn the rest of the set into a comment */
+
+        for (q = p + 2; (*q >= 'a' && *q <= 'z') || (*q >= 'A' && *q <= 'Z')
+                        || *q == '-'; q++)
+        {
+            if (*q == 'x') {
+                return NGX_DECLINED;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_regex_set_compile_branches(ngx_regex_compile_t *rc, ngx_regex_set_t *set,
+    ngx_regex_elt_t *elts, ngx_uint_t type, ngx_regex_branches_t *br)
+{
+    size_t          len;
+    u_char         *p, *start;
+    ngx_uint_t      i, n;
+    unsigned long   options;
+
+    static u_char  branch[] = ")(?C)(*PRUNE)(*F)";
+
+    n = 0;
+    len = 0;
+
+    for (i = 0; i < set->nelts; i++) {
+        if (set->combined[i] == type) {
+            n++;
+            len += sizeof("|(?i:") - 1 + ngx_strlen(elts[i].name)
+                   + sizeof(branch) - 1;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    br->index = ngx_palloc(rc->pool, n * sizeof(ngx_uint_t));
+    if (br->index == NULL) {
+        goto nomem;
+    }
+
+    br->starts = ngx_palloc(rc->pool, n * sizeof(int));
+    if (br->starts == NULL) {
+        goto nomem;
+    }
+
+    start = ngx_pnalloc(rc->pool, len + 1);
+    if (start == NULL) {
+        goto nomem;
+    }
+
+    p = start;
+
+    for (i = 0; i < set->nelts; i++) {
+
+        if (set->combined[i] != type) {
+            continue;
+        }
+
+        if (br->nelts) {
+            *p++ = '|';
+        }
+
+        br->index[br->nelts] = i;
+        br->starts[br->nelts] = p - start;
+        br->nelts++;
+
+        (void) pcre_fullinfo(elts[i].regex->code, NULL, PCRE_INFO_OPTIONS,
+                             &options);
+
+        if (options & PCRE_CASELESS) {
+            p = ngx_cpymem(p, "(?i:", sizeof("(?i:") - 1);
+
+        } else {
+            p = ngx_cpymem(p, "(?:", sizeof("(?:") - 1);
+        }
+
+        p = ngx_cpymem(p, elts[i].name, ngx_strlen(elts[i].name));
+        p = ngx_cpymem(p, branch, sizeof(branch) - 1);
+    }
+
+    *p = '\0';
+
+    rc->pattern.len = p - start;
+    rc->pattern.data = start;
+    rc->options = PCRE_NO_AUTO_CAPTURE|PCRE_DUPNAMES;
+
+    if (ngx_regex_compile(rc) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    br->regex = rc->regex;
+
+    return NGX_OK;
+
+nomem:
+
+    rc->err.len = ngx_snprintf(rc->err.data, rc->err.len,
+                               "regex set compilation failed: no memory")
+                  - rc->err.data;
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_regex_set_exec(ngx_regex_set_t *set, ngx_str_t *s)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  best;
+
+    best = set->nelts;
+
+    if (set->anchored.nelts) {
+        rc = ngx_regex_set_exec_branches(&set->anchored, s, &best);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    /* floating patterns are only of interest if listed before the match */
+
+    if (set->floating.nelts && set->floating.index[0] < best) {
+        rc = ngx_regex_set_exec_branches(&set->floating, s, &best);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (best == set->nelts) {
+        return NGX_REGEX_NO_MATCHED;
+    }
+
+    return best;
+}
+
+
+static ngx_int_t
+ngx_regex_set_exec_branches(ngx_regex_branches_t *br, ngx_str_t *s,
+    ngx_uint_t *best)
+{
+    int                  rc;
+    pcre_extra           extra;
+    ngx_regex_set_ctx_t  ctx;
+    int (*callout)(pcre_callout_block *);
+
+    if (br->regex->extra) {
+        extra = *br->regex->extra;
+
+    } else {
+        ngx_memzero(&extra, sizeof(pcre_extra));
+    }
+
+    ctx.branches = br;
+    ctx.best = *best;
+
+    extra.flags |= PCRE_EXTRA_CALLOUT_DATA;
+    extra.callout_data = &ctx;
+
+    /*
+     * the callout function of PCRE is global, so it is only set for
+     * the duration of the match, and the previous one is restored
+     */
+
+    callout = pcre_callout;
+    pcre_callout = ngx_regex_set_callout;
+
+    rc = pcre_exec(br->regex->code, &extra, (const char *) s->data, s->len,
+                   0, 0, NULL, 0);
+
+    pcre_callout = callout;
+
+    *best = ctx.best;
+
+    /* all branches fail in the end, the callout may abort early */
+
+    if (rc < 0 && rc != PCRE_ERROR_NOMATCH && rc != PCRE_ERROR_CALLOUT) {
+        return rc;
+    }
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_regex_set_callout(pcre_callout_block *cb)
+{
+    ngx_uint_t             lo, hi, k;
+    ngx_regex_branches_t  *br;
+    ngx_regex_set_ctx_t   *ctx;
+
+    ctx = cb->callout_data;
+
+    if (ctx == NULL
+        || ctx->branches == NULL
+        || cb->callout_number != 0
+        || cb->pattern_position < 0)
+    {
+        /* not a regex set */
+        return 0;
+    }
+
+    br = ctx->branches;
+
+    lo = 0;
+    hi = br->nelts - 1;
+
+    while (lo < hi) {
+        k = (lo + hi + 1) / 2;
+
+        if (br->starts[k] <= cb->pattern_position) {
+            lo = k;
+
+        } else {
+            hi = k - 1;
+        }
+    }
+
+    if (br->index[lo] < ctx->best) {
+        ctx->best = br->index[lo];
+    }
+
+    /* nothing can precede the first branch */
+
+    return (lo == 0) ? PCRE_ERROR_CALLOUT : 0;
+}
+
+
 static void * ngx_libc_cdecl
 ngx_regex_malloc(size_t size)
 {
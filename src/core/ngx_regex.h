@@ -46,6 +46,22 @@ typedef struct {
 } ngx_regex_elt_t;
 
 
+typedef struct {
+    ngx_regex_t  *regex;
+    ngx_uint_t    nelts;
+    ngx_uint_t   *index;
+    int          *starts;
+} ngx_regex_branches_t;
+
+
+typedef struct {
+    ngx_regex_branches_t  anchored;
+    ngx_regex_branches_t  floating;
+    ngx_uint_t            nelts;
+    u_char               *combined;
+} ngx_regex_set_t;
+
+
 void ngx_regex_init(void);
 ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
 
@@ -56,5 +72,9 @@ ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
 
 ngx_int_t ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log);
 
+ngx_regex_set_t *ngx_regex_set_compile(ngx_regex_compile_t *rc,
+    ngx_regex_elt_t *elts, ngx_uint_t n);
+ngx_int_t ngx_regex_set_exec(ngx_regex_set_t *set, ngx_str_t *s);
+
 
 #endif /* _NGX_REGEX_H_INCLUDED_ */
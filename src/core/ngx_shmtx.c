@@ -18,6 +18,7 @@ static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx);
 ngx_int_t
 ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 {
+    mtx->sh = addr;
     mtx->lock = &addr->lock;
 
     if (mtx->spin == (ngx_uint_t) -1) {
@@ -73,10 +74,15 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx lock");
 
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        mtx->sh->locks++;
+        return;
+    }
+
     for ( ;; ) {
 
         if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
-            return;
+            goto locked;
         }
 
         if (ngx_ncpu > 1) {
@@ -90,7 +96,7 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
                 if (*mtx->lock == 0
                     && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
                 {
-                    return;
+                    goto locked;
                 }
             }
         }
@@ -102,7 +108,7 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 
             if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
                 (void) ngx_atomic_fetch_add(mtx->wait, -1);
-                return;
+                goto locked;
             }
 
             ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
@@ -130,6 +136,11 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 
         ngx_sched_yield();
     }
+
+locked:
+
+    mtx->sh->locks++;
+    mtx->sh->contended++;
 }
 
 
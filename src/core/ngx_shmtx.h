@@ -18,22 +18,27 @@ typedef struct {
 #if (NGX_HAVE_POSIX_SEM)
     ngx_atomic_t   wait;
 #endif
+
+    /* updated under the lock by ngx_shmtx_lock() */
+    ngx_atomic_t   locks;
+    ngx_atomic_t   contended;
 } ngx_shmtx_sh_t;
 
 
 typedef struct {
 #if (NGX_HAVE_ATOMIC_OPS)
-    ngx_atomic_t  *lock;
+    ngx_atomic_t    *lock;
+    ngx_shmtx_sh_t  *sh;
 #if (NGX_HAVE_POSIX_SEM)
-    ngx_atomic_t  *wait;
-    ngx_uint_t     semaphore;
-    sem_t          sem;
+    ngx_atomic_t    *wait;
+    ngx_uint_t       semaphore;
+    sem_t            sem;
 #endif
 #else
-    ngx_fd_t       fd;
-    u_char        *name;
+    ngx_fd_t         fd;
+    u_char          *name;
 #endif
-    ngx_uint_t     spin;
+    ngx_uint_t       spin;
 } ngx_shmtx_t;
 
 
@@ -54,6 +54,28 @@
      + (uintptr_t) (pool)->start)
 
 
+/*
+ * the pages are protected by the lock 0, and the slots of each size
+ * by the lock "slot + 1", so allocations of different sizes do not
+ * contend with each other and do not need the zone mutex
+ */
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+#define ngx_slab_lock_addr(pool, n)                                           \
+    ((ngx_slab_lock_t *) ((u_char *) (pool)->locks + (n) * NGX_CPU_CACHE_LINE))
+
+#define ngx_slab_unlock(pool, n)                                              \
+    (void) ngx_atomic_cmp_set(&ngx_slab_lock_addr(pool, n)->lock, ngx_pid, 0)
+
+#else
+
+#define ngx_slab_lock(pool, n)
+#define ngx_slab_unlock(pool, n)
+
+#endif
+
+
 #if (NGX_DEBUG_MALLOC)
 
 #define ngx_slab_junk(p, size)     ngx_memset(p, 0xA5, size)
@@ -69,6 +91,9 @@
 
 #endif
 
+#if (NGX_HAVE_ATOMIC_OPS)
+static void ngx_slab_lock(ngx_slab_pool_t *pool, ngx_uint_t n);
+#endif
 static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
     ngx_uint_t pages);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
@@ -128,6 +153,13 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 
     size -= n * (sizeof(ngx_slab_page_t) + sizeof(ngx_slab_stat_t));
 
+    pool->locks = (ngx_slab_lock_t *) ngx_align_ptr(p, NGX_CPU_CACHE_LINE);
+    ngx_memzero((void *) pool->locks, (n + 1) * NGX_CPU_CACHE_LINE);
+
+    size -= (u_char *) pool->locks + (n + 1) * NGX_CPU_CACHE_LINE - p;
+
+    p = (u_char *) pool->locks + (n + 1) * NGX_CPU_CACHE_LINE;
+
     pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t)));
 
     pool->pages = (ngx_slab_page_t *) p;
@@ -165,6 +197,12 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 void *
 ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    return ngx_slab_alloc_locked(pool, size);
+
+#else
+
     void  *p;
 
     ngx_shmtx_lock(&pool->mutex);
@@ -174,6 +212,8 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
     ngx_shmtx_unlock(&pool->mutex);
 
     return p;
+
+#endif
 }
 
 
@@ -190,8 +230,13 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                        "slab alloc: %uz", size);
 
+        ngx_slab_lock(pool, 0);
+
         page = ngx_slab_alloc_pages(pool, (size >> ngx_pagesize_shift)
                                           + ((size % ngx_pagesize) ? 1 : 0));
+
+        ngx_slab_unlock(pool, 0);
+
         if (page) {
             p = ngx_slab_page_addr(pool, page);
 
@@ -212,6 +257,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         slot = 0;
     }
 
+    ngx_slab_lock(pool, slot + 1);
+
     pool->stats[slot].reqs++;
 
     ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
@@ -248,7 +295,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         if (bitmap[n] == NGX_SLAB_BUSY) {
                             for (n = n + 1; n < map; n++) {
                                 if (bitmap[n] != NGX_SLAB_BUSY) {
-                                    goto done;
+                                    goto unlock;
                                 }
                             }
 
@@ -260,7 +307,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                             page->prev = NGX_SLAB_SMALL;
                         }
 
-                        goto done;
+                        goto unlock;
                     }
                 }
             }
@@ -287,7 +334,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
                 pool->stats[slot].used++;
 
-                goto done;
+                goto unlock;
             }
 
         } else { /* shift > ngx_slab_exact_shift */
@@ -318,7 +365,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
                 pool->stats[slot].used++;
 
-                goto done;
+                goto unlock;
             }
         }
 
@@ -326,6 +373,13 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         ngx_debug_point();
     }
 
+    /*
+     * the page descriptor is set up under the page lock, as
+     * ngx_slab_free_pages() looks at the neighbours of a freed page
+     */
+
+    ngx_slab_lock(pool, 0);
+
     page = ngx_slab_alloc_pages(pool, 1);
 
     if (page) {
@@ -351,6 +405,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             page->next = &slots[slot];
             page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_SMALL;
 
+            ngx_slab_unlock(pool, 0);
+
             slots[slot].next = page;
 
             pool->stats[slot].total += (ngx_pagesize >> shift) - n;
@@ -359,7 +415,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
             pool->stats[slot].used++;
 
-            goto done;
+            goto unlock;
 
         } else if (shift == ngx_slab_exact_shift) {
 
@@ -367,6 +423,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             page->next = &slots[slot];
             page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_EXACT;
 
+            ngx_slab_unlock(pool, 0);
+
             slots[slot].next = page;
 
             pool->stats[slot].total += sizeof(uintptr_t) * 8;
@@ -375,7 +433,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
             pool->stats[slot].used++;
 
-            goto done;
+            goto unlock;
 
         } else { /* shift > ngx_slab_exact_shift */
 
@@ -383,6 +441,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             page->next = &slots[slot];
             page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_BIG;
 
+            ngx_slab_unlock(pool, 0);
+
             slots[slot].next = page;
 
             pool->stats[slot].total += ngx_pagesize >> shift;
@@ -391,14 +451,20 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
             pool->stats[slot].used++;
 
-            goto done;
+            goto unlock;
         }
     }
 
+    ngx_slab_unlock(pool, 0);
+
     p = 0;
 
     pool->stats[slot].fails++;
 
+unlock:
+
+    ngx_slab_unlock(pool, slot + 1);
+
 done:
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
@@ -411,6 +477,12 @@ done:
 void *
 ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
 {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    return ngx_slab_calloc_locked(pool, size);
+
+#else
+
     void  *p;
 
     ngx_shmtx_lock(&pool->mutex);
@@ -420,6 +492,8 @@ ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
     ngx_shmtx_unlock(&pool->mutex);
 
     return p;
+
+#endif
 }
 
 
@@ -440,11 +514,19 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_slab_free_locked(pool, p);
+
+#else
+
     ngx_shmtx_lock(&pool->mutex);
 
     ngx_slab_free_locked(pool, p);
 
     ngx_shmtx_unlock(&pool->mutex);
+
+#endif
 }
 
 
@@ -485,8 +567,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         bitmap = (uintptr_t *)
                              ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
 
+        slot = shift - pool->min_shift;
+
+        ngx_slab_lock(pool, slot + 1);
+
         if (bitmap[n] & m) {
-            slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
                 slots = ngx_slab_slots(pool);
@@ -518,7 +603,9 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 }
             }
 
+            ngx_slab_lock(pool, 0);
             ngx_slab_free_pages(pool, page, 1);
+            ngx_slab_unlock(pool, 0);
 
             pool->stats[slot].total -= (ngx_pagesize >> shift) - n;
 
@@ -537,8 +624,13 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
             goto wrong_chunk;
         }
 
+        slot = ngx_slab_exact_shift - pool->min_shift;
+
+        ngx_slab_lock(pool, slot + 1);
+
+        slab = page->slab;
+
         if (slab & m) {
-            slot = ngx_slab_exact_shift - pool->min_shift;
 
             if (slab == NGX_SLAB_BUSY) {
                 slots = ngx_slab_slots(pool);
@@ -556,7 +648,9 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
+            ngx_slab_lock(pool, 0);
             ngx_slab_free_pages(pool, page, 1);
+            ngx_slab_unlock(pool, 0);
 
             pool->stats[slot].total -= sizeof(uintptr_t) * 8;
 
@@ -577,8 +671,13 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         m = (uintptr_t) 1 << ((((uintptr_t) p & (ngx_pagesize - 1)) >> shift)
                               + NGX_SLAB_MAP_SHIFT);
 
+        slot = shift - pool->min_shift;
+
+        ngx_slab_lock(pool, slot + 1);
+
+        slab = page->slab;
+
         if (slab & m) {
-            slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
                 slots = ngx_slab_slots(pool);
@@ -596,7 +695,9 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
+            ngx_slab_lock(pool, 0);
             ngx_slab_free_pages(pool, page, 1);
+            ngx_slab_unlock(pool, 0);
 
             pool->stats[slot].total -= ngx_pagesize >> shift;
 
@@ -626,10 +727,12 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
         size = slab & ~NGX_SLAB_PAGE_START;
 
-        ngx_slab_free_pages(pool, &pool->pages[n], size);
-
         ngx_slab_junk(p, size << ngx_pagesize_shift);
 
+        ngx_slab_lock(pool, 0);
+        ngx_slab_free_pages(pool, &pool->pages[n], size);
+        ngx_slab_unlock(pool, 0);
+
         return;
     }
 
@@ -643,6 +746,8 @@ done:
 
     ngx_slab_junk(p, size);
 
+    ngx_slab_unlock(pool, slot + 1);
+
     return;
 
 wrong_chunk:
@@ -654,6 +759,8 @@ wrong_chunk:
 
 chunk_already_free:
 
+    ngx_slab_unlock(pool, slot + 1);
+
     ngx_slab_error(pool, NGX_LOG_ALERT,
                    "ngx_slab_free(): chunk is already free");
 
@@ -663,6 +770,117 @@ fail:
 }
 
 
+ngx_uint_t
+ngx_slab_force_unlock(ngx_slab_pool_t *pool, ngx_pid_t pid)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_uint_t  i, n, unlocked;
+
+    unlocked = 0;
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    for (i = 0; i < n + 1; i++) {
+        if (ngx_atomic_cmp_set(&ngx_slab_lock_addr(pool, i)->lock, pid, 0)) {
+            unlocked = 1;
+        }
+    }
+
+    return unlocked;
+
+#else
+
+    return 0;
+
+#endif
+}
+
+
+void
+ngx_slab_lock_stats(ngx_slab_pool_t *pool, ngx_slab_lock_t *total)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_uint_t        i, n;
+    ngx_slab_lock_t  *lock;
+#endif
+
+    ngx_memzero(total, sizeof(ngx_slab_lock_t));
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    for (i = 0; i < n + 1; i++) {
+        lock = ngx_slab_lock_addr(pool, i);
+
+        total->locks += lock->locks;
+        total->contended += lock->contended;
+        total->spins += lock->spins;
+    }
+
+#endif
+}
+
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+static void
+ngx_slab_lock(ngx_slab_pool_t *pool, ngx_uint_t n)
+{
+    ngx_uint_t        i, k, spins;
+    ngx_slab_lock_t  *lock;
+
+    lock = ngx_slab_lock_addr(pool, n);
+
+    if (lock->lock == 0 && ngx_atomic_cmp_set(&lock->lock, 0, ngx_pid)) {
+        lock->locks++;
+        return;
+    }
+
+    /* ngx_spinlock() with the failed attempts counted */
+
+    spins = 0;
+
+    for ( ;; ) {
+
+        if (ngx_ncpu > 1) {
+
+            for (k = 1; k < 1024; k <<= 1) {
+
+                for (i = 0; i < k; i++) {
+                    ngx_cpu_pause();
+                }
+
+                spins++;
+
+                if (lock->lock == 0
+                    && ngx_atomic_cmp_set(&lock->lock, 0, ngx_pid))
+                {
+                    goto locked;
+                }
+            }
+        }
+
+        ngx_sched_yield();
+
+        spins++;
+
+        if (lock->lock == 0 && ngx_atomic_cmp_set(&lock->lock, 0, ngx_pid)) {
+            goto locked;
+        }
+    }
+
+locked:
+
+    lock->locks++;
+    lock->contended++;
+    lock->spins += spins;
+}
+
+#endif
+
+
 static ngx_slab_page_t *
 ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
 {
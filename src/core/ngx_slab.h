@@ -31,6 +31,18 @@ typedef struct {
 } ngx_slab_stat_t;
 
 
+/* a lock of the allocator, on a cache line of its own */
+
+typedef struct {
+    ngx_atomic_t      lock;
+
+    /* updated under the lock */
+    ngx_atomic_t      locks;
+    ngx_atomic_t      contended;
+    ngx_atomic_t      spins;
+} ngx_slab_lock_t;
+
+
 typedef struct {
     ngx_shmtx_sh_t    lock;
 
@@ -44,6 +56,8 @@ typedef struct {
     ngx_slab_stat_t  *stats;
     ngx_uint_t        pfree;
 
+    ngx_slab_lock_t  *locks;
+
     u_char           *start;
     u_char           *end;
 
@@ -66,6 +80,8 @@ void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+ngx_uint_t ngx_slab_force_unlock(ngx_slab_pool_t *pool, ngx_pid_t pid);
+void ngx_slab_lock_stats(ngx_slab_pool_t *pool, ngx_slab_lock_t *total);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
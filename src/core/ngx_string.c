@@ -8,17 +8,64 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+#if (NGX_HAVE_X86_TARGET)
+#include <immintrin.h>
+#elif (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if (NGX_HAVE_NEON)
+#include <arm_neon.h>
+#endif
 
+
+static void ngx_strlow_generic(u_char *dst, u_char *src, size_t n);
 static u_char *ngx_sprintf_num(u_char *buf, u_char *last, uint64_t ui64,
     u_char zero, ngx_uint_t hexadecimal, ngx_uint_t width);
-static void ngx_encode_base64_internal(ngx_str_t *dst, ngx_str_t *src,
+static u_char *ngx_hex_dump_generic(u_char *dst, u_char *src, size_t len);
+static void ngx_encode_base64_generic(ngx_str_t *dst, ngx_str_t *src,
     const u_char *basis, ngx_uint_t padding);
 static ngx_int_t ngx_decode_base64_internal(ngx_str_t *dst, ngx_str_t *src,
     const u_char *basis);
+static uintptr_t ngx_escape_uri_generic(u_char *dst, u_char *src, size_t size,
+    ngx_uint_t type);
+static void ngx_unescape_uri_generic(u_char **dst, u_char **src, size_t size,
+    ngx_uint_t type);
+
+#if (NGX_HAVE_X86_TARGET)
+static void ngx_strlow_avx2(u_char *dst, u_char *src, size_t n);
+static u_char *ngx_hex_dump_ssse3(u_char *dst, u_char *src, size_t len);
+static void ngx_encode_base64_ssse3(ngx_str_t *dst, ngx_str_t *src,
+    const u_char *basis, ngx_uint_t padding);
+static void ngx_escape_uri_ssse3_init(void);
+static uintptr_t ngx_escape_uri_ssse3(u_char *dst, u_char *src, size_t size,
+    ngx_uint_t type);
+#endif
+#if (NGX_HAVE_SSE2)
+static void ngx_unescape_uri_sse2(u_char **dst, u_char **src, size_t size,
+    ngx_uint_t type);
+#endif
+#if (NGX_HAVE_NEON)
+static void ngx_strlow_neon(u_char *dst, u_char *src, size_t n);
+#endif
 
 
-void
-ngx_strlow(u_char *dst, u_char *src, size_t n)
+/* the implementations are selected by ngx_string_cpu_init() */
+
+void (*ngx_strlow)(u_char *dst, u_char *src, size_t n) = ngx_strlow_generic;
+u_char *(*ngx_hex_dump)(u_char *dst, u_char *src, size_t len) =
+    ngx_hex_dump_generic;
+uintptr_t (*ngx_escape_uri)(u_char *dst, u_char *src, size_t size,
+    ngx_uint_t type) = ngx_escape_uri_generic;
+void (*ngx_unescape_uri)(u_char **dst, u_char **src, size_t size,
+    ngx_uint_t type) = ngx_unescape_uri_generic;
+
+static void (*ngx_encode_base64_internal)(ngx_str_t *dst, ngx_str_t *src,
+    const u_char *basis, ngx_uint_t padding) = ngx_encode_base64_generic;
+
+
+static void
+ngx_strlow_generic(u_char *dst, u_char *src, size_t n)
 {
     while (n) {
         *dst = ngx_tolower(*src);
@@ -1104,8 +1151,8 @@ ngx_hextoi(u_char *line, size_t n)
 }
 
 
-u_char *
-ngx_hex_dump(u_char *dst, u_char *src, size_t len)
+static u_char *
+ngx_hex_dump_generic(u_char *dst, u_char *src, size_t len)
 {
     static u_char  hex[] = "0123456789abcdef";
 
@@ -1139,7 +1186,7 @@ ngx_encode_base64url(ngx_str_t *dst, ngx_str_t *src)
 
 
 static void
-ngx_encode_base64_internal(ngx_str_t *dst, ngx_str_t *src, const u_char *basis,
+ngx_encode_base64_generic(ngx_str_t *dst, ngx_str_t *src, const u_char *basis,
     ngx_uint_t padding)
 {
     u_char         *d, *s;
@@ -1421,8 +1468,8 @@ ngx_utf8_cpystrn(u_char *dst, u_char *src, size_t n, size_t len)
 }
 
 
-uintptr_t
-ngx_escape_uri(u_char *dst, u_char *src, size_t size, ngx_uint_t type)
+static uintptr_t
+ngx_escape_uri_generic(u_char *dst, u_char *src, size_t size, ngx_uint_t type)
 {
     ngx_uint_t      n;
     uint32_t       *escape;
@@ -1590,8 +1637,9 @@ ngx_escape_uri(u_char *dst, u_char *src, size_t size, ngx_uint_t type)
 }
 
 
-void
-ngx_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type)
+static void
+ngx_unescape_uri_generic(u_char **dst, u_char **src, size_t size,
+    ngx_uint_t type)
 {
     u_char  *d, *s, ch, c, decoded;
     enum {
@@ -1960,6 +2008,467 @@ ngx_sort(void *base, size_t n, size_t size,
 }
 
 
+void
+ngx_string_cpu_init(void)
+{
+#if (NGX_HAVE_X86_TARGET)
+
+    if (ngx_cpu_features & NGX_CPU_AVX2) {
+        ngx_strlow = ngx_strlow_avx2;
+    }
+
+    /* all CPUs with SSE4.2 support SSSE3 */
+
+    if (ngx_cpu_features & NGX_CPU_SSE42) {
+        ngx_hex_dump = ngx_hex_dump_ssse3;
+        ngx_encode_base64_internal = ngx_encode_base64_ssse3;
+
+        ngx_escape_uri_ssse3_init();
+        ngx_escape_uri = ngx_escape_uri_ssse3;
+    }
+
+#endif
+
+#if (NGX_HAVE_SSE2)
+    ngx_unescape_uri = ngx_unescape_uri_sse2;
+#endif
+
+#if (NGX_HAVE_NEON)
+    if (ngx_cpu_features & NGX_CPU_NEON) {
+        ngx_strlow = ngx_strlow_neon;
+    }
+#endif
+}
+
+
+#if (NGX_HAVE_X86_TARGET)
+
+__attribute__((target("avx2")))
+static void
+ngx_strlow_avx2(u_char *dst, u_char *src, size_t n)
+{
+    __m128i  v, m;
+    __m256i  w, u;
+
+    while (n >= 32) {
+        w = _mm256_loadu_si256((__m256i *) src);
+
+        u = _mm256_and_si256(_mm256_cmpgt_epi8(w, _mm256_set1_epi8('A' - 1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), w));
+        w = _mm256_add_epi8(w, _mm256_and_si256(u, _mm256_set1_epi8(0x20)));
+
+        _mm256_storeu_si256((__m256i *) dst, w);
+
+        dst += 32;
+        src += 32;
+        n -= 32;
+    }
+
+    /* gcc does not emit vzeroupper for functions with the target attribute */
+
+    _mm256_zeroupper();
+
+    if (n >= 16) {
+        v = _mm_loadu_si128((__m128i *) src);
+
+        m = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                          _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+        v = _mm_add_epi8(v, _mm_and_si128(m, _mm_set1_epi8(0x20)));
+
+        _mm_storeu_si128((__m128i *) dst, v);
+
+        dst += 16;
+        src += 16;
+        n -= 16;
+    }
+
+    ngx_strlow_generic(dst, src, n);
+}
+
+
+__attribute__((target("ssse3")))
+static u_char *
+ngx_hex_dump_ssse3(u_char *dst, u_char *src, size_t len)
+{
+    __m128i  hex, v, hi, lo;
+
+    hex = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+
+    while (len >= 16) {
+        v = _mm_loadu_si128((__m128i *) src);
+
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+        lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+
+        hi = _mm_shuffle_epi8(hex, hi);
+        lo = _mm_shuffle_epi8(hex, lo);
+
+        _mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi8(hi, lo));
+
+        dst += 32;
+        src += 16;
+        len -= 16;
+    }
+
+    return ngx_hex_dump_generic(dst, src, len);
+}
+
+
+/*
+ * 12 input bytes are spread to 16 6-bit indices and the indices
+ * are translated to the alphabet with a single 16-byte lookup
+ * of the offsets of the ranges "A-Z", "a-z", "0-9", and two last characters,
+ * as described by Wojciech Mula in "Base64 encoding with SIMD instructions".
+ */
+
+__attribute__((target("ssse3")))
+static void
+ngx_encode_base64_ssse3(ngx_str_t *dst, ngx_str_t *src, const u_char *basis,
+    ngx_uint_t padding)
+{
+    u_char     *d, *s;
+    size_t      len;
+    __m128i     v, t0, t1, t2, t3, shift, r;
+    ngx_str_t   tail, out;
+
+    len = src->len;
+    s = src->data;
+    d = dst->data;
+
+    shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                          '0' - 52, (char) (basis[62] - 62),
+                          (char) (basis[63] - 63), 'A', 0, 0);
+
+    /* 16 bytes are loaded, 12 of them are encoded */
+
+    while (len >= 16) {
+        v = _mm_loadu_si128((__m128i *) s);
+
+        v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                             4, 5, 3, 4, 1, 2, 0, 1));
+
+        t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+        t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+        t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+        v = _mm_or_si128(t1, t3);
+
+        /* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+
+        r = _mm_subs_epu8(v, _mm_set1_epi8(51));
+        r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), v),
+                                          _mm_set1_epi8(13)));
+
+        v = _mm_add_epi8(v, _mm_shuffle_epi8(shift, r));
+
+        _mm_storeu_si128((__m128i *) d, v);
+
+        s += 12;
+        d += 16;
+        len -= 12;
+    }
+
+    tail.len = len;
+    tail.data = s;
+
+    out.data = d;
+
+    ngx_encode_base64_generic(&out, &tail, basis, padding);
+
+    dst->len = d + out.len - dst->data;
+}
+
+
+/*
+ * A byte is looked up in the 256-bit escape map with two shuffles:
+ * the low nibble selects a byte of the map column, and the high nibble
+ * selects a bit in it.  The columns for the high nibbles 0-7 and 8-15
+ * are kept separately, as pshufb zeroes the result for indices >= 0x80.
+ */
+
+#define NGX_ESCAPE_URI_TYPES  (NGX_ESCAPE_MAIL_AUTH + 1)
+
+static u_char  ngx_escape_uri_columns[NGX_ESCAPE_URI_TYPES][32];
+
+
+static void
+ngx_escape_uri_ssse3_init(void)
+{
+    u_char      c;
+    ngx_uint_t  type, n;
+
+    for (type = 0; type < NGX_ESCAPE_URI_TYPES; type++) {
+        for (n = 0; n < 256; n++) {
+            c = (u_char) n;
+
+            if (ngx_escape_uri_generic(NULL, &c, 1, type)) {
+                ngx_escape_uri_columns[type][(n >> 7) * 16 + (n & 0x0f)]
+                    |= (u_char) (1 << ((n >> 4) & 7));
+            }
+        }
+    }
+}
+
+
+__attribute__((target("ssse3")))
+static ngx_inline ngx_uint_t
+ngx_escape_uri_mask(__m128i v, __m128i lo, __m128i hi)
+{
+    __m128i  col, bit;
+
+    col = _mm_or_si128(_mm_shuffle_epi8(lo, v),
+                       _mm_shuffle_epi8(hi, _mm_xor_si128(v,
+                                                 _mm_set1_epi8((char) 0x80))));
+
+    bit = _mm_shuffle_epi8(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128,
+                                         1, 2, 4, 8, 16, 32, 64, (char) 128),
+                           _mm_and_si128(_mm_srli_epi16(v, 4),
+                                         _mm_set1_epi8(0x0f)));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(col, bit), bit));
+}
+
+
+__attribute__((target("ssse3,popcnt")))
+static uintptr_t
+ngx_escape_uri_ssse3(u_char *dst, u_char *src, size_t size, ngx_uint_t type)
+{
+    ngx_uint_t      n, m;
+    __m128i         v, lo, hi;
+    static u_char   hex[] = "0123456789ABCDEF";
+
+    lo = _mm_loadu_si128((__m128i *) ngx_escape_uri_columns[type]);
+    hi = _mm_loadu_si128((__m128i *) &ngx_escape_uri_columns[type][16]);
+
+    if (dst == NULL) {
+
+        /* find the number of the characters to be escaped */
+
+        n = 0;
+
+        while (size >= 16) {
+            v = _mm_loadu_si128((__m128i *) src);
+
+            n += __builtin_popcount(ngx_escape_uri_mask(v, lo, hi));
+
+            src += 16;
+            size -= 16;
+        }
+
+        return (uintptr_t) n + ngx_escape_uri_generic(NULL, src, size, type);
+    }
+
+    while (size >= 16) {
+        v = _mm_loadu_si128((__m128i *) src);
+
+        m = ngx_escape_uri_mask(v, lo, hi);
+
+        /*
+         * the whole block is stored even if it contains characters
+         * to be escaped: there are at least 16 bytes left in dst
+         */
+
+        _mm_storeu_si128((__m128i *) dst, v);
+
+        if (m == 0) {
+            dst += 16;
+            src += 16;
+            size -= 16;
+            continue;
+        }
+
+        n = __builtin_ctz(m);
+
+        dst += n;
+        src += n;
+
+        *dst++ = '%';
+        *dst++ = hex[*src >> 4];
+        *dst++ = hex[*src & 0xf];
+
+        src++;
+        size -= n + 1;
+    }
+
+    return ngx_escape_uri_generic(dst, src, size, type);
+}
+
+#endif
+
+
+#if (NGX_HAVE_SSE2)
+
+static void
+ngx_unescape_uri_sse2(u_char **dst, u_char **src, size_t size, ngx_uint_t type)
+{
+    u_char      *d, *s, ch, c, second, decoded;
+    ngx_uint_t   m, n;
+    __m128i      v, pct, qst;
+
+    d = *dst;
+    s = *src;
+
+    pct = _mm_set1_epi8('%');
+    qst = _mm_set1_epi8((type & (NGX_UNESCAPE_URI|NGX_UNESCAPE_REDIRECT))
+                        ? '?' : '%');
+
+    for ( ;; ) {
+
+        /* skip the bytes that are copied as is */
+
+        while (size >= 16) {
+            v = _mm_loadu_si128((__m128i *) s);
+
+            m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, pct),
+                                               _mm_cmpeq_epi8(v, qst)));
+
+            if (m) {
+                break;
+            }
+
+            /* the block may overlap the source only below s */
+
+            _mm_storeu_si128((__m128i *) d, v);
+
+            d += 16;
+            s += 16;
+            size -= 16;
+        }
+
+        if (size < 16) {
+            break;
+        }
+
+        n = __builtin_ctz(m);
+
+        ngx_memmove(d, s, n);
+
+        d += n;
+        s += n;
+        size -= n;
+
+        if (*s == '?') {
+            *d++ = *s++;
+            goto done;
+        }
+
+        /* "%XY" with both hex digits, other cases are left to the generic */
+
+        if (size < 3) {
+            break;
+        }
+
+        ch = s[1];
+
+        if (ch >= '0' && ch <= '9') {
+            decoded = (u_char) (ch - '0');
+
+        } else {
+            c = (u_char) (ch | 0x20);
+
+            if (c < 'a' || c > 'f') {
+                break;
+            }
+
+            decoded = (u_char) (c - 'a' + 10);
+        }
+
+        ch = s[2];
+
+        if (ch >= '0' && ch <= '9') {
+            second = 0;
+            ch = (u_char) ((decoded << 4) + ch - '0');
+
+        } else {
+            c = (u_char) (ch | 0x20);
+
+            if (c < 'a' || c > 'f') {
+                break;
+            }
+
+            second = 1;
+            ch = (u_char) ((decoded << 4) + c - 'a' + 10);
+        }
+
+        if (second && (type & NGX_UNESCAPE_URI)) {
+            *d++ = ch;
+            s += 3;
+
+            if (ch == '?') {
+                goto done;
+            }
+
+        } else if (type & NGX_UNESCAPE_REDIRECT) {
+
+            if (ch == '?') {
+                *d++ = ch;
+                s += 3;
+                goto done;
+            }
+
+            if (ch > '%' && ch < 0x7f) {
+                *d++ = ch;
+
+            } else {
+                *d++ = '%'; *d++ = s[1]; *d++ = s[2];
+            }
+
+            s += 3;
+
+        } else {
+            *d++ = ch;
+            s += 3;
+        }
+
+        size -= 3;
+    }
+
+    *dst = d;
+    *src = s;
+
+    ngx_unescape_uri_generic(dst, src, size, type);
+
+    return;
+
+done:
+
+    *dst = d;
+    *src = s;
+}
+
+#endif
+
+
+#if (NGX_HAVE_NEON)
+
+static void
+ngx_strlow_neon(u_char *dst, u_char *src, size_t n)
+{
+    uint8x16_t  v, m;
+
+    while (n >= 16) {
+        v = vld1q_u8(src);
+
+        m = vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')),
+                     vcleq_u8(v, vdupq_n_u8('Z')));
+        v = vaddq_u8(v, vandq_u8(m, vdupq_n_u8(0x20)));
+
+        vst1q_u8(dst, v);
+
+        dst += 16;
+        src += 16;
+        n -= 16;
+    }
+
+    ngx_strlow_generic(dst, src, n);
+}
+
+#endif
+
 #if (NGX_MEMCPY_LIMIT)
 
 void *
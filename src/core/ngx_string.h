@@ -47,7 +47,7 @@ typedef struct {
 #define ngx_tolower(c)      (u_char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
 #define ngx_toupper(c)      (u_char) ((c >= 'a' && c <= 'z') ? (c & ~0x20) : c)
 
-void ngx_strlow(u_char *dst, u_char *src, size_t n);
+extern void (*ngx_strlow)(u_char *dst, u_char *src, size_t n);
 
 
 #define ngx_strncmp(s1, s2, n)  strncmp((const char *) s1, (const char *) s2, n)
@@ -176,7 +176,7 @@ off_t ngx_atoof(u_char *line, size_t n);
 time_t ngx_atotm(u_char *line, size_t n);
 ngx_int_t ngx_hextoi(u_char *line, size_t n);
 
-u_char *ngx_hex_dump(u_char *dst, u_char *src, size_t len);
+extern u_char *(*ngx_hex_dump)(u_char *dst, u_char *src, size_t len);
 
 
 #define ngx_base64_encoded_length(len)  (((len + 2) / 3) * 4)
@@ -203,9 +203,10 @@ u_char *ngx_utf8_cpystrn(u_char *dst, u_char *src, size_t n, size_t len);
 #define NGX_UNESCAPE_URI       1
 #define NGX_UNESCAPE_REDIRECT  2
 
-uintptr_t ngx_escape_uri(u_char *dst, u_char *src, size_t size,
+extern uintptr_t (*ngx_escape_uri)(u_char *dst, u_char *src, size_t size,
+    ngx_uint_t type);
+extern void (*ngx_unescape_uri)(u_char **dst, u_char **src, size_t size,
     ngx_uint_t type);
-void ngx_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type);
 uintptr_t ngx_escape_html(u_char *dst, u_char *src, size_t size);
 uintptr_t ngx_escape_json(u_char *dst, u_char *src, size_t size);
 
@@ -227,6 +228,9 @@ void ngx_sort(void *base, size_t n, size_t size,
 #define ngx_qsort             qsort
 
 
+void ngx_string_cpu_init(void);
+
+
 #define ngx_value_helper(n)   #n
 #define ngx_value(n)          ngx_value_helper(n)
 
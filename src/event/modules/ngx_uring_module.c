@@ -0,0 +1,2364 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The module uses one io_uring instance per worker process.  Sockets are
+ * watched with edge-triggered multishot poll requests, so a connection is
+ * armed once and keeps posting completions until it is removed; arming,
+ * modifying and removing the requests are queued in the submission ring
+ * and are passed to a kernel together with the wait for completions in
+ * a single io_uring_enter() call.  File AIO reads are submitted to the
+ * same ring.
+ *
+ * Listening TCP sockets are served by multishot accept requests if the
+ * kernel supports them: each completion carries an accepted socket, which
+ * is queued and handed to ngx_event_accept() through ngx_uring_accept(),
+ * so no accept() system calls are made.
+ *
+ * Connections are read and written through the ring as well, with the
+ * ngx_io handlers installed by the module.  Once a connection has been
+ * drained by a readiness based read, its readiness for reading is no
+ * longer polled: a recv request is kept in the ring instead, which takes
+ * one of the provided buffers when data arrive, and ngx_uring_recv()
+ * copies the data from there.  ngx_uring_send_chain() queues the memory
+ * bufs of a chain as a sendmsg request and leaves the bufs unsent in the
+ * chain; the request is passed to a kernel with the next io_uring_enter()
+ * call, and the bytes sent are taken off the chain on the next call after
+ * the completion.  As the request is made with MSG_DONTWAIT, it is never
+ * deferred by a kernel and the bufs are not referenced after the call it
+ * was submitted with; a request still queued when the connection is
+ * closed is replaced with a no-op.  File bufs are still sent with
+ * sendfile().
+ *
+ * The user_data of a request is a connection pointer with the instance
+ * bit for poll requests, the same tagged with NGX_URING_ACCEPT,
+ * NGX_URING_RECV, or NGX_URING_SEND for accept, recv, and sendmsg
+ * requests, or an aio event pointer tagged with NGX_URING_AIO for file
+ * reads.  Requests with zero user_data are used for poll updates,
+ * removals, cancellations, and returned buffers, whose completions are
+ * not interesting.
+ */
+
+#define NGX_URING_AIO     2
+#define NGX_URING_ACCEPT  ((uint64_t) 1 << 63)
+#define NGX_URING_RECV    ((uint64_t) 1 << 62)
+#define NGX_URING_SEND    ((uint64_t) 1 << 61)
+
+#define NGX_URING_BGID    0
+#define NGX_URING_CHUNK   32
+
+
+typedef struct {
+    ngx_uint_t  entries;
+    ngx_uint_t  events;
+    ngx_bufs_t  buffers;
+} ngx_uring_conf_t;
+
+
+typedef struct ngx_uring_conn_s  ngx_uring_conn_t;
+
+struct ngx_uring_conn_s {
+    ngx_uring_conn_t      *next;
+
+    u_char                *pos;        /* the data left in a buffer */
+    size_t                 size;
+    ngx_uint_t             bid;
+    ngx_err_t              err;
+
+    ssize_t                sent;       /* the result of a sendmsg request */
+    size_t                 send_size;
+
+    uint32_t               recv_seq;
+    uint32_t               send_seq;
+
+    unsigned               reading:1;
+    unsigned               buffer:1;
+    unsigned               recv:1;
+    unsigned               eof:1;
+    unsigned               nobufs:1;
+    unsigned               send:1;
+    unsigned               done:1;
+
+    struct msghdr          msg;
+    struct iovec           iovs[NGX_IOVS_PREALLOCATE];
+};
+
+
+typedef struct {
+    volatile uint32_t     *head;
+    volatile uint32_t     *tail;
+    uint32_t              *ring_mask;
+    uint32_t              *ring_entries;
+    uint32_t              *array;
+    struct io_uring_sqe   *sqes;
+    uint32_t               sqe_tail;
+} ngx_uring_sq_t;
+
+
+typedef struct {
+    volatile uint32_t     *head;
+    volatile uint32_t     *tail;
+    uint32_t              *ring_mask;
+    struct io_uring_cqe   *cqes;
+} ngx_uring_cq_t;
+
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+typedef struct {
+    ngx_connection_t      *listening;
+    ngx_socket_t           fd;
+    ngx_err_t              err;
+} ngx_uring_accepted_t;
+
+#endif
+
+
+static ngx_int_t ngx_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_uring_setup(ngx_cycle_t *cycle, ngx_uring_conf_t *urcf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_uring_notify_init(ngx_log_t *log);
+static void ngx_uring_notify_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_uring_test_poll(ngx_cycle_t *cycle);
+static ngx_int_t ngx_uring_io_init(ngx_cycle_t *cycle,
+    ngx_uring_conf_t *urcf);
+static void ngx_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags);
+
+static struct io_uring_sqe *ngx_uring_get_sqe(ngx_log_t *log);
+static uint32_t ngx_uring_poll_events(ngx_connection_t *c);
+static ngx_int_t ngx_uring_poll_set(ngx_connection_t *c, uint32_t prev,
+    uint32_t events, ngx_log_t *log);
+static ngx_int_t ngx_uring_poll_add(ngx_connection_t *c, uint32_t events,
+    ngx_log_t *log);
+static ngx_int_t ngx_uring_poll_update(ngx_connection_t *c, uint32_t events,
+    ngx_log_t *log);
+static ngx_int_t ngx_uring_poll_remove(ngx_connection_t *c, ngx_log_t *log);
+#if (NGX_HAVE_IO_URING_ACCEPT)
+static ngx_int_t ngx_uring_accept_add(ngx_connection_t *c, ngx_log_t *log);
+static ngx_int_t ngx_uring_accept_cancel(ngx_connection_t *c,
+    ngx_log_t *log);
+static ngx_int_t ngx_uring_accept_complete(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+#endif
+static ssize_t ngx_uring_recv(ngx_connection_t *c, u_char *buf, size_t size);
+static ssize_t ngx_uring_recv_chain(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit);
+static ssize_t ngx_uring_send(ngx_connection_t *c, u_char *buf, size_t size);
+static ngx_chain_t *ngx_uring_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit);
+static void ngx_uring_io_complete(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+static ngx_int_t ngx_uring_recv_add(ngx_connection_t *c);
+static ngx_int_t ngx_uring_buffer_return(ngx_uint_t bid, ngx_log_t *log);
+static ngx_uring_conn_t *ngx_uring_conn(ngx_connection_t *c);
+static void ngx_uring_conn_free(ngx_connection_t *c);
+static ngx_int_t ngx_uring_cancel(ngx_connection_t *c, uint32_t seq,
+    uint64_t tag);
+static int ngx_uring_enter(ngx_uint_t wait, ngx_msec_t timer);
+
+static void *ngx_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static int                   ring = -1;
+static ngx_uring_sq_t        sq;
+static ngx_uring_cq_t        cq;
+static void                 *sq_ptr = MAP_FAILED;
+static size_t                sq_size;
+static void                 *cq_ptr = MAP_FAILED;
+static size_t                cq_size;
+static size_t                sqes_size;
+static struct io_uring_cqe  *event_list;
+static ngx_uint_t            nevents;
+
+#if (NGX_HAVE_EVENTFD)
+static int                   notify_fd = -1;
+static ngx_event_t           notify_event;
+static ngx_connection_t      notify_conn;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+ngx_uint_t                   ngx_uring_file_aio;
+#endif
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+static ngx_uring_accepted_t *accepted;
+static ngx_uint_t            naccepted;
+static ngx_uint_t            accepted_first;
+ngx_uint_t                   ngx_uring_multishot_accept;
+#endif
+
+static ngx_os_io_t           ngx_uring_io;
+static ngx_uint_t            ngx_uring_socket_io;
+static u_char               *buffers;
+static size_t                buffer_size;
+static ngx_uint_t            nbuffers;
+static ngx_uring_conn_t     *free_conns;
+static void                 *conn_chunks;
+
+static ngx_str_t      uring_name = ngx_string("uring");
+
+static ngx_command_t  ngx_uring_commands[] = {
+
+    { ngx_string("uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_uring_conf_t, entries),
+      NULL },
+
+    { ngx_string("uring_events"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_uring_conf_t, events),
+      NULL },
+
+    { ngx_string("uring_buffers"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      0,
+      offsetof(ngx_uring_conf_t, buffers),
+      NULL },
+
+      ngx_null_command
+};
+
+
+ngx_event_module_t  ngx_uring_module_ctx = {
+    &uring_name,
+    ngx_uring_create_conf,               /* create configuration */
+    ngx_uring_init_conf,                 /* init configuration */
+
+    {
+        ngx_uring_add_event,             /* add an event */
+        ngx_uring_del_event,             /* delete an event */
+        ngx_uring_add_event,             /* enable an event */
+        ngx_uring_del_event,             /* disable an event */
+        ngx_uring_add_connection,        /* add an connection */
+        ngx_uring_del_connection,        /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_uring_notify,                /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_uring_process_events,        /* process the events */
+        ngx_uring_init,                  /* init the events */
+        ngx_uring_done,                  /* done the events */
+    }
+};
+
+ngx_module_t  ngx_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_uring_module_ctx,               /* module context */
+    ngx_uring_commands,                  /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage to avoid an additional build dependency.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_uring_module);
+
+    if (ring == -1) {
+        if (ngx_uring_setup(cycle, urcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_uring_test_poll(cycle) != NGX_OK) {
+            ngx_uring_done(cycle);
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_uring_file_aio = 1;
+#endif
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+        ngx_uring_multishot_accept = 1;
+#endif
+
+        switch (ngx_uring_io_init(cycle, urcf)) {
+
+        case NGX_OK:
+            ngx_uring_socket_io = 1;
+            break;
+
+        case NGX_DECLINED:
+            break;
+
+        default:
+            ngx_uring_done(cycle);
+            return NGX_ERROR;
+        }
+    }
+
+    if (nevents < urcf->events) {
+        if (event_list) {
+            ngx_free(event_list);
+        }
+
+        event_list = ngx_alloc(sizeof(struct io_uring_cqe) * urcf->events,
+                               cycle->log);
+        if (event_list == NULL) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+        if (accepted) {
+            ngx_free(accepted);
+        }
+
+        accepted = ngx_alloc(sizeof(ngx_uring_accepted_t) * urcf->events,
+                             cycle->log);
+        if (accepted == NULL) {
+            return NGX_ERROR;
+        }
+
+        naccepted = 0;
+        accepted_first = 0;
+
+#endif
+    }
+
+    nevents = urcf->events;
+
+    ngx_io = ngx_uring_socket_io ? ngx_uring_io : ngx_os_io;
+
+    ngx_event_actions = ngx_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_setup(ngx_cycle_t *cycle, ngx_uring_conf_t *urcf)
+{
+    u_char                  *p;
+    struct io_uring_params   params;
+
+    ngx_memzero(&params, sizeof(struct io_uring_params));
+
+    ring = io_uring_setup(urcf->entries, &params);
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG)
+        || !(params.features & IORING_FEAT_NODROP))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring does not support required features");
+        goto failed;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_size = params.cq_off.cqes
+              + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = ngx_max(sq_size, cq_size);
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ptr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        goto failed;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+
+        if (cq_ptr == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "mmap(IORING_OFF_CQ_RING) failed");
+            goto failed;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq.sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sq.sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        goto failed;
+    }
+
+    p = sq_ptr;
+
+    sq.head = (uint32_t *) (p + params.sq_off.head);
+    sq.tail = (uint32_t *) (p + params.sq_off.tail);
+    sq.ring_mask = (uint32_t *) (p + params.sq_off.ring_mask);
+    sq.ring_entries = (uint32_t *) (p + params.sq_off.ring_entries);
+    sq.array = (uint32_t *) (p + params.sq_off.array);
+    sq.sqe_tail = *sq.tail;
+
+    p = cq_ptr;
+
+    cq.head = (uint32_t *) (p + params.cq_off.head);
+    cq.tail = (uint32_t *) (p + params.cq_off.tail);
+    cq.ring_mask = (uint32_t *) (p + params.cq_off.ring_mask);
+    cq.cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: %d sq:%uD cq:%uD",
+                   ring, params.sq_entries, params.cq_entries);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_uring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_uring_poll_add(&notify_conn, EPOLLIN, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                            "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+/*
+ * multishot poll appeared in Linux 5.13, so the poll request is tested
+ * on a socket pair before the ring is used; the test also checks that
+ * the peer shutdown is reported as POLLRDHUP
+ */
+
+static ngx_int_t
+ngx_uring_test_poll(ngx_cycle_t *cycle)
+{
+    int                   s[2];
+    uint32_t              head;
+    ngx_int_t             rc;
+    ngx_uint_t            i, done;
+    ngx_event_t           rev;
+    ngx_connection_t      c;
+    struct io_uring_cqe  *cqe;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "socketpair() failed");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    ngx_memzero(&c, sizeof(ngx_connection_t));
+    ngx_memzero(&rev, sizeof(ngx_event_t));
+
+    c.fd = s[0];
+    c.read = &rev;
+
+    if (ngx_uring_poll_add(&c, EPOLLIN|EPOLLRDHUP, cycle->log) != NGX_OK) {
+        goto failed;
+    }
+
+    if (close(s[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+        s[1] = -1;
+        goto failed;
+    }
+
+    s[1] = -1;
+
+    /*
+     * the poll request refers to the connection on the stack,
+     * so all its completions are consumed here: the first one
+     * is tested, and the last one follows the removal
+     */
+
+    done = 0;
+
+    for (i = 0; i < 3 && !done; i++) {
+
+        if (ngx_uring_enter(1, 5000) == -1 && ngx_errno != ETIME) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "io_uring_enter() failed");
+            goto failed;
+        }
+
+        head = *cq.head;
+
+        ngx_memory_barrier();
+
+        if (head == *cq.tail) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, NGX_ETIMEDOUT,
+                          "io_uring_enter() timed out");
+            goto failed;
+        }
+
+        for ( /* void */ ; head != *cq.tail; head++) {
+            cqe = &cq.cqes[head & *cq.ring_mask];
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "testing io_uring multishot poll: "
+                           "%d f:%uD d:%p", cqe->res, cqe->flags,
+                           cqe->user_data);
+
+            if (cqe->user_data != (uint64_t) (uintptr_t) &c) {
+                continue;
+            }
+
+            if (rc == NGX_OK) {
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    done = 1;
+                }
+
+                continue;
+            }
+
+            if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_MORE)) {
+                ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                              "io_uring multishot poll is not supported");
+                goto failed;
+            }
+
+#if (NGX_HAVE_EPOLLRDHUP)
+            ngx_use_epoll_rdhup = cqe->res & EPOLLRDHUP;
+#endif
+
+            if (ngx_uring_poll_remove(&c, cycle->log) != NGX_OK) {
+                goto failed;
+            }
+
+            rc = NGX_OK;
+        }
+
+        ngx_memory_barrier();
+
+        *cq.head = head;
+    }
+
+    if (!done) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring poll request was not removed");
+        rc = NGX_ERROR;
+    }
+
+failed:
+
+    if (s[1] != -1 && close(s[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    if (close(s[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    return rc;
+}
+
+
+/*
+ * the socket I/O requests are tested with a probe (Linux 5.6), and
+ * the buffers for the recv requests are provided to the ring at once
+ */
+
+static ngx_int_t
+ngx_uring_io_init(ngx_cycle_t *cycle, ngx_uring_conf_t *urcf)
+{
+    size_t                  size;
+    ngx_int_t               rc;
+    ngx_uint_t              i;
+    struct io_uring_sqe    *sqe;
+    struct io_uring_probe  *probe;
+
+    static ngx_uint_t  ops[] = {
+        IORING_OP_SENDMSG,
+        IORING_OP_RECV,
+        IORING_OP_PROVIDE_BUFFERS,
+        IORING_OP_ASYNC_CANCEL,
+        IORING_OP_NOP
+    };
+
+    size = sizeof(struct io_uring_probe)
+           + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+
+    probe = ngx_alloc(size, cycle->log);
+    if (probe == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(probe, size);
+
+    rc = NGX_OK;
+
+    if (syscall(SYS_io_uring_register, ring, IORING_REGISTER_PROBE, probe,
+                IORING_OP_LAST)
+        == -1)
+    {
+        rc = NGX_DECLINED;
+
+    } else {
+        for (i = 0; i < sizeof(ops) / sizeof(ngx_uint_t); i++) {
+            if (ops[i] >= probe->ops_len
+                || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                rc = NGX_DECLINED;
+                break;
+            }
+        }
+    }
+
+    ngx_free(probe);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "io_uring socket I/O is not supported, "
+                      "connections are read and written directly");
+        return NGX_DECLINED;
+    }
+
+    nbuffers = urcf->buffers.num;
+    buffer_size = urcf->buffers.size;
+
+    buffers = ngx_alloc(nbuffers * buffer_size, cycle->log);
+    if (buffers == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe = ngx_uring_get_sqe(cycle->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = nbuffers;
+    sqe->addr = (uint64_t) (uintptr_t) buffers;
+    sqe->len = buffer_size;
+    sqe->off = 0;
+    sqe->buf_group = NGX_URING_BGID;
+
+    ngx_uring_io = ngx_os_io;
+
+    ngx_uring_io.recv = ngx_uring_recv;
+    ngx_uring_io.recv_chain = ngx_uring_recv_chain;
+    ngx_uring_io.send = ngx_uring_send;
+    ngx_uring_io.send_chain = ngx_uring_send_chain;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_uring_done(ngx_cycle_t *cycle)
+{
+    void  *chunk;
+
+    if (sq.sqes && sq.sqes != MAP_FAILED) {
+        if (munmap(sq.sqes, sqes_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQES) failed");
+        }
+    }
+
+    sq.sqes = NULL;
+
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+        if (munmap(cq_ptr, cq_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_CQ_RING) failed");
+        }
+    }
+
+    cq_ptr = MAP_FAILED;
+
+    if (sq_ptr != MAP_FAILED) {
+        if (munmap(sq_ptr, sq_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQ_RING) failed");
+        }
+    }
+
+    sq_ptr = MAP_FAILED;
+
+    if (ring != -1 && close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+    ngx_uring_file_aio = 0;
+#endif
+
+    if (event_list) {
+        ngx_free(event_list);
+    }
+
+    event_list = NULL;
+    nevents = 0;
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+    if (accepted) {
+        ngx_free(accepted);
+    }
+
+    accepted = NULL;
+    naccepted = 0;
+    accepted_first = 0;
+
+    ngx_uring_multishot_accept = 0;
+
+#endif
+
+    if (buffers) {
+        ngx_free(buffers);
+    }
+
+    buffers = NULL;
+    nbuffers = 0;
+
+    while (conn_chunks) {
+        chunk = conn_chunks;
+        conn_chunks = *(void **) chunk;
+        ngx_free(chunk);
+    }
+
+    free_conns = NULL;
+
+    ngx_uring_socket_io = 0;
+}
+
+
+static ngx_int_t
+ngx_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           prev;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+    if (ev->accept && c->type == SOCK_STREAM && ngx_uring_multishot_accept) {
+
+        if (ev->active) {
+            return NGX_OK;
+        }
+
+        if (ngx_uring_accept_add(c, ev->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ev->active = 1;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    /*
+     * the NGX_CLEAR_EVENT and NGX_EXCLUSIVE_EVENT flags are not passed:
+     * multishot poll requests are always edge-triggered, and exclusive
+     * wakeups are left to the accept mutex
+     */
+
+    prev = ngx_uring_poll_events(c);
+
+    ev->active = 1;
+
+    if (ngx_uring_poll_set(c, prev, ngx_uring_poll_events(c), ev->log)
+        != NGX_OK)
+    {
+        ev->active = 0;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           prev;
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+    if (ev->accept && c->type == SOCK_STREAM && ngx_uring_multishot_accept) {
+        rc = ev->active ? ngx_uring_accept_cancel(c, ev->log) : NGX_OK;
+
+        ev->active = 0;
+
+        return rc;
+    }
+
+#endif
+
+    prev = ngx_uring_poll_events(c);
+
+    ev->active = 0;
+
+    /*
+     * unlike epoll, a poll request holds a reference to the socket,
+     * so the request is always canceled, even before the closing
+     * the file descriptor
+     */
+
+    if (flags & NGX_CLOSE_EVENT) {
+        c->read->active = 0;
+        c->write->active = 0;
+    }
+
+    return ngx_uring_poll_set(c, prev, ngx_uring_poll_events(c), ev->log);
+}
+
+
+static ngx_int_t
+ngx_uring_add_connection(ngx_connection_t *c)
+{
+    uint32_t  prev;
+
+    prev = ngx_uring_poll_events(c);
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    if (ngx_uring_poll_set(c, prev, ngx_uring_poll_events(c), c->log)
+        != NGX_OK)
+    {
+        c->read->active = 0;
+        c->write->active = 0;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    uint32_t   prev;
+    ngx_int_t  rc;
+
+    prev = ngx_uring_poll_events(c);
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    rc = ngx_uring_poll_set(c, prev, 0, c->log);
+
+    if (flags & NGX_CLOSE_EVENT) {
+        ngx_uring_conn_free(c);
+    }
+
+    return rc;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
+{
+    int                   rc;
+    uint32_t              head, tail, revents;
+    uintptr_t             data;
+    ngx_int_t             instance, events, i;
+    ngx_uint_t            level;
+    ngx_err_t             err;
+    ngx_event_t          *rev, *wev;
+    ngx_queue_t          *queue;
+    ngx_connection_t     *c;
+    ngx_uring_conn_t     *u;
+    struct io_uring_cqe  *cqe;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_t          *e;
+    ngx_event_aio_t      *aio;
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %uD",
+                   timer, sq.sqe_tail - *sq.head);
+
+    rc = ngx_uring_enter(1, timer);
+
+    err = (rc == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err && err != ETIME && err != NGX_EBUSY) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    /*
+     * the completions are copied out of the ring first, so the handlers
+     * are free to submit new requests
+     */
+
+    head = *cq.head;
+    tail = *cq.tail;
+
+    ngx_memory_barrier();
+
+    for (events = 0; head != tail && (ngx_uint_t) events < nevents; events++) {
+        event_list[events] = cq.cqes[head & *cq.ring_mask];
+        head++;
+    }
+
+    ngx_memory_barrier();
+
+    *cq.head = head;
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+    /*
+     * the sockets accepted in the previous iteration have been taken
+     * by the posted accept events
+     */
+
+    if (accepted_first == naccepted) {
+        naccepted = 0;
+        accepted_first = 0;
+    }
+
+#endif
+
+    if (events == 0) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        if (err == NGX_EBUSY) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < events; i++) {
+        cqe = &event_list[i];
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+        if (cqe->user_data & NGX_URING_ACCEPT) {
+            if (ngx_uring_accept_complete(cycle, cqe, flags) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+#endif
+
+        if (cqe->user_data & (NGX_URING_RECV|NGX_URING_SEND)) {
+            ngx_uring_io_complete(cycle, cqe, flags);
+            continue;
+        }
+
+        data = (uintptr_t) cqe->user_data;
+
+        if (data == 0) {
+
+            /* poll update or removal, cancellation, returned buffers */
+
+            if (cqe->res < 0 && cqe->res != -NGX_ENOENT
+                && cqe->res != -NGX_EALREADY)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, -cqe->res,
+                              "io_uring request failed");
+            }
+
+            continue;
+        }
+
+#if (NGX_HAVE_FILE_AIO)
+
+        if (data & NGX_URING_AIO) {
+            e = (ngx_event_t *) (data & (uintptr_t) ~NGX_URING_AIO);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring aio: %p %d", e, cqe->res);
+
+            e->complete = 1;
+            e->active = 0;
+            e->ready = 1;
+
+            aio = e->data;
+            aio->res = cqe->res;
+
+            ngx_post_event(e, &ngx_posted_events);
+
+            continue;
+        }
+
+#endif
+
+        instance = data & 1;
+        c = (ngx_connection_t *) (data & (uintptr_t) ~1);
+
+        rev = c->read;
+
+        if (c->fd == -1 || rev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", c);
+            continue;
+        }
+
+        wev = c->write;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: fd:%d res:%d f:%uD d:%p",
+                       c->fd, cqe->res, cqe->flags, cqe->user_data);
+
+        if (cqe->res == -NGX_ECANCELED) {
+            continue;
+        }
+
+        revents = ngx_uring_poll_events(c);
+
+        if (!(cqe->flags & IORING_CQE_F_MORE) && revents) {
+
+            /*
+             * the kernel has terminated the multishot request,
+             * e.g., on a memory shortage, so it is armed again
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: rearm fd:%d", c->fd);
+
+            if (ngx_uring_poll_add(c, revents, cycle->log) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (cqe->res < 0) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, -cqe->res,
+                           "io_uring poll error on fd:%d res:%d",
+                           c->fd, cqe->res);
+
+            revents = EPOLLIN|EPOLLOUT;
+
+        } else {
+            revents = cqe->res;
+        }
+
+        if (revents & (EPOLLERR|EPOLLHUP)) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring poll error on fd:%d ev:%04XD",
+                           c->fd, revents);
+
+            /*
+             * if the error events were returned, add EPOLLIN and EPOLLOUT
+             * to handle the events at least in one active handler
+             */
+
+            revents |= EPOLLIN|EPOLLOUT;
+        }
+
+        u = c->uring;
+
+        /* the connections read through the ring are posted by recv requests */
+
+        if ((revents & EPOLLIN) && rev->active && (u == NULL || !u->reading)) {
+
+#if (NGX_HAVE_EPOLLRDHUP)
+            if (revents & EPOLLRDHUP) {
+                rev->pending_eof = 1;
+            }
+
+            rev->available = 1;
+#endif
+
+            rev->ready = 1;
+
+            if (flags & NGX_POST_EVENTS) {
+                queue = rev->accept ? &ngx_posted_accept_events
+                                    : &ngx_posted_events;
+
+                ngx_post_event(rev, queue);
+
+            } else {
+                rev->handler(rev);
+            }
+        }
+
+        if ((revents & EPOLLOUT) && wev->active) {
+
+            if (c->fd == -1 || wev->instance != instance) {
+
+                /*
+                 * the stale event from a file descriptor
+                 * that was just closed in this iteration
+                 */
+
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                               "io_uring: stale event %p", c);
+                continue;
+            }
+
+            wev->ready = 1;
+#if (NGX_THREADS)
+            wev->complete = 1;
+#endif
+
+            if (flags & NGX_POST_EVENTS) {
+                ngx_post_event(wev, &ngx_posted_events);
+
+            } else {
+                wev->handler(wev);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_uring_aio_read(ngx_event_t *ev, ngx_fd_t fd, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_uring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_DECLINED;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t) ((uintptr_t) ev | NGX_URING_AIO);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring read: fd:%d @%O:%uz %p", fd, offset, size, ev);
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static struct io_uring_sqe *
+ngx_uring_get_sqe(ngx_log_t *log)
+{
+    uint32_t              n;
+    struct io_uring_sqe  *sqe;
+
+    if (sq.sqe_tail - *sq.head >= *sq.ring_entries) {
+
+        /* the submission ring is full, pass the queued requests to a kernel */
+
+        if (ngx_uring_enter(0, 0) == -1 && ngx_errno != NGX_EBUSY) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "io_uring_enter() failed");
+            return NULL;
+        }
+
+        if (sq.sqe_tail - *sq.head >= *sq.ring_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0, "io_uring is full");
+            return NULL;
+        }
+    }
+
+    n = sq.sqe_tail & *sq.ring_mask;
+
+    sqe = &sq.sqes[n];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq.array[n] = n;
+    sq.sqe_tail++;
+
+    return sqe;
+}
+
+
+static uint32_t
+ngx_uring_poll_events(ngx_connection_t *c)
+{
+    uint32_t           events;
+    ngx_uring_conn_t  *u;
+
+    u = c->uring;
+
+    events = 0;
+
+    if (c->read->active && (u == NULL || !u->reading)) {
+        events |= EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (c->write->active) {
+        events |= EPOLLOUT;
+    }
+
+    return events;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_set(ngx_connection_t *c, uint32_t prev, uint32_t events,
+    ngx_log_t *log)
+{
+    if (events == prev) {
+        return NGX_OK;
+    }
+
+    if (prev == 0) {
+        return ngx_uring_poll_add(c, events, log);
+    }
+
+    if (events == 0) {
+        return ngx_uring_poll_remove(c, log);
+    }
+
+    return ngx_uring_poll_update(c, events, log);
+}
+
+
+static ngx_int_t
+ngx_uring_poll_add(ngx_connection_t *c, uint32_t events, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring poll add: fd:%d ev:%08XD", c->fd, events);
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uint64_t) ((uintptr_t) c | c->read->instance);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_update(ngx_connection_t *c, uint32_t events, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring poll update: fd:%d ev:%08XD", c->fd, events);
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) ((uintptr_t) c | c->read->instance);
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_UPDATE_EVENTS|IORING_POLL_ADD_MULTI;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_remove(ngx_connection_t *c, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring poll remove: fd:%d", c->fd);
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) ((uintptr_t) c | c->read->instance);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+
+static ngx_int_t
+ngx_uring_accept_add(ngx_connection_t *c, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring accept add: fd:%d", c->fd);
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = (uint64_t) ((uintptr_t) c | c->read->instance)
+                     | NGX_URING_ACCEPT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_accept_cancel(ngx_connection_t *c, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring accept cancel: fd:%d", c->fd);
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->addr = (uint64_t) ((uintptr_t) c | c->read->instance)
+                | NGX_URING_ACCEPT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_accept_complete(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    ngx_err_t              err;
+    ngx_uint_t             instance;
+    ngx_event_t           *rev;
+    ngx_connection_t      *c;
+    ngx_uring_accepted_t  *a;
+
+    instance = (ngx_uint_t) (cqe->user_data & 1);
+    c = (ngx_connection_t *)
+            (uintptr_t) (cqe->user_data & ~(NGX_URING_ACCEPT|1));
+
+    rev = c->read;
+
+    if (c->fd == -1 || rev->instance != instance || !rev->accept) {
+
+        /*
+         * the stale completion from a listening socket
+         * that was closed in this iteration
+         */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale accept %p res:%d", c, cqe->res);
+
+        if (cqe->res >= 0 && ngx_close_socket(cqe->res) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring accept: fd:%d res:%d f:%uD",
+                   c->fd, cqe->res, cqe->flags);
+
+    if (cqe->res == -NGX_ECANCELED) {
+        return NGX_OK;
+    }
+
+    err = (cqe->res < 0) ? -cqe->res : 0;
+
+    if (err == NGX_EINVAL) {
+
+        /* multishot accept appeared in Linux 5.19 */
+
+        if (ngx_uring_multishot_accept) {
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                          "io_uring multishot accept is not supported, "
+                          "listening sockets are polled");
+
+            ngx_uring_multishot_accept = 0;
+        }
+
+        if (!rev->active) {
+            return NGX_OK;
+        }
+
+        return ngx_uring_poll_add(c, EPOLLIN|EPOLLRDHUP, cycle->log);
+    }
+
+    /*
+     * an accepted socket or an error is queued to be taken by
+     * ngx_event_accept(), which handles the errors as for accept()
+     */
+
+    if (naccepted == nevents) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring accept queue overflow");
+
+        if (err == 0 && ngx_close_socket(cqe->res) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+    } else {
+        a = &accepted[naccepted++];
+
+        a->listening = c;
+        a->fd = err ? (ngx_socket_t) -1 : cqe->res;
+        a->err = err;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)
+        && rev->active
+        && err != NGX_EMFILE && err != NGX_ENFILE)
+    {
+        /*
+         * the kernel has terminated the multishot request, so it is
+         * armed again; on EMFILE and ENFILE ngx_event_accept() disables
+         * the accept events for a while instead
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: rearm accept fd:%d", c->fd);
+
+        if (ngx_uring_accept_add(c, cycle->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(rev, &ngx_posted_accept_events);
+
+    } else {
+        rev->handler(rev);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_socket_t
+ngx_uring_accept(ngx_connection_t *lc, struct sockaddr *sa,
+    socklen_t *socklen)
+{
+    ngx_uint_t             i, n;
+    ngx_socket_t           s;
+    ngx_uring_accepted_t  *a;
+
+    for (i = accepted_first; i < naccepted; i++) {
+        a = &accepted[i];
+
+        if (a->listening != lc) {
+            continue;
+        }
+
+        a->listening = NULL;
+
+        while (accepted_first < naccepted
+               && accepted[accepted_first].listening == NULL)
+        {
+            accepted_first++;
+        }
+
+        /* more sockets are queued, so the handler is called again */
+
+        for (n = i + 1; n < naccepted; n++) {
+            if (accepted[n].listening == lc) {
+                ngx_post_event(lc->read, &ngx_posted_accept_events);
+                break;
+            }
+        }
+
+        if (a->fd == (ngx_socket_t) -1) {
+            ngx_set_socket_errno(a->err);
+            return (ngx_socket_t) -1;
+        }
+
+        s = a->fd;
+
+        /* multishot accept does not return peer addresses */
+
+        if (getpeername(s, sa, socklen) == -1) {
+            ngx_log_error(NGX_LOG_ERR, lc->log, ngx_socket_errno,
+                          "getpeername() failed");
+
+            if (ngx_close_socket(s) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, lc->log, ngx_socket_errno,
+                              ngx_close_socket_n " failed");
+            }
+
+            continue;
+        }
+
+        return s;
+    }
+
+    ngx_set_socket_errno(NGX_EAGAIN);
+
+    return (ngx_socket_t) -1;
+}
+
+#endif
+
+
+static ssize_t
+ngx_uring_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t            n;
+    uint32_t           prev;
+    ngx_event_t       *rev;
+    ngx_uring_conn_t  *u;
+
+    rev = c->read;
+
+    u = ngx_uring_conn(c);
+    if (u == NULL) {
+        return ngx_os_io.recv(c, buf, size);
+    }
+
+    if (!u->reading) {
+
+        /*
+         * the first reads follow readiness notifications and are made
+         * directly; once the socket is drained, a recv request is added
+         */
+
+        n = ngx_os_io.recv(c, buf, size);
+
+        if (n == NGX_ERROR || n == 0 || rev->ready) {
+            return n;
+        }
+
+        prev = ngx_uring_poll_events(c);
+
+        u->reading = 1;
+
+        if (ngx_uring_poll_set(c, prev, ngx_uring_poll_events(c), c->log)
+            != NGX_OK
+            || ngx_uring_recv_add(c) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        return n;
+    }
+
+    if (u->buffer) {
+        n = ngx_min(size, u->size);
+
+        ngx_memcpy(buf, u->pos, n);
+
+        u->pos += n;
+        u->size -= n;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (u->size == 0) {
+            u->buffer = 0;
+            rev->ready = 0;
+
+            if (ngx_uring_buffer_return(u->bid, c->log) != NGX_OK
+                || ngx_uring_recv_add(c) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        return n;
+    }
+
+    if (u->eof) {
+        rev->ready = 0;
+        rev->eof = 1;
+        return 0;
+    }
+
+    if (u->err) {
+        rev->ready = 0;
+
+        n = ngx_connection_error(c, u->err, "recv() failed");
+
+        if (n == NGX_ERROR) {
+            rev->error = 1;
+        }
+
+        return n;
+    }
+
+    if (u->nobufs) {
+
+        /* no buffer was left for the request, so the data are read directly */
+
+        u->nobufs = 0;
+
+#if (NGX_HAVE_EPOLLRDHUP)
+        rev->available = 1;
+#endif
+
+        n = ngx_os_io.recv(c, buf, size);
+
+        if (n != NGX_ERROR && n != 0 && !rev->ready
+            && ngx_uring_recv_add(c) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        return n;
+    }
+
+    rev->ready = 0;
+
+    if (ngx_uring_recv_add(c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_uring_recv_chain(ngx_connection_t *c, ngx_chain_t *cl, off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+
+        size = cl->buf->end - cl->buf->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            if ((off_t) size > limit - total) {
+                size = (size_t) (limit - total);
+            }
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        n = ngx_uring_recv(c, cl->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_uring_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_uring_conn_t  *u;
+
+    u = c->uring;
+
+    /* the data of a sendmsg request go first */
+
+    if (u && (u->send || u->done)) {
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    return ngx_os_io.send(c, buf, size);
+}
+
+
+static ngx_chain_t *
+ngx_uring_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    ssize_t               sent;
+    ngx_chain_t          *cl;
+    ngx_iovec_t           vec;
+    ngx_event_t          *wev;
+    ngx_uring_conn_t     *u;
+    struct io_uring_sqe  *sqe;
+
+    wev = c->write;
+
+    u = ngx_uring_conn(c);
+    if (u == NULL) {
+        return ngx_os_io.send_chain(c, in, limit);
+    }
+
+    if (u->send) {
+        wev->ready = 0;
+        return in;
+    }
+
+    /* the maximum limit size is the maximum size_t value - the page size */
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_SIZE_T_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_SIZE_T_VALUE - ngx_pagesize;
+    }
+
+    if (u->done) {
+        u->done = 0;
+
+        if (u->sent == -NGX_EAGAIN) {
+            wev->ready = 0;
+            return in;
+        }
+
+        if (u->sent < 0) {
+            wev->error = 1;
+            (void) ngx_connection_error(c, -u->sent, "sendmsg() failed");
+            return NGX_CHAIN_ERROR;
+        }
+
+        sent = u->sent;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring sendmsg: %z of %uz", sent, u->send_size);
+
+        c->sent += sent;
+
+        in = ngx_chain_update_sent(in, sent);
+
+        if ((size_t) sent < u->send_size) {
+            wev->ready = 0;
+            return in;
+        }
+
+        if (in == NULL || sent >= limit) {
+            return in;
+        }
+
+        limit -= sent;
+    }
+
+    if (!wev->ready) {
+        return in;
+    }
+
+    vec.iovs = u->iovs;
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+    cl = ngx_output_chain_to_iovec(&vec, in, limit, c->log);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (vec.size == 0) {
+        if (cl && cl->buf->in_file) {
+            return ngx_os_io.send_chain(c, in, limit);
+        }
+
+        return ngx_chain_update_sent(in, 0);
+    }
+
+    sqe = ngx_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    ngx_memzero(&u->msg, sizeof(struct msghdr));
+
+    u->msg.msg_iov = u->iovs;
+    u->msg.msg_iovlen = vec.count;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &u->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = (uint64_t) ((uintptr_t) c | c->read->instance)
+                     | NGX_URING_SEND;
+
+    u->send = 1;
+    u->send_size = vec.size;
+    u->send_seq = sq.sqe_tail - 1;
+
+    wev->ready = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring sendmsg add: fd:%d %uz", c->fd, vec.size);
+
+    return in;
+}
+
+
+static void
+ngx_uring_io_complete(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    ngx_uint_t         instance, bid;
+    ngx_event_t       *ev;
+    ngx_connection_t  *c;
+    ngx_uring_conn_t  *u;
+
+    instance = (ngx_uint_t) (cqe->user_data & 1);
+    c = (ngx_connection_t *)
+            (uintptr_t) (cqe->user_data & ~(NGX_URING_RECV|NGX_URING_SEND|1));
+
+    u = c->uring;
+
+    if (c->fd == -1 || c->read->instance != instance || u == NULL) {
+
+        /*
+         * the stale completion from a connection that was closed,
+         * the buffer taken by it is returned to the ring
+         */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale request %p res:%d", c, cqe->res);
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            (void) ngx_uring_buffer_return(
+                                       cqe->flags >> IORING_CQE_BUFFER_SHIFT,
+                                       cycle->log);
+        }
+
+        return;
+    }
+
+    if (cqe->user_data & NGX_URING_SEND) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring sendmsg: fd:%d res:%d", c->fd, cqe->res);
+
+        u->send = 0;
+        u->done = 1;
+        u->sent = cqe->res;
+
+        ev = c->write;
+
+    } else {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring recv: fd:%d res:%d f:%uD",
+                       c->fd, cqe->res, cqe->flags);
+
+        u->recv = 0;
+
+        if (cqe->res == -NGX_ECANCELED) {
+            return;
+        }
+
+        ev = c->read;
+
+        if (cqe->res > 0) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            u->buffer = 1;
+            u->bid = bid;
+            u->pos = buffers + bid * buffer_size;
+            u->size = cqe->res;
+
+        } else if (cqe->res == 0) {
+            u->eof = 1;
+            ev->pending_eof = 1;
+
+        } else if (cqe->res == -NGX_ENOBUFS) {
+            u->nobufs = 1;
+
+        } else {
+            u->err = -cqe->res;
+            ev->pending_eof = 1;
+        }
+    }
+
+    ev->ready = 1;
+
+    if (!ev->active) {
+        return;
+    }
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(ev, &ngx_posted_events);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_uring_recv_add(ngx_connection_t *c)
+{
+    ngx_uring_conn_t     *u;
+    struct io_uring_sqe  *sqe;
+
+    u = c->uring;
+
+    if (u->recv) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring recv add: fd:%d", c->fd);
+
+    sqe = ngx_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = buffer_size;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NGX_URING_BGID;
+    sqe->user_data = (uint64_t) ((uintptr_t) c | c->read->instance)
+                     | NGX_URING_RECV;
+
+    u->recv = 1;
+    u->recv_seq = sq.sqe_tail - 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_buffer_return(ngx_uint_t bid, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (bid >= nbuffers) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "io_uring returned invalid buffer %ui", bid);
+        return NGX_ERROR;
+    }
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t) (uintptr_t) (buffers + bid * buffer_size);
+    sqe->len = buffer_size;
+    sqe->off = bid;
+    sqe->buf_group = NGX_URING_BGID;
+
+    return NGX_OK;
+}
+
+
+static ngx_uring_conn_t *
+ngx_uring_conn(ngx_connection_t *c)
+{
+    u_char            *p;
+    ngx_uint_t         i;
+    ngx_uring_conn_t  *u;
+
+    if (c->uring) {
+        return c->uring;
+    }
+
+    if (free_conns == NULL) {
+
+        /* the states are allocated in chunks and kept in the process */
+
+        p = ngx_alloc(sizeof(void *)
+                      + NGX_URING_CHUNK * sizeof(ngx_uring_conn_t), c->log);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        *(void **) p = conn_chunks;
+        conn_chunks = p;
+
+        u = (ngx_uring_conn_t *) (p + sizeof(void *));
+
+        for (i = 0; i < NGX_URING_CHUNK; i++) {
+            u[i].next = free_conns;
+            free_conns = &u[i];
+        }
+    }
+
+    u = free_conns;
+    free_conns = u->next;
+
+    ngx_memzero(u, offsetof(ngx_uring_conn_t, msg));
+
+    c->uring = u;
+
+    return u;
+}
+
+
+static void
+ngx_uring_conn_free(ngx_connection_t *c)
+{
+    ngx_uring_conn_t  *u;
+
+    u = c->uring;
+
+    if (u == NULL) {
+        return;
+    }
+
+    if (u->send) {
+        (void) ngx_uring_cancel(c, u->send_seq, NGX_URING_SEND);
+    }
+
+    if (u->recv) {
+        (void) ngx_uring_cancel(c, u->recv_seq, NGX_URING_RECV);
+    }
+
+    if (u->buffer) {
+        (void) ngx_uring_buffer_return(u->bid, c->log);
+    }
+
+    c->uring = NULL;
+
+    u->next = free_conns;
+    free_conns = u;
+}
+
+
+static ngx_int_t
+ngx_uring_cancel(ngx_connection_t *c, uint32_t seq, uint64_t tag)
+{
+    struct io_uring_sqe  *sqe;
+
+    if ((int32_t) (seq - *sq.head) >= 0) {
+
+        /*
+         * the request has not been read by a kernel yet, so it is
+         * replaced in the ring, and the bufs of a sendmsg request
+         * are not referenced after the connection is closed
+         */
+
+        sqe = &sq.sqes[seq & *sq.ring_mask];
+
+        ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_NOP;
+
+        return NGX_OK;
+    }
+
+    if (tag == NGX_URING_SEND) {
+
+        /* sendmsg requests with MSG_DONTWAIT complete when submitted */
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring recv cancel: fd:%d", c->fd);
+
+    sqe = ngx_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) ((uintptr_t) c | c->read->instance) | tag;
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_uring_enter(ngx_uint_t wait, ngx_msec_t timer)
+{
+    u_int                            flags, to_submit, min_complete;
+    struct __kernel_timespec         ts;
+    struct io_uring_getevents_arg    arg, *parg;
+
+    ngx_memory_barrier();
+
+    *sq.tail = sq.sqe_tail;
+
+    ngx_memory_barrier();
+
+    to_submit = sq.sqe_tail - *sq.head;
+
+    flags = 0;
+    min_complete = 0;
+    parg = NULL;
+
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+        min_complete = 1;
+
+        ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+        if (timer != NGX_TIMER_INFINITE) {
+            ts.tv_sec = timer / 1000;
+            ts.tv_nsec = (timer % 1000) * 1000000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+
+        parg = &arg;
+
+    } else if (to_submit == 0) {
+        return 0;
+    }
+
+    return io_uring_enter(ring, to_submit, min_complete, flags, parg,
+                          parg ? sizeof(struct io_uring_getevents_arg) : 0);
+}
+
+
+static void *
+ngx_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+    urcf->events = NGX_CONF_UNSET;
+    urcf->buffers.num = 0;
+
+    return urcf;
+}
+
+
+static char *
+ngx_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+    ngx_conf_init_uint_value(urcf->events, 512);
+
+    if (urcf->buffers.num == 0) {
+        urcf->buffers.num = 128;
+        urcf->buffers.size = 8192;
+    }
+
+    if (urcf->buffers.num > 65536) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "the number of \"uring_buffers\" must not exceed 65536");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -198,6 +198,12 @@ extern ngx_event_actions_t   ngx_event_actions;
 #if (NGX_HAVE_EPOLLRDHUP)
 extern ngx_uint_t            ngx_use_epoll_rdhup;
 #endif
+#if (NGX_HAVE_IO_URING && NGX_HAVE_FILE_AIO)
+extern ngx_uint_t            ngx_uring_file_aio;
+#endif
+#if (NGX_HAVE_IO_URING_ACCEPT)
+extern ngx_uint_t            ngx_uring_multishot_accept;
+#endif
 
 
 /*
@@ -446,6 +452,8 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -516,6 +524,17 @@ ngx_int_t ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags);
 ngx_int_t ngx_handle_write_event(ngx_event_t *wev, size_t lowat);
 
 
+#if (NGX_HAVE_IO_URING && NGX_HAVE_FILE_AIO)
+ngx_int_t ngx_uring_aio_read(ngx_event_t *ev, ngx_fd_t fd, u_char *buf,
+    size_t size, off_t offset);
+#endif
+
+#if (NGX_HAVE_IO_URING_ACCEPT)
+ngx_socket_t ngx_uring_accept(ngx_connection_t *lc, struct sockaddr *sa,
+    socklen_t *socklen);
+#endif
+
+
 #if (NGX_WIN32)
 void ngx_event_acceptex(ngx_event_t *ev);
 ngx_int_t ngx_event_post_acceptex(ngx_listening_t *ls, ngx_uint_t n);
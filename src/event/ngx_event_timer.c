@@ -10,9 +10,58 @@
 #include <ngx_event.h>
 
 
+/*
+ * The timing wheel is a hierarchy of the arrays of timer lists: the root
+ * level has a list for each millisecond of the next 256 ms, and each of
+ * the 4 upper levels has 64 lists, each covering 64 times longer interval
+ * than a list of the level below.  When the root level wraps, the timers
+ * of the next list of the first level are redistributed ("cascaded") over
+ * the root level, and so on.  A timer is linked in a list using the rbtree
+ * node: "left" and "right" are the previous and next timers, and "parent"
+ * points to the list head.
+ */
+
+#define NGX_TIMER_WHEEL_ROOT         256
+#define NGX_TIMER_WHEEL_ROOT_BITS    8
+#define NGX_TIMER_WHEEL_LEVEL        64
+#define NGX_TIMER_WHEEL_LEVEL_BITS   6
+#define NGX_TIMER_WHEEL_LEVELS       4
+#define NGX_TIMER_WHEEL_LISTS                                                 \
+    (NGX_TIMER_WHEEL_ROOT + NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_LEVEL)
+
+#define ngx_timer_wheel_shift(level)                                          \
+    (NGX_TIMER_WHEEL_ROOT_BITS + ((level) - 1) * NGX_TIMER_WHEEL_LEVEL_BITS)
+
+#define ngx_timer_wheel_list(level, key)                                      \
+    (NGX_TIMER_WHEEL_ROOT + ((level) - 1) * NGX_TIMER_WHEEL_LEVEL             \
+     + (((key) >> ngx_timer_wheel_shift(level)) & (NGX_TIMER_WHEEL_LEVEL - 1)))
+
+
+typedef struct {
+    ngx_msec_t          next;        /* the next millisecond to process */
+    ngx_uint_t          count;
+    uint64_t            busy[NGX_TIMER_WHEEL_LISTS / 64];
+    ngx_rbtree_node_t   lists[NGX_TIMER_WHEEL_LISTS];
+} ngx_timer_wheel_t;
+
+
+static void ngx_timer_wheel_init(void);
+static void ngx_timer_wheel_insert(ngx_rbtree_node_t *node);
+static void ngx_timer_wheel_unlink(ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_timer_wheel_cascade(ngx_uint_t level);
+static ngx_uint_t ngx_timer_wheel_next_busy(ngx_uint_t n, ngx_uint_t last);
+static ngx_msec_t ngx_timer_wheel_find(void);
+static void ngx_timer_wheel_expire(void);
+static void ngx_timer_wheel_cancel(void);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                ngx_event_timer_wheel;
+static ngx_timer_wheel_t  ngx_timer_wheel;
+
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -25,6 +74,10 @@ ngx_event_timer_init(ngx_log_t *log)
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    if (ngx_event_timer_wheel) {
+        ngx_timer_wheel_init();
+    }
+
     return NGX_OK;
 }
 
@@ -35,6 +88,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +113,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -102,6 +164,11 @@ ngx_event_cancel_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_timer_wheel_cancel();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -136,3 +203,338 @@ ngx_event_cancel_timers(void)
         ev->handler(ev);
     }
 }
+
+
+ngx_uint_t
+ngx_event_timers_empty(void)
+{
+    if (ngx_event_timer_wheel) {
+        return ngx_timer_wheel.count == 0;
+    }
+
+    return ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel;
+}
+
+
+void
+ngx_event_timer_wheel_add(ngx_event_t *ev)
+{
+    ngx_timer_wheel_insert(&ev->timer);
+    ngx_timer_wheel.count++;
+}
+
+
+void
+ngx_event_timer_wheel_del(ngx_event_t *ev)
+{
+    ngx_timer_wheel_unlink(&ev->timer);
+    ngx_timer_wheel.count--;
+}
+
+
+static void
+ngx_timer_wheel_init(void)
+{
+    ngx_uint_t          i;
+    ngx_rbtree_node_t  *head;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LISTS; i++) {
+        head = &ngx_timer_wheel.lists[i];
+
+        head->left = head;
+        head->right = head;
+    }
+
+    ngx_memzero(ngx_timer_wheel.busy, sizeof(ngx_timer_wheel.busy));
+
+    ngx_timer_wheel.next = ngx_current_msec;
+    ngx_timer_wheel.count = 0;
+}
+
+
+static void
+ngx_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          n, level;
+    ngx_msec_t          key;
+    ngx_msec_int_t      diff;
+    ngx_rbtree_node_t  *head;
+
+    key = node->key;
+    diff = (ngx_msec_int_t) (key - ngx_timer_wheel.next);
+
+    if (diff < NGX_TIMER_WHEEL_ROOT) {
+
+        /* the expired timers are processed with the next millisecond */
+
+        if (diff < 0) {
+            key = ngx_timer_wheel.next;
+        }
+
+        n = key & (NGX_TIMER_WHEEL_ROOT - 1);
+
+    } else {
+
+#if (NGX_PTR_SIZE == 8)
+        if (diff > NGX_MAX_INT32_VALUE) {
+            key = ngx_timer_wheel.next + NGX_MAX_INT32_VALUE;
+            diff = NGX_MAX_INT32_VALUE;
+        }
+#endif
+
+        for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+            if (diff < (ngx_msec_int_t) 1 << ngx_timer_wheel_shift(level + 1))
+            {
+                break;
+            }
+        }
+
+        n = ngx_timer_wheel_list(level, key);
+    }
+
+    head = &ngx_timer_wheel.lists[n];
+
+    node->parent = head;
+    node->right = head;
+    node->left = head->left;
+    head->left->right = node;
+    head->left = node;
+
+    ngx_timer_wheel.busy[n / 64] |= (uint64_t) 1 << (n % 64);
+}
+
+
+static void
+ngx_timer_wheel_unlink(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          n;
+    ngx_rbtree_node_t  *head;
+
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    head = node->parent;
+
+    if (head->right == head) {
+        n = head - ngx_timer_wheel.lists;
+        ngx_timer_wheel.busy[n / 64] &= ~((uint64_t) 1 << (n % 64));
+    }
+
+#if (NGX_DEBUG)
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = NULL;
+#endif
+}
+
+
+/* returns the index of the list cascaded, the next level wraps on 0 */
+
+static ngx_uint_t
+ngx_timer_wheel_cascade(ngx_uint_t level)
+{
+    ngx_uint_t          n;
+    ngx_rbtree_node_t  *head, *node, *next;
+
+    n = ngx_timer_wheel_list(level, ngx_timer_wheel.next);
+    head = &ngx_timer_wheel.lists[n];
+
+    if (head->right != head) {
+        node = head->right;
+        head->left->right = NULL;
+
+        head->left = head;
+        head->right = head;
+        ngx_timer_wheel.busy[n / 64] &= ~((uint64_t) 1 << (n % 64));
+
+        while (node) {
+            next = node->right;
+            ngx_timer_wheel_insert(node);
+            node = next;
+        }
+    }
+
+    return n - ngx_timer_wheel_list(level, 0);
+}
+
+
+/* the first busy list in the range [n, last), or last */
+
+static ngx_uint_t
+ngx_timer_wheel_next_busy(ngx_uint_t n, ngx_uint_t last)
+{
+    uint64_t  bits;
+
+    while (n < last) {
+        bits = ngx_timer_wheel.busy[n / 64] >> (n % 64);
+
+        if (bits) {
+            while ((bits & 0xff) == 0) {
+                bits >>= 8;
+                n += 8;
+            }
+
+            while ((bits & 1) == 0) {
+                bits >>= 1;
+                n++;
+            }
+
+            return ngx_min(n, last);
+        }
+
+        n = (n | 63) + 1;
+    }
+
+    return last;
+}
+
+
+static ngx_msec_t
+ngx_timer_wheel_find(void)
+{
+    ngx_uint_t      n, i, last;
+    ngx_msec_t      next, wrap;
+    ngx_msec_int_t  timer;
+
+    if (ngx_timer_wheel.count == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    next = ngx_timer_wheel.next;
+
+    n = next & (NGX_TIMER_WHEEL_ROOT - 1);
+    i = ngx_timer_wheel_next_busy(n, NGX_TIMER_WHEEL_ROOT);
+
+    wrap = (next | (NGX_TIMER_WHEEL_ROOT - 1)) + 1;
+
+    if (i < NGX_TIMER_WHEEL_ROOT) {
+        next += i - n;
+
+    } else if (ngx_timer_wheel_next_busy(0, n) < n) {
+
+        /* the root level has timers after its wrap */
+
+        next = wrap;
+
+    } else {
+
+        /*
+         * the root level is empty: wake up when the next busy list
+         * of the first level is cascaded, or when the first level wraps
+         * and the upper levels are cascaded
+         */
+
+        n = ngx_timer_wheel_list(1, wrap);
+        last = ngx_timer_wheel_list(1, 0) + NGX_TIMER_WHEEL_LEVEL;
+
+        if (n == ngx_timer_wheel_list(1, 0)) {
+            next = wrap;
+
+        } else {
+            i = ngx_timer_wheel_next_busy(n, last);
+            next = wrap + (i - n) * NGX_TIMER_WHEEL_ROOT;
+        }
+    }
+
+    timer = (ngx_msec_int_t) (next - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_timer_wheel_expire(void)
+{
+    ngx_uint_t          n, i, level;
+    ngx_msec_t          next;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node;
+
+    while ((ngx_msec_int_t) (ngx_current_msec - ngx_timer_wheel.next) >= 0) {
+
+        n = ngx_timer_wheel.next & (NGX_TIMER_WHEEL_ROOT - 1);
+
+        if (n == 0) {
+            for (level = 1; level <= NGX_TIMER_WHEEL_LEVELS; level++) {
+                if (ngx_timer_wheel_cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        head = &ngx_timer_wheel.lists[n];
+
+        while (head->right != head) {
+            node = head->right;
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer del: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_del(ev);
+
+            ev->timer_set = 0;
+
+            ev->timedout = 1;
+
+            ev->handler(ev);
+        }
+
+        /* skip the empty lists up to the current time or the wrap */
+
+        next = ngx_timer_wheel.next + 1;
+
+        n = next & (NGX_TIMER_WHEEL_ROOT - 1);
+
+        if (n) {
+            i = ngx_timer_wheel_next_busy(n, NGX_TIMER_WHEEL_ROOT);
+            next += i - n;
+        }
+
+        if ((ngx_msec_int_t) (next - ngx_current_msec) > 0) {
+            next = ngx_current_msec + 1;
+        }
+
+        ngx_timer_wheel.next = next;
+    }
+}
+
+
+static void
+ngx_timer_wheel_cancel(void)
+{
+    ngx_uint_t          n;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node;
+
+    for (n = 0; n < NGX_TIMER_WHEEL_LISTS; n++) {
+        head = &ngx_timer_wheel.lists[n];
+
+    again:
+
+        for (node = head->right; node != head; node = node->right) {
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            if (!ev->cancelable) {
+                continue;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer cancel: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_del(ev);
+
+            ev->timer_set = 0;
+
+            ev->handler(ev);
+
+            /* the handler may change the list */
+
+            goto again;
+        }
+    }
+}
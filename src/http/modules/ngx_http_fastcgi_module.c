@@ -12,6 +12,7 @@
 
 typedef struct {
     ngx_array_t                    caches;  /* ngx_http_file_cache_t * */
+    ngx_queue_t                    muxes;   /* ngx_http_fastcgi_mux_t */
 } ngx_http_fastcgi_main_conf_t;
 
 
@@ -42,6 +43,9 @@ typedef struct {
 
     ngx_flag_t                     keep_conn;
 
+    ngx_uint_t                     multiplex;
+    ngx_uint_t                     multiplex_requests;
+
 #if (NGX_HTTP_CACHE)
     ngx_http_complex_value_t       cache_key;
 #endif
@@ -108,6 +112,10 @@ typedef struct {
 #define NGX_HTTP_FASTCGI_STDERR         7
 #define NGX_HTTP_FASTCGI_DATA           8
 
+#define NGX_HTTP_FASTCGI_GET_VALUES         9
+#define NGX_HTTP_FASTCGI_GET_VALUES_RESULT  10
+#define NGX_HTTP_FASTCGI_UNKNOWN_TYPE       11
+
 
 typedef struct {
     u_char  version;
@@ -144,6 +152,89 @@ typedef struct {
 } ngx_http_fastcgi_request_start_t;
 
 
+typedef struct ngx_http_fastcgi_mux_s  ngx_http_fastcgi_mux_t;
+
+
+typedef struct {
+    ngx_connection_t               connection;
+    ngx_event_t                    read;
+    ngx_event_t                    write;
+
+    ngx_http_fastcgi_mux_t        *mux;
+    ngx_uint_t                     id;
+
+    /* the received records, the stream reads the first buffer */
+    ngx_chain_t                   *in;
+    ngx_chain_t                   *last;
+    ngx_uint_t                     nbufs;
+
+    u_char                         header[8];
+    ngx_uint_t                     header_len;
+    size_t                         rest;
+
+    unsigned                       busy:1;
+    unsigned                       attached:1;
+    unsigned                       begun:1;
+    unsigned                       end:1;
+    unsigned                       abort:1;
+    unsigned                       wait:1;
+} ngx_http_fastcgi_mux_stream_t;
+
+
+struct ngx_http_fastcgi_mux_s {
+    ngx_queue_t                    queue;
+
+    ngx_pool_t                    *pool;
+    ngx_peer_connection_t          peer;
+    ngx_connection_t              *connection;
+
+    socklen_t                      socklen;
+    ngx_sockaddr_t                 sockaddr;
+
+    ngx_buf_t                     *in;
+    ngx_buf_t                     *out;
+
+    ngx_http_fastcgi_mux_stream_t *streams;
+    ngx_uint_t                     nstreams;
+    ngx_uint_t                     busy;
+
+    /* streams allowed, 1 unless the application multiplexes requests */
+    ngx_uint_t                     limit;
+
+    /* spare input buffers of the streams */
+    ngx_chain_t                   *free;
+    size_t                         buffer_size;
+    ngx_uint_t                     max_bufs;
+
+    /* the stream which has sent a part of a record */
+    ngx_http_fastcgi_mux_stream_t *owner;
+
+    /* the stream whose input buffers are exhausted */
+    ngx_http_fastcgi_mux_stream_t *blocked;
+
+    /* the stream the record being read belongs to */
+    ngx_http_fastcgi_mux_stream_t *target;
+    ngx_uint_t                     state;
+    size_t                         rest;
+    size_t                         padding;
+
+    unsigned                       error:1;
+};
+
+
+typedef struct {
+    ngx_http_fastcgi_loc_conf_t   *conf;
+    ngx_queue_t                   *muxes;
+
+    ngx_http_fastcgi_mux_stream_t *stream;
+
+    void                          *data;
+
+    ngx_event_get_peer_pt          original_get_peer;
+    ngx_event_free_peer_pt         original_free_peer;
+} ngx_http_fastcgi_mux_peer_data_t;
+
+
 static ngx_int_t ngx_http_fastcgi_eval(ngx_http_request_t *r,
     ngx_http_fastcgi_loc_conf_t *flcf);
 #if (NGX_HTTP_CACHE)
@@ -165,6 +256,38 @@ static void ngx_http_fastcgi_abort_request(ngx_http_request_t *r);
 static void ngx_http_fastcgi_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
 
+static ngx_int_t ngx_http_fastcgi_mux_init_peer(ngx_http_request_t *r);
+static ngx_int_t ngx_http_fastcgi_mux_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_fastcgi_mux_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_http_fastcgi_mux_t *ngx_http_fastcgi_mux_create(
+    ngx_peer_connection_t *pc, ngx_http_fastcgi_mux_peer_data_t *mp);
+static ngx_http_fastcgi_mux_stream_t *ngx_http_fastcgi_mux_attach(
+    ngx_http_fastcgi_mux_t *mux, ngx_log_t *log);
+static void ngx_http_fastcgi_mux_detach(ngx_http_fastcgi_mux_stream_t *st);
+static void ngx_http_fastcgi_mux_finish(ngx_http_fastcgi_mux_stream_t *st);
+static void ngx_http_fastcgi_mux_read_handler(ngx_event_t *rev);
+static void ngx_http_fastcgi_mux_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_fastcgi_mux_process(ngx_http_fastcgi_mux_t *mux);
+static void ngx_http_fastcgi_mux_values(ngx_http_fastcgi_mux_t *mux,
+    ngx_uint_t type, u_char *p, u_char *last);
+static ngx_buf_t *ngx_http_fastcgi_mux_in_buf(
+    ngx_http_fastcgi_mux_stream_t *st, size_t size);
+static void ngx_http_fastcgi_mux_send(ngx_http_fastcgi_mux_t *mux);
+static size_t ngx_http_fastcgi_mux_write(ngx_http_fastcgi_mux_stream_t *st,
+    u_char *p, size_t size);
+static void ngx_http_fastcgi_mux_error(ngx_http_fastcgi_mux_t *mux);
+static void ngx_http_fastcgi_mux_close(ngx_http_fastcgi_mux_t *mux);
+static ssize_t ngx_http_fastcgi_mux_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_fastcgi_mux_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *cl, off_t limit);
+static ssize_t ngx_http_fastcgi_mux_send_buf(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ngx_chain_t *ngx_http_fastcgi_mux_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+
 static ngx_int_t ngx_http_fastcgi_add_variables(ngx_conf_t *cf);
 static void *ngx_http_fastcgi_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf);
@@ -187,6 +310,8 @@ static char *ngx_http_fastcgi_split_path_info(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static char *ngx_http_fastcgi_store(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_fastcgi_multiplex(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 #if (NGX_HTTP_CACHE)
 static char *ngx_http_fastcgi_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -399,6 +524,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, upstream.cache_bypass),
       NULL },
 
+    { ngx_string("fastcgi_cache_purge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_set_predicate_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, upstream.cache_purge),
+      NULL },
+
     { ngx_string("fastcgi_no_cache"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_http_set_predicate_slot,
@@ -555,6 +687,20 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, keep_conn),
       NULL },
 
+    { ngx_string("fastcgi_multiplex"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fastcgi_multiplex,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fastcgi_multiplex_requests"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, multiplex_requests),
+      NULL },
+
       ngx_null_command
 };
 
@@ -613,6 +759,14 @@ static ngx_http_fastcgi_request_start_t  ngx_http_fastcgi_request_start = {
 };
 
 
+/* FCGI_GET_VALUES of FCGI_MAX_REQS and FCGI_MPXS_CONNS */
+
+static u_char  ngx_http_fastcgi_get_values[] =
+    "\1\11\0\0\0\40\0\0"
+    "\15\0" "FCGI_MAX_REQS"
+    "\17\0" "FCGI_MPXS_CONNS";
+
+
 static ngx_http_variable_t  ngx_http_fastcgi_vars[] = {
 
     { ngx_string("fastcgi_script_name"), NULL,
@@ -704,6 +858,11 @@ ngx_http_fastcgi_handler(ngx_http_request_t *r)
 #endif
 
     u->create_request = ngx_http_fastcgi_create_request;
+
+    if (flcf->multiplex) {
+        u->init_peer = ngx_http_fastcgi_mux_init_peer;
+    }
+
     u->reinit_request = ngx_http_fastcgi_reinit_request;
     u->process_header = ngx_http_fastcgi_process_header;
     u->abort_request = ngx_http_fastcgi_abort_request;
@@ -2662,208 +2821,1507 @@ ngx_http_fastcgi_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 
 
 static ngx_int_t
-ngx_http_fastcgi_add_variables(ngx_conf_t *cf)
+ngx_http_fastcgi_mux_init_peer(ngx_http_request_t *r)
 {
-    ngx_http_variable_t  *var, *v;
+    ngx_http_upstream_t               *u;
+    ngx_http_fastcgi_main_conf_t      *fmcf;
+    ngx_http_fastcgi_mux_peer_data_t  *mp;
 
-    for (v = ngx_http_fastcgi_vars; v->name.len; v++) {
-        var = ngx_http_add_variable(cf, &v->name, v->flags);
-        if (var == NULL) {
-            return NGX_ERROR;
+    static ngx_uint_t                  warned;
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+
+        /*
+         * the event method is checked by the "fastcgi_multiplex"
+         * directive unless the "events" block follows the "http" one
+         */
+
+        if (!warned) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "\"fastcgi_multiplex\" is ignored with "
+                          "the event method used");
+            warned = 1;
         }
 
-        var->get_handler = v->get_handler;
-        var->data = v->data;
+        return NGX_OK;
     }
 
+    mp = ngx_palloc(r->pool, sizeof(ngx_http_fastcgi_mux_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+    fmcf = ngx_http_get_module_main_conf(r, ngx_http_fastcgi_module);
+
+    mp->conf = ngx_http_get_module_loc_conf(r, ngx_http_fastcgi_module);
+    mp->muxes = &fmcf->muxes;
+    mp->stream = NULL;
+
+    mp->data = u->peer.data;
+    mp->original_get_peer = u->peer.get;
+    mp->original_free_peer = u->peer.free;
+
+    u->peer.data = mp;
+    u->peer.get = ngx_http_fastcgi_mux_get_peer;
+    u->peer.free = ngx_http_fastcgi_mux_free_peer;
+
     return NGX_OK;
 }
 
 
-static void *
-ngx_http_fastcgi_create_main_conf(ngx_conf_t *cf)
+static ngx_int_t
+ngx_http_fastcgi_mux_get_peer(ngx_peer_connection_t *pc, void *data)
 {
-    ngx_http_fastcgi_main_conf_t  *conf;
+    ngx_http_fastcgi_mux_peer_data_t  *mp = data;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fastcgi_main_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+    ngx_int_t                       rc;
+    ngx_uint_t                      n;
+    ngx_queue_t                    *q;
+    ngx_http_fastcgi_mux_t         *mux, *best;
+    ngx_http_fastcgi_mux_stream_t  *st;
 
-#if (NGX_HTTP_CACHE)
-    if (ngx_array_init(&conf->caches, cf->pool, 4,
-                       sizeof(ngx_http_file_cache_t *))
-        != NGX_OK)
-    {
-        return NULL;
+    rc = mp->original_get_peer(pc, mp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
     }
-#endif
 
-    return conf;
-}
+    /* search for the least loaded multiplexed connection to the peer */
 
+    best = NULL;
+    n = 0;
 
-static void *
-ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
-{
-    ngx_http_fastcgi_loc_conf_t  *conf;
+    for (q = ngx_queue_head(mp->muxes);
+         q != ngx_queue_sentinel(mp->muxes);
+         q = ngx_queue_next(q))
+    {
+        mux = ngx_queue_data(q, ngx_http_fastcgi_mux_t, queue);
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fastcgi_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+        if (ngx_memn2cmp((u_char *) &mux->sockaddr, (u_char *) pc->sockaddr,
+                         mux->socklen, pc->socklen)
+            != 0)
+        {
+            continue;
+        }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->upstream.bufs.num = 0;
-     *     conf->upstream.ignore_headers = 0;
-     *     conf->upstream.next_upstream = 0;
-     *     conf->upstream.cache_zone = NULL;
-     *     conf->upstream.cache_use_stale = 0;
-     *     conf->upstream.cache_methods = 0;
-     *     conf->upstream.temp_path = NULL;
-     *     conf->upstream.hide_headers_hash = { NULL, 0 };
-     *     conf->upstream.uri = { 0, NULL };
-     *     conf->upstream.location = NULL;
-     *     conf->upstream.store_lengths = NULL;
-     *     conf->upstream.store_values = NULL;
-     *
-     *     conf->index.len = { 0, NULL };
-     */
+        if (mux->peer.transparent != pc->transparent) {
+            continue;
+        }
 
-    conf->upstream.store = NGX_CONF_UNSET;
-    conf->upstream.store_access = NGX_CONF_UNSET_UINT;
-    conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
-    conf->upstream.buffering = NGX_CONF_UNSET;
-    conf->upstream.request_buffering = NGX_CONF_UNSET;
-    conf->upstream.ignore_client_abort = NGX_CONF_UNSET;
-    conf->upstream.force_ranges = NGX_CONF_UNSET;
+        if (mux->peer.local || pc->local) {
 
-    conf->upstream.local = NGX_CONF_UNSET_PTR;
+            if (mux->peer.local == NULL || pc->local == NULL) {
+                continue;
+            }
 
-    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+            if (ngx_memn2cmp((u_char *) mux->peer.local->sockaddr,
+                             (u_char *) pc->local->sockaddr,
+                             mux->peer.local->socklen, pc->local->socklen)
+                != 0)
+            {
+                continue;
+            }
+        }
 
-    conf->upstream.send_lowat = NGX_CONF_UNSET_SIZE;
-    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
-    conf->upstream.limit_rate = NGX_CONF_UNSET_SIZE;
+        n++;
 
-    conf->upstream.busy_buffers_size_conf = NGX_CONF_UNSET_SIZE;
-    conf->upstream.max_temp_file_size_conf = NGX_CONF_UNSET_SIZE;
-    conf->upstream.temp_file_write_size_conf = NGX_CONF_UNSET_SIZE;
+        if (mux->busy >= mux->limit || mux->blocked) {
+            continue;
+        }
 
-    conf->upstream.pass_request_headers = NGX_CONF_UNSET;
-    conf->upstream.pass_request_body = NGX_CONF_UNSET;
+        if (best == NULL || mux->busy < best->busy) {
+            best = mux;
+        }
+    }
 
-#if (NGX_HTTP_CACHE)
-    conf->upstream.cache = NGX_CONF_UNSET;
-    conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
-    conf->upstream.cache_max_range_offset = NGX_CONF_UNSET;
-    conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
-    conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
-    conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
-    conf->upstream.cache_lock = NGX_CONF_UNSET;
-    conf->upstream.cache_lock_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.cache_lock_age = NGX_CONF_UNSET_MSEC;
-    conf->upstream.cache_revalidate = NGX_CONF_UNSET;
-#endif
+    if ((best == NULL || best->busy) && n < mp->conf->multiplex) {
+        mux = ngx_http_fastcgi_mux_create(pc, mp);
 
-    conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
-    conf->upstream.pass_headers = NGX_CONF_UNSET_PTR;
+        if (mux) {
+            ngx_queue_insert_head(mp->muxes, &mux->queue);
+            best = mux;
+        }
+    }
 
-    conf->upstream.intercept_errors = NGX_CONF_UNSET;
+    if (best == NULL) {
 
-    /* "fastcgi_cyclic_temp_file" is disabled */
-    conf->upstream.cyclic_temp_file = 0;
+        /* fall back to a dedicated connection */
 
-    conf->upstream.change_buffering = 1;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "fastcgi mux: no free connection");
+        return NGX_OK;
+    }
 
-    conf->catch_stderr = NGX_CONF_UNSET_PTR;
+    st = ngx_http_fastcgi_mux_attach(best, pc->log);
+    if (st == NULL) {
+        return NGX_OK;
+    }
 
-    conf->keep_conn = NGX_CONF_UNSET;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "fastcgi mux: stream %ui of %ui on %d",
+                   st->id, best->busy, best->connection->fd);
 
-    ngx_str_set(&conf->upstream.module, "fastcgi");
+    mp->stream = st;
+    pc->connection = &st->connection;
 
-    return conf;
+    return NGX_DONE;
 }
 
 
-static char *
-ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+static void
+ngx_http_fastcgi_mux_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
 {
-    ngx_http_fastcgi_loc_conf_t *prev = parent;
-    ngx_http_fastcgi_loc_conf_t *conf = child;
+    ngx_http_fastcgi_mux_peer_data_t  *mp = data;
 
-    size_t                        size;
-    ngx_int_t                     rc;
-    ngx_hash_init_t               hash;
-    ngx_http_core_loc_conf_t     *clcf;
+    ngx_connection_t               *c;
+    ngx_http_fastcgi_mux_t         *mux;
+    ngx_http_fastcgi_mux_stream_t  *st;
 
-#if (NGX_HTTP_CACHE)
+    st = mp->stream;
 
-    if (conf->upstream.store > 0) {
-        conf->upstream.cache = 0;
-    }
+    if (st) {
+        mp->stream = NULL;
 
-    if (conf->upstream.cache > 0) {
-        conf->upstream.store = 0;
-    }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "fastcgi mux: free stream %ui", st->id);
 
-#endif
+        c = &st->connection;
 
-    if (conf->upstream.store == NGX_CONF_UNSET) {
-        ngx_conf_merge_value(conf->upstream.store,
-                              prev->upstream.store, 0);
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
 
-        conf->upstream.store_lengths = prev->upstream.store_lengths;
-        conf->upstream.store_values = prev->upstream.store_values;
-    }
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
 
-    ngx_conf_merge_uint_value(conf->upstream.store_access,
-                              prev->upstream.store_access, 0600);
+        if (c->read->posted) {
+            ngx_delete_posted_event(c->read);
+        }
 
-    ngx_conf_merge_uint_value(conf->upstream.next_upstream_tries,
-                              prev->upstream.next_upstream_tries, 0);
+        if (c->write->posted) {
+            ngx_delete_posted_event(c->write);
+        }
 
-    ngx_conf_merge_value(conf->upstream.buffering,
-                              prev->upstream.buffering, 1);
+        if (c->pool) {
+            ngx_destroy_pool(c->pool);
+            c->pool = NULL;
+        }
 
-    ngx_conf_merge_value(conf->upstream.request_buffering,
-                              prev->upstream.request_buffering, 1);
+        pc->connection = NULL;
 
-    ngx_conf_merge_value(conf->upstream.ignore_client_abort,
-                              prev->upstream.ignore_client_abort, 0);
+        mux = st->mux;
 
-    ngx_conf_merge_value(conf->upstream.force_ranges,
-                              prev->upstream.force_ranges, 0);
+        ngx_http_fastcgi_mux_detach(st);
+        ngx_http_fastcgi_mux_close(mux);
+    }
 
-    ngx_conf_merge_ptr_value(conf->upstream.local,
-                              prev->upstream.local, NULL);
+    mp->original_free_peer(pc, mp->data, state);
+}
 
-    ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
-                              prev->upstream.connect_timeout, 60000);
 
-    ngx_conf_merge_msec_value(conf->upstream.send_timeout,
-                              prev->upstream.send_timeout, 60000);
+static ngx_http_fastcgi_mux_t *
+ngx_http_fastcgi_mux_create(ngx_peer_connection_t *pc,
+    ngx_http_fastcgi_mux_peer_data_t *mp)
+{
+    ngx_int_t                rc;
+    ngx_uint_t               i;
+    ngx_pool_t              *pool;
+    ngx_chain_t             *cl;
+    ngx_connection_t        *c;
+    ngx_http_fastcgi_mux_t  *mux;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
 
-    ngx_conf_merge_msec_value(conf->upstream.read_timeout,
-                              prev->upstream.read_timeout, 60000);
+    mux = ngx_pcalloc(pool, sizeof(ngx_http_fastcgi_mux_t));
+    if (mux == NULL) {
+        goto failed;
+    }
 
-    ngx_conf_merge_msec_value(conf->upstream.next_upstream_timeout,
-                              prev->upstream.next_upstream_timeout, 0);
+    mux->pool = pool;
+    mux->nstreams = mp->conf->multiplex_requests;
+    mux->limit = 1;
 
-    ngx_conf_merge_size_value(conf->upstream.send_lowat,
-                              prev->upstream.send_lowat, 0);
+    /*
+     * a stream queues up to fastcgi_buffers of records it has not read
+     * yet, other streams are not blocked by a slow one until then
+     */
 
-    ngx_conf_merge_size_value(conf->upstream.buffer_size,
-                              prev->upstream.buffer_size,
-                              (size_t) ngx_pagesize);
+    mux->buffer_size = mp->conf->upstream.buffer_size;
+    mux->max_bufs = mp->conf->upstream.bufs.num * mp->conf->upstream.bufs.size
+                    / mux->buffer_size;
 
-    ngx_conf_merge_size_value(conf->upstream.limit_rate,
-                              prev->upstream.limit_rate, 0);
+    if (mux->max_bufs == 0) {
+        mux->max_bufs = 1;
+    }
+
+    mux->streams = ngx_pcalloc(pool, mux->nstreams
+                                     * sizeof(ngx_http_fastcgi_mux_stream_t));
+    if (mux->streams == NULL) {
+        goto failed;
+    }
+
+    for (i = 0; i < mux->nstreams; i++) {
+        mux->streams[i].mux = mux;
+        mux->streams[i].id = i + 1;
+
+        cl = ngx_alloc_chain_link(pool);
+        if (cl == NULL) {
+            goto failed;
+        }
+
+        cl->buf = ngx_create_temp_buf(pool, mux->buffer_size);
+        if (cl->buf == NULL) {
+            goto failed;
+        }
+
+        cl->next = NULL;
+
+        mux->streams[i].in = cl;
+        mux->streams[i].last = cl;
+        mux->streams[i].nbufs = 1;
+    }
+
+    mux->in = ngx_create_temp_buf(pool, mux->buffer_size);
+    if (mux->in == NULL) {
+        goto failed;
+    }
+
+    mux->out = ngx_create_temp_buf(pool, mux->buffer_size);
+    if (mux->out == NULL) {
+        goto failed;
+    }
+
+    /*
+     * the first request is sent right away, further ones only if
+     * the application reports that it multiplexes requests
+     */
+
+    mux->out->last = ngx_cpymem(mux->out->last, ngx_http_fastcgi_get_values,
+                                sizeof(ngx_http_fastcgi_get_values) - 1);
+
+    ngx_memcpy(&mux->sockaddr, pc->sockaddr, pc->socklen);
+    mux->socklen = pc->socklen;
+
+    mux->peer.sockaddr = &mux->sockaddr.sockaddr;
+    mux->peer.socklen = pc->socklen;
+
+    mux->peer.name = ngx_pcalloc(pool, sizeof(ngx_str_t));
+    if (mux->peer.name == NULL) {
+        goto failed;
+    }
+
+    mux->peer.name->data = ngx_pstrdup(pool, pc->name);
+    if (mux->peer.name->data == NULL) {
+        goto failed;
+    }
+
+    mux->peer.name->len = pc->name->len;
+
+    if (pc->local) {
+        mux->peer.local = ngx_palloc(pool, sizeof(ngx_addr_t));
+        if (mux->peer.local == NULL) {
+            goto failed;
+        }
+
+        mux->peer.local->sockaddr = ngx_palloc(pool, pc->local->socklen);
+        if (mux->peer.local->sockaddr == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(mux->peer.local->sockaddr, pc->local->sockaddr,
+                   pc->local->socklen);
+        mux->peer.local->socklen = pc->local->socklen;
+
+        mux->peer.local->name.data = ngx_pstrdup(pool, &pc->local->name);
+        if (mux->peer.local->name.data == NULL) {
+            goto failed;
+        }
+
+        mux->peer.local->name.len = pc->local->name.len;
+    }
+
+    mux->peer.get = ngx_event_get_peer;
+    mux->peer.log = ngx_cycle->log;
+    mux->peer.log_error = NGX_ERROR_ERR;
+    mux->peer.type = pc->type;
+    mux->peer.rcvbuf = pc->rcvbuf;
+    mux->peer.transparent = pc->transparent;
+
+    rc = ngx_event_connect_peer(&mux->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (mux->peer.connection) {
+            ngx_close_connection(mux->peer.connection);
+        }
+
+        goto failed;
+    }
+
+    c = mux->peer.connection;
+    mux->connection = c;
+
+    c->data = mux;
+    c->read->handler = ngx_http_fastcgi_mux_read_handler;
+    c->write->handler = ngx_http_fastcgi_mux_write_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, mp->conf->upstream.connect_timeout);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "fastcgi mux: new connection %d", c->fd);
+
+    return mux;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static ngx_http_fastcgi_mux_stream_t *
+ngx_http_fastcgi_mux_attach(ngx_http_fastcgi_mux_t *mux, ngx_log_t *log)
+{
+    ngx_uint_t                      i;
+    ngx_connection_t               *c;
+    ngx_http_fastcgi_mux_stream_t  *st;
+
+    for (i = 0; i < mux->nstreams; i++) {
+        if (!mux->streams[i].busy) {
+            break;
+        }
+    }
+
+    if (i == mux->nstreams) {
+        return NULL;
+    }
+
+    st = &mux->streams[i];
+
+    st->busy = 1;
+    st->attached = 1;
+    st->begun = 0;
+    st->end = 0;
+    st->abort = 0;
+    st->wait = 0;
+    st->header_len = 0;
+    st->rest = 0;
+
+    mux->busy++;
+
+    c = &st->connection;
+
+    ngx_memzero(c, sizeof(ngx_connection_t));
+    ngx_memzero(&st->read, sizeof(ngx_event_t));
+    ngx_memzero(&st->write, sizeof(ngx_event_t));
+
+    c->read = &st->read;
+    c->write = &st->write;
+
+    c->fd = mux->connection->fd;
+    c->log = log;
+    c->log_error = NGX_ERROR_ERR;
+
+    c->recv = ngx_http_fastcgi_mux_recv;
+    c->send = ngx_http_fastcgi_mux_send_buf;
+    c->recv_chain = ngx_http_fastcgi_mux_recv_chain;
+    c->send_chain = ngx_http_fastcgi_mux_send_chain;
+
+    c->sockaddr = mux->peer.sockaddr;
+    c->socklen = mux->peer.socklen;
+
+    c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+    c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    /*
+     * the events are never added to the event method, they are
+     * posted by the multiplexed connection handlers instead
+     */
+
+    c->read->data = c;
+    c->read->log = log;
+    c->read->active = 1;
+    c->read->ready = 0;
+
+    c->write->data = c;
+    c->write->log = log;
+    c->write->write = 1;
+    c->write->active = 1;
+    c->write->ready = 1;
+
+    return st;
+}
+
+
+static void
+ngx_http_fastcgi_mux_detach(ngx_http_fastcgi_mux_stream_t *st)
+{
+    ngx_http_fastcgi_mux_t  *mux;
+
+    mux = st->mux;
+
+    st->attached = 0;
+    st->wait = 0;
+
+    /* the buffers except the first one are returned to the connection */
+
+    st->last->next = mux->free;
+    mux->free = st->in->next;
+    st->in->next = NULL;
+
+    st->in->buf->pos = st->in->buf->start;
+    st->in->buf->last = st->in->buf->start;
+    st->last = st->in;
+    st->nbufs = 1;
+
+    if (mux->blocked == st) {
+        mux->blocked = NULL;
+        ngx_post_event(mux->connection->read, &ngx_posted_events);
+    }
+
+    if (mux->error || !st->begun) {
+        st->busy = 0;
+        mux->busy--;
+        return;
+    }
+
+    /*
+     * a partially sent record is completed with zeroes, and the request
+     * is aborted unless FCGI_END_REQUEST was already received
+     */
+
+    st->abort = !st->end;
+
+    ngx_http_fastcgi_mux_send(st->mux);
+}
+
+
+static void
+ngx_http_fastcgi_mux_finish(ngx_http_fastcgi_mux_stream_t *st)
+{
+    size_t                      n;
+    ngx_buf_t                  *b;
+    ngx_http_fastcgi_mux_t     *mux;
+    ngx_http_fastcgi_header_t  *h;
+
+    static u_char               zero[512];
+
+    mux = st->mux;
+    b = mux->out;
+
+    while (mux->owner == st) {
+        n = ngx_min((size_t) (b->end - b->last), sizeof(zero));
+
+        if (ngx_http_fastcgi_mux_write(st, zero, n) == 0) {
+            return;
+        }
+    }
+
+    if (st->abort && !st->end) {
+
+        if (mux->owner || (size_t) (b->end - b->last) < sizeof(*h)) {
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                       "fastcgi mux: abort stream %ui", st->id);
+
+        h = (ngx_http_fastcgi_header_t *) b->last;
+        b->last += sizeof(ngx_http_fastcgi_header_t);
+
+        h->version = 1;
+        h->type = NGX_HTTP_FASTCGI_ABORT_REQUEST;
+        h->request_id_hi = (u_char) (st->id >> 8);
+        h->request_id_lo = (u_char) st->id;
+        h->content_length_hi = 0;
+        h->content_length_lo = 0;
+        h->padding_length = 0;
+        h->reserved = 0;
+
+        st->abort = 0;
+    }
+
+    if (st->end && mux->target != st) {
+        st->busy = 0;
+        mux->busy--;
+    }
+}
+
+
+static void
+ngx_http_fastcgi_mux_read_handler(ngx_event_t *rev)
+{
+    ssize_t                  n;
+    ngx_buf_t               *b;
+    ngx_connection_t        *c;
+    ngx_http_fastcgi_mux_t  *mux;
+
+    c = rev->data;
+    mux = c->data;
+    b = mux->in;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "fastcgi mux read handler: %d", c->fd);
+
+    for ( ;; ) {
+
+        if (ngx_http_fastcgi_mux_process(mux) != NGX_OK) {
+            break;
+        }
+
+        if (b->pos != b->start) {
+            b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+            b->pos = b->start;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_fastcgi_mux_error(mux);
+            }
+
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "fastcgi mux: connection %d closed", c->fd);
+            ngx_http_fastcgi_mux_error(mux);
+            break;
+        }
+
+        b->last += n;
+    }
+
+    ngx_http_fastcgi_mux_close(mux);
+}
+
+
+static void
+ngx_http_fastcgi_mux_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t        *c;
+    ngx_http_fastcgi_mux_t  *mux;
+
+    c = wev->data;
+    mux = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "fastcgi mux write handler: %d", c->fd);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while connecting to %V",
+                      mux->peer.name);
+        ngx_http_fastcgi_mux_error(mux);
+        ngx_http_fastcgi_mux_close(mux);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_http_fastcgi_mux_send(mux);
+    ngx_http_fastcgi_mux_close(mux);
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_process(ngx_http_fastcgi_mux_t *mux)
+{
+    size_t                          n;
+    ngx_uint_t                      id;
+    ngx_buf_t                      *b, *in;
+    ngx_http_fastcgi_header_t      *h;
+    ngx_http_fastcgi_mux_stream_t  *st;
+
+    b = mux->in;
+
+    for ( ;; ) {
+
+        if (mux->blocked) {
+            return NGX_AGAIN;
+        }
+
+        if (mux->state == 1 && mux->rest == 0 && mux->padding == 0) {
+
+            /* the record is complete */
+
+            st = mux->target;
+
+            mux->state = 0;
+            mux->target = NULL;
+
+            if (st && !st->attached) {
+                ngx_http_fastcgi_mux_finish(st);
+            }
+        }
+
+        if (b->pos == b->last) {
+            return NGX_OK;
+        }
+
+        if (mux->state == 0) {
+
+            if ((size_t) (b->last - b->pos)
+                < sizeof(ngx_http_fastcgi_header_t))
+            {
+                return NGX_OK;
+            }
+
+            h = (ngx_http_fastcgi_header_t *) b->pos;
+
+            if (h->version != 1) {
+                ngx_log_error(NGX_LOG_ERR, mux->connection->log, 0,
+                              "upstream sent unsupported FastCGI "
+                              "protocol version: %ud", h->version);
+                ngx_http_fastcgi_mux_error(mux);
+                return NGX_ERROR;
+            }
+
+            id = (h->request_id_hi << 8) + h->request_id_lo;
+
+            if (id == 0
+                && (h->type == NGX_HTTP_FASTCGI_GET_VALUES_RESULT
+                    || h->type == NGX_HTTP_FASTCGI_UNKNOWN_TYPE))
+            {
+                n = sizeof(ngx_http_fastcgi_header_t)
+                    + (h->content_length_hi << 8) + h->content_length_lo;
+
+                if ((size_t) (b->last - b->pos) < n) {
+
+                    if (n <= (size_t) (b->end - b->start)) {
+                        return NGX_OK;
+                    }
+
+                    /* too long, the application is not asked again */
+
+                    n = sizeof(ngx_http_fastcgi_header_t);
+                }
+
+                ngx_http_fastcgi_mux_values(mux, h->type,
+                                  b->pos + sizeof(ngx_http_fastcgi_header_t),
+                                  b->pos + n);
+            }
+
+            st = (id && id <= mux->nstreams) ? &mux->streams[id - 1] : NULL;
+
+            if (st && !st->busy) {
+                st = NULL;
+            }
+
+            if (st && st->attached) {
+                in = ngx_http_fastcgi_mux_in_buf(st,
+                                           sizeof(ngx_http_fastcgi_header_t));
+                if (in == NULL) {
+                    mux->blocked = st;
+                    return NGX_AGAIN;
+                }
+
+                /* the stream sees its records with id 1 and no padding */
+
+                in->last = ngx_cpymem(in->last, b->pos,
+                                      sizeof(ngx_http_fastcgi_header_t));
+
+                h = (ngx_http_fastcgi_header_t *)
+                        (in->last - sizeof(ngx_http_fastcgi_header_t));
+                h->request_id_hi = 0;
+                h->request_id_lo = 1;
+                h->padding_length = 0;
+
+                st->read.ready = 1;
+                ngx_post_event(&st->read, &ngx_posted_events);
+
+                h = (ngx_http_fastcgi_header_t *) b->pos;
+            }
+
+            if (st && h->type == NGX_HTTP_FASTCGI_END_REQUEST) {
+                st->end = 1;
+            }
+
+            mux->target = st;
+            mux->rest = (h->content_length_hi << 8) + h->content_length_lo;
+            mux->padding = h->padding_length;
+            mux->state = 1;
+
+            b->pos += sizeof(ngx_http_fastcgi_header_t);
+
+            continue;
+        }
+
+        if (mux->rest) {
+            n = ngx_min(mux->rest, (size_t) (b->last - b->pos));
+
+            st = mux->target;
+
+            if (st && st->attached) {
+                in = ngx_http_fastcgi_mux_in_buf(st, 1);
+                if (in == NULL) {
+                    mux->blocked = st;
+                    return NGX_AGAIN;
+                }
+
+                n = ngx_min(n, (size_t) (in->end - in->last));
+
+                in->last = ngx_cpymem(in->last, b->pos, n);
+
+                st->read.ready = 1;
+                ngx_post_event(&st->read, &ngx_posted_events);
+            }
+
+            b->pos += n;
+            mux->rest -= n;
+
+            continue;
+        }
+
+        n = ngx_min(mux->padding, (size_t) (b->last - b->pos));
+
+        b->pos += n;
+        mux->padding -= n;
+    }
+}
+
+
+static void
+ngx_http_fastcgi_mux_values(ngx_http_fastcgi_mux_t *mux, ngx_uint_t type,
+    u_char *p, u_char *last)
+{
+    size_t      len[2];
+    ngx_int_t   max;
+    ngx_str_t   name, value;
+    ngx_uint_t  i, mpxs;
+
+    mpxs = 0;
+    max = 0;
+
+    while (type == NGX_HTTP_FASTCGI_GET_VALUES_RESULT && p < last) {
+
+        for (i = 0; i < 2; i++) {
+
+            if (p < last && *p < 0x80) {
+                len[i] = *p++;
+                continue;
+            }
+
+            if (last - p < 4) {
+                goto invalid;
+            }
+
+            len[i] = ((p[0] & 0x7f) << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+            p += 4;
+        }
+
+        if ((size_t) (last - p) < len[0] + len[1]) {
+            goto invalid;
+        }
+
+        name.len = len[0];
+        name.data = p;
+        p += len[0];
+
+        value.len = len[1];
+        value.data = p;
+        p += len[1];
+
+        if (name.len == sizeof("FCGI_MPXS_CONNS") - 1
+            && ngx_strncmp(name.data, "FCGI_MPXS_CONNS", name.len) == 0)
+        {
+            mpxs = (value.len == 1 && value.data[0] == '1');
+
+        } else if (name.len == sizeof("FCGI_MAX_REQS") - 1
+                   && ngx_strncmp(name.data, "FCGI_MAX_REQS", name.len) == 0)
+        {
+            max = ngx_atoi(value.data, value.len);
+        }
+    }
+
+    if (mpxs) {
+        mux->limit = mux->nstreams;
+
+        if (max > 0 && (ngx_uint_t) max < mux->limit) {
+            mux->limit = max;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                   "fastcgi mux: multiplexing:%ui, streams:%ui",
+                   mpxs, mux->limit);
+
+    return;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, mux->connection->log, 0,
+                  "upstream sent invalid FastCGI FCGI_GET_VALUES_RESULT");
+}
+
+
+static ngx_buf_t *
+ngx_http_fastcgi_mux_in_buf(ngx_http_fastcgi_mux_stream_t *st, size_t size)
+{
+    ngx_buf_t               *b;
+    ngx_chain_t             *cl;
+    ngx_http_fastcgi_mux_t  *mux;
+
+    b = st->last->buf;
+
+    if ((size_t) (b->end - b->last) >= size) {
+        return b;
+    }
+
+    mux = st->mux;
+
+    if (st->nbufs == mux->max_bufs) {
+        return NULL;
+    }
+
+    cl = mux->free;
+
+    if (cl) {
+        mux->free = cl->next;
+        b = cl->buf;
+
+    } else {
+        cl = ngx_alloc_chain_link(mux->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        b = ngx_create_temp_buf(mux->pool, mux->buffer_size);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    cl->next = NULL;
+    st->last->next = cl;
+    st->last = cl;
+    st->nbufs++;
+
+    return b;
+}
+
+
+static void
+ngx_http_fastcgi_mux_send(ngx_http_fastcgi_mux_t *mux)
+{
+    ssize_t                         n;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      i;
+    ngx_connection_t               *c;
+    ngx_http_fastcgi_mux_stream_t  *st;
+
+    if (mux->error) {
+        return;
+    }
+
+    c = mux->connection;
+    b = mux->out;
+
+    for ( ;; ) {
+
+        for (i = 0; i < mux->nstreams; i++) {
+            st = &mux->streams[i];
+
+            if (st->busy && !st->attached) {
+                ngx_http_fastcgi_mux_finish(st);
+            }
+        }
+
+        if (b->pos == b->last || !c->write->ready) {
+            break;
+        }
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            ngx_http_fastcgi_mux_error(mux);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        b->pos += n;
+
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_fastcgi_mux_error(mux);
+        return;
+    }
+
+    if (b->last == b->end) {
+        return;
+    }
+
+    /* wake up streams waiting for the output buffer */
+
+    for (i = 0; i < mux->nstreams; i++) {
+        st = &mux->streams[i];
+
+        if (st->wait) {
+            st->wait = 0;
+            st->write.ready = 1;
+            ngx_post_event(&st->write, &ngx_posted_events);
+        }
+    }
+}
+
+
+static size_t
+ngx_http_fastcgi_mux_write(ngx_http_fastcgi_mux_stream_t *st, u_char *p,
+    size_t size)
+{
+    size_t                   n;
+    u_char                  *start;
+    ngx_buf_t               *b;
+    ngx_http_fastcgi_mux_t  *mux;
+
+    mux = st->mux;
+    b = mux->out;
+
+    /* records of different streams must not interleave */
+
+    if (mux->owner && mux->owner != st) {
+        return 0;
+    }
+
+    start = p;
+
+    while (size && b->last < b->end) {
+
+        if (st->header_len < sizeof(ngx_http_fastcgi_header_t)) {
+
+            /* replace request id in the record header */
+
+            st->header[st->header_len] = *p;
+
+            switch (st->header_len) {
+
+            case 2:
+                *b->last++ = (u_char) (st->id >> 8);
+                break;
+
+            case 3:
+                *b->last++ = (u_char) st->id;
+                break;
+
+            default:
+                *b->last++ = *p;
+            }
+
+            p++;
+            size--;
+
+            if (++st->header_len == sizeof(ngx_http_fastcgi_header_t)) {
+                st->rest = (st->header[4] << 8) + st->header[5]
+                           + st->header[6];
+
+                if (st->rest == 0) {
+                    st->header_len = 0;
+                }
+            }
+
+            continue;
+        }
+
+        n = ngx_min(size, st->rest);
+        n = ngx_min(n, (size_t) (b->end - b->last));
+
+        b->last = ngx_cpymem(b->last, p, n);
+
+        p += n;
+        size -= n;
+        st->rest -= n;
+
+        if (st->rest == 0) {
+            st->header_len = 0;
+        }
+    }
+
+    mux->owner = st->header_len ? st : NULL;
+
+    if (p != start) {
+        st->begun = 1;
+    }
+
+    return p - start;
+}
+
+
+static void
+ngx_http_fastcgi_mux_error(ngx_http_fastcgi_mux_t *mux)
+{
+    ngx_uint_t                      i;
+    ngx_http_fastcgi_mux_stream_t  *st;
+
+    if (mux->error) {
+        return;
+    }
+
+    mux->error = 1;
+
+    ngx_queue_remove(&mux->queue);
+
+    mux->owner = NULL;
+    mux->blocked = NULL;
+    mux->target = NULL;
+
+    for (i = 0; i < mux->nstreams; i++) {
+        st = &mux->streams[i];
+
+        if (!st->busy) {
+            continue;
+        }
+
+        if (!st->attached) {
+            st->busy = 0;
+            mux->busy--;
+            continue;
+        }
+
+        st->connection.fd = (ngx_socket_t) -1;
+
+        st->read.ready = 1;
+        ngx_post_event(&st->read, &ngx_posted_events);
+
+        st->write.ready = 1;
+        ngx_post_event(&st->write, &ngx_posted_events);
+    }
+
+    ngx_close_connection(mux->connection);
+    mux->connection = NULL;
+}
+
+
+static void
+ngx_http_fastcgi_mux_close(ngx_http_fastcgi_mux_t *mux)
+{
+    if (mux->error && mux->busy == 0) {
+        ngx_destroy_pool(mux->pool);
+    }
+}
+
+
+static ssize_t
+ngx_http_fastcgi_mux_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                          n;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl;
+    ngx_http_fastcgi_mux_t         *mux;
+    ngx_http_fastcgi_mux_stream_t  *st;
+
+    st = (ngx_http_fastcgi_mux_stream_t *) c;
+    mux = st->mux;
+    cl = st->in;
+    b = cl->buf;
+
+    n = b->last - b->pos;
+
+    if (n) {
+        n = ngx_min(n, size);
+
+        buf = ngx_cpymem(buf, b->pos, n);
+        b->pos += n;
+
+        if (cl->next == NULL) {
+            b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+            b->pos = b->start;
+
+        } else if (b->pos == b->last) {
+            st->in = cl->next;
+            cl->next = mux->free;
+            mux->free = cl;
+            st->nbufs--;
+        }
+
+        b = st->in->buf;
+
+        c->read->ready = (b->pos < b->last);
+
+        if (mux->blocked == st) {
+            mux->blocked = NULL;
+            ngx_post_event(mux->connection->read, &ngx_posted_events);
+        }
+
+        return n;
+    }
+
+    c->read->ready = 0;
+
+    if (mux->error) {
+        c->read->eof = 1;
+        return 0;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_fastcgi_mux_recv_chain(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+
+        size = cl->buf->end - cl->buf->last;
+
+        if (limit && (off_t) size > limit - total) {
+            size = (size_t) (limit - total);
+        }
+
+        if (size == 0) {
+            break;
+        }
+
+        n = ngx_http_fastcgi_mux_recv(c, cl->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size || (limit && total >= limit)) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_fastcgi_mux_send_buf(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_buf_t    b;
+    ngx_chain_t  cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.temporary = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_http_fastcgi_mux_send_chain(c, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_fastcgi_mux_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    off_t                           sent;
+    size_t                          size, n;
+    ngx_chain_t                    *cl;
+    ngx_http_fastcgi_mux_t         *mux;
+    ngx_http_fastcgi_mux_stream_t  *st;
+
+    st = (ngx_http_fastcgi_mux_stream_t *) c;
+    mux = st->mux;
+
+    if (mux->error) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_OFF_T_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_OFF_T_VALUE - ngx_pagesize;
+    }
+
+    sent = 0;
+
+    for (cl = in; cl && sent < limit; cl = cl->next) {
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(cl->buf)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "fastcgi mux: buffer is not in memory");
+            return NGX_CHAIN_ERROR;
+        }
+
+        size = cl->buf->last - cl->buf->pos;
+
+        if ((off_t) size > limit - sent) {
+            size = (size_t) (limit - sent);
+        }
+
+        n = ngx_http_fastcgi_mux_write(st, cl->buf->pos, size);
+
+        sent += n;
+
+        if (n < size) {
+            st->wait = 1;
+            c->write->ready = 0;
+            break;
+        }
+    }
+
+    c->sent += sent;
+
+    in = ngx_chain_update_sent(in, sent);
+
+    if (sent) {
+        ngx_http_fastcgi_mux_send(mux);
+    }
+
+    return in;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_fastcgi_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_fastcgi_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_fastcgi_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fastcgi_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+#if (NGX_HTTP_CACHE)
+    if (ngx_array_init(&conf->caches, cf->pool, 4,
+                       sizeof(ngx_http_file_cache_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+#endif
+
+    ngx_queue_init(&conf->muxes);
+
+    return conf;
+}
+
+
+static void *
+ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_fastcgi_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fastcgi_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream.bufs.num = 0;
+     *     conf->upstream.ignore_headers = 0;
+     *     conf->upstream.next_upstream = 0;
+     *     conf->upstream.cache_zone = NULL;
+     *     conf->upstream.cache_use_stale = 0;
+     *     conf->upstream.cache_methods = 0;
+     *     conf->upstream.temp_path = NULL;
+     *     conf->upstream.hide_headers_hash = { NULL, 0 };
+     *     conf->upstream.uri = { 0, NULL };
+     *     conf->upstream.location = NULL;
+     *     conf->upstream.store_lengths = NULL;
+     *     conf->upstream.store_values = NULL;
+     *
+     *     conf->index.len = { 0, NULL };
+     */
+
+    conf->upstream.store = NGX_CONF_UNSET;
+    conf->upstream.store_access = NGX_CONF_UNSET_UINT;
+    conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
+    conf->upstream.buffering = NGX_CONF_UNSET;
+    conf->upstream.request_buffering = NGX_CONF_UNSET;
+    conf->upstream.ignore_client_abort = NGX_CONF_UNSET;
+    conf->upstream.force_ranges = NGX_CONF_UNSET;
+
+    conf->upstream.local = NGX_CONF_UNSET_PTR;
+
+    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+
+    conf->upstream.send_lowat = NGX_CONF_UNSET_SIZE;
+    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->upstream.limit_rate = NGX_CONF_UNSET_SIZE;
+
+    conf->upstream.busy_buffers_size_conf = NGX_CONF_UNSET_SIZE;
+    conf->upstream.max_temp_file_size_conf = NGX_CONF_UNSET_SIZE;
+    conf->upstream.temp_file_write_size_conf = NGX_CONF_UNSET_SIZE;
+
+    conf->upstream.pass_request_headers = NGX_CONF_UNSET;
+    conf->upstream.pass_request_body = NGX_CONF_UNSET;
+
+#if (NGX_HTTP_CACHE)
+    conf->upstream.cache = NGX_CONF_UNSET;
+    conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
+    conf->upstream.cache_max_range_offset = NGX_CONF_UNSET;
+    conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_purge = NGX_CONF_UNSET_PTR;
+    conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_lock = NGX_CONF_UNSET;
+    conf->upstream.cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.cache_lock_age = NGX_CONF_UNSET_MSEC;
+    conf->upstream.cache_revalidate = NGX_CONF_UNSET;
+#endif
+
+    conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
+    conf->upstream.pass_headers = NGX_CONF_UNSET_PTR;
+
+    conf->upstream.intercept_errors = NGX_CONF_UNSET;
+
+    /* "fastcgi_cyclic_temp_file" is disabled */
+    conf->upstream.cyclic_temp_file = 0;
+
+    conf->upstream.change_buffering = 1;
+
+    conf->catch_stderr = NGX_CONF_UNSET_PTR;
+
+    conf->keep_conn = NGX_CONF_UNSET;
+
+    conf->multiplex = NGX_CONF_UNSET_UINT;
+    conf->multiplex_requests = NGX_CONF_UNSET_UINT;
+
+    ngx_str_set(&conf->upstream.module, "fastcgi");
+
+    return conf;
+}
+
+
+static char *
+ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_fastcgi_loc_conf_t *prev = parent;
+    ngx_http_fastcgi_loc_conf_t *conf = child;
+
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_hash_init_t               hash;
+    ngx_http_core_loc_conf_t     *clcf;
+
+#if (NGX_HTTP_CACHE)
+
+    if (conf->upstream.store > 0) {
+        conf->upstream.cache = 0;
+    }
+
+    if (conf->upstream.cache > 0) {
+        conf->upstream.store = 0;
+    }
+
+#endif
+
+    if (conf->upstream.store == NGX_CONF_UNSET) {
+        ngx_conf_merge_value(conf->upstream.store,
+                              prev->upstream.store, 0);
+
+        conf->upstream.store_lengths = prev->upstream.store_lengths;
+        conf->upstream.store_values = prev->upstream.store_values;
+    }
+
+    ngx_conf_merge_uint_value(conf->upstream.store_access,
+                              prev->upstream.store_access, 0600);
+
+    ngx_conf_merge_uint_value(conf->upstream.next_upstream_tries,
+                              prev->upstream.next_upstream_tries, 0);
+
+    ngx_conf_merge_value(conf->upstream.buffering,
+                              prev->upstream.buffering, 1);
+
+    ngx_conf_merge_value(conf->upstream.request_buffering,
+                              prev->upstream.request_buffering, 1);
+
+    ngx_conf_merge_value(conf->upstream.ignore_client_abort,
+                              prev->upstream.ignore_client_abort, 0);
+
+    ngx_conf_merge_value(conf->upstream.force_ranges,
+                              prev->upstream.force_ranges, 0);
+
+    ngx_conf_merge_ptr_value(conf->upstream.local,
+                              prev->upstream.local, NULL);
+
+    ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
+                              prev->upstream.connect_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.send_timeout,
+                              prev->upstream.send_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.read_timeout,
+                              prev->upstream.read_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.next_upstream_timeout,
+                              prev->upstream.next_upstream_timeout, 0);
+
+    ngx_conf_merge_size_value(conf->upstream.send_lowat,
+                              prev->upstream.send_lowat, 0);
+
+    ngx_conf_merge_size_value(conf->upstream.buffer_size,
+                              prev->upstream.buffer_size,
+                              (size_t) ngx_pagesize);
+
+    ngx_conf_merge_size_value(conf->upstream.limit_rate,
+                              prev->upstream.limit_rate, 0);
 
 
     ngx_conf_merge_bufs_value(conf->upstream.bufs, prev->upstream.bufs,
@@ -3034,6 +4492,9 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->upstream.cache_bypass,
                              prev->upstream.cache_bypass, NULL);
 
+    ngx_conf_merge_ptr_value(conf->upstream.cache_purge,
+                             prev->upstream.cache_purge, NULL);
+
     ngx_conf_merge_ptr_value(conf->upstream.no_cache,
                              prev->upstream.no_cache, NULL);
 
@@ -3075,6 +4536,22 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->keep_conn, prev->keep_conn, 0);
 
+    ngx_conf_merge_uint_value(conf->multiplex, prev->multiplex, 0);
+    ngx_conf_merge_uint_value(conf->multiplex_requests,
+                              prev->multiplex_requests, 32);
+
+    if (conf->multiplex_requests == 0
+        || conf->multiplex_requests > 0xffff)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fastcgi_multiplex_requests\" must be "
+                           "between 1 and 65535");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->multiplex) {
+        conf->keep_conn = 1;
+    }
 
     ngx_conf_merge_str_value(conf->index, prev->index, "");
 
@@ -3316,6 +4793,7 @@ ngx_http_fastcgi_init_params(ngx_conf_t *cf, ngx_http_fastcgi_loc_conf_t *conf,
         sc.flushes = &params->flushes;
         sc.lengths = &params->lengths;
         sc.values = &params->values;
+        sc.flat = 1;
 
         if (ngx_http_script_compile(&sc) != NGX_OK) {
             return NGX_ERROR;
@@ -3656,6 +5134,56 @@ ngx_http_fastcgi_store(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_fastcgi_multiplex(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fastcgi_loc_conf_t *flcf = conf;
+
+    ngx_int_t          n;
+    ngx_str_t         *value;
+    ngx_event_conf_t  *ecf;
+
+    if (flcf->multiplex != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        flcf->multiplex = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the stream events are never added, see ngx_handle_read_event() */
+
+    if (ngx_get_conf(cf->cycle->conf_ctx, ngx_events_module)) {
+        ecf = ngx_event_get_conf(cf->cycle->conf_ctx, ngx_event_core_module);
+
+        if (ngx_strcmp(ecf->name, "epoll") != 0
+            && ngx_strcmp(ecf->name, "kqueue") != 0
+            && ngx_strcmp(ecf->name, "uring") != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"fastcgi_multiplex\" is not supported "
+                               "with the \"%s\" event method", ecf->name);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    flcf->multiplex = n;
+
+    return NGX_CONF_OK;
+}
+
+
 #if (NGX_HTTP_CACHE)
 
 static char *
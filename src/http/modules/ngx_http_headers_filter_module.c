@@ -48,6 +48,7 @@ typedef struct {
     time_t                     expires_time;
     ngx_http_complex_value_t  *expires_value;
     ngx_array_t               *headers;
+    ngx_uint_t                 lines;  /* unsigned  lines:1 */
 } ngx_http_headers_conf_t;
 
 
@@ -67,6 +68,8 @@ static ngx_int_t ngx_http_set_response_header(ngx_http_request_t *r,
 static void *ngx_http_headers_create_conf(ngx_conf_t *cf);
 static char *ngx_http_headers_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
+static ngx_int_t ngx_http_headers_lines(ngx_conf_t *cf,
+    ngx_http_headers_conf_t *conf);
 static ngx_int_t ngx_http_headers_filter_init(ngx_conf_t *cf);
 static char *ngx_http_headers_expires(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -557,6 +560,7 @@ ngx_http_headers_create_conf(ngx_conf_t *cf)
      *     conf->headers = NULL;
      *     conf->expires_time = 0;
      *     conf->expires_value = NULL;
+     *     conf->lines = 0;
      */
 
     conf->expires = NGX_HTTP_EXPIRES_UNSET;
@@ -581,14 +585,84 @@ ngx_http_headers_merge_conf(ngx_conf_t *cf, void *parent, void *child)
         }
     }
 
+    if (ngx_http_headers_lines(cf, prev) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     if (conf->headers == NULL) {
         conf->headers = prev->headers;
+        conf->lines = prev->lines;
+    }
+
+    if (ngx_http_headers_lines(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_headers_lines(ngx_conf_t *cf, ngx_http_headers_conf_t *conf)
+{
+    u_char                 *p;
+    size_t                  len;
+    ngx_uint_t              i;
+    ngx_http_header_val_t  *hv;
+
+    if (conf->headers == NULL || conf->lines) {
+        return NGX_OK;
+    }
+
+    conf->lines = 1;
+
+    /*
+     * the keys and the constant values of the headers are placed
+     * one after another as the "key: value" CRLF header lines,
+     * so the header filter is able to copy adjacent lines at once
+     */
+
+    hv = conf->headers->elts;
+    len = 0;
+
+    for (i = 0; i < conf->headers->nelts; i++) {
+        if (hv[i].value.lengths == NULL && hv[i].value.value.len) {
+            len += hv[i].key.len + sizeof(": ") - 1
+                   + hv[i].value.value.len + sizeof(CRLF) - 1;
+        }
+    }
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < conf->headers->nelts; i++) {
+        if (hv[i].value.lengths || hv[i].value.value.len == 0) {
+            continue;
+        }
+
+        ngx_memcpy(p, hv[i].key.data, hv[i].key.len);
+        hv[i].key.data = p;
+        p += hv[i].key.len;
+
+        *p++ = ':'; *p++ = ' ';
+
+        ngx_memcpy(p, hv[i].value.value.data, hv[i].value.value.len);
+        hv[i].value.value.data = p;
+        p += hv[i].value.value.len;
+
+        *p++ = CR; *p++ = LF;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_headers_filter_init(ngx_conf_t *cf)
 {
@@ -10,20 +10,121 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_STUB_STATUS_TEXT        0
+#define NGX_HTTP_STUB_STATUS_JSON        1
+#define NGX_HTTP_STUB_STATUS_PROMETHEUS  2
+
+
+#define NGX_HTTP_STUB_STATUS_SERVER      0
+#define NGX_HTTP_STUB_STATUS_LOCATION    1
+#define NGX_HTTP_STUB_STATUS_UPSTREAM    2
+
+
+#define NGX_HTTP_STUB_STATUS_BUCKETS     12
+
+
+/*
+ * the counters are only written by the worker process they belong to,
+ * and read by any of them, see ngx_http_stub_status_read()
+ */
+
+typedef struct {
+    uint64_t                  requests;
+    uint64_t                  responses[5];
+    uint64_t                  received;
+    uint64_t                  sent;
+    uint64_t                  time;
+    uint64_t                  buckets[NGX_HTTP_STUB_STATUS_BUCKETS];
+} ngx_http_stub_status_counters_t;
+
+
+typedef struct {
+    ngx_str_t                 name;
+    ngx_uint_t                type;
+} ngx_http_stub_status_zone_t;
+
+
+typedef struct {
+    ngx_str_t                 name;
+    ngx_atomic_uint_t         value[5];
+} ngx_http_stub_status_shm_t;
+
+
+typedef struct {
+    ngx_array_t               zones;   /* ngx_http_stub_status_zone_t */
+
+    ngx_shm_t                 shm;
+    ngx_uint_t                workers;
+    size_t                    size;
+
+    ngx_uint_t                metrics;   /* unsigned  metrics:1; */
+} ngx_http_stub_status_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                zone;
+} ngx_http_stub_status_srv_conf_t;
+
+
+typedef struct {
+    ngx_flag_t                zones;
+    ngx_flag_t                caches;
+    ngx_uint_t                format;
+    ngx_uint_t                zone;
+} ngx_http_stub_status_loc_conf_t;
+
+
 static ngx_int_t ngx_http_stub_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_stub_status_metrics_handler(ngx_http_request_t *r,
+    ngx_http_stub_status_loc_conf_t *sscf);
+static ngx_int_t ngx_http_stub_status_shm_zones(ngx_http_request_t *r,
+    ngx_array_t *a, ngx_uint_t caches);
+static ngx_int_t ngx_http_stub_status_escape(ngx_pool_t *pool, ngx_str_t *src,
+    ngx_str_t *dst);
+static ngx_inline uint64_t ngx_http_stub_status_read(uint64_t *v);
+static u_char *ngx_http_stub_status_json(u_char *p,
+    ngx_http_stub_status_main_conf_t *smcf,
+    ngx_http_stub_status_counters_t *sum, ngx_str_t *names,
+    ngx_array_t *shm);
+static u_char *ngx_http_stub_status_prometheus(u_char *p,
+    ngx_http_stub_status_main_conf_t *smcf,
+    ngx_http_stub_status_counters_t *sum, ngx_str_t *names,
+    ngx_array_t *shm);
+static ngx_int_t ngx_http_stub_status_log_handler(ngx_http_request_t *r);
+static void ngx_http_stub_status_count(ngx_http_stub_status_counters_t *sc,
+    ngx_uint_t status, ngx_msec_t ms, off_t received, off_t sent);
 static ngx_int_t ngx_http_stub_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_stub_status_add_variables(ngx_conf_t *cf);
+static void *ngx_http_stub_status_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_stub_status_create_srv_conf(ngx_conf_t *cf);
+static void *ngx_http_stub_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_stub_status_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
 static char *ngx_http_set_stub_status(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_stub_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_stub_status_add_zone(ngx_conf_t *cf,
+    ngx_str_t *name, ngx_uint_t type);
+static ngx_int_t ngx_http_stub_status_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_stub_status_init_module(ngx_cycle_t *cycle);
+static void ngx_http_stub_status_cleanup(void *data);
 
 
 static ngx_command_t  ngx_http_status_commands[] = {
 
     { ngx_string("stub_status"),
-      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE123,
       ngx_http_set_stub_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
+      NULL },
+
+    { ngx_string("status_zone"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_stub_status_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
@@ -33,16 +134,16 @@ static ngx_command_t  ngx_http_status_commands[] = {
 
 static ngx_http_module_t  ngx_http_stub_status_module_ctx = {
     ngx_http_stub_status_add_variables,    /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_stub_status_init,             /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_stub_status_create_main_conf, /* create main configuration */
     NULL,                                  /* init main configuration */
 
-    NULL,                                  /* create server configuration */
+    ngx_http_stub_status_create_srv_conf,  /* create server configuration */
     NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL                                   /* merge location configuration */
+    ngx_http_stub_status_create_loc_conf,  /* create location configuration */
+    ngx_http_stub_status_merge_loc_conf    /* merge location configuration */
 };
 
 
@@ -52,7 +153,7 @@ ngx_module_t  ngx_http_stub_status_module = {
     ngx_http_status_commands,              /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
+    ngx_http_stub_status_init_module,      /* init module */
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
@@ -80,14 +181,85 @@ static ngx_http_variable_t  ngx_http_stub_status_vars[] = {
 };
 
 
+/* the default buckets of Prometheus client libraries */
+
+static ngx_msec_t  ngx_http_stub_status_bounds[] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static char  *ngx_http_stub_status_le[] = {
+    "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5",
+    "10", "+Inf"
+};
+
+
+static char  *ngx_http_stub_status_sections[] = {
+    "server_zones", "location_zones", "upstreams"
+};
+
+static char  *ngx_http_stub_status_families[] = {
+    "nginx_server_zone", "nginx_location_zone", "nginx_upstream"
+};
+
+
+/* the "zones" and "caches" parameters */
+
+static char  *ngx_http_stub_status_shm_sections[] = {
+    "shared_zones", "caches"
+};
+
+static char  *ngx_http_stub_status_shm_families[] = {
+    "nginx_shared_zone", "nginx_cache"
+};
+
+static char  *ngx_http_stub_status_shm_labels[] = {
+    "zone", "cache"
+};
+
+static char  *ngx_http_stub_status_shm_values[][5] = {
+    { "locks", "contended", "slab_locks", "slab_contended", "slab_spins" },
+    { "hits", "misses", "rejected", "evicted", "ram_hits" }
+};
+
+
+static char  ngx_http_stub_status_json_head[] =
+    "{\"connections\":{\"active\":%uA,\"reading\":%uA,\"writing\":%uA,"
+    "\"waiting\":%uA,\"accepted\":%uA,\"handled\":%uA},\"requests\":%uA";
+
+static char  ngx_http_stub_status_prometheus_head[] =
+    "# TYPE nginx_connections_active gauge\n"
+    "nginx_connections_active %uA\n"
+    "# TYPE nginx_connections_reading gauge\n"
+    "nginx_connections_reading %uA\n"
+    "# TYPE nginx_connections_writing gauge\n"
+    "nginx_connections_writing %uA\n"
+    "# TYPE nginx_connections_waiting gauge\n"
+    "nginx_connections_waiting %uA\n"
+    "# TYPE nginx_connections_accepted_total counter\n"
+    "nginx_connections_accepted_total %uA\n"
+    "# TYPE nginx_connections_handled_total counter\n"
+    "nginx_connections_handled_total %uA\n"
+    "# TYPE nginx_http_requests_total counter\n"
+    "nginx_http_requests_total %uA\n";
+
+
 static ngx_int_t
 ngx_http_stub_status_handler(ngx_http_request_t *r)
 {
-    size_t             size;
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
+    size_t                            size;
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_uint_t                        i;
+    ngx_chain_t                       out;
+    ngx_list_part_t                  *part;
+    ngx_shm_zone_t                   *shm_zone;
+    ngx_slab_pool_t                  *sp;
+    ngx_slab_lock_t                   slab;
+    ngx_atomic_int_t                  ap, hn, ac, rq, rd, wr, wa;
+    ngx_http_stub_status_loc_conf_t  *sscf;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_t            *cache;
+#endif
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
         return NGX_HTTP_NOT_ALLOWED;
@@ -99,6 +271,12 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
         return rc;
     }
 
+    sscf = ngx_http_get_module_loc_conf(r, ngx_http_stub_status_module);
+
+    if (sscf->format != NGX_HTTP_STUB_STATUS_TEXT) {
+        return ngx_http_stub_status_metrics_handler(r, sscf);
+    }
+
     r->headers_out.content_type_len = sizeof("text/plain") - 1;
     ngx_str_set(&r->headers_out.content_type, "text/plain");
     r->headers_out.content_type_lowcase = NULL;
@@ -118,6 +296,56 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
            + 6 + 3 * NGX_ATOMIC_T_LEN
            + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN;
 
+    if (sscf->zones) {
+        size += sizeof("zone locks contended slab_locks slab_contended slab_spins\n") - 1;
+
+        part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+        shm_zone = part->elts;
+
+        for (i = 0; /* void */ ; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+                part = part->next;
+                shm_zone = part->elts;
+                i = 0;
+            }
+
+            size += shm_zone[i].shm.name.len + 8 + 5 * NGX_ATOMIC_T_LEN;
+        }
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (sscf->caches) {
+        size += sizeof("cache hits misses rejected evicted ram_hits\n") - 1;
+
+        part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+        shm_zone = part->elts;
+
+        for (i = 0; /* void */ ; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+                part = part->next;
+                shm_zone = part->elts;
+                i = 0;
+            }
+
+            if (shm_zone[i].init != ngx_http_file_cache_init) {
+                continue;
+            }
+
+            size += shm_zone[i].shm.name.len + 8 + 5 * NGX_ATOMIC_T_LEN;
+        }
+    }
+
+#endif
+
     b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -144,6 +372,81 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+    if (sscf->zones) {
+        b->last = ngx_cpymem(b->last, "zone locks contended slab_locks slab_contended slab_spins\n",
+                             sizeof("zone locks contended slab_locks slab_contended slab_spins\n") - 1);
+
+        part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+        shm_zone = part->elts;
+
+        for (i = 0; /* void */ ; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+                part = part->next;
+                shm_zone = part->elts;
+                i = 0;
+            }
+
+            sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+            if (sp == NULL) {
+                continue;
+            }
+
+            ngx_slab_lock_stats(sp, &slab);
+
+            b->last = ngx_sprintf(b->last, " %V %uA %uA %uA %uA %uA \n",
+                                  &shm_zone[i].shm.name,
+                                  sp->lock.locks, sp->lock.contended,
+                                  slab.locks, slab.contended, slab.spins);
+        }
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (sscf->caches) {
+        b->last = ngx_cpymem(b->last,
+                             "cache hits misses rejected evicted ram_hits\n",
+                             sizeof("cache hits misses rejected evicted "
+                                    "ram_hits\n") - 1);
+
+        part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+        shm_zone = part->elts;
+
+        for (i = 0; /* void */ ; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+                part = part->next;
+                shm_zone = part->elts;
+                i = 0;
+            }
+
+            if (shm_zone[i].init != ngx_http_file_cache_init) {
+                continue;
+            }
+
+            cache = shm_zone[i].data;
+
+            if (cache->sh == NULL) {
+                continue;
+            }
+
+            b->last = ngx_sprintf(b->last, " %V %uA %uA %uA %uA %uA \n",
+                                  &shm_zone[i].shm.name,
+                                  cache->sh->hits, cache->sh->misses,
+                                  cache->sh->rejected, cache->sh->evicted,
+                                  cache->sh->ram_hits);
+        }
+    }
+
+#endif
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
@@ -160,6 +463,656 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_stub_status_metrics_handler(ngx_http_request_t *r,
+    ngx_http_stub_status_loc_conf_t *sscf)
+{
+    size_t                             size;
+    uint64_t                          *s, *v;
+    ngx_int_t                          rc;
+    ngx_buf_t                         *b;
+    ngx_str_t                         *names;
+    ngx_uint_t                         i, j, w, n;
+    ngx_array_t                        shm[2];
+    ngx_chain_t                        out;
+    ngx_http_stub_status_zone_t       *zone;
+    ngx_http_stub_status_shm_t        *sz;
+    ngx_http_stub_status_counters_t   *sum, *counters;
+    ngx_http_stub_status_main_conf_t  *smcf;
+
+    if (sscf->format == NGX_HTTP_STUB_STATUS_JSON) {
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        r->headers_out.content_type_len = sizeof("text/plain") - 1;
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+    }
+
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_stub_status_module);
+
+    zone = smcf->zones.elts;
+    n = smcf->zones.nelts;
+
+    sum = ngx_pcalloc(r->pool, n * sizeof(ngx_http_stub_status_counters_t));
+    if (sum == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    names = ngx_palloc(r->pool, n * sizeof(ngx_str_t));
+    if (names == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    size = sizeof(ngx_http_stub_status_prometheus_head) + 7 * NGX_ATOMIC_T_LEN
+           + 3 * 6 * sizeof("# TYPE nginx_location_zone_request_time_seconds "
+                            "histogram\n");
+
+    for (i = 0; i < n; i++) {
+
+        if (ngx_http_stub_status_escape(r->pool, &zone[i].name, &names[i])
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* Prometheus lines of a zone, JSON is shorter */
+
+        size += (NGX_HTTP_STUB_STATUS_BUCKETS + 10)
+                * (sizeof("nginx_location_zone_request_time_seconds_bucket"
+                          "{zone=\"\",le=\"0.005\"} \n")
+                   + names[i].len + NGX_INT64_LEN);
+
+        /* the counters of all worker processes are summed up on read */
+
+        s = (uint64_t *) &sum[i];
+
+        for (w = 0; w < smcf->workers; w++) {
+            counters = (ngx_http_stub_status_counters_t *)
+                           ((u_char *) smcf->shm.addr + w * smcf->size);
+            v = (uint64_t *) &counters[i];
+
+            for (j = 0; j < sizeof(ngx_http_stub_status_counters_t)
+                            / sizeof(uint64_t); j++)
+            {
+                s[j] += ngx_http_stub_status_read(&v[j]);
+            }
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+
+        if (ngx_array_init(&shm[i], r->pool, 4,
+                           sizeof(ngx_http_stub_status_shm_t))
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (!(i ? sscf->caches : sscf->zones)) {
+            continue;
+        }
+
+        if (ngx_http_stub_status_shm_zones(r, &shm[i], i) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        size += 5 * sizeof("# TYPE nginx_shared_zone_slab_contended_total "
+                           "counter\n");
+
+        sz = shm[i].elts;
+
+        for (j = 0; j < shm[i].nelts; j++) {
+            size += 5 * (sizeof("nginx_shared_zone_slab_contended_total"
+                                "{zone=\"\"} \n")
+                         + sz[j].name.len + NGX_ATOMIC_T_LEN);
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    if (sscf->format == NGX_HTTP_STUB_STATUS_JSON) {
+        b->last = ngx_http_stub_status_json(b->last, smcf, sum, names, shm);
+
+    } else {
+        b->last = ngx_http_stub_status_prometheus(b->last, smcf, sum, names,
+                                                  shm);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_stub_status_json(u_char *p, ngx_http_stub_status_main_conf_t *smcf,
+    ngx_http_stub_status_counters_t *sum, ngx_str_t *names, ngx_array_t *shm)
+{
+    char                             *sep, **values;
+    uint64_t                          n;
+    ngx_uint_t                        i, j, t;
+    ngx_http_stub_status_shm_t       *sz;
+    ngx_http_stub_status_zone_t      *zone;
+    ngx_http_stub_status_counters_t  *sc;
+
+    p = ngx_sprintf(p, ngx_http_stub_status_json_head,
+                    *ngx_stat_active, *ngx_stat_reading, *ngx_stat_writing,
+                    *ngx_stat_waiting, *ngx_stat_accepted, *ngx_stat_handled,
+                    *ngx_stat_requests);
+
+    zone = smcf->zones.elts;
+
+    for (t = NGX_HTTP_STUB_STATUS_SERVER;
+         t <= NGX_HTTP_STUB_STATUS_UPSTREAM;
+         t++)
+    {
+        p = ngx_sprintf(p, ",\"%s\":{", ngx_http_stub_status_sections[t]);
+
+        sep = "";
+
+        for (i = 0; i < smcf->zones.nelts; i++) {
+
+            if (zone[i].type != t) {
+                continue;
+            }
+
+            sc = &sum[i];
+
+            p = ngx_sprintf(p, "%s\"%V\":{\"requests\":%uL,\"responses\":{"
+                            "\"1xx\":%uL,\"2xx\":%uL,\"3xx\":%uL,\"4xx\":%uL,"
+                            "\"5xx\":%uL},\"received\":%uL,",
+                            sep, &names[i], sc->requests,
+                            sc->responses[0], sc->responses[1],
+                            sc->responses[2], sc->responses[3],
+                            sc->responses[4], sc->received);
+
+            if (t != NGX_HTTP_STUB_STATUS_UPSTREAM) {
+                p = ngx_sprintf(p, "\"sent\":%uL,", sc->sent);
+            }
+
+            p = ngx_sprintf(p, "\"%s\":{\"sum\":%uL,\"buckets\":{",
+                            t == NGX_HTTP_STUB_STATUS_UPSTREAM
+                            ? "response_time" : "request_time",
+                            sc->time);
+
+            n = 0;
+
+            for (j = 0; j < NGX_HTTP_STUB_STATUS_BUCKETS - 1; j++) {
+                n += sc->buckets[j];
+                p = ngx_sprintf(p, "\"%M\":%uL,",
+                                ngx_http_stub_status_bounds[j], n);
+            }
+
+            p = ngx_sprintf(p, "\"+Inf\":%uL}}}", n + sc->buckets[j]);
+
+            sep = ",";
+        }
+
+        *p++ = '}';
+    }
+
+    for (t = 0; t < 2; t++) {
+
+        if (shm[t].nelts == 0) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, ",\"%s\":{", ngx_http_stub_status_shm_sections[t]);
+
+        values = ngx_http_stub_status_shm_values[t];
+        sz = shm[t].elts;
+
+        for (i = 0; i < shm[t].nelts; i++) {
+            p = ngx_sprintf(p, "%s\"%V\":{\"%s\":%uA,\"%s\":%uA,\"%s\":%uA,"
+                            "\"%s\":%uA,\"%s\":%uA}",
+                            i ? "," : "", &sz[i].name,
+                            values[0], sz[i].value[0],
+                            values[1], sz[i].value[1],
+                            values[2], sz[i].value[2],
+                            values[3], sz[i].value[3],
+                            values[4], sz[i].value[4]);
+        }
+
+        *p++ = '}';
+    }
+
+    *p++ = '}';
+    *p++ = LF;
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_stub_status_prometheus(u_char *p,
+    ngx_http_stub_status_main_conf_t *smcf,
+    ngx_http_stub_status_counters_t *sum, ngx_str_t *names, ngx_array_t *shm)
+{
+    char                         *f, *l, *tm;
+    uint64_t                      n;
+    ngx_uint_t                    i, j, t, found;
+    ngx_http_stub_status_shm_t   *sz;
+    ngx_http_stub_status_zone_t  *zone;
+
+    p = ngx_sprintf(p, ngx_http_stub_status_prometheus_head,
+                    *ngx_stat_active, *ngx_stat_reading, *ngx_stat_writing,
+                    *ngx_stat_waiting, *ngx_stat_accepted, *ngx_stat_handled,
+                    *ngx_stat_requests);
+
+    zone = smcf->zones.elts;
+
+    /* samples of a metric family are grouped after its TYPE line */
+
+    for (t = NGX_HTTP_STUB_STATUS_SERVER;
+         t <= NGX_HTTP_STUB_STATUS_UPSTREAM;
+         t++)
+    {
+        found = 0;
+
+        for (i = 0; i < smcf->zones.nelts; i++) {
+            if (zone[i].type == t) {
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found) {
+            continue;
+        }
+
+        f = ngx_http_stub_status_families[t];
+
+        if (t == NGX_HTTP_STUB_STATUS_UPSTREAM) {
+            l = "upstream";
+            tm = "response_time";
+
+        } else {
+            l = "zone";
+            tm = "request_time";
+        }
+
+        p = ngx_sprintf(p, "# TYPE %s_requests_total counter\n", f);
+
+        for (i = 0; i < smcf->zones.nelts; i++) {
+            if (zone[i].type == t) {
+                p = ngx_sprintf(p, "%s_requests_total{%s=\"%V\"} %uL\n",
+                                f, l, &names[i], sum[i].requests);
+            }
+        }
+
+        p = ngx_sprintf(p, "# TYPE %s_responses_total counter\n", f);
+
+        for (i = 0; i < smcf->zones.nelts; i++) {
+            if (zone[i].type != t) {
+                continue;
+            }
+
+            for (j = 0; j < 5; j++) {
+                p = ngx_sprintf(p, "%s_responses_total"
+                                   "{%s=\"%V\",code=\"%uixx\"} %uL\n",
+                                f, l, &names[i], j + 1,
+                                sum[i].responses[j]);
+            }
+        }
+
+        p = ngx_sprintf(p, "# TYPE %s_received_bytes_total counter\n", f);
+
+        for (i = 0; i < smcf->zones.nelts; i++) {
+            if (zone[i].type == t) {
+                p = ngx_sprintf(p, "%s_received_bytes_total{%s=\"%V\"} %uL\n",
+                                f, l, &names[i], sum[i].received);
+            }
+        }
+
+        if (t != NGX_HTTP_STUB_STATUS_UPSTREAM) {
+            p = ngx_sprintf(p, "# TYPE %s_sent_bytes_total counter\n", f);
+
+            for (i = 0; i < smcf->zones.nelts; i++) {
+                if (zone[i].type == t) {
+                    p = ngx_sprintf(p, "%s_sent_bytes_total{%s=\"%V\"} %uL\n",
+                                    f, l, &names[i], sum[i].sent);
+                }
+            }
+        }
+
+        p = ngx_sprintf(p, "# TYPE %s_%s_seconds histogram\n", f, tm);
+
+        for (i = 0; i < smcf->zones.nelts; i++) {
+            if (zone[i].type != t) {
+                continue;
+            }
+
+            n = 0;
+
+            for (j = 0; j < NGX_HTTP_STUB_STATUS_BUCKETS; j++) {
+                n += sum[i].buckets[j];
+                p = ngx_sprintf(p, "%s_%s_seconds_bucket"
+                                   "{%s=\"%V\",le=\"%s\"} %uL\n",
+                                f, tm, l, &names[i],
+                                ngx_http_stub_status_le[j], n);
+            }
+
+            p = ngx_sprintf(p, "%s_%s_seconds_sum{%s=\"%V\"} %uL.%03uL\n"
+                               "%s_%s_seconds_count{%s=\"%V\"} %uL\n",
+                            f, tm, l, &names[i],
+                            sum[i].time / 1000, sum[i].time % 1000,
+                            f, tm, l, &names[i], n);
+        }
+    }
+
+    for (t = 0; t < 2; t++) {
+
+        if (shm[t].nelts == 0) {
+            continue;
+        }
+
+        f = ngx_http_stub_status_shm_families[t];
+        l = ngx_http_stub_status_shm_labels[t];
+        sz = shm[t].elts;
+
+        for (j = 0; j < 5; j++) {
+            tm = ngx_http_stub_status_shm_values[t][j];
+
+            p = ngx_sprintf(p, "# TYPE %s_%s_total counter\n", f, tm);
+
+            for (i = 0; i < shm[t].nelts; i++) {
+                p = ngx_sprintf(p, "%s_%s_total{%s=\"%V\"} %uA\n",
+                                f, tm, l, &sz[i].name, sz[i].value[j]);
+            }
+        }
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_stub_status_shm_zones(ngx_http_request_t *r, ngx_array_t *a,
+    ngx_uint_t caches)
+{
+    ngx_uint_t                   i;
+    ngx_list_part_t             *part;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_slab_pool_t             *sp;
+    ngx_slab_lock_t              slab;
+    ngx_http_stub_status_shm_t  *sz;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_t       *cache;
+#endif
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (caches) {
+#if (NGX_HTTP_CACHE)
+            if (shm_zone[i].init != ngx_http_file_cache_init) {
+                continue;
+            }
+
+            cache = shm_zone[i].data;
+
+            if (cache->sh == NULL) {
+                continue;
+            }
+
+            sz = ngx_array_push(a);
+            if (sz == NULL) {
+                return NGX_ERROR;
+            }
+
+            sz->value[0] = cache->sh->hits;
+            sz->value[1] = cache->sh->misses;
+            sz->value[2] = cache->sh->rejected;
+            sz->value[3] = cache->sh->evicted;
+            sz->value[4] = cache->sh->ram_hits;
+#else
+            return NGX_OK;
+#endif
+
+        } else {
+            sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+            if (sp == NULL) {
+                continue;
+            }
+
+            ngx_slab_lock_stats(sp, &slab);
+
+            sz = ngx_array_push(a);
+            if (sz == NULL) {
+                return NGX_ERROR;
+            }
+
+            sz->value[0] = sp->lock.locks;
+            sz->value[1] = sp->lock.contended;
+            sz->value[2] = slab.locks;
+            sz->value[3] = slab.contended;
+            sz->value[4] = slab.spins;
+        }
+
+        if (ngx_http_stub_status_escape(r->pool, &shm_zone[i].shm.name,
+                                        &sz->name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_stub_status_escape(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst)
+{
+    size_t  len;
+
+    /* the escaping of JSON strings is enough for Prometheus labels */
+
+    len = ngx_escape_json(NULL, src->data, src->len);
+
+    if (len == 0) {
+        *dst = *src;
+        return NGX_OK;
+    }
+
+    dst->data = ngx_pnalloc(pool, src->len + len);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst->len = (u_char *) ngx_escape_json(dst->data, src->data, src->len)
+               - dst->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_inline uint64_t
+ngx_http_stub_status_read(uint64_t *v)
+{
+#if (NGX_PTR_SIZE == 4)
+
+    uint64_t  n;
+
+    /*
+     * a 64-bit counter being incremented by another process
+     * may be read torn, so it is read until two reads agree
+     */
+
+    do {
+        n = *(volatile uint64_t *) v;
+    } while (n != *(volatile uint64_t *) v);
+
+    return n;
+
+#else
+
+    return *v;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_http_stub_status_log_handler(ngx_http_request_t *r)
+{
+    ngx_uint_t                         i, status;
+    ngx_time_t                        *tp;
+    ngx_msec_int_t                     ms;
+    ngx_http_upstream_t               *u;
+    ngx_http_upstream_state_t         *state;
+    ngx_http_stub_status_srv_conf_t   *sscf;
+    ngx_http_stub_status_loc_conf_t   *slcf;
+    ngx_http_stub_status_counters_t   *counters;
+    ngx_http_stub_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_stub_status_module);
+
+    /*
+     * the slot is updated by this worker process only,
+     * so there is no need in atomic operations
+     */
+
+    counters = (ngx_http_stub_status_counters_t *)
+                   ((u_char *) smcf->shm.addr + ngx_worker * smcf->size);
+
+    if (r == r->main) {
+        sscf = ngx_http_get_module_srv_conf(r, ngx_http_stub_status_module);
+        slcf = ngx_http_get_module_loc_conf(r, ngx_http_stub_status_module);
+
+        if (sscf->zone != NGX_CONF_UNSET_UINT
+            || slcf->zone != NGX_CONF_UNSET_UINT)
+        {
+            tp = ngx_timeofday();
+
+            ms = (ngx_msec_int_t) ((tp->sec - r->start_sec) * 1000
+                                   + (tp->msec - r->start_msec));
+            ms = ngx_max(ms, 0);
+
+            status = r->err_status ? r->err_status : r->headers_out.status;
+
+            if (sscf->zone != NGX_CONF_UNSET_UINT) {
+                ngx_http_stub_status_count(&counters[sscf->zone], status, ms,
+                                           r->request_length,
+                                           r->connection->sent);
+            }
+
+            if (slcf->zone != NGX_CONF_UNSET_UINT) {
+                ngx_http_stub_status_count(&counters[slcf->zone], status, ms,
+                                           r->request_length,
+                                           r->connection->sent);
+            }
+        }
+    }
+
+    u = r->upstream;
+
+    if (u == NULL
+        || u->upstream == NULL
+        || u->upstream->srv_conf == NULL
+        || r->upstream_states == NULL)
+    {
+        return NGX_OK;
+    }
+
+    sscf = ngx_http_conf_upstream_srv_conf(u->upstream,
+                                           ngx_http_stub_status_module);
+
+    if (sscf->zone == NGX_CONF_UNSET_UINT) {
+        return NGX_OK;
+    }
+
+    /*
+     * an empty state separates attempts made before an internal redirect,
+     * only the attempts after the last one belong to this upstream
+     */
+
+    state = r->upstream_states->elts;
+
+    for (i = r->upstream_states->nelts; i; i--) {
+        if (state[i - 1].peer == NULL) {
+            break;
+        }
+    }
+
+    for ( /* void */ ; i < r->upstream_states->nelts; i++) {
+        ngx_http_stub_status_count(&counters[sscf->zone], state[i].status,
+                                   state[i].response_time,
+                                   state[i].bytes_received, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_stub_status_count(ngx_http_stub_status_counters_t *sc,
+    ngx_uint_t status, ngx_msec_t ms, off_t received, off_t sent)
+{
+    ngx_uint_t  i;
+
+    sc->requests++;
+
+    if (status >= 100 && status < 600) {
+        sc->responses[status / 100 - 1]++;
+    }
+
+    sc->received += received;
+    sc->sent += sent;
+    sc->time += ms;
+
+    for (i = 0; i < NGX_HTTP_STUB_STATUS_BUCKETS - 1; i++) {
+        if (ms <= ngx_http_stub_status_bounds[i]) {
+            break;
+        }
+    }
+
+    sc->buckets[i]++;
+}
+
+
 static ngx_int_t
 ngx_http_stub_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -224,13 +1177,328 @@ ngx_http_stub_status_add_variables(ngx_conf_t *cf)
 }
 
 
+static void *
+ngx_http_stub_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_stub_status_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_stub_status_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->shm = { 0 };
+     *     smcf->workers = 0;
+     *     smcf->size = 0;
+     *     smcf->metrics = 0;
+     */
+
+    if (ngx_array_init(&smcf->zones, cf->pool, 4,
+                       sizeof(ngx_http_stub_status_zone_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return smcf;
+}
+
+
+static void *
+ngx_http_stub_status_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_stub_status_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_stub_status_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static void *
+ngx_http_stub_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_stub_status_loc_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_stub_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->zones = NGX_CONF_UNSET;
+    conf->caches = NGX_CONF_UNSET;
+    conf->format = NGX_CONF_UNSET_UINT;
+    conf->zone = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_stub_status_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_stub_status_loc_conf_t *prev = parent;
+    ngx_http_stub_status_loc_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->zones, prev->zones, 0);
+    ngx_conf_merge_value(conf->caches, prev->caches, 0);
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              NGX_HTTP_STUB_STATUS_TEXT);
+    ngx_conf_merge_uint_value(conf->zone, prev->zone, NGX_CONF_UNSET_UINT);
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_set_stub_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_stub_status_loc_conf_t *sscf = conf;
+
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_http_core_loc_conf_t          *clcf;
+    ngx_http_stub_status_main_conf_t  *smcf;
 
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
     clcf->handler = ngx_http_stub_status_handler;
 
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "zones") == 0) {
+            sscf->zones = 1;
+
+        } else if (ngx_strcmp(value[i].data, "caches") == 0) {
+            sscf->caches = 1;
+
+        } else if (ngx_strcmp(value[i].data, "format=text") == 0) {
+            sscf->format = NGX_HTTP_STUB_STATUS_TEXT;
+
+        } else if (ngx_strcmp(value[i].data, "format=json") == 0) {
+            sscf->format = NGX_HTTP_STUB_STATUS_JSON;
+
+        } else if (ngx_strcmp(value[i].data, "format=prometheus") == 0) {
+            sscf->format = NGX_HTTP_STUB_STATUS_PROMETHEUS;
+
+        } else if (ngx_strncmp(value[i].data, "format=", 7) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid format \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (sscf->format != NGX_CONF_UNSET_UINT
+        && sscf->format != NGX_HTTP_STUB_STATUS_TEXT)
+    {
+        smcf = ngx_http_conf_get_module_main_conf(cf,
+                                                  ngx_http_stub_status_module);
+        smcf->metrics = 1;
+    }
+
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_stub_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_stub_status_loc_conf_t *slcf = conf;
+
+    ngx_int_t                         index;
+    ngx_str_t                        *value;
+    ngx_uint_t                       *zone, type;
+    ngx_http_stub_status_srv_conf_t  *sscf;
+
+    if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
+        sscf = ngx_http_conf_get_module_srv_conf(cf,
+                                                 ngx_http_stub_status_module);
+        zone = &sscf->zone;
+        type = NGX_HTTP_STUB_STATUS_SERVER;
+
+    } else {
+        zone = &slcf->zone;
+        type = NGX_HTTP_STUB_STATUS_LOCATION;
+    }
+
+    if (*zone != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    index = ngx_http_stub_status_add_zone(cf, &value[1], type);
+    if (index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = index;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_stub_status_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_uint_t type)
+{
+    ngx_uint_t                         i;
+    ngx_http_stub_status_zone_t       *zone;
+    ngx_http_stub_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stub_status_module);
+
+    zone = smcf->zones.elts;
+
+    for (i = 0; i < smcf->zones.nelts; i++) {
+        if (zone[i].type == type
+            && zone[i].name.len == name->len
+            && ngx_strncmp(zone[i].name.data, name->data, name->len) == 0)
+        {
+            return i;
+        }
+    }
+
+    zone = ngx_array_push(&smcf->zones);
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->name = *name;
+    zone->type = type;
+
+    return i;
+}
+
+
+static ngx_int_t
+ngx_http_stub_status_init(ngx_conf_t *cf)
+{
+    ngx_int_t                          index;
+    ngx_uint_t                         i;
+    ngx_http_handler_pt               *h;
+    ngx_http_core_main_conf_t         *cmcf;
+    ngx_http_upstream_srv_conf_t     **uscfp;
+    ngx_http_upstream_main_conf_t     *umcf;
+    ngx_http_stub_status_srv_conf_t   *sscf;
+    ngx_http_stub_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stub_status_module);
+
+    if (smcf->metrics) {
+
+        /* upstream{} blocks are counted once the metrics are shown */
+
+        umcf = ngx_http_conf_get_module_main_conf(cf,
+                                                  ngx_http_upstream_module);
+        uscfp = umcf->upstreams.elts;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+            if (uscfp[i]->srv_conf == NULL) {
+                /* implicit upstream */
+                continue;
+            }
+
+            index = ngx_http_stub_status_add_zone(cf, &uscfp[i]->host,
+                                              NGX_HTTP_STUB_STATUS_UPSTREAM);
+            if (index == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            sscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_stub_status_module);
+            sscf->zone = index;
+        }
+    }
+
+    if (smcf->zones.nelts == 0) {
+        return NGX_OK;
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_stub_status_log_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_stub_status_init_module(ngx_cycle_t *cycle)
+{
+    ngx_core_conf_t                   *ccf;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_stub_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_stub_status_module);
+
+    if (smcf == NULL || smcf->zones.nelts == 0) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    /*
+     * each worker process has its own slot with counters of all zones,
+     * slots are aligned to 128 bytes to never share cache lines
+     */
+
+    smcf->workers = ccf->master ? ccf->worker_processes : 1;
+    smcf->size = ngx_align(smcf->zones.nelts
+                           * sizeof(ngx_http_stub_status_counters_t), 128);
+
+    smcf->shm.size = smcf->workers * smcf->size;
+    ngx_str_set(&smcf->shm.name, "stub_status_zone");
+    smcf->shm.log = cycle->log;
+
+    if (ngx_shm_alloc(&smcf->shm) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        ngx_shm_free(&smcf->shm);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_stub_status_cleanup;
+    cln->data = &smcf->shm;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_stub_status_cleanup(void *data)
+{
+    ngx_shm_t  *shm = data;
+
+    ngx_shm_free(shm);
+}
@@ -43,9 +43,11 @@ static ngx_int_t ngx_http_join_exact_locations(ngx_conf_t *cf,
     ngx_queue_t *locations);
 static void ngx_http_create_locations_list(ngx_queue_t *locations,
     ngx_queue_t *q);
-static ngx_http_location_tree_node_t *
-    ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
-    size_t prefix);
+static ngx_int_t ngx_http_size_locations_tree(ngx_conf_t *cf,
+    ngx_queue_t *locations, size_t prefix, ngx_uint_t *nodes, size_t *names);
+static ngx_uint_t ngx_http_create_locations_tree(
+    ngx_http_location_tree_t *tree, ngx_queue_t *locations, size_t prefix,
+    ngx_uint_t *nodes, size_t *names);
 
 static ngx_int_t ngx_http_optimize_servers(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_array_t *ports);
@@ -147,6 +149,11 @@ ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_max_module = ngx_count_modules(cf->cycle, NGX_HTTP_MODULE);
 
 
+    /* the request parser scanners for the CPU features detected */
+
+    ngx_http_parse_cpu_init();
+
+
     /* the http main_conf context, it is the same in the all http contexts */
 
     ctx->main_conf = ngx_pcalloc(cf->pool,
@@ -679,6 +686,7 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     ngx_uint_t                   r;
     ngx_queue_t                 *regex;
+    ngx_http_regex_t           **re;
 #endif
 
     locations = pclcf->locations;
@@ -787,6 +795,20 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 
         *clcfp = NULL;
 
+        re = ngx_palloc(cf->pool, r * sizeof(ngx_http_regex_t *));
+        if (re == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (n = 0; n < r; n++) {
+            re[n] = pclcf->regex_locations[n]->regex;
+        }
+
+        pclcf->regex_set = ngx_http_regex_set_create(cf, re, r);
+        if (pclcf->regex_set == NULL) {
+            return NGX_ERROR;
+        }
+
         ngx_queue_split(locations, regex, &tail);
     }
 
@@ -800,8 +822,11 @@ static ngx_int_t
 ngx_http_init_static_location_trees(ngx_conf_t *cf,
     ngx_http_core_loc_conf_t *pclcf)
 {
+    size_t                      names;
+    ngx_uint_t                  nodes;
     ngx_queue_t                *q, *locations;
     ngx_http_core_loc_conf_t   *clcf;
+    ngx_http_location_tree_t   *tree;
     ngx_http_location_queue_t  *lq;
 
     locations = pclcf->locations;
@@ -833,11 +858,41 @@ ngx_http_init_static_location_trees(ngx_conf_t *cf,
 
     ngx_http_create_locations_list(locations, ngx_queue_head(locations));
 
-    pclcf->static_locations = ngx_http_create_locations_tree(cf, locations, 0);
-    if (pclcf->static_locations == NULL) {
+    nodes = 0;
+    names = 0;
+
+    if (ngx_http_size_locations_tree(cf, locations, 0, &nodes, &names)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    tree = ngx_palloc(cf->pool, sizeof(ngx_http_location_tree_t));
+    if (tree == NULL) {
+        return NGX_ERROR;
+    }
+
+    tree->nodes = ngx_pmemalign(cf->pool,
+                           nodes * sizeof(ngx_http_location_tree_node_t)
+                           + 2 * nodes * sizeof(ngx_http_core_loc_conf_t *)
+                           + names,
+                           ngx_cacheline_size);
+    if (tree->nodes == NULL) {
         return NGX_ERROR;
     }
 
+    tree->exact = (ngx_http_core_loc_conf_t **) (tree->nodes + nodes);
+    tree->inclusive = tree->exact + nodes;
+    tree->names = (u_char *) (tree->inclusive + nodes);
+
+    nodes = 0;
+    names = 0;
+
+    tree->nelts = ngx_http_create_locations_tree(tree, locations, 0, &nodes,
+                                                 &names);
+
+    pclcf->static_locations = tree;
+
     return NGX_OK;
 }
 
@@ -1062,81 +1117,112 @@ ngx_http_create_locations_list(ngx_queue_t *locations, ngx_queue_t *q)
 }
 
 
+static ngx_int_t
+ngx_http_size_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
+    size_t prefix, ngx_uint_t *nodes, size_t *names)
+{
+    size_t                      len;
+    ngx_queue_t                *q;
+    ngx_http_location_queue_t  *lq;
+
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
+    {
+        lq = (ngx_http_location_queue_t *) q;
+
+        len = lq->name->len - prefix;
+
+        if (len > 65535) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "too long location \"%V\" in %s:%ui",
+                          lq->name, lq->file_name, lq->line);
+            return NGX_ERROR;
+        }
+
+        (*nodes)++;
+        *names += len;
+
+        if (ngx_http_size_locations_tree(cf, &lq->list, lq->name->len,
+                                         nodes, names)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 /*
- * to keep cache locality for left leaf nodes, allocate nodes in following
- * order: node, left subtree, right subtree, inclusive subtree
+ * to keep cache locality, the nodes of a level, as well as their names,
+ * are placed one after another, followed by the nested levels
  */
 
-static ngx_http_location_tree_node_t *
-ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
-    size_t prefix)
+static ngx_uint_t
+ngx_http_create_locations_tree(ngx_http_location_tree_t *tree,
+    ngx_queue_t *locations, size_t prefix, ngx_uint_t *nodes, size_t *names)
 {
     size_t                          len;
-    ngx_queue_t                    *q, tail;
+    ngx_uint_t                      i, n;
+    ngx_queue_t                    *q;
     ngx_http_location_queue_t      *lq;
     ngx_http_location_tree_node_t  *node;
 
-    q = ngx_queue_middle(locations);
+    n = *nodes;
 
-    lq = (ngx_http_location_queue_t *) q;
-    len = lq->name->len - prefix;
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
+    {
+        lq = (ngx_http_location_queue_t *) q;
 
-    node = ngx_palloc(cf->pool,
-                      offsetof(ngx_http_location_tree_node_t, name) + len);
-    if (node == NULL) {
-        return NULL;
-    }
+        i = (*nodes)++;
+        node = &tree->nodes[i];
 
-    node->left = NULL;
-    node->right = NULL;
-    node->tree = NULL;
-    node->exact = lq->exact;
-    node->inclusive = lq->inclusive;
+        len = lq->name->len - prefix;
 
-    node->auto_redirect = (u_char) ((lq->exact && lq->exact->auto_redirect)
-                           || (lq->inclusive && lq->inclusive->auto_redirect));
+        ngx_memzero(node->key, NGX_HTTP_LOCATION_KEY_LEN);
+        ngx_memcpy(node->key, &lq->name->data[prefix],
+                   ngx_min(len, NGX_HTTP_LOCATION_KEY_LEN));
 
-    node->len = (u_char) len;
-    ngx_memcpy(node->name, &lq->name->data[prefix], len);
+        node->name = (u_int) *names;
+        node->len = (u_short) len;
+        node->tree = 0;
+        node->ntree = 0;
 
-    ngx_queue_split(locations, q, &tail);
+        node->auto_redirect = (u_char) ((lq->exact && lq->exact->auto_redirect)
+                               || (lq->inclusive
+                                   && lq->inclusive->auto_redirect));
 
-    if (ngx_queue_empty(locations)) {
-        /*
-         * ngx_queue_split() insures that if left part is empty,
-         * then right one is empty too
-         */
-        goto inclusive;
-    }
+        ngx_memcpy(&tree->names[*names], &lq->name->data[prefix], len);
+        *names += len;
 
-    node->left = ngx_http_create_locations_tree(cf, locations, prefix);
-    if (node->left == NULL) {
-        return NULL;
+        tree->exact[i] = lq->exact;
+        tree->inclusive[i] = lq->inclusive;
     }
 
-    ngx_queue_remove(q);
+    node = &tree->nodes[n];
 
-    if (ngx_queue_empty(&tail)) {
-        goto inclusive;
-    }
-
-    node->right = ngx_http_create_locations_tree(cf, &tail, prefix);
-    if (node->right == NULL) {
-        return NULL;
-    }
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
+    {
+        lq = (ngx_http_location_queue_t *) q;
 
-inclusive:
+        if (!ngx_queue_empty(&lq->list)) {
+            node->tree = (u_int) *nodes;
 
-    if (ngx_queue_empty(&lq->list)) {
-        return node;
-    }
+            i = ngx_http_create_locations_tree(tree, &lq->list, lq->name->len,
+                                               nodes, names);
+            node->ntree = (u_int) i;
+        }
 
-    node->tree = ngx_http_create_locations_tree(cf, &lq->list, prefix + len);
-    if (node->tree == NULL) {
-        return NULL;
+        node++;
     }
 
-    return node;
+    return node - &tree->nodes[n];
 }
 
 
@@ -23,6 +23,10 @@
 #define NGX_HTTP_CACHE_HIT           7
 #define NGX_HTTP_CACHE_SCARCE        8
 
+#define NGX_HTTP_CACHE_POLICY_LRU      0
+#define NGX_HTTP_CACHE_POLICY_SLRU     1
+#define NGX_HTTP_CACHE_POLICY_TINYLFU  2
+
 #define NGX_HTTP_CACHE_KEY_LEN       16
 #define NGX_HTTP_CACHE_ETAG_LEN      42
 #define NGX_HTTP_CACHE_VARY_LEN      42
@@ -36,6 +40,10 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_ram_s  ngx_http_file_cache_ram_t;
+typedef struct ngx_http_file_cache_text_s  ngx_http_file_cache_text_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +59,8 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         protect:1;
+                                     /* 9 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,6 +68,8 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_ram_t       *ram;
+    ngx_http_file_cache_text_t      *text;
 } ngx_http_file_cache_node_t;
 
 
@@ -114,6 +125,7 @@ struct ngx_http_cache_s {
     unsigned                         purged:1;
     unsigned                         reading:1;
     unsigned                         secondary:1;
+    unsigned                         memory:1;
 };
 
 
@@ -135,14 +147,39 @@ typedef struct {
 
 
 typedef struct {
+    ngx_shmtx_t                     *mutex;
+    ngx_shmtx_t                      mtx;
+    ngx_shmtx_sh_t                   lock;
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
+    ngx_rbtree_t                     keys;
+    ngx_rbtree_node_t                keys_sentinel;
     ngx_queue_t                      queue;
+    ngx_queue_t                      protect;
+    ngx_queue_t                      ram_queue;
+    ngx_uint_t                       count;
+    ngx_uint_t                       protect_count;
+} ngx_http_file_cache_part_t;
+
+
+typedef struct {
+    ngx_http_file_cache_part_t      *parts;
+    ngx_uint_t                       nparts;
+    ngx_atomic_t                     next_part;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
-    off_t                            size;
-    ngx_uint_t                       count;
+    ngx_atomic_t                     size;
+    ngx_atomic_t                     count;
     ngx_uint_t                       watermark;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_mask;
+    ngx_atomic_t                     sketch_adds;
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     rejected;
+    ngx_atomic_t                     evicted;
+    ngx_atomic_t                     ram_size;
+    ngx_atomic_t                     ram_hits;
 } ngx_http_file_cache_sh_t;
 
 
@@ -157,6 +194,13 @@ struct ngx_http_file_cache_s {
 
     time_t                           inactive;
 
+    ngx_uint_t                       policy;
+
+    size_t                           ram_size;
+    size_t                           ram_max;
+
+    ngx_flag_t                       purger;
+
     time_t                           fail_time;
 
     ngx_uint_t                       files;
@@ -164,18 +208,25 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       last;
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
+    ngx_uint_t                       loader_threads;
 
     ngx_uint_t                       manager_files;
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
+    ngx_uint_t                       manager_threads;
 
     ngx_shm_zone_t                  *shm_zone;
 
+    ngx_str_t                        index;
+    time_t                           index_interval;
+    time_t                           index_saved;
+
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
 };
 
 
+ngx_int_t ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data);
 ngx_int_t ngx_http_file_cache_new(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
@@ -185,6 +236,7 @@ void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+ngx_int_t ngx_http_file_cache_purge(ngx_http_request_t *r);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
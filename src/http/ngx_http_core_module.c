@@ -23,7 +23,7 @@ typedef struct {
 
 static ngx_int_t ngx_http_core_find_location(ngx_http_request_t *r);
 static ngx_int_t ngx_http_core_find_static_location(ngx_http_request_t *r,
-    ngx_http_location_tree_node_t *node);
+    ngx_http_location_tree_t *tree);
 
 static ngx_int_t ngx_http_core_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_http_core_postconfiguration(ngx_conf_t *cf);
@@ -664,7 +664,7 @@ static ngx_command_t  ngx_http_core_commands[] = {
       NULL },
 
     { ngx_string("open_file_cache"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
       ngx_http_core_open_file_cache,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_core_loc_conf_t, open_file_cache),
@@ -1511,7 +1511,7 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 #if (NGX_PCRE)
     ngx_int_t                  n;
     ngx_uint_t                 noregex;
-    ngx_http_core_loc_conf_t  *clcf, **clcfp;
+    ngx_http_core_loc_conf_t  *clcf;
 
     noregex = 0;
 #endif
@@ -1543,27 +1543,24 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
     if (noregex == 0 && pclcf->regex_locations) {
 
-        for (clcfp = pclcf->regex_locations; *clcfp; clcfp++) {
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "test location: ~ \"%V\"", &(*clcfp)->name);
+        n = ngx_http_regex_set_exec(r, pclcf->regex_set, &r->uri);
 
-            n = ngx_http_regex_exec(r, (*clcfp)->regex, &r->uri);
+        if (n >= 0) {
+            clcf = pclcf->regex_locations[n];
 
-            if (n == NGX_OK) {
-                r->loc_conf = (*clcfp)->loc_conf;
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "regex location: ~ \"%V\"", &clcf->name);
 
-                /* look up nested locations */
+            r->loc_conf = clcf->loc_conf;
 
-                rc = ngx_http_core_find_location(r);
+            /* look up nested locations */
 
-                return (rc == NGX_ERROR) ? rc : NGX_OK;
-            }
+            rc = ngx_http_core_find_location(r);
 
-            if (n == NGX_DECLINED) {
-                continue;
-            }
+            return (rc == NGX_ERROR) ? rc : NGX_OK;
+        }
 
+        if (n == NGX_ERROR) {
             return NGX_ERROR;
         }
     }
@@ -1582,45 +1579,66 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
 static ngx_int_t
 ngx_http_core_find_static_location(ngx_http_request_t *r,
-    ngx_http_location_tree_node_t *node)
+    ngx_http_location_tree_t *tree)
 {
-    u_char     *uri;
-    size_t      len, n;
-    ngx_int_t   rc, rv;
+    u_char                         *uri;
+    size_t                          len, n, k;
+    ngx_int_t                       rc, rv;
+    ngx_uint_t                      i, lo, hi;
+    ngx_http_location_tree_node_t  *node;
+
+    if (tree == NULL) {
+        return NGX_DECLINED;
+    }
 
     len = r->uri.len;
     uri = r->uri.data;
 
     rv = NGX_DECLINED;
 
-    for ( ;; ) {
+    lo = 0;
+    hi = tree->nelts;
 
-        if (node == NULL) {
-            return rv;
-        }
+    while (lo < hi) {
+
+        i = lo + (hi - lo) / 2;
+        node = &tree->nodes[i];
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "test location: \"%*s\"",
-                       (size_t) node->len, node->name);
+                       (size_t) node->len, &tree->names[node->name]);
 
         n = (len <= (size_t) node->len) ? len : node->len;
+        k = ngx_min(n, NGX_HTTP_LOCATION_KEY_LEN);
+
+        rc = ngx_filename_cmp(uri, node->key, k);
 
-        rc = ngx_filename_cmp(uri, node->name, n);
+        if (rc == 0 && n > k) {
+            rc = ngx_filename_cmp(uri + k, &tree->names[node->name + k],
+                                  n - k);
+        }
 
         if (rc != 0) {
-            node = (rc < 0) ? node->left : node->right;
+
+            if (rc < 0) {
+                hi = i;
+
+            } else {
+                lo = i + 1;
+            }
 
             continue;
         }
 
         if (len > (size_t) node->len) {
 
-            if (node->inclusive) {
+            if (tree->inclusive[i]) {
 
-                r->loc_conf = node->inclusive->loc_conf;
+                r->loc_conf = tree->inclusive[i]->loc_conf;
                 rv = NGX_AGAIN;
 
-                node = node->tree;
+                lo = node->tree;
+                hi = node->tree + node->ntree;
                 uri += n;
                 len -= n;
 
@@ -1629,19 +1647,19 @@ ngx_http_core_find_static_location(ngx_http_request_t *r,
 
             /* exact only */
 
-            node = node->right;
+            lo = i + 1;
 
             continue;
         }
 
         if (len == (size_t) node->len) {
 
-            if (node->exact) {
-                r->loc_conf = node->exact->loc_conf;
+            if (tree->exact[i]) {
+                r->loc_conf = tree->exact[i]->loc_conf;
                 return NGX_OK;
 
             } else {
-                r->loc_conf = node->inclusive->loc_conf;
+                r->loc_conf = tree->inclusive[i]->loc_conf;
                 return NGX_AGAIN;
             }
         }
@@ -1650,13 +1668,15 @@ ngx_http_core_find_static_location(ngx_http_request_t *r,
 
         if (len + 1 == (size_t) node->len && node->auto_redirect) {
 
-            r->loc_conf = (node->exact) ? node->exact->loc_conf:
-                                          node->inclusive->loc_conf;
+            r->loc_conf = (tree->exact[i]) ? tree->exact[i]->loc_conf:
+                                             tree->inclusive[i]->loc_conf;
             rv = NGX_DONE;
         }
 
-        node = node->left;
+        hi = i;
     }
+
+    return rv;
 }
 
 
@@ -4934,8 +4954,10 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_core_loc_conf_t *clcf = conf;
 
+    u_char      *p;
     time_t       inactive;
-    ngx_str_t   *value, s;
+    ssize_t      size;
+    ngx_str_t   *value, s, name;
     ngx_int_t    max;
     ngx_uint_t   i;
 
@@ -4948,6 +4970,9 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max = 0;
     inactive = 60;
 
+    ngx_str_null(&name);
+    size = 0;
+
     for (i = 1; i < cf->args->nelts; i++) {
 
         if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
@@ -4973,6 +4998,37 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shared=", 7) == 0) {
+
+            name.data = value[i].data + 7;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                goto failed;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (name.len == 0 || size == NGX_ERROR) {
+                goto failed;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "open file cache zone \"%V\" is too small",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "off") == 0) {
 
             clcf->open_file_cache = NULL;
@@ -4999,11 +5055,18 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     clcf->open_file_cache = ngx_open_file_cache_init(cf->pool, max, inactive);
-    if (clcf->open_file_cache) {
-        return NGX_CONF_OK;
+    if (clcf->open_file_cache == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_CONF_ERROR;
+    if (name.len
+        && ngx_open_file_cache_shared(cf, clcf->open_file_cache, &name, size)
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
 }
 
 
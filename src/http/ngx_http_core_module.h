@@ -56,6 +56,7 @@ typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
 
 
 typedef struct ngx_http_location_tree_node_s  ngx_http_location_tree_node_t;
+typedef struct ngx_http_location_tree_s  ngx_http_location_tree_t;
 typedef struct ngx_http_core_loc_conf_s  ngx_http_core_loc_conf_t;
 
 
@@ -320,9 +321,10 @@ struct ngx_http_core_loc_conf_s {
     unsigned      gzip_disable_degradation:2;
 #endif
 
-    ngx_http_location_tree_node_t   *static_locations;
+    ngx_http_location_tree_t        *static_locations;
 #if (NGX_PCRE)
     ngx_http_core_loc_conf_t       **regex_locations;
+    ngx_http_regex_set_t            *regex_set;
 #endif
 
     /* pointer to the modules' loc_conf */
@@ -453,17 +455,32 @@ typedef struct {
 } ngx_http_location_queue_t;
 
 
-struct ngx_http_location_tree_node_s {
-    ngx_http_location_tree_node_t   *left;
-    ngx_http_location_tree_node_t   *right;
-    ngx_http_location_tree_node_t   *tree;
+/*
+ * The static locations of a level are kept sorted in a node array, which
+ * is searched in a binary way; the nested locations of a node form their
+ * own level, placed in the same array.  A node holds the first bytes of
+ * the name, so most comparisons do not touch the names; the configurations
+ * referenced only on a match live in separate arrays indexed as the nodes.
+ */
 
-    ngx_http_core_loc_conf_t        *exact;
-    ngx_http_core_loc_conf_t        *inclusive;
+#define NGX_HTTP_LOCATION_KEY_LEN  16
 
+struct ngx_http_location_tree_node_s {
+    u_char                           key[NGX_HTTP_LOCATION_KEY_LEN];
+    u_int                            name;
+    u_int                            tree;
+    u_int                            ntree;
+    u_short                          len;
     u_char                           auto_redirect;
-    u_char                           len;
-    u_char                           name[1];
+};
+
+
+struct ngx_http_location_tree_s {
+    ngx_http_location_tree_node_t   *nodes;
+    u_char                          *names;
+    ngx_http_core_loc_conf_t       **exact;
+    ngx_http_core_loc_conf_t       **inclusive;
+    ngx_uint_t                       nelts;
 };
 
 
@@ -11,6 +11,132 @@
 #include <ngx_md5.h>
 
 
+/*
+ * the cache index is a snapshot of the cache nodes in the LRU order,
+ * from the least recently used one, the probation segment first and
+ * then the protected one, followed by the texts of the keys if known;
+ * a "clean" snapshot is saved by the master process on exit, when no
+ * other process may change the cache anymore, and allows to skip the
+ * cache loader on the next start;  any other snapshot is only used to
+ * prefill the keys zone
+ */
+
+#define NGX_HTTP_CACHE_INDEX_VERSION  3
+#define NGX_HTTP_CACHE_INDEX_CHUNK    4096
+
+
+/*
+ * the TinyLFU admission policy estimates access frequencies of the keys
+ * with a count-min sketch of 4 rows of saturating 4-bit counters, kept
+ * in bytes; all counters are halved once 10 accesses per counter of a row
+ * are added, so the estimates follow recent popularity
+ */
+
+#define NGX_HTTP_CACHE_SKETCH_DEPTH   4
+#define NGX_HTTP_CACHE_SKETCH_MAX     15
+#define NGX_HTTP_CACHE_SKETCH_SAMPLE  10
+
+
+/*
+ * the keys zone is split into parts by the first byte of the keys, each
+ * with its own mutex, tree and queues, so requests for different keys
+ * do not contend for a single zone mutex;  the totals are kept in atomic
+ * counters;  without atomic operations there is a single part locked with
+ * the zone mutex, as the slab allocator has no locks of its own then
+ */
+
+#if (NGX_HAVE_ATOMIC_OPS)
+#define NGX_HTTP_CACHE_PARTS          16
+#else
+#define NGX_HTTP_CACHE_PARTS          1
+#endif
+
+#define ngx_http_file_cache_part(cache, key)                                  \
+    (&(cache)->sh->parts[(key)[0] & ((cache)->sh->nparts - 1)])
+
+#define ngx_http_file_cache_node_part(cache, fcn)                             \
+    ngx_http_file_cache_part(cache, (u_char *) &(fcn)->node.key)
+
+#define ngx_http_file_cache_mutex(cache, key)                                 \
+    ngx_http_file_cache_part(cache, key)->mutex
+
+
+typedef struct {
+    u_char                           magic[8];
+    ngx_uint_t                       version;
+    size_t                           entry_size;
+    size_t                           bsize;
+    time_t                           saved;
+    ngx_uint_t                       count;
+    size_t                           text_size;
+    ngx_uint_t                       clean;
+    uint32_t                         crc32;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    time_t                           valid_sec;
+    off_t                            fs_size;
+    size_t                           body_start;
+    u_short                          uses;
+    u_short                          valid_msec;
+    u_short                          error;
+    u_short                          exists;
+    u_short                          protect;
+    u_short                          purged;
+    u_short                          text_len;
+} ngx_http_file_cache_index_entry_t;
+
+
+struct ngx_http_file_cache_ram_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
+/*
+ * with the "purger" parameter the texts of the keys are kept in a tree
+ * of each part ordered by the text, so the nodes matching a wildcard key
+ * are found as a range of the tree
+ */
+
+struct ngx_http_file_cache_text_s {
+    ngx_str_node_t                   sn;
+    ngx_http_file_cache_node_t      *fcn;
+    u_char                           data[1];
+};
+
+
+typedef struct {
+    ngx_http_file_cache_t           *cache;
+    ngx_uint_t                       files;
+    ngx_msec_t                       last;
+#if (NGX_THREADS)
+    ngx_array_t                     *shards;
+    ngx_atomic_t                     next;
+    ngx_atomic_t                     aborted;
+#endif
+} ngx_http_file_cache_loader_ctx_t;
+
+
+typedef struct {
+    ngx_http_file_cache_node_t     **nodes;
+    u_char                          *names;
+    size_t                           len;
+    ngx_uint_t                       nelts;
+    ngx_uint_t                       nalloc;
+    ngx_atomic_t                     next;
+} ngx_http_file_cache_batch_t;
+
+
+static ngx_uint_t ngx_http_file_cache_force_unlock(ngx_shm_zone_t *shm_zone,
+    ngx_pid_t pid);
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -30,12 +156,35 @@ static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 #endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_sh_t *sh,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_sh_t *sh, u_char *key);
+static void ngx_http_file_cache_sketch_counters(ngx_http_file_cache_sh_t *sh,
+    u_char *key, u_char **counters);
+static ngx_uint_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, u_char *key);
+static void ngx_http_file_cache_promote(ngx_http_file_cache_part_t *part,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_ram_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_store(ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_t *ram);
+static void ngx_http_file_cache_set_text(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_node_t *fcn,
+    ngx_str_t *keys, ngx_uint_t n);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
     ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_text_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
     size_t len, u_char *hash);
 static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
@@ -45,11 +194,39 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static ngx_uint_t ngx_http_file_cache_purge_texts(ngx_http_file_cache_t *cache,
+    ngx_str_t *key, ngx_uint_t prefix);
+static ngx_uint_t ngx_http_file_cache_purge_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_purge_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_uint_t n);
+static ngx_int_t ngx_http_file_cache_forced_expire_part(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_part_t *part,
+    ngx_http_file_cache_batch_t *batch, ngx_uint_t quota, ngx_uint_t *tries,
+    ngx_uint_t *evicted);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_queue_t *queue,
+    ngx_http_file_cache_batch_t *batch);
+static ngx_int_t ngx_http_file_cache_batch_init(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_batch_t *batch, ngx_uint_t n);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
-static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
+    ngx_http_file_cache_part_t *part, ngx_queue_t *q,
+    ngx_http_file_cache_batch_t *batch);
+static void ngx_http_file_cache_delete_files(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_batch_t *batch);
+static void *ngx_http_file_cache_delete_handler(void *data);
+static void ngx_http_file_cache_loader_sleep(
+    ngx_http_file_cache_loader_ctx_t *lctx);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_loader_shards(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
+static void *ngx_http_file_cache_loader_thread(void *data);
+static void ngx_http_file_cache_run_threads(ngx_uint_t n,
+    void *(*handler)(void *data), void *data);
+#endif
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx,
@@ -58,11 +235,24 @@ static ngx_int_t ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static ngx_int_t ngx_http_file_cache_read_key(ngx_tree_ctx_t *ctx,
+    ngx_str_t *name, u_char *buf, size_t size, ngx_str_t *key);
 static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_file_cache_index_read(ngx_http_file_cache_t *cache,
+    ngx_file_t *file, ngx_http_file_cache_index_header_t *h,
+    ngx_uint_t insert);
+static void ngx_http_file_cache_index_insert(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_entry_t *e, u_char *text, time_t now,
+    time_t saved);
+static void ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache,
+    ngx_uint_t clean);
+static void ngx_http_file_cache_saver(void *data);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -78,15 +268,18 @@ ngx_str_t  ngx_http_cache_status[] = {
 
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
+static u_char  ngx_http_file_cache_index_magic[8] = "NGXCIDX";
 
-static ngx_int_t
+
+ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                       len;
+    ngx_uint_t                   n;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_part_t  *part;
 
     cache = shm_zone->data;
 
@@ -121,7 +314,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
-        return NGX_OK;
+        return ngx_http_file_cache_sketch_init(cache);
     }
 
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -140,16 +333,52 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    cache->sh->nparts = NGX_HTTP_CACHE_PARTS;
+
+    cache->sh->parts = ngx_slab_calloc(cache->shpool,
+                                       NGX_HTTP_CACHE_PARTS
+                                       * sizeof(ngx_http_file_cache_part_t));
+    if (cache->sh->parts == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < NGX_HTTP_CACHE_PARTS; n++) {
+        part = &cache->sh->parts[n];
+
+#if (NGX_HAVE_ATOMIC_OPS)
+        if (ngx_shmtx_create(&part->mtx, &part->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        part->mutex = &part->mtx;
+#else
+        part->mutex = &cache->shpool->mutex;
+#endif
+
+        ngx_rbtree_init(&part->rbtree, &part->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
 
-    ngx_queue_init(&cache->sh->queue);
+        ngx_rbtree_init(&part->keys, &part->keys_sentinel,
+                        ngx_http_file_cache_text_insert_value);
 
+        ngx_queue_init(&part->queue);
+        ngx_queue_init(&part->protect);
+        ngx_queue_init(&part->ram_queue);
+    }
+
+    cache->sh->next_part = 0;
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->sketch = NULL;
+    cache->sh->hits = 0;
+    cache->sh->misses = 0;
+    cache->sh->rejected = 0;
+    cache->sh->evicted = 0;
+    cache->sh->ram_size = 0;
+    cache->sh->ram_hits = 0;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -167,10 +396,55 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    if (ngx_http_file_cache_sketch_init(cache) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (cache->index.len
+        && !ngx_test_config
+        && ngx_http_file_cache_index_load(cache, shm_zone->shm.log) == NGX_OK)
+    {
+        cache->sh->cold = 0;
+    }
+
     return NGX_OK;
 }
 
 
+static ngx_uint_t
+ngx_http_file_cache_force_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_uint_t              i, unlocked;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (cache->sh == NULL) {
+        return 0;
+    }
+
+    unlocked = 0;
+
+    for (i = 0; i < cache->sh->nparts; i++) {
+        if (ngx_shmtx_force_unlock(&cache->sh->parts[i].mtx, pid)) {
+            unlocked = 1;
+        }
+    }
+
+    return unlocked;
+
+#else
+
+    /* the only part is locked with the zone mutex */
+
+    return 0;
+
+#endif
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -342,6 +616,19 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->ram_size) {
+
+        rc = ngx_http_file_cache_ram_read(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -381,6 +668,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
+    /* small files are read completely to be kept in memory */
+
+    if (cache->ram_size
+        && c->length <= (off_t) cache->ram_max
+        && c->length > (off_t) c->body_start)
+    {
+        c->body_start = (size_t) c->length;
+    }
+
     c->buf = ngx_create_temp_buf(r->pool, c->body_start);
     if (c->buf == NULL) {
         return NGX_ERROR;
@@ -412,7 +708,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
 
     timer = c->node->lock_time - now;
 
@@ -423,7 +719,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->lock_time = c->node->lock_time;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
@@ -498,7 +794,7 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     cache = c->file_cache;
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
 
     timer = c->node->lock_time - now;
 
@@ -506,7 +802,7 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
         wait = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
 
     if (wait) {
         ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
@@ -533,10 +829,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->memory) {
+        n = c->buf->end - c->buf->pos;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -614,7 +915,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     if (cache->sh->cold) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -623,17 +924,22 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            (void) ngx_atomic_fetch_add(&cache->sh->size, c->fs_size);
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
+    }
+
+    if (cache->ram_size && !c->memory && n == c->length && !h->vary_len) {
+        c->memory = 1;
+        ngx_http_file_cache_ram_store(c);
     }
 
     now = ngx_time();
 
     if (c->valid_sec < now) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -645,7 +951,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -815,14 +1121,28 @@ static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
     ngx_int_t                    rc;
+    ngx_http_file_cache_part_t  *part;
     ngx_http_file_cache_node_t  *fcn;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    part = ngx_http_file_cache_part(cache, c->key);
+
+    ngx_shmtx_lock(part->mutex);
 
     fcn = c->node;
 
     if (fcn == NULL) {
         fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (fcn && fcn->exists && !fcn->purged) {
+            (void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
+
+        } else {
+            (void) ngx_atomic_fetch_add(&cache->sh->misses, 1);
+        }
+
+        if (cache->policy == NGX_HTTP_CACHE_POLICY_TINYLFU) {
+            ngx_http_file_cache_sketch_add(cache->sh, c->key);
+        }
     }
 
     if (fcn) {
@@ -831,6 +1151,12 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         if (c->node == NULL) {
             fcn->uses++;
             fcn->count++;
+
+            if (fcn->exists && !fcn->protect
+                && cache->policy != NGX_HTTP_CACHE_POLICY_LRU)
+            {
+                ngx_http_file_cache_promote(part, fcn);
+            }
         }
 
         if (fcn->error) {
@@ -846,7 +1172,15 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         if (fcn->exists || fcn->uses >= c->min_uses) {
 
-            c->exists = fcn->exists;
+            if (!fcn->exists
+                && c->node == NULL
+                && !ngx_http_file_cache_admit(cache, part, c->key))
+            {
+                rc = NGX_AGAIN;
+                goto done;
+            }
+
+            c->exists = fcn->exists && !fcn->purged;
             if (fcn->body_start) {
                 c->body_start = fcn->body_start;
             }
@@ -866,11 +1200,11 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(part->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(cache, 1);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(part->mutex);
 
         fcn = ngx_slab_calloc_locked(cache->shpool,
                                      sizeof(ngx_http_file_cache_node_t));
@@ -882,18 +1216,24 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    part->count++;
+    (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
 
     ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&part->rbtree, &fcn->node);
 
     fcn->uses = 1;
     fcn->count = 1;
 
+    if (c->min_uses == 1 && !ngx_http_file_cache_admit(cache, part, c->key)) {
+        rc = NGX_AGAIN;
+        goto done;
+    }
+
 renew:
 
     rc = NGX_DECLINED;
@@ -908,9 +1248,15 @@ renew:
 
 done:
 
+    if (cache->purger && fcn->text == NULL) {
+        ngx_http_file_cache_set_text(cache, part, fcn, c->keys.elts,
+                                     c->keys.nelts);
+    }
+
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(fcn->protect ? &part->protect : &part->queue,
+                          &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -918,1318 +1264,3059 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(part->mutex);
 
     return rc;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
-
-    c = r->cache;
+    size_t      n;
+    ngx_uint_t  width;
 
-    if (c->file.name.len) {
+    if (cache->policy != NGX_HTTP_CACHE_POLICY_TINYLFU
+        || cache->sh->sketch != NULL)
+    {
         return NGX_OK;
     }
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
-
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
-        return NGX_ERROR;
-    }
+    /* a counter per node the keys zone may hold */
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+    n = cache->shm_zone->shm.size / sizeof(ngx_http_file_cache_node_t);
 
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+    for (width = 256; width < n; width <<= 1) { /* void */ }
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+    cache->sh->sketch = ngx_slab_calloc(cache->shpool,
+                                        NGX_HTTP_CACHE_SKETCH_DEPTH * width);
+    if (cache->sh->sketch == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cache->shm_zone->shm.log, 0,
+                      "could not allocate frequency sketch%s",
+                      cache->shpool->log_ctx);
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+    cache->sh->sketch_mask = width - 1;
+    cache->sh->sketch_adds = 0;
 
     return NGX_OK;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_sh_t *sh, u_char *key)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
-
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    u_char      *p, *last, *counters[NGX_HTTP_CACHE_SKETCH_DEPTH];
+    ngx_uint_t   i, min, sample;
 
-    while (node != sentinel) {
+    ngx_http_file_cache_sketch_counters(sh, key, counters);
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+    min = NGX_HTTP_CACHE_SKETCH_MAX;
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        if (*counters[i] < min) {
+            min = *counters[i];
         }
+    }
 
-        /* node_key == node->key */
-
-        fcn = (ngx_http_file_cache_node_t *) node;
+    if (min == NGX_HTTP_CACHE_SKETCH_MAX) {
+        return;
+    }
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    /* conservative update: only the smallest counters are incremented */
 
-        if (rc == 0) {
-            return fcn;
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        if (*counters[i] == min) {
+            (*counters[i])++;
         }
-
-        node = (rc < 0) ? node->left : node->right;
     }
 
-    /* not found */
-
-    return NULL;
-}
-
+    /*
+     * the counters are shared by all parts of the keys zone and updated
+     * without locking, a lost update merely makes an estimate less precise;
+     * the aging is done by the only process which reaches the sample size
+     */
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
-{
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    sample = NGX_HTTP_CACHE_SKETCH_SAMPLE * (sh->sketch_mask + 1);
 
-    for ( ;; ) {
+    if (ngx_atomic_fetch_add(&sh->sketch_adds, 1) + 1 != sample) {
+        return;
+    }
 
-        if (node->key < temp->key) {
+    p = sh->sketch;
+    last = p + NGX_HTTP_CACHE_SKETCH_DEPTH * (sh->sketch_mask + 1);
 
-            p = &temp->left;
+    while (p < last) {
+        *p++ >>= 1;
+    }
 
-        } else if (node->key > temp->key) {
+    (void) ngx_atomic_fetch_add(&sh->sketch_adds,
+                                -(ngx_atomic_int_t) (sample / 2));
+}
 
-            p = &temp->right;
 
-        } else { /* node->key == temp->key */
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_sh_t *sh, u_char *key)
+{
+    u_char      *counters[NGX_HTTP_CACHE_SKETCH_DEPTH];
+    ngx_uint_t   i, min;
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+    ngx_http_file_cache_sketch_counters(sh, key, counters);
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    min = NGX_HTTP_CACHE_SKETCH_MAX;
 
-        if (*p == sentinel) {
-            break;
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        if (*counters[i] < min) {
+            min = *counters[i];
         }
-
-        temp = *p;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    return min;
 }
 
 
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_file_cache_sketch_counters(ngx_http_file_cache_sh_t *sh, u_char *key,
+    u_char **counters)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    uint32_t    hash;
+    ngx_uint_t  i;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    /* the keys are MD5 hashes, so each row just uses its 32 bits of a key */
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
 
-    ngx_strlow(buf, vary, len);
+        counters[i] = sh->sketch + i * (sh->sketch_mask + 1)
+                      + (hash & sh->sketch_mask);
+    }
+}
 
-    p = buf;
-    last = buf + len;
 
-    while (p < last) {
+static ngx_uint_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, u_char *key)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       victim[NGX_HTTP_CACHE_KEY_LEN];
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    sh = cache->sh;
 
-        name.data = p;
+    if (cache->policy != NGX_HTTP_CACHE_POLICY_TINYLFU) {
+        return 1;
+    }
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    /* everything is admitted while the cache is not close to its limits */
 
-        name.len = p - name.data;
+    if ((off_t) sh->size < cache->max_size - cache->max_size / 16
+        && sh->count < sh->watermark - sh->watermark / 16)
+    {
+        return 1;
+    }
 
-        if (name.len == 0) {
-            break;
-        }
+    /* the node of the part to be evicted next */
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+    q = ngx_queue_empty(&part->queue) ? &part->protect : &part->queue;
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+    if (ngx_queue_empty(q)) {
+        return 1;
+    }
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+    fcn = ngx_queue_data(ngx_queue_last(q), ngx_http_file_cache_node_t, queue);
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    ngx_memcpy(victim, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&victim[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    if (ngx_http_file_cache_sketch_estimate(sh, key)
+        > ngx_http_file_cache_sketch_estimate(sh, victim))
+    {
+        return 1;
     }
 
-    ngx_md5_final(hash, &md5);
-}
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache admission rejected");
 
+    (void) ngx_atomic_fetch_add(&sh->rejected, 1);
 
-static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+    return 0;
+}
+
+
+static void
+ngx_http_file_cache_promote(ngx_http_file_cache_part_t *part,
+    ngx_http_file_cache_node_t *fcn)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *tail;
 
-    multiple = 0;
-    normalize = 0;
+    fcn->protect = 1;
+    part->protect_count++;
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
+    /*
+     * the protected segment is limited to 80% of the nodes of a part,
+     * its least recently used nodes are moved back to probation
+     */
 
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
+    while (part->protect_count > part->count - part->count / 5
+           && !ngx_queue_empty(&part->protect))
     {
-        normalize = 1;
+        q = ngx_queue_last(&part->protect);
+        ngx_queue_remove(q);
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
-    }
+        tail = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        tail->protect = 0;
+        part->protect_count--;
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+        ngx_queue_insert_head(&part->queue, q);
+    }
+}
 
-    for (i = 0; /* void */ ; i++) {
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+static void
+ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_node_t *fcn)
+{
+    if (fcn->protect) {
+        part->protect_count--;
+    }
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
-        }
+    if (fcn->ram) {
+        ngx_http_file_cache_ram_free(cache, fcn->ram);
+    }
 
-        if (header[i].hash == 0) {
-            continue;
-        }
+    if (fcn->text) {
+        ngx_rbtree_delete(&part->keys, &fcn->text->sn.node);
+        ngx_slab_free_locked(cache->shpool, fcn->text);
+    }
 
-        if (header[i].key.len != name->len) {
-            continue;
-        }
+    ngx_queue_remove(&fcn->queue);
+    ngx_rbtree_delete(&part->rbtree, &fcn->node);
+    ngx_slab_free_locked(cache->shpool, fcn);
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
-        }
+    part->count--;
+    (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+}
 
-        if (!normalize) {
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+static ngx_int_t
+ngx_http_file_cache_ram_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                       len;
+    ngx_buf_t                   *b;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_ram_t   *ram;
+    ngx_http_file_cache_part_t  *part;
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+    cache = c->file_cache;
+    part = ngx_http_file_cache_part(cache, c->key);
 
-            multiple = 1;
+    ngx_shmtx_lock(part->mutex);
 
-            continue;
-        }
+    ram = c->node->ram;
 
-        /* normalize spaces */
+    if (ram == NULL) {
+        ngx_shmtx_unlock(part->mutex);
+        return NGX_DECLINED;
+    }
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
+    len = ram->len;
 
-        while (p < last) {
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        ngx_shmtx_unlock(part->mutex);
+        return NGX_ERROR;
+    }
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    ngx_memcpy(b->pos, ram->data, len);
 
-            start = p;
+    c->uniq = ram->uniq;
+    c->fs_size = c->node->fs_size;
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+    ngx_queue_remove(&ram->queue);
+    ngx_queue_insert_head(&part->ram_queue, &ram->queue);
 
-            len = p - start;
+    ngx_shmtx_unlock(part->mutex);
 
-            if (len == 0) {
-                break;
-            }
+    (void) ngx_atomic_fetch_add(&cache->sh->ram_hits, 1);
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram: %uz", len);
 
-            ngx_md5_update(md5, start, len);
+    c->file.log = r->connection->log;
+    c->length = len;
+    c->body_start = len;
+    c->buf = b;
+    c->memory = 1;
 
-            multiple = 1;
-        }
-    }
+    return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_ram_store(ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
-
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+    size_t                       size;
+    ngx_uint_t                   tries;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_ram_t   *ram;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    c->node->count--;
-    c->node = NULL;
+    size = offsetof(ngx_http_file_cache_ram_t, data) + (size_t) c->length;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (size > cache->ram_size) {
+        return;
+    }
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buf->end - c->buf->start;
+    part = ngx_http_file_cache_part(cache, c->key);
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_shmtx_lock(part->mutex);
 
-    return ngx_http_file_cache_open(r);
-}
+    fcn = c->node;
 
+    /* the file might be replaced or deleted after it was opened */
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
-{
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+    if (fcn->ram
+        || !fcn->exists
+        || fcn->purged
+        || fcn->deleting
+        || (fcn->uniq && fcn->uniq != c->uniq))
+    {
+        goto done;
+    }
 
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+    /*
+     * the memory is shared by all parts of the keys zone, but only
+     * the copies of the same part can be evicted under its lock
+     */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+    while (cache->sh->ram_size + size > cache->ram_size) {
 
-    c = r->cache;
+        if (ngx_queue_empty(&part->ram_queue)) {
+            goto done;
+        }
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+        q = ngx_queue_last(&part->ram_queue);
+        ram = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+        ngx_http_file_cache_ram_free(cache, ram);
+    }
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+    for (tries = 0; /* void */ ; tries++) {
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
-    }
+        ram = ngx_slab_alloc_locked(cache->shpool, size);
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        if (ram) {
+            break;
         }
 
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+        /* the keys zone is full, the nodes are not evicted for a copy */
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
-    }
+        if (tries == 3 || ngx_queue_empty(&part->ram_queue)) {
+            goto done;
+        }
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
+        q = ngx_queue_last(&part->ram_queue);
+        ram = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+        ngx_http_file_cache_ram_free(cache, ram);
     }
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+    ram->node = fcn;
+    ram->uniq = c->uniq;
+    ram->len = (size_t) c->length;
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+    ngx_memcpy(ram->data, c->buf->pos, ram->len);
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
-    }
+    ngx_queue_insert_head(&part->ram_queue, &ram->queue);
 
-    *p = LF;
+    (void) ngx_atomic_fetch_add(&cache->sh->ram_size, size);
 
-    return NGX_OK;
+    fcn->ram = ram;
+
+done:
+
+    ngx_shmtx_unlock(part->mutex);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_t *ram)
 {
-    ngx_http_file_cache_t  *cache;
-
-    if (!c->secondary) {
-        return NGX_OK;
-    }
+    size_t  size;
 
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
-    {
-        return NGX_OK;
-    }
+    size = offsetof(ngx_http_file_cache_ram_t, data) + ram->len;
 
-    /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
-     */
+    ram->node->ram = NULL;
 
-    cache = c->file_cache;
+    ngx_queue_remove(&ram->queue);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
+    ngx_slab_free_locked(cache->shpool, ram);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    (void) ngx_atomic_fetch_add(&cache->sh->ram_size,
+                                -(ngx_atomic_int_t) size);
+}
 
-    c->node->count--;
-    c->node->updating = 0;
-    c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+static void
+ngx_http_file_cache_set_text(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_node_t *fcn,
+    ngx_str_t *keys, ngx_uint_t n)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_uint_t                   i;
+    ngx_http_file_cache_text_t  *text;
 
-    c->file.name.len = 0;
+    len = 0;
 
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+    for (i = 0; i < n; i++) {
+        len += keys[i].len;
+    }
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
+    text = ngx_slab_alloc_locked(cache->shpool,
+                                 offsetof(ngx_http_file_cache_text_t, data)
+                                 + len);
+    if (text == NULL) {
+        /* the node just cannot be purged with a wildcard key */
+        return;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
+    p = text->data;
+
+    for (i = 0; i < n; i++) {
+        p = ngx_cpymem(p, keys[i].data, keys[i].len);
     }
 
-    return NGX_OK;
+    text->sn.node.key = 0;
+    text->sn.str.len = len;
+    text->sn.str.data = text->data;
+    text->fcn = fcn;
+
+    ngx_rbtree_insert(&part->keys, &text->sn.node);
+
+    fcn->text = text;
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    u_char            *p;
+    ngx_http_cache_t  *c;
 
     c = r->cache;
 
-    if (c->updated) {
-        return;
+    if (c->file.name.len) {
+        return NGX_OK;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
-    cache = c->file_cache;
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    part = ngx_http_file_cache_part(cache, key);
+
+    node = part->rbtree.root;
+    sentinel = part->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_text_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_str_node_t      *n, *t;
+    ngx_rbtree_node_t  **p;
+
+    /* unlike ngx_str_rbtree_insert_value(), the texts are sorted as is */
+
+    for ( ;; ) {
+
+        n = (ngx_str_node_t *) node;
+        t = (ngx_str_node_t *) temp;
+
+        p = (ngx_memn2cmp(n->str.data, t->str.data, n->str.len, t->str.len)
+             < 0)
+            ? &temp->left : &temp->right;
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
+
+    c->node->count--;
+    ngx_http_file_cache_purge_expire(cache, c->node);
+    c->node = NULL;
+
+    ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
+
+    c->secondary = 1;
+    c->memory = 0;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
+
+    c->node->count--;
+    c->node->updating = 0;
+    ngx_http_file_cache_purge_expire(cache, c->node);
+    c->node = NULL;
+
+    ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
+
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                   fs_size;
+    ngx_int_t               rc;
+    ngx_file_uniq_t         uniq;
+    ngx_file_info_t         fi;
+    ngx_http_cache_t        *c;
+    ngx_ext_rename_file_t   ext;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
+    fs_size = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, c->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+    ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    if (c->node->ram) {
+        ngx_http_file_cache_ram_free(cache, c->node->ram);
+    }
+
+    (void) ngx_atomic_fetch_add(&cache->sh->size,
+                              (ngx_atomic_int_t) (fs_size - c->node->fs_size));
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+        c->node->purged = 0;
+    }
+
+    c->node->updating = 0;
+
+    ngx_http_file_cache_purge_expire(cache, c->node);
+
+    ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_ram_t     *ram;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->uniq != ngx_file_uniq(&fi)
+        || c->length != ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || (size_t) h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = NGX_HTTP_CACHE_VERSION;
+    h.valid_sec = c->valid_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_write_file(&file, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto done;
+    }
+
+    cache = c->file_cache;
+
+    if (cache->ram_size) {
+
+        /* the copy in memory is updated as well */
+
+        ngx_shmtx_lock(ngx_http_file_cache_mutex(cache, c->key));
+
+        ram = c->node->ram;
+
+        if (ram && ram->uniq == c->uniq) {
+            ngx_memcpy(ram->data, &h, sizeof(ngx_http_file_cache_header_t));
+        }
+
+        ngx_shmtx_unlock(ngx_http_file_cache_mutex(cache, c->key));
+    }
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (c->memory) {
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        b->pos = c->buf->start + c->body_start;
+        b->last = c->buf->start + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+        b->last_buf = (r == r->main) ? 1: 0;
+        b->last_in_chain = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->file_pos = c->body_start;
+    b->file_last = c->length;
+
+    b->in_file = (c->length - c->body_start) ? 1: 0;
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    part = ngx_http_file_cache_part(cache, c->key);
+
+    ngx_shmtx_lock(part->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_free_node(cache, part, fcn);
+        c->node = NULL;
+    }
+
+    if (c->node) {
+        ngx_http_file_cache_purge_expire(cache, fcn);
+    }
+
+    ngx_shmtx_unlock(part->mutex);
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_purge(ngx_http_request_t *r)
+{
+    u_char                      *p;
+    ngx_str_t                    key, *keys;
+    ngx_uint_t                   i, n;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    keys = c->keys.elts;
+
+    key.len = 0;
+
+    for (i = 0; i < c->keys.nelts; i++) {
+        key.len += keys[i].len;
+    }
+
+    key.data = ngx_pnalloc(r->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = key.data;
+
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_cpymem(p, keys[i].data, keys[i].len);
+    }
+
+    n = 0;
+
+    if (key.len == 0 || key.data[key.len - 1] != '*') {
+
+        part = ngx_http_file_cache_part(cache, c->key);
+
+        ngx_shmtx_lock(part->mutex);
+
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (fcn) {
+            n = ngx_http_file_cache_purge_node(cache, part, fcn);
+        }
+
+        ngx_shmtx_unlock(part->mutex);
+
+        /*
+         * the variants of a response with "Vary" are stored with their
+         * own md5 keys, and are only found by the text of the key
+         */
+
+        if (cache->purger) {
+            n += ngx_http_file_cache_purge_texts(cache, &key, 0);
+        }
+
+        goto done;
+    }
+
+    if (!cache->purger) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "wildcard purge requires the \"purger\" parameter "
+                      "of cache \"%V\"", &cache->shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    key.len--;
+
+    n = ngx_http_file_cache_purge_texts(cache, &key, 1);
+
+done:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache purge: \"%V\" %ui", &key, n);
+
+    return n ? NGX_OK : NGX_DECLINED;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_purge_texts(ngx_http_file_cache_t *cache, ngx_str_t *key,
+    ngx_uint_t prefix)
+{
+    ngx_uint_t                   i, n;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
+    ngx_http_file_cache_text_t  *text;
+    ngx_http_file_cache_part_t  *part;
+
+    n = 0;
+
+    for (i = 0; i < cache->sh->nparts; i++) {
+        part = &cache->sh->parts[i];
+
+        ngx_shmtx_lock(part->mutex);
+
+        /* the first text not less than the key */
+
+        node = part->keys.root;
+        sentinel = part->keys.sentinel;
+        next = NULL;
+
+        while (node != sentinel) {
+            text = (ngx_http_file_cache_text_t *) node;
+
+            if (ngx_memn2cmp(text->sn.str.data, key->data, text->sn.str.len,
+                             key->len)
+                >= 0)
+            {
+                next = node;
+                node = node->left;
+
+            } else {
+                node = node->right;
+            }
+        }
+
+        while (next) {
+            text = (ngx_http_file_cache_text_t *) next;
+
+            if (text->sn.str.len < key->len
+                || (!prefix && text->sn.str.len != key->len)
+                || ngx_memcmp(text->sn.str.data, key->data, key->len) != 0)
+            {
+                break;
+            }
+
+            next = ngx_rbtree_next(&part->keys, next);
+
+            n += ngx_http_file_cache_purge_node(cache, part, text->fcn);
+        }
+
+        ngx_shmtx_unlock(part->mutex);
+    }
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_purge_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_node_t *fcn)
+{
+    ngx_uint_t  purged;
+
+    purged = 0;
+
+    if (fcn->error) {
+        fcn->error = 0;
+        purged = 1;
+    }
+
+    if (!fcn->exists || fcn->purged || fcn->deleting) {
+        return purged;
+    }
+
+    /*
+     * a purged node is not used for responses anymore, and its file is
+     * either replaced by a new response or deleted by the cache manager
+     */
+
+    fcn->purged = 1;
+
+    if (fcn->ram) {
+        ngx_http_file_cache_ram_free(cache, fcn->ram);
+    }
+
+    ngx_http_file_cache_purge_expire(cache, fcn);
+
+    return 1;
+}
+
+
+static void
+ngx_http_file_cache_purge_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_part_t  *part;
+
+    /*
+     * an unused purged node is moved to the tail of its queue, a used
+     * one is moved there as soon as it is released
+     */
+
+    if (!fcn->purged || fcn->count) {
+        return;
+    }
+
+    part = ngx_http_file_cache_node_part(cache, fcn);
+
+    fcn->expire = 0;
+
+    ngx_queue_remove(&fcn->queue);
+    ngx_queue_insert_tail(fcn->protect ? &part->protect : &part->queue,
+                          &fcn->queue);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache, ngx_uint_t n)
+{
+    time_t                       wait;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, start, quota, tries, evicted;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_batch_t  batch;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire: %ui", n);
+
+    if (ngx_http_file_cache_batch_init(cache, &batch, n) != NGX_OK) {
+        return 10;
+    }
+
+    /*
+     * the parts are evicted in turn starting from the next one, each
+     * at most its share of the nodes, so the whole zone is evicted
+     * approximately in the LRU order
+     */
+
+    start = ngx_atomic_fetch_add(&cache->sh->next_part, 1);
+    quota = (batch.nalloc + cache->sh->nparts - 1) / cache->sh->nparts;
+    tries = 20;
+    evicted = 0;
+
+    for (i = 0; i < cache->sh->nparts; i++) {
+        part = &cache->sh->parts[(start + i) % cache->sh->nparts];
+
+        ngx_shmtx_lock(part->mutex);
+
+        rc = ngx_http_file_cache_forced_expire_part(cache, part, &batch,
+                                                    quota, &tries, &evicted);
+
+        ngx_shmtx_unlock(part->mutex);
+
+        if (rc == NGX_OK) {
+            break;
+        }
+    }
+
+    if (evicted) {
+        wait = 0;
+
+    } else if (tries == 0) {
+        wait = 1;
+
+    } else {
+        wait = 10;
+    }
+
+    ngx_http_file_cache_delete_files(cache, &batch);
+
+    cache->files += batch.nelts;
+
+    return wait;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_forced_expire_part(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_http_file_cache_batch_t *batch,
+    ngx_uint_t quota, ngx_uint_t *tries, ngx_uint_t *evicted)
+{
+    ngx_queue_t                 *queue, *q, *prev;
+    ngx_http_file_cache_node_t  *fcn;
+
+    /* the probation segment is evicted first, then the protected one */
+
+    queue = &part->queue;
+
+    for ( ;; ) {
+
+        for (q = ngx_queue_last(queue);
+             q != ngx_queue_sentinel(queue);
+             q = prev)
+        {
+            prev = ngx_queue_prev(q);
+
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+            if (fcn->count == 0) {
+                ngx_http_file_cache_delete(cache, part, q, batch);
+                (void) ngx_atomic_fetch_add(&cache->sh->evicted, 1);
+                (*evicted)++;
+
+                /* the nodes being deleted are still counted */
+
+                if (batch->nelts == batch->nalloc
+                    || ((off_t) cache->sh->size < cache->max_size
+                        && cache->sh->count - batch->nelts
+                           < cache->sh->watermark))
+                {
+                    return NGX_OK;
+                }
+
+                if (--quota == 0) {
+                    return NGX_DECLINED;
+                }
+
+                continue;
+            }
+
+            if (--(*tries)) {
+                continue;
+            }
+
+            return NGX_OK;
+        }
+
+        if (queue == &part->protect) {
+            return NGX_DECLINED;
+        }
+
+        queue = &part->protect;
+    }
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    time_t                       wait, n, protect;
+    ngx_uint_t                   i, start;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_batch_t  batch;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    if (ngx_http_file_cache_batch_init(cache, &batch, cache->manager_files)
+        != NGX_OK)
+    {
+        return 10;
+    }
+
+    /*
+     * the files are deleted after the queue walk, the nodes to delete
+     * are only marked here and skipped;  the walk continues from the next
+     * part if the previous one stopped on the limits
+     */
+
+    wait = 10;
+    start = ngx_atomic_fetch_add(&cache->sh->next_part, 1);
+
+    for (i = 0; i < cache->sh->nparts && wait; i++) {
+        part = &cache->sh->parts[(start + i) % cache->sh->nparts];
+
+        ngx_shmtx_lock(part->mutex);
+
+        n = ngx_http_file_cache_expire_queue(cache, part, &part->queue,
+                                             &batch);
+
+        if (n) {
+            protect = ngx_http_file_cache_expire_queue(cache, part,
+                                                       &part->protect, &batch);
+            n = ngx_min(n, protect);
+        }
+
+        ngx_shmtx_unlock(part->mutex);
+
+        wait = ngx_min(wait, n);
+    }
+
+    ngx_http_file_cache_delete_files(cache, &batch);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_queue_t *queue,
+    ngx_http_file_cache_batch_t *batch)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q, *prev;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    now = ngx_time();
+
+    q = ngx_queue_last(queue);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        if (q == ngx_queue_sentinel(queue)) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        prev = ngx_queue_prev(q);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, part, q, batch);
+            q = prev;
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(queue, &fcn->queue);
+
+        q = prev;
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files
+            || batch->nelts == batch->nalloc)
+        {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    return wait;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_batch_init(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_batch_t *batch, ngx_uint_t n)
+{
+    u_char  *p;
+
+    if (n == 0) {
+        n = 1;
+    }
+
+    batch->len = cache->path->name.len + 1 + cache->path->len
+                 + 2 * NGX_HTTP_CACHE_KEY_LEN + 1;
+
+    p = ngx_alloc(n * (sizeof(ngx_http_file_cache_node_t *) + batch->len),
+                  ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    batch->nodes = (ngx_http_file_cache_node_t **) p;
+    batch->names = p + n * sizeof(ngx_http_file_cache_node_t *);
+    batch->nelts = 0;
+    batch->nalloc = n;
+    batch->next = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_part_t *part, ngx_queue_t *q,
+    ngx_http_file_cache_batch_t *batch)
+{
+    u_char                      *p, *name;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                    -(ngx_atomic_int_t) fcn->fs_size);
+
+        if (fcn->ram) {
+            ngx_http_file_cache_ram_free(cache, fcn->ram);
+        }
+
+        path = cache->path;
+        name = batch->names + batch->nelts * batch->len;
+
+        p = ngx_cpymem(name, path->name.data, path->name.len);
+        p += 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        ngx_create_hashed_filename(path, name, batch->len - 1);
+
+        /* the file is deleted by ngx_http_file_cache_delete_files() */
+
+        fcn->count++;
+        fcn->deleting = 1;
+
+        batch->nodes[batch->nelts++] = fcn;
+
+        return;
+    }
+
+    if (fcn->count == 0) {
+        ngx_http_file_cache_free_node(cache, part, fcn);
+    }
+}
+
+
+static void
+ngx_http_file_cache_delete_files(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_batch_t *batch)
+{
+    ngx_uint_t                   i;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (batch->nelts) {
+
+#if (NGX_THREADS)
+
+        if (cache->manager_threads > 1 && batch->nelts > 1) {
+            ngx_http_file_cache_run_threads(ngx_min(cache->manager_threads,
+                                                    batch->nelts),
+                                            ngx_http_file_cache_delete_handler,
+                                            batch);
+        } else {
+            (void) ngx_http_file_cache_delete_handler(batch);
+        }
+
+#else
+        (void) ngx_http_file_cache_delete_handler(batch);
+#endif
+
+        for (i = 0; i < batch->nelts; i++) {
+            fcn = batch->nodes[i];
+            part = ngx_http_file_cache_node_part(cache, fcn);
+
+            ngx_shmtx_lock(part->mutex);
+
+            fcn->count--;
+            fcn->deleting = 0;
+
+            if (fcn->count == 0) {
+                ngx_http_file_cache_free_node(cache, part, fcn);
+            }
+
+            ngx_shmtx_unlock(part->mutex);
+        }
+    }
+
+    ngx_free(batch->nodes);
+}
 
-    c->updated = 1;
-    c->updating = 0;
 
-    uniq = 0;
-    fs_size = 0;
+static void *
+ngx_http_file_cache_delete_handler(void *data)
+{
+    ngx_http_file_cache_batch_t *batch = data;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+    u_char      *name;
+    ngx_uint_t   i;
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+    for ( ;; ) {
+        i = ngx_atomic_fetch_add(&batch->next, 1);
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+        if (i >= batch->nelts) {
+            break;
+        }
 
-    if (rc == NGX_OK) {
+        name = batch->names + i * batch->len;
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
 
-            rc = NGX_ERROR;
+        /* the nodes loaded from an index may refer to removed files */
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        if (ngx_delete_file(name) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
         }
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    return NULL;
+}
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
+    off_t       size;
+    time_t      wait;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark;
+
+    if (cache->index.len) {
+
+        if (cache->index_saved == 0) {
+            cache->index_saved = ngx_time();
+
+        } else if (ngx_time() - cache->index_saved >= cache->index_interval) {
+            ngx_http_file_cache_index_save(cache, 0);
+            ngx_time_update();
+            cache->index_saved = ngx_time();
+        }
     }
 
-    c->node->updating = 0;
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-}
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
 
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
-{
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    for ( ;; ) {
+        size = (off_t) cache->sh->size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
 
-    c = r->cache;
+        if (size < cache->max_size && count < watermark) {
+            break;
+        }
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+        wait = ngx_http_file_cache_forced_expire(cache,
+                                          cache->manager_files - cache->files);
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
 
-        /* cache file may have been deleted */
+        if (cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
         }
+    }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
-        return;
+done:
+
+    if (cache->index.len && next > (ngx_msec_t) cache->index_interval * 1000) {
+        next = (ngx_msec_t) cache->index_interval * 1000;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_int_t                          rc;
+    ngx_tree_ctx_t                     tree;
+    ngx_http_file_cache_loader_ctx_t   lctx;
+#if (NGX_THREADS)
+    ngx_pool_t                        *pool;
+#endif
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
     }
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
-        goto done;
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
     }
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
 
-    if (n == NGX_ERROR) {
-        goto done;
+    ngx_memzero(&lctx, sizeof(ngx_http_file_cache_loader_ctx_t));
+
+    lctx.cache = cache;
+    lctx.last = ngx_current_msec;
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = &lctx;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+#if (NGX_THREADS)
+
+    if (cache->loader_threads > 1) {
+
+        /*
+         * the top level directories are collected by the walk,
+         * and then loaded in parallel by the threads
+         */
+
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        if (pool == NULL) {
+            cache->sh->loading = 0;
+            return;
+        }
+
+        lctx.shards = ngx_array_create(pool, 16, sizeof(ngx_str_t));
+        if (lctx.shards == NULL) {
+            ngx_destroy_pool(pool);
+            cache->sh->loading = 0;
+            return;
+        }
+
+        tree.pre_tree_handler = ngx_http_file_cache_loader_shards;
     }
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
+#endif
+
+    rc = ngx_walk_tree(&tree, &cache->path->name);
+
+#if (NGX_THREADS)
+
+    if (lctx.shards) {
+
+        if (rc != NGX_ABORT && lctx.shards->nelts) {
+            ngx_http_file_cache_run_threads(ngx_min(cache->loader_threads,
+                                                    lctx.shards->nelts),
+                                            ngx_http_file_cache_loader_thread,
+                                            &lctx);
+
+            if (lctx.aborted) {
+                rc = NGX_ABORT;
+            }
+        }
+
+        ngx_destroy_pool(lctx.shards->pool);
     }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
+#endif
+
+    if (rc == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
     }
 
-    /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
-     */
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
 
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t                         elapsed;
+    ngx_http_file_cache_t             *cache;
+    ngx_http_file_cache_loader_ctx_t  *lctx;
+
+    lctx = ctx->data;
+    cache = lctx->cache;
+
+    if (cache->index.len
+        && path->len >= cache->index.len
+        && ngx_strncmp(path->data, cache->index.data, cache->index.len) == 0)
+    {
+        /* the index and its temporary files */
+        return NGX_OK;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++lctx->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(lctx);
+
+    } else {
+        ngx_time_update();
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - lctx->last));
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(lctx);
+        }
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
 
-done:
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
     }
+
+    return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_loader_ctx_t *lctx)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    ngx_msleep(lctx->cache->loader_sleep);
 
-    c = r->cache;
+    ngx_time_update();
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+    lctx->last = ngx_current_msec;
+    lctx->files = 0;
+}
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_file_cache_loader_shards(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_str_t                         *shard;
+    ngx_http_file_cache_loader_ctx_t  *lctx;
+
+    if (ngx_http_file_cache_manage_directory(ctx, path) == NGX_DECLINED) {
+        return NGX_DECLINED;
     }
 
-    /* we need to allocate all before the header would be sent */
+    lctx = ctx->data;
 
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    shard = ngx_array_push(lctx->shards);
+    if (shard == NULL) {
+        return NGX_ABORT;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    shard->len = path->len;
+    shard->data = ngx_pnalloc(lctx->shards->pool, path->len + 1);
+    if (shard->data == NULL) {
+        return NGX_ABORT;
     }
 
-    rc = ngx_http_send_header(r);
+    (void) ngx_cpystrn(shard->data, path->data, path->len + 1);
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
-    }
+    /* the directory will be walked by a loader thread */
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    return NGX_DECLINED;
+}
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+static void *
+ngx_http_file_cache_loader_thread(void *data)
+{
+    ngx_http_file_cache_loader_ctx_t  *shared = data;
 
-    out.buf = b;
-    out.next = NULL;
+    ngx_str_t                         *shards;
+    ngx_uint_t                         i;
+    ngx_tree_ctx_t                     tree;
+    ngx_http_file_cache_loader_ctx_t   lctx;
 
-    return ngx_http_output_filter(r, &out);
+    ngx_memzero(&lctx, sizeof(ngx_http_file_cache_loader_ctx_t));
+
+    lctx.cache = shared->cache;
+    lctx.last = ngx_current_msec;
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = &lctx;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    shards = shared->shards->elts;
+
+    while (!shared->aborted) {
+        i = ngx_atomic_fetch_add(&shared->next, 1);
+
+        if (i >= shared->shards->nelts) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader shard: \"%V\"", &shards[i]);
+
+        if (ngx_walk_tree(&tree, &shards[i]) == NGX_ABORT) {
+            shared->aborted = 1;
+        }
+    }
+
+    return NULL;
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static void
+ngx_http_file_cache_run_threads(ngx_uint_t n, void *(*handler)(void *data),
+    void *data)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    int         err;
+    sigset_t    set, old;
+    pthread_t  *tids;
+    ngx_uint_t  i, started;
 
-    if (c->updated || c->node == NULL) {
-        return;
-    }
+    started = 0;
 
-    cache = c->file_cache;
+    tids = ngx_alloc(n * sizeof(pthread_t), ngx_cycle->log);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    if (tids) {
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        /* signals are handled by the calling thread only */
 
-    fcn = c->node;
-    fcn->count--;
+        sigfillset(&set);
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+        err = pthread_sigmask(SIG_BLOCK, &set, &old);
+        if (err) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                          "pthread_sigmask() failed");
+            n = 1;
+        }
 
-    if (c->error) {
-        fcn->error = c->error;
+        for (i = 1; i < n; i++) {
+            err = pthread_create(&tids[started], NULL, handler, data);
+            if (err) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                              "pthread_create() failed");
+                break;
+            }
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+            started++;
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
+        if (n > 1) {
+            (void) pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache threads: %ui of %ui", started + 1, n);
 
-    c->updated = 1;
-    c->updating = 0;
-
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+    (void) handler(data);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
+    for (i = 0; i < started; i++) {
+        err = pthread_join(tids[i], NULL);
+        if (err) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                          "pthread_join() failed");
         }
     }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+    if (tids) {
+        ngx_free(tids);
     }
 }
 
+#endif
+
 
-static void
-ngx_http_file_cache_cleanup(void *data)
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
 {
-    ngx_http_cache_t  *c = data;
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_str_t               key;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+    u_char                  buf[4096];
 
-    if (c->updated) {
-        return;
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
 
-    if (c->updating) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
     }
 
-    ngx_http_file_cache_free(c, NULL);
-}
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
 
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ((ngx_http_file_cache_loader_ctx_t *) ctx->data)->cache;
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+        p += 2;
 
-    wait = 10;
-    tries = 20;
+        c.key[i] = (u_char) n;
+    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /* the keys are needed for wildcard purge */
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
+    if (cache->purger
+        && ngx_http_file_cache_read_key(ctx, name, buf, sizeof(buf), &key)
+           == NGX_OK)
     {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        c.keys.elts = &key;
+        c.keys.nelts = 1;
+    }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    return ngx_http_file_cache_add(cache, &c);
+}
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
 
-        } else {
-            if (--tries) {
-                continue;
-            }
+static ngx_int_t
+ngx_http_file_cache_read_key(ngx_tree_ctx_t *ctx, ngx_str_t *name,
+    u_char *buf, size_t size, ngx_str_t *key)
+{
+    u_char                        *p, *last;
+    ssize_t                        n;
+    ngx_file_t                     file;
+    ngx_http_file_cache_header_t  *h;
 
-            wait = 1;
-        }
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-        break;
-    }
+    file.name = *name;
+    file.log = ctx->log;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-    ngx_free(name);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name->data);
+        return NGX_ERROR;
+    }
 
-    return wait;
-}
+    n = ngx_read_file(&file, buf, size, 0);
 
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    h = (ngx_http_file_cache_header_t *) buf;
+    p = buf + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (n < p - buf
+        || h->version != NGX_HTTP_CACHE_VERSION
+        || ngx_memcmp(buf + sizeof(ngx_http_file_cache_header_t),
+                      ngx_http_file_cache_key,
+                      sizeof(ngx_http_file_cache_key))
+           != 0)
+    {
+        return NGX_DECLINED;
+    }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    /* longer keys are not known until the cache entry is used */
+
+    last = ngx_strlchr(p, buf + n, LF);
+    if (last == NULL) {
+        return NGX_DECLINED;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    key->len = last - p;
+    key->data = p;
 
-    now = ngx_time();
+    return NGX_OK;
+}
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    for ( ;; ) {
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
+
+    part = ngx_http_file_cache_part(cache, c->key);
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    ngx_shmtx_lock(part->mutex);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
 
-        q = ngx_queue_last(&cache->sh->queue);
+    if (fcn == NULL) {
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
 
-        wait = fcn->expire - now;
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
+            ngx_shmtx_unlock(part->mutex);
+            return NGX_ERROR;
         }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        part->count++;
+        (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        ngx_rbtree_insert(&part->rbtree, &fcn->node);
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+
+        (void) ngx_atomic_fetch_add(&cache->sh->size, c->fs_size);
 
-        ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+        ngx_queue_insert_head(&part->queue, &fcn->queue);
+    }
 
-next:
+    /*
+     * the nodes already known, either used since the start
+     * or loaded from the index, keep their place in the queue
+     */
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    if (cache->purger && fcn->text == NULL && c->keys.nelts) {
+        ngx_http_file_cache_set_text(cache, part, fcn, c->keys.elts,
+                                     c->keys.nelts);
+    }
 
-        ngx_time_update();
+    ngx_shmtx_unlock(part->mutex);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    return NGX_OK;
+}
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
-        }
-    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-    ngx_free(name);
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
 
-    return wait;
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+static ngx_int_t
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache, ngx_log_t *log)
+{
+    ssize_t                              n;
+    ngx_int_t                            rc;
+    ngx_file_t                           file;
+    ngx_http_file_cache_index_header_t   h;
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    file.name = cache->index;
+    file.log = log;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+    file.fd = ngx_open_file(cache->index.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed",
+                          cache->index.data);
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+        return NGX_DECLINED;
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+    rc = NGX_DECLINED;
+
+    n = ngx_read_file(&file, (u_char *) &h, sizeof(h), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
     }
-}
 
+    if ((size_t) n != sizeof(h)
+        || ngx_memcmp(h.magic, ngx_http_file_cache_index_magic,
+                      sizeof(h.magic)) != 0
+        || h.version != NGX_HTTP_CACHE_INDEX_VERSION
+        || h.entry_size != sizeof(ngx_http_file_cache_index_entry_t))
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache index \"%s\" has incompatible format, ignored",
+                      cache->index.data);
+        goto done;
+    }
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+    if (h.bsize != cache->bsize) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache index \"%s\" was saved with different "
+                      "block size, ignored", cache->index.data);
+        goto done;
+    }
 
-    off_t       size;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    /* the first pass checks the snapshot, the second one loads it */
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    if (ngx_http_file_cache_index_read(cache, &file, &h, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache index \"%s\" is corrupted, ignored",
+                      cache->index.data);
+        goto done;
+    }
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    if (ngx_http_file_cache_index_read(cache, &file, &h, 1) != NGX_OK) {
+        h.clean = 0;
+    }
 
-    if (next == 0) {
-        next = cache->manager_sleep;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V loaded %ui of %ui entries "
+                  "from index%s", &cache->path->name, cache->sh->count,
+                  h.count, h.clean ? "" : ", loader is still needed");
+
+    if (!h.clean) {
         goto done;
     }
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    /*
+     * the snapshot will not reflect the cache state anymore,
+     * so it must not be trusted on the next start
+     */
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+    h.clean = 0;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto done;
+    }
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+    rc = NGX_OK;
 
-        if (size < cache->max_size && count < watermark) {
-            break;
-        }
+done:
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", cache->index.data);
+    }
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
-        }
+    return rc;
+}
 
-        if (ngx_quit || ngx_terminate) {
-            break;
-        }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
+static ngx_int_t
+ngx_http_file_cache_index_read(ngx_http_file_cache_t *cache, ngx_file_t *file,
+    ngx_http_file_cache_index_header_t *h, ngx_uint_t insert)
+{
+    u_char                             *texts, *text, *last;
+    off_t                               offset;
+    size_t                              size;
+    time_t                              now;
+    ssize_t                             n;
+    uint32_t                            crc32;
+    ngx_uint_t                          i, left, count;
+    ngx_http_file_cache_index_entry_t  *entries;
+
+    entries = ngx_alloc(NGX_HTTP_CACHE_INDEX_CHUNK
+                        * sizeof(ngx_http_file_cache_index_entry_t),
+                        file->log);
+    if (entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_crc32_init(crc32);
+
+    texts = NULL;
+
+    if (h->text_size) {
+        texts = ngx_alloc(h->text_size, file->log);
+        if (texts == NULL) {
+            ngx_free(entries);
+            return NGX_ERROR;
         }
 
-        ngx_time_update();
+        offset = sizeof(ngx_http_file_cache_index_header_t)
+                 + h->count * sizeof(ngx_http_file_cache_index_entry_t);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        n = ngx_read_file(file, texts, h->text_size, offset);
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+        if (n == NGX_ERROR || (size_t) n != h->text_size) {
+            left = h->count;
+            goto done;
         }
     }
 
-done:
+    now = ngx_time();
+    offset = sizeof(ngx_http_file_cache_index_header_t);
+    text = texts;
+    last = texts + h->text_size;
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    for (left = h->count; left; left -= count) {
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+        count = ngx_min(left, NGX_HTTP_CACHE_INDEX_CHUNK);
+        size = count * sizeof(ngx_http_file_cache_index_entry_t);
 
-    return next;
-}
+        n = ngx_read_file(file, (u_char *) entries, size, offset);
 
+        if (n == NGX_ERROR || (size_t) n != size) {
+            break;
+        }
 
-static void
-ngx_http_file_cache_loader(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+        offset += size;
 
-    ngx_tree_ctx_t  tree;
+        if (!insert) {
+            ngx_crc32_update(&crc32, (u_char *) entries, size);
+            continue;
+        }
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
-    }
+        for (i = 0; i < count; i++) {
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
-    }
+            if ((size_t) (last - text) < entries[i].text_len) {
+                break;
+            }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+            ngx_http_file_cache_index_insert(cache, &entries[i], text, now,
+                                             h->saved);
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+            text += entries[i].text_len;
+        }
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+        if (i < count || cache->sh->watermark != (ngx_uint_t) -1) {
+            /* the texts are inconsistent or the keys zone is full */
+            break;
+        }
+    }
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+done:
+
+    if (texts && left == 0 && !insert) {
+        ngx_crc32_update(&crc32, texts, h->text_size);
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    ngx_free(texts);
+    ngx_free(entries);
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    if (left) {
+        return NGX_ERROR;
+    }
 
+    if (insert) {
+        return NGX_OK;
+    }
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
+    ngx_crc32_final(crc32);
+
+    return (crc32 == h->crc32) ? NGX_OK : NGX_ERROR;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_index_insert(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_entry_t *e, u_char *text, time_t now,
+    time_t saved)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    time_t                       inactive;
+    ngx_str_t                    key;
+    ngx_http_file_cache_part_t  *part;
+    ngx_http_file_cache_node_t  *fcn;
 
-    cache = ctx->data;
+    if (cache->sh->watermark != (ngx_uint_t) -1) {
+        return;
+    }
+
+    if (ngx_http_file_cache_lookup(cache, e->key) != NULL) {
+        return;
+    }
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+        return;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    part = ngx_http_file_cache_part(cache, e->key);
 
-    } else {
-        ngx_time_update();
+    part->count++;
+    (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_memcpy((u_char *) &fcn->node.key, e->key, sizeof(ngx_rbtree_key_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    ngx_memcpy(fcn->key, &e->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
-    }
+    ngx_rbtree_insert(&part->rbtree, &fcn->node);
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+    /* the time spent stopped is not counted as inactivity */
 
+    inactive = e->expire - saved;
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    if (inactive > cache->inactive) {
+        inactive = cache->inactive;
+
+    } else if (inactive < 0) {
+        inactive = 0;
     }
 
-    return NGX_OK;
-}
+    fcn->uses = e->uses;
+    fcn->valid_msec = e->valid_msec;
+    fcn->error = e->error;
+    fcn->exists = e->exists;
+    fcn->uniq = e->uniq;
+    fcn->expire = now + inactive;
+    fcn->valid_sec = e->valid_sec;
+    fcn->body_start = e->body_start;
+    fcn->fs_size = e->fs_size;
+    fcn->purged = e->purged;
+
+    if (cache->purger && e->text_len) {
+        key.len = e->text_len;
+        key.data = text;
+
+        ngx_http_file_cache_set_text(cache, part, fcn, &key, 1);
+    }
 
+    if (fcn->exists) {
+        (void) ngx_atomic_fetch_add(&cache->sh->size, fcn->fs_size);
+    }
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+    if (e->protect) {
+        fcn->protect = 1;
+        part->protect_count++;
 
-    ngx_time_update();
+        ngx_queue_insert_head(&part->protect, &fcn->queue);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    } else {
+        ngx_queue_insert_head(&part->queue, &fcn->queue);
+    }
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+static void
+ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache, ngx_uint_t clean)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
-
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
+    u_char                              *p, *name;
+    size_t                               len;
+    ngx_err_t                            err;
+    ngx_uint_t                           i, n, count;
+    ngx_pool_t                          *pool;
+    ngx_file_t                           file;
+    ngx_array_t                         *texts;
+    ngx_queue_t                         *queue, *q;
+    ngx_http_file_cache_part_t          *part;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_entry_t   *entries, *e;
+    ngx_http_file_cache_index_header_t   h;
+
+    n = cache->sh->count;
+
+    entries = ngx_alloc((n ? n : 1) * sizeof(ngx_http_file_cache_index_entry_t),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        return;
     }
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    name = ngx_alloc(cache->index.len + 1 + NGX_INT64_LEN + 1, ngx_cycle->log);
+    if (name == NULL) {
+        ngx_free(entries);
+        return;
+    }
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        ngx_free(name);
+        ngx_free(entries);
+        return;
     }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+    texts = ngx_array_create(pool, ngx_pagesize, 1);
+    if (texts == NULL) {
+        goto failed;
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    count = 0;
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    /* the nodes are saved part by part, each in its own LRU order */
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    for (i = 0; i < cache->sh->nparts; i++) {
+        part = &cache->sh->parts[i];
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        ngx_shmtx_lock(part->mutex);
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
+        queue = &part->queue;
 
-        p += 2;
+        for (q = ngx_queue_last(queue); count < n; q = ngx_queue_prev(q)) {
 
-        c.key[i] = (u_char) n;
-    }
+            if (q == ngx_queue_sentinel(queue)) {
 
-    return ngx_http_file_cache_add(cache, &c);
-}
+                if (queue == &part->protect) {
+                    break;
+                }
 
+                queue = &part->protect;
+                q = queue;
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_node_t  *fcn;
+                continue;
+            }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+            if (!(fcn->exists || fcn->error) || fcn->deleting) {
+                continue;
+            }
 
-    if (fcn == NULL) {
+            e = &entries[count++];
+
+            ngx_memcpy(e->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&e->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            e->uniq = fcn->uniq;
+            e->expire = fcn->expire;
+            e->valid_sec = fcn->valid_sec;
+            e->fs_size = fcn->fs_size;
+            e->body_start = fcn->body_start;
+            e->uses = (u_short) fcn->uses;
+            e->valid_msec = (u_short) fcn->valid_msec;
+            e->error = (u_short) fcn->error;
+            e->exists = (u_short) fcn->exists;
+            e->protect = (u_short) fcn->protect;
+            e->purged = (u_short) fcn->purged;
+            e->text_len = 0;
+
+            if (fcn->text == NULL || fcn->text->sn.str.len > 0xffff) {
+                continue;
+            }
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+            len = fcn->text->sn.str.len;
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
+            p = ngx_array_push_n(texts, len);
+            if (p == NULL) {
+                continue;
             }
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+            ngx_memcpy(p, fcn->text->sn.str.data, len);
+            e->text_len = (u_short) len;
         }
 
-        cache->sh->count++;
+        ngx_shmtx_unlock(part->mutex);
+    }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    /* an interrupted loader leaves some files unknown */
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    if (cache->sh->cold) {
+        clean = 0;
+    }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_memzero(&h, sizeof(h));
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    ngx_memcpy(h.magic, ngx_http_file_cache_index_magic, sizeof(h.magic));
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.entry_size = sizeof(ngx_http_file_cache_index_entry_t);
+    h.bsize = cache->bsize;
+    h.saved = ngx_time();
+    h.count = count;
+    h.text_size = texts->nelts;
+    h.clean = clean;
 
-        cache->sh->size += c->fs_size;
+    ngx_crc32_init(h.crc32);
+    ngx_crc32_update(&h.crc32, (u_char *) entries,
+                     count * sizeof(ngx_http_file_cache_index_entry_t));
+    ngx_crc32_update(&h.crc32, texts->elts, texts->nelts);
+    ngx_crc32_final(h.crc32);
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    (void) ngx_sprintf(name, "%V.%P%Z", &cache->index, ngx_pid);
+
+    file.name.data = name;
+    file.name.len = ngx_strlen(name);
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        goto failed;
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    len = count * sizeof(ngx_http_file_cache_index_entry_t);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR
+        || ngx_write_file(&file, (u_char *) entries, len, sizeof(h))
+           == NGX_ERROR
+        || ngx_write_file(&file, texts->elts, texts->nelts, sizeof(h) + len)
+           == NGX_ERROR)
+    {
+        goto close;
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
 
-    return NGX_OK;
-}
+    if (ngx_rename_file(name, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      name, cache->index.data);
+        goto delete;
+    }
 
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index saved: \"%V\" %ui c:%ui",
+                   &cache->index, count, clean);
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    goto failed;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+close:
+
+    err = ngx_errno;
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
     }
 
-    return NGX_OK;
+    ngx_set_errno(err);
+
+delete:
+
+    if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
+
+failed:
+
+    ngx_destroy_pool(pool);
+    ngx_free(name);
+    ngx_free(entries);
 }
 
 
 static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_saver(void *data)
 {
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    ngx_http_file_cache_t  *cache = data;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    ngx_http_file_cache_index_save(cache, 1);
 }
 
 
@@ -2267,12 +4354,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     off_t                   max_size;
     u_char                 *last, *p;
     time_t                  inactive;
-    ssize_t                 size;
+    ssize_t                 size, ram_size, ram_max;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_int_t               loader_files, manager_files, loader_threads,
+                            manager_threads;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, policy, purger;
+    ngx_str_t               index;
+    time_t                  index_interval;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2289,14 +4379,25 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     use_temp_path = 1;
 
     inactive = 600;
+    policy = NGX_HTTP_CACHE_POLICY_LRU;
+
+    ram_size = 0;
+    ram_max = 16384;
+
+    purger = 0;
 
     loader_files = 100;
     loader_sleep = 50;
     loader_threshold = 200;
+    loader_threads = 1;
 
     manager_files = 100;
     manager_sleep = 50;
     manager_threshold = 200;
+    manager_threads = 1;
+
+    ngx_str_null(&index);
+    index_interval = 300;
 
     name.len = 0;
     size = 0;
@@ -2412,6 +4513,78 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+
+            if (ngx_strcmp(&value[i].data[7], "lru") == 0) {
+                policy = NGX_HTTP_CACHE_POLICY_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "slru") == 0) {
+                policy = NGX_HTTP_CACHE_POLICY_SLRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "tinylfu") == 0) {
+                policy = NGX_HTTP_CACHE_POLICY_TINYLFU;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid policy value \"%V\", "
+                                   "it must be \"lru\", \"slru\" "
+                                   "or \"tinylfu\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_size=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            ram_size = ngx_parse_size(&s);
+            if (ram_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_max=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            ram_max = ngx_parse_size(&s);
+            if (ram_max == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_max value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "purger=", 7) == 0) {
+
+            if (ngx_strcmp(&value[i].data[7], "on") == 0) {
+                purger = 1;
+
+            } else if (ngx_strcmp(&value[i].data[7], "off") == 0) {
+                purger = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid purger value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2469,6 +4642,29 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "loader_threads=", 15) == 0) {
+
+            loader_threads = ngx_atoi(value[i].data + 15, value[i].len - 15);
+            if (loader_threads == NGX_ERROR || loader_threads == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid loader_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_THREADS)
+
+            if (loader_threads > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"loader_threads\" is unsupported "
+                                   "on this platform");
+                return NGX_CONF_ERROR;
+            }
+
+#endif
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "manager_files=", 14) == 0) {
 
             manager_files = ngx_atoi(value[i].data + 14, value[i].len - 14);
@@ -2511,6 +4707,62 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "manager_threads=", 16) == 0) {
+
+            manager_threads = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (manager_threads == NGX_ERROR || manager_threads == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_THREADS)
+
+            if (manager_threads > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"manager_threads\" is unsupported "
+                                   "on this platform");
+                return NGX_CONF_ERROR;
+            }
+
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            index.len = value[i].len - 6;
+            index.data = value[i].data + 6;
+
+            if (index.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &index, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR || index_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2531,9 +4783,17 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_files = loader_files;
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
+    cache->loader_threads = loader_threads;
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->manager_threads = manager_threads;
+
+    if (index.len) {
+        cache->path->saver = ngx_http_file_cache_saver;
+        cache->index = index;
+        cache->index_interval = index_interval;
+    }
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -2552,11 +4812,16 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 
     cache->shm_zone->init = ngx_http_file_cache_init;
+    cache->shm_zone->unlock = ngx_http_file_cache_force_unlock;
     cache->shm_zone->data = cache;
 
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
+    cache->policy = policy;
+    cache->ram_size = ram_size;
+    cache->ram_max = ram_max;
+    cache->purger = purger;
     cache->max_size = max_size;
 
     caches = (ngx_array_t *) (confp + cmd->offset);
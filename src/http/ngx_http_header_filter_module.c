@@ -11,6 +11,18 @@
 #include <nginx.h>
 
 
+typedef struct {
+    /* "Server: ...\r\nDate: " */
+    ngx_str_t                  server_date;
+
+    /* "Connection: keep-alive\r\nKeep-Alive: timeout=...\r\n" */
+    ngx_str_t                  keepalive;
+} ngx_http_header_filter_conf_t;
+
+
+static void *ngx_http_header_filter_create_conf(ngx_conf_t *cf);
+static char *ngx_http_header_filter_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
 static ngx_int_t ngx_http_header_filter_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_header_filter(ngx_http_request_t *r);
 
@@ -25,8 +37,8 @@ static ngx_http_module_t  ngx_http_header_filter_module_ctx = {
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL,                                  /* merge location configuration */
+    ngx_http_header_filter_create_conf,    /* create location configuration */
+    ngx_http_header_filter_merge_conf      /* merge location configuration */
 };
 
 
@@ -49,6 +61,10 @@ ngx_module_t  ngx_http_header_filter_module = {
 static char ngx_http_server_string[] = "Server: nginx" CRLF;
 static char ngx_http_server_full_string[] = "Server: " NGINX_VER CRLF;
 
+static char ngx_http_server_date_string[] = "Server: nginx" CRLF "Date: ";
+static char ngx_http_server_full_date_string[] =
+    "Server: " NGINX_VER CRLF "Date: ";
+
 
 static ngx_str_t ngx_http_status_lines[] = {
 
@@ -150,18 +166,19 @@ ngx_http_header_out_t  ngx_http_headers_out[] = {
 static ngx_int_t
 ngx_http_header_filter(ngx_http_request_t *r)
 {
-    u_char                    *p;
-    size_t                     len;
-    ngx_str_t                  host, *status_line;
-    ngx_buf_t                 *b;
-    ngx_uint_t                 status, i, port;
-    ngx_chain_t                out;
-    ngx_list_part_t           *part;
-    ngx_table_elt_t           *header;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
-    ngx_http_core_srv_conf_t  *cscf;
-    u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                         *p, *last;
+    size_t                          len;
+    ngx_str_t                       host, *status_line;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      status, i, port;
+    ngx_chain_t                     out;
+    ngx_list_part_t                *part;
+    ngx_table_elt_t                *header;
+    ngx_connection_t               *c;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_core_srv_conf_t       *cscf;
+    ngx_http_header_filter_conf_t  *hfcf;
+    u_char                          addr[NGX_SOCKADDR_STRLEN];
 
     if (r->header_sent) {
         return NGX_OK;
@@ -272,6 +289,7 @@ ngx_http_header_filter(ngx_http_request_t *r)
     }
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    hfcf = ngx_http_get_module_loc_conf(r, ngx_http_header_filter_module);
 
     if (r->headers_out.server == NULL) {
         len += clcf->server_tokens ? sizeof(ngx_http_server_full_string) - 1:
@@ -366,19 +384,7 @@ ngx_http_header_filter(ngx_http_request_t *r)
         len += sizeof("Connection: upgrade" CRLF) - 1;
 
     } else if (r->keepalive) {
-        len += sizeof("Connection: keep-alive" CRLF) - 1;
-
-        /*
-         * MSIE and Opera ignore the "Keep-Alive: timeout=<N>" header.
-         * MSIE keeps the connection alive for about 60-65 seconds.
-         * Opera keeps the connection alive very long.
-         * Mozilla keeps the connection alive for N plus about 1-10 seconds.
-         * Konqueror keeps the connection alive for about N seconds.
-         */
-
-        if (clcf->keepalive_header) {
-            len += sizeof("Keep-Alive: timeout=") - 1 + NGX_TIME_T_LEN + 2;
-        }
+        len += hfcf->keepalive.len;
 
     } else {
         len += sizeof("Connection: close" CRLF) - 1;
@@ -435,7 +441,15 @@ ngx_http_header_filter(ngx_http_request_t *r)
     }
     *b->last++ = CR; *b->last++ = LF;
 
-    if (r->headers_out.server == NULL) {
+    if (r->headers_out.server == NULL && r->headers_out.date == NULL) {
+        b->last = ngx_cpymem(b->last, hfcf->server_date.data,
+                             hfcf->server_date.len);
+        b->last = ngx_cpymem(b->last, ngx_cached_http_time.data,
+                             ngx_cached_http_time.len);
+
+        *b->last++ = CR; *b->last++ = LF;
+
+    } else if (r->headers_out.server == NULL) {
         if (clcf->server_tokens) {
             p = (u_char *) ngx_http_server_full_string;
             len = sizeof(ngx_http_server_full_string) - 1;
@@ -446,9 +460,8 @@ ngx_http_header_filter(ngx_http_request_t *r)
         }
 
         b->last = ngx_cpymem(b->last, p, len);
-    }
 
-    if (r->headers_out.date == NULL) {
+    } else if (r->headers_out.date == NULL) {
         b->last = ngx_cpymem(b->last, "Date: ", sizeof("Date: ") - 1);
         b->last = ngx_cpymem(b->last, ngx_cached_http_time.data,
                              ngx_cached_http_time.len);
@@ -539,13 +552,8 @@ ngx_http_header_filter(ngx_http_request_t *r)
                              sizeof("Connection: upgrade" CRLF) - 1);
 
     } else if (r->keepalive) {
-        b->last = ngx_cpymem(b->last, "Connection: keep-alive" CRLF,
-                             sizeof("Connection: keep-alive" CRLF) - 1);
-
-        if (clcf->keepalive_header) {
-            b->last = ngx_sprintf(b->last, "Keep-Alive: timeout=%T" CRLF,
-                                  clcf->keepalive_header);
-        }
+        b->last = ngx_cpymem(b->last, hfcf->keepalive.data,
+                             hfcf->keepalive.len);
 
     } else {
         b->last = ngx_cpymem(b->last, "Connection: close" CRLF,
@@ -578,6 +586,40 @@ ngx_http_header_filter(ngx_http_request_t *r)
             continue;
         }
 
+        /*
+         * the header lines laid out one after another in memory, such as
+         * the lines of the constant "add_header" directives of a location,
+         * are copied at once; the separators between them are tested,
+         * so the copy is the same as the lines copied one by one
+         */
+
+        p = header[i].key.data;
+
+        if (header[i].value.data == p + header[i].key.len + 2
+            && p[header[i].key.len] == ':'
+            && p[header[i].key.len + 1] == ' ')
+        {
+            last = header[i].value.data + header[i].value.len;
+
+            while (i + 1 < part->nelts
+                   && header[i + 1].hash
+                   && header[i + 1].key.data == last + 2
+                   && last[0] == CR && last[1] == LF
+                   && header[i + 1].value.data
+                      == last + 2 + header[i + 1].key.len + 2
+                   && last[2 + header[i + 1].key.len] == ':'
+                   && last[2 + header[i + 1].key.len + 1] == ' ')
+            {
+                i++;
+                last = header[i].value.data + header[i].value.len;
+            }
+
+            b->last = ngx_cpymem(b->last, p, last - p);
+            *b->last++ = CR; *b->last++ = LF;
+
+            continue;
+        }
+
         b->last = ngx_copy(b->last, header[i].key.data, header[i].key.len);
         *b->last++ = ':'; *b->last++ = ' ';
 
@@ -604,6 +646,81 @@ ngx_http_header_filter(ngx_http_request_t *r)
 }
 
 
+static void *
+ngx_http_header_filter_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_header_filter_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_header_filter_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->server_date = { 0, NULL };
+     *     conf->keepalive = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_header_filter_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_header_filter_conf_t *conf = child;
+
+    u_char                    *p;
+    size_t                     len;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    /*
+     * the constant parts of the response header which depend on
+     * the location configuration only are built once
+     */
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (clcf->server_tokens) {
+        ngx_str_set(&conf->server_date, ngx_http_server_full_date_string);
+
+    } else {
+        ngx_str_set(&conf->server_date, ngx_http_server_date_string);
+    }
+
+    /*
+     * MSIE and Opera ignore the "Keep-Alive: timeout=<N>" header.
+     * MSIE keeps the connection alive for about 60-65 seconds.
+     * Opera keeps the connection alive very long.
+     * Mozilla keeps the connection alive for N plus about 1-10 seconds.
+     * Konqueror keeps the connection alive for about N seconds.
+     */
+
+    if (clcf->keepalive_header == 0) {
+        ngx_str_set(&conf->keepalive, "Connection: keep-alive" CRLF);
+        return NGX_CONF_OK;
+    }
+
+    len = sizeof("Connection: keep-alive" CRLF "Keep-Alive: timeout=") - 1
+          + NGX_TIME_T_LEN + 2;
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->keepalive.data = p;
+    conf->keepalive.len = ngx_sprintf(p, "Connection: keep-alive" CRLF
+                                          "Keep-Alive: timeout=%T" CRLF,
+                                       clcf->keepalive_header)
+                          - p;
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_http_header_filter_init(ngx_conf_t *cf)
 {
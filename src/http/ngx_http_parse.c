@@ -98,6 +98,449 @@ static uint32_t  usual[] = {
 #endif
 
 
+#if (NGX_HAVE_SSE2 || NGX_HAVE_NEON)
+
+/*
+ * The vectorized scanners skip runs of bytes that do not change the parser
+ * state and return the first byte that should be passed to the state
+ * machine.  The bytes of the last incomplete block are always left to the
+ * state machine.  The baseline scanners use SSE2, which is always present
+ * on amd64, or NEON; ngx_http_parse_cpu_init() replaces them with the AVX2
+ * ones if the CPU supports them.  SSE4.2 pcmpestri is not used, as it is
+ * slower than the comparisons.
+ */
+
+#if (NGX_HAVE_SSE2)
+
+#include <emmintrin.h>
+
+typedef __m128i  ngx_http_parse_vec_t;
+
+#define ngx_http_parse_vload(p)     _mm_loadu_si128((__m128i *) (p))
+#define ngx_http_parse_veq(v, c)    _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define ngx_http_parse_vor(a, b)    _mm_or_si128(a, b)
+#define ngx_http_parse_vmask(v)     (uint64_t) _mm_movemask_epi8(v)
+#define ngx_http_parse_vfirst(m)    __builtin_ctzll(m)
+
+#else /* NGX_HAVE_NEON */
+
+#include <arm_neon.h>
+
+typedef uint8x16_t  ngx_http_parse_vec_t;
+
+#define ngx_http_parse_vload(p)     vld1q_u8(p)
+#define ngx_http_parse_veq(v, c)    vceqq_u8(v, vdupq_n_u8(c))
+#define ngx_http_parse_vor(a, b)    vorrq_u8(a, b)
+
+/* 4 bits per byte */
+#define ngx_http_parse_vmask(v)                                              \
+    vget_lane_u64(vreinterpret_u64_u8(                                        \
+                      vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+#define ngx_http_parse_vfirst(m)    (__builtin_ctzll(m) >> 2)
+
+#endif
+
+#if (NGX_HAVE_X86_TARGET)
+#include <immintrin.h>
+#endif
+
+
+typedef u_char *(*ngx_http_parse_scan_pt)(u_char *p, u_char *last);
+
+
+static u_char *ngx_http_parse_scan_value(u_char *p, u_char *last);
+static u_char *ngx_http_parse_scan_uri(u_char *p, u_char *last);
+static u_char *ngx_http_parse_scan_check_uri(u_char *p, u_char *last);
+
+#if (NGX_HAVE_X86_TARGET)
+static u_char *ngx_http_parse_scan_value_avx2(u_char *p, u_char *last);
+static u_char *ngx_http_parse_scan_uri_avx2(u_char *p, u_char *last);
+static u_char *ngx_http_parse_scan_check_uri_avx2(u_char *p, u_char *last);
+#endif
+
+
+/* the implementations are selected by ngx_http_parse_cpu_init() */
+
+static ngx_http_parse_scan_pt  ngx_http_parse_value_handler =
+    ngx_http_parse_scan_value;
+static ngx_http_parse_scan_pt  ngx_http_parse_uri_handler =
+    ngx_http_parse_scan_uri;
+static ngx_http_parse_scan_pt  ngx_http_parse_check_uri_handler =
+    ngx_http_parse_scan_check_uri;
+
+
+/*
+ * Up to NGX_HTTP_PARSE_INLINE bytes are matched inline, and only longer
+ * runs are passed to the selected scanner, as a call from the state
+ * machine is not free.
+ */
+
+#define NGX_HTTP_PARSE_INLINE  64
+
+
+/* header value: CR, LF, and "\0" */
+
+static ngx_inline u_char *
+ngx_http_parse_skip_value(u_char *p, u_char *last)
+{
+    u_char                *start, *end;
+    uint64_t               m;
+    ngx_http_parse_vec_t   v, e;
+
+    start = p;
+    end = (last - p > NGX_HTTP_PARSE_INLINE) ? p + NGX_HTTP_PARSE_INLINE
+                                             : last;
+
+    while (end - p >= 16) {
+        v = ngx_http_parse_vload(p);
+
+        e = ngx_http_parse_vor(ngx_http_parse_veq(v, CR),
+                               ngx_http_parse_veq(v, LF));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\0'));
+
+        m = ngx_http_parse_vmask(e);
+
+        if (m) {
+            p += ngx_http_parse_vfirst(m);
+            goto done;
+        }
+
+        p += 16;
+    }
+
+    if (end != last) {
+        p = ngx_http_parse_value_handler(p, last);
+    }
+
+done:
+
+    /* trailing spaces are handled by the state machine */
+
+    while (p > start && p[-1] == ' ') {
+        p--;
+    }
+
+    return p;
+}
+
+
+/* URI in the sw_uri state: space, CR, LF, "#", and "\0" */
+
+static ngx_inline u_char *
+ngx_http_parse_skip_uri(u_char *p, u_char *last)
+{
+    u_char                *end;
+    uint64_t               m;
+    ngx_http_parse_vec_t   v, e;
+
+    end = (last - p > NGX_HTTP_PARSE_INLINE) ? p + NGX_HTTP_PARSE_INLINE
+                                             : last;
+
+    while (end - p >= 16) {
+        v = ngx_http_parse_vload(p);
+
+        e = ngx_http_parse_vor(ngx_http_parse_veq(v, ' '),
+                               ngx_http_parse_veq(v, CR));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, LF));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '#'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\0'));
+
+        m = ngx_http_parse_vmask(e);
+
+        if (m) {
+            return p + ngx_http_parse_vfirst(m);
+        }
+
+        p += 16;
+    }
+
+    if (end != last) {
+        return ngx_http_parse_uri_handler(p, last);
+    }
+
+    return p;
+}
+
+
+/* URI in the sw_check_uri state: the bytes not marked as usual */
+
+static ngx_inline u_char *
+ngx_http_parse_skip_check_uri(u_char *p, u_char *last)
+{
+    u_char                *end;
+    uint64_t               m;
+    ngx_http_parse_vec_t   v, e;
+
+    end = (last - p > NGX_HTTP_PARSE_INLINE) ? p + NGX_HTTP_PARSE_INLINE
+                                             : last;
+
+    while (end - p >= 16) {
+        v = ngx_http_parse_vload(p);
+
+        e = ngx_http_parse_vor(ngx_http_parse_veq(v, '/'),
+                               ngx_http_parse_veq(v, '.'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, ' '));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '%'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '?'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '#'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '+'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, CR));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, LF));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\0'));
+#if (NGX_WIN32)
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\\'));
+#endif
+
+        m = ngx_http_parse_vmask(e);
+
+        if (m) {
+            return p + ngx_http_parse_vfirst(m);
+        }
+
+        p += 16;
+    }
+
+    if (end != last) {
+        return ngx_http_parse_check_uri_handler(p, last);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_parse_scan_value(u_char *p, u_char *last)
+{
+    uint64_t               m;
+    ngx_http_parse_vec_t   v, e;
+
+    while (last - p >= 16) {
+        v = ngx_http_parse_vload(p);
+
+        e = ngx_http_parse_vor(ngx_http_parse_veq(v, CR),
+                               ngx_http_parse_veq(v, LF));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\0'));
+
+        m = ngx_http_parse_vmask(e);
+
+        if (m) {
+            return p + ngx_http_parse_vfirst(m);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_parse_scan_uri(u_char *p, u_char *last)
+{
+    uint64_t               m;
+    ngx_http_parse_vec_t   v, e;
+
+    while (last - p >= 16) {
+        v = ngx_http_parse_vload(p);
+
+        e = ngx_http_parse_vor(ngx_http_parse_veq(v, ' '),
+                               ngx_http_parse_veq(v, CR));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, LF));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '#'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\0'));
+
+        m = ngx_http_parse_vmask(e);
+
+        if (m) {
+            return p + ngx_http_parse_vfirst(m);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_parse_scan_check_uri(u_char *p, u_char *last)
+{
+    uint64_t               m;
+    ngx_http_parse_vec_t   v, e;
+
+    while (last - p >= 16) {
+        v = ngx_http_parse_vload(p);
+
+        e = ngx_http_parse_vor(ngx_http_parse_veq(v, '/'),
+                               ngx_http_parse_veq(v, '.'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, ' '));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '%'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '?'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '#'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '+'));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, CR));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, LF));
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\0'));
+#if (NGX_WIN32)
+        e = ngx_http_parse_vor(e, ngx_http_parse_veq(v, '\\'));
+#endif
+
+        m = ngx_http_parse_vmask(e);
+
+        if (m) {
+            return p + ngx_http_parse_vfirst(m);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+#if (NGX_HAVE_X86_TARGET)
+
+/*
+ * AVX2 scans 32 bytes per step; a remaining block of 16 bytes is scanned
+ * with the baseline scanner.  The upper halves of the registers are
+ * cleared explicitly before returning to the SSE code, as gcc does not
+ * do this for functions with the target attribute.
+ */
+
+#define ngx_http_parse_veq256(v, c)                                          \
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_parse_scan_value_avx2(u_char *p, u_char *last)
+{
+    uint32_t  m;
+    __m256i   v, e;
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        e = _mm256_or_si256(ngx_http_parse_veq256(v, CR),
+                            ngx_http_parse_veq256(v, LF));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '\0'));
+
+        m = _mm256_movemask_epi8(e);
+
+        if (m) {
+            _mm256_zeroupper();
+            return p + __builtin_ctz(m);
+        }
+
+        p += 32;
+    }
+
+    _mm256_zeroupper();
+
+    return ngx_http_parse_scan_value(p, last);
+}
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_parse_scan_uri_avx2(u_char *p, u_char *last)
+{
+    uint32_t  m;
+    __m256i   v, e;
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        e = _mm256_or_si256(ngx_http_parse_veq256(v, ' '),
+                            ngx_http_parse_veq256(v, CR));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, LF));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '#'));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '\0'));
+
+        m = _mm256_movemask_epi8(e);
+
+        if (m) {
+            _mm256_zeroupper();
+            return p + __builtin_ctz(m);
+        }
+
+        p += 32;
+    }
+
+    _mm256_zeroupper();
+
+    return ngx_http_parse_scan_uri(p, last);
+}
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_parse_scan_check_uri_avx2(u_char *p, u_char *last)
+{
+    uint32_t  m;
+    __m256i   v, e;
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        e = _mm256_or_si256(ngx_http_parse_veq256(v, '/'),
+                            ngx_http_parse_veq256(v, '.'));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, ' '));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '%'));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '?'));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '#'));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '+'));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, CR));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, LF));
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '\0'));
+#if (NGX_WIN32)
+        e = _mm256_or_si256(e, ngx_http_parse_veq256(v, '\\'));
+#endif
+
+        m = _mm256_movemask_epi8(e);
+
+        if (m) {
+            _mm256_zeroupper();
+            return p + __builtin_ctz(m);
+        }
+
+        p += 32;
+    }
+
+    _mm256_zeroupper();
+
+    return ngx_http_parse_scan_check_uri(p, last);
+}
+
+#endif
+
+#endif
+
+
+void
+ngx_http_parse_cpu_init(void)
+{
+#if (NGX_HAVE_SSE2 || NGX_HAVE_NEON)
+
+    ngx_http_parse_value_handler = ngx_http_parse_scan_value;
+    ngx_http_parse_uri_handler = ngx_http_parse_scan_uri;
+    ngx_http_parse_check_uri_handler = ngx_http_parse_scan_check_uri;
+
+#if (NGX_HAVE_X86_TARGET)
+
+    if (ngx_cpu_features & NGX_CPU_AVX2) {
+        ngx_http_parse_value_handler = ngx_http_parse_scan_value_avx2;
+        ngx_http_parse_uri_handler = ngx_http_parse_scan_uri_avx2;
+        ngx_http_parse_check_uri_handler =
+                                          ngx_http_parse_scan_check_uri_avx2;
+    }
+
+#endif
+
+#endif
+}
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 
 ngx_int_t
@@ -541,6 +984,9 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+#if (NGX_HAVE_SSE2 || NGX_HAVE_NEON)
+                p = ngx_http_parse_skip_check_uri(p + 1, b->last) - 1;
+#endif
                 break;
             }
 
@@ -627,6 +1073,9 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+#if (NGX_HAVE_SSE2 || NGX_HAVE_NEON)
+                p = ngx_http_parse_skip_uri(p + 1, b->last) - 1;
+#endif
                 break;
             }
 
@@ -1020,6 +1469,11 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 goto done;
             case '\0':
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+#if (NGX_HAVE_SSE2 || NGX_HAVE_NEON)
+            default:
+                p = ngx_http_parse_skip_value(p + 1, b->last) - 1;
+                break;
+#endif
             }
             break;
 
@@ -10,6 +10,16 @@
 #include <ngx_http.h>
 
 
+static ngx_int_t ngx_http_script_compile_ops(ngx_conf_t *cf, u_char *ip,
+    u_char *last, ngx_http_script_op_t **ops);
+static ngx_int_t ngx_http_script_run_ops(ngx_http_request_t *r,
+    ngx_http_script_op_t *ops, ngx_str_t *value);
+static size_t ngx_http_script_ops_len(ngx_http_request_t *r,
+    ngx_http_script_op_t *op);
+static u_char *ngx_http_script_ops_copy(ngx_http_request_t *r,
+    ngx_http_script_op_t *op, u_char *p);
+static ngx_int_t ngx_http_script_flatten(ngx_http_script_compile_t *sc,
+    ngx_uint_t lengths, ngx_uint_t values);
 static ngx_int_t ngx_http_script_init_arrays(ngx_http_script_compile_t *sc);
 static ngx_int_t ngx_http_script_done(ngx_http_script_compile_t *sc);
 static ngx_int_t ngx_http_script_add_copy_code(ngx_http_script_compile_t *sc,
@@ -70,6 +80,10 @@ ngx_http_complex_value(ngx_http_request_t *r, ngx_http_complex_value_t *val,
 
     ngx_http_script_flush_complex_value(r, val);
 
+    if (val->ops) {
+        return ngx_http_script_run_ops(r, val->ops, value);
+    }
+
     ngx_memzero(&e, sizeof(ngx_http_script_engine_t));
 
     e.ip = val->lengths;
@@ -143,6 +157,7 @@ ngx_http_compile_complex_value(ngx_http_compile_complex_value_t *ccv)
     ccv->complex_value->flushes = NULL;
     ccv->complex_value->lengths = NULL;
     ccv->complex_value->values = NULL;
+    ccv->complex_value->ops = NULL;
 
     if (nv == 0 && nc == 0) {
         return NGX_OK;
@@ -204,10 +219,241 @@ ngx_http_compile_complex_value(ngx_http_compile_complex_value_t *ccv)
     ccv->complex_value->lengths = lengths.elts;
     ccv->complex_value->values = values.elts;
 
+    return ngx_http_script_compile_ops(ccv->cf, ccv->complex_value->values,
+                                       NULL, &ccv->complex_value->ops);
+}
+
+
+static ngx_int_t
+ngx_http_script_compile_ops(ngx_conf_t *cf, u_char *ip, u_char *last,
+    ngx_http_script_op_t **ops)
+{
+    u_char                               *p, *start;
+    size_t                                size;
+    ngx_uint_t                            n;
+    ngx_http_script_op_t                 *op;
+    ngx_http_script_code_pt               code;
+    ngx_http_script_var_code_t           *var;
+    ngx_http_script_copy_code_t          *copy;
+#if (NGX_PCRE)
+    ngx_http_script_copy_capture_code_t  *cap;
+#endif
+
+    /*
+     * the values codes made of strings, variables, and captures, up to
+     * the "last" code or to the null code, are translated into a flat
+     * array of operations; the operations are run without calling the
+     * codes by pointers, the length being calculated by one loop over
+     * the array, and the value copied by another one from the variables
+     * already evaluated by the first
+     *
+     * the values of complex values are translated, and the value parts
+     * of scripts compiled with sc->flat, see ngx_http_script_flatten();
+     * the rest of the scripts, such as the ones of the rewrite module,
+     * are run by the script engine, as they interleave the values with
+     * the conditions
+     */
+
+    *ops = NULL;
+
+    n = 1;
+    size = 0;
+
+    for (start = ip; ip != last && *(uintptr_t *) ip; n++) {
+        code = *(ngx_http_script_code_pt *) ip;
+
+        if (code == ngx_http_script_copy_code) {
+            copy = (ngx_http_script_copy_code_t *) ip;
+            size += copy->len;
+
+            ip += sizeof(ngx_http_script_copy_code_t)
+                  + ((copy->len + sizeof(uintptr_t) - 1)
+                     & ~(sizeof(uintptr_t) - 1));
+            continue;
+        }
+
+        if (code == ngx_http_script_copy_var_code) {
+            ip += sizeof(ngx_http_script_var_code_t);
+            continue;
+        }
+
+#if (NGX_PCRE)
+        if (code == ngx_http_script_copy_capture_code) {
+            ip += sizeof(ngx_http_script_copy_capture_code_t);
+            continue;
+        }
+#endif
+
+        /* the full name code, the value is left to the script engine */
+
+        return NGX_OK;
+    }
+
+    op = ngx_palloc(cf->pool, n * sizeof(ngx_http_script_op_t) + size);
+    if (op == NULL) {
+        return NGX_ERROR;
+    }
+
+    *ops = op;
+
+    p = (u_char *) &op[n];
+
+    for (ip = start; ip != last && *(uintptr_t *) ip; /* void */) {
+        code = *(ngx_http_script_code_pt *) ip;
+
+        if (code == ngx_http_script_copy_code) {
+            copy = (ngx_http_script_copy_code_t *) ip;
+
+            ip += sizeof(ngx_http_script_copy_code_t);
+
+            op->op = ngx_http_script_op_copy;
+            op->n = copy->len;
+            op->data = p;
+            op++;
+
+            p = ngx_cpymem(p, ip, copy->len);
+
+            ip += (copy->len + sizeof(uintptr_t) - 1)
+                  & ~(sizeof(uintptr_t) - 1);
+            continue;
+        }
+
+#if (NGX_PCRE)
+        if (code == ngx_http_script_copy_capture_code) {
+            cap = (ngx_http_script_copy_capture_code_t *) ip;
+
+            op->op = ngx_http_script_op_capture;
+            op->n = cap->n;
+            op->data = NULL;
+            op++;
+
+            ip += sizeof(ngx_http_script_copy_capture_code_t);
+            continue;
+        }
+#endif
+
+        var = (ngx_http_script_var_code_t *) ip;
+
+        op->op = ngx_http_script_op_var;
+        op->n = var->index;
+        op->data = NULL;
+        op++;
+
+        ip += sizeof(ngx_http_script_var_code_t);
+    }
+
+    op->op = ngx_http_script_op_end;
+    op->n = 0;
+    op->data = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_script_run_ops(ngx_http_request_t *r, ngx_http_script_op_t *ops,
+    ngx_str_t *value)
+{
+    u_char  *p;
+
+    p = ngx_pnalloc(r->pool, ngx_http_script_ops_len(r, ops));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    value->data = p;
+    value->len = ngx_http_script_ops_copy(r, ops, p) - p;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http script complex value: \"%V\"", value);
+
     return NGX_OK;
 }
 
 
+static size_t
+ngx_http_script_ops_len(ngx_http_request_t *r, ngx_http_script_op_t *op)
+{
+    size_t                      len;
+    ngx_http_variable_value_t  *vv;
+#if (NGX_PCRE)
+    int                        *cap;
+#endif
+
+    len = 0;
+
+    for ( /* void */ ; op->op; op++) {
+
+        if (op->op == ngx_http_script_op_copy) {
+            len += op->n;
+            continue;
+        }
+
+        if (op->op == ngx_http_script_op_var) {
+            vv = ngx_http_get_indexed_variable(r, op->n);
+
+            if (vv && !vv->not_found) {
+                len += vv->len;
+            }
+
+            continue;
+        }
+
+#if (NGX_PCRE)
+        /* ngx_http_script_op_capture */
+
+        if (op->n < r->ncaptures) {
+            cap = r->captures;
+            len += cap[op->n + 1] - cap[op->n];
+        }
+#endif
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_script_ops_copy(ngx_http_request_t *r, ngx_http_script_op_t *op,
+    u_char *p)
+{
+    ngx_http_variable_value_t  *vv;
+#if (NGX_PCRE)
+    int                        *cap;
+#endif
+
+    for ( /* void */ ; op->op; op++) {
+
+        if (op->op == ngx_http_script_op_copy) {
+            p = ngx_copy(p, op->data, op->n);
+            continue;
+        }
+
+        if (op->op == ngx_http_script_op_var) {
+            vv = ngx_http_get_indexed_variable(r, op->n);
+
+            if (vv && !vv->not_found) {
+                p = ngx_copy(p, vv->data, vv->len);
+            }
+
+            continue;
+        }
+
+#if (NGX_PCRE)
+        /* ngx_http_script_op_capture */
+
+        if (op->n < r->ncaptures) {
+            cap = r->captures;
+            p = ngx_copy(p, r->captures_data + cap[op->n],
+                         cap[op->n + 1] - cap[op->n]);
+        }
+#endif
+    }
+
+    return p;
+}
+
+
 char *
 ngx_http_set_complex_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -334,12 +580,15 @@ ngx_http_script_compile(ngx_http_script_compile_t *sc)
 {
     u_char       ch;
     ngx_str_t    name;
-    ngx_uint_t   i, bracket;
+    ngx_uint_t   i, bracket, lengths, values;
 
     if (ngx_http_script_init_arrays(sc) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    lengths = (*sc->lengths)->nelts;
+    values = (*sc->values)->nelts;
+
     for (i = 0; i < sc->source->len; /* void */ ) {
 
         name.len = 0;
@@ -474,6 +723,10 @@ ngx_http_script_compile(ngx_http_script_compile_t *sc)
         }
     }
 
+    if (sc->flat && ngx_http_script_flatten(sc, lengths, values) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     return ngx_http_script_done(sc);
 
 invalid_variable:
@@ -640,6 +893,63 @@ ngx_http_script_done(ngx_http_script_compile_t *sc)
 }
 
 
+static ngx_int_t
+ngx_http_script_flatten(ngx_http_script_compile_t *sc, ngx_uint_t lengths,
+    ngx_uint_t values)
+{
+    u_char                      *ip;
+    ngx_http_script_op_t        *ops;
+    ngx_http_script_ops_code_t  *code;
+
+    /*
+     * the codes just compiled for the value are replaced with a single
+     * code, which runs the value as flat operations; the header framing
+     * codes of the upstream modules around the value are kept as is
+     */
+
+    if ((*sc->values)->nelts == values) {
+        return NGX_OK;
+    }
+
+    ip = (*sc->values)->elts;
+
+    if (ngx_http_script_compile_ops(sc->cf, ip + values,
+                                    ip + (*sc->values)->nelts, &ops)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ops == NULL || ops[1].op == ngx_http_script_op_end) {
+
+        /* a value of a single part is run as fast by its own code */
+
+        return NGX_OK;
+    }
+
+    (*sc->lengths)->nelts = lengths;
+    (*sc->values)->nelts = values;
+
+    code = ngx_array_push_n(*sc->lengths, sizeof(ngx_http_script_ops_code_t));
+    if (code == NULL) {
+        return NGX_ERROR;
+    }
+
+    code->code = (ngx_http_script_code_pt) ngx_http_script_ops_len_code;
+    code->ops = ops;
+
+    code = ngx_array_push_n(*sc->values, sizeof(ngx_http_script_ops_code_t));
+    if (code == NULL) {
+        return NGX_ERROR;
+    }
+
+    code->code = ngx_http_script_ops_code;
+    code->ops = ops;
+
+    return NGX_OK;
+}
+
+
 void *
 ngx_http_script_start_code(ngx_pool_t *pool, ngx_array_t **codes, size_t size)
 {
@@ -1281,6 +1591,39 @@ ngx_http_script_copy_capture_code(ngx_http_script_engine_t *e)
 #endif
 
 
+size_t
+ngx_http_script_ops_len_code(ngx_http_script_engine_t *e)
+{
+    ngx_http_script_ops_code_t  *code;
+
+    code = (ngx_http_script_ops_code_t *) e->ip;
+
+    e->ip += sizeof(ngx_http_script_ops_code_t);
+
+    return ngx_http_script_ops_len(e->request, code->ops);
+}
+
+
+void
+ngx_http_script_ops_code(ngx_http_script_engine_t *e)
+{
+    u_char                      *p;
+    ngx_http_script_ops_code_t  *code;
+
+    code = (ngx_http_script_ops_code_t *) e->ip;
+
+    e->ip += sizeof(ngx_http_script_ops_code_t);
+
+    if (!e->skip) {
+        p = e->pos;
+        e->pos = ngx_http_script_ops_copy(e->request, code->ops, p);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, e->request->connection->log, 0,
+                       "http script value: \"%*s\"", e->pos - p, p);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_script_add_full_name_code(ngx_http_script_compile_t *sc)
 {
@@ -60,14 +60,41 @@ typedef struct {
 
     unsigned                    dup_capture:1;
     unsigned                    args:1;
+
+    /* the value is run as flat operations, with the variables flushed */
+    unsigned                    flat:1;
 } ngx_http_script_compile_t;
 
 
+/*
+ * the flat operations of a complex value, or of a value compiled with
+ * sc->flat, see misc/bench/script
+ */
+
+typedef enum {
+    ngx_http_script_op_end = 0,
+    ngx_http_script_op_copy,
+    ngx_http_script_op_var,
+    ngx_http_script_op_capture
+} ngx_http_script_op_e;
+
+
+typedef struct {
+    ngx_http_script_op_e        op;
+
+    /* the string length, the variable index, or the capture number */
+    ngx_uint_t                  n;
+
+    u_char                     *data;
+} ngx_http_script_op_t;
+
+
 typedef struct {
     ngx_str_t                   value;
     ngx_uint_t                 *flushes;
     void                       *lengths;
     void                       *values;
+    ngx_http_script_op_t       *ops;
 } ngx_http_complex_value_t;
 
 
@@ -111,6 +138,12 @@ typedef struct {
 } ngx_http_script_copy_capture_code_t;
 
 
+typedef struct {
+    ngx_http_script_code_pt     code;
+    ngx_http_script_op_t       *ops;
+} ngx_http_script_ops_code_t;
+
+
 #if (NGX_PCRE)
 
 typedef struct {
@@ -234,6 +267,8 @@ size_t ngx_http_script_copy_var_len_code(ngx_http_script_engine_t *e);
 void ngx_http_script_copy_var_code(ngx_http_script_engine_t *e);
 size_t ngx_http_script_copy_capture_len_code(ngx_http_script_engine_t *e);
 void ngx_http_script_copy_capture_code(ngx_http_script_engine_t *e);
+size_t ngx_http_script_ops_len_code(ngx_http_script_engine_t *e);
+void ngx_http_script_ops_code(ngx_http_script_engine_t *e);
 size_t ngx_http_script_mark_args_code(ngx_http_script_engine_t *e);
 void ngx_http_script_start_args_code(ngx_http_script_engine_t *e);
 #if (NGX_PCRE)
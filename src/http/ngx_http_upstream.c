@@ -75,6 +75,15 @@ static void
 static void
     ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_splice_test(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_process_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_splice_cleanup(void *data);
+#endif
 static ngx_int_t ngx_http_upstream_non_buffered_filter_init(void *data);
 static ngx_int_t ngx_http_upstream_non_buffered_filter(void *data,
     ssize_t bytes);
@@ -693,6 +702,12 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
                 return;
             }
 
+            if (u->init_peer && u->init_peer(r) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
             ngx_http_upstream_connect(r, u);
 
             return;
@@ -762,6 +777,12 @@ found:
         return;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     u->peer.start_time = ngx_current_msec;
 
     if (u->conf->next_upstream_tries
@@ -780,6 +801,7 @@ static ngx_int_t
 ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
     ngx_int_t               rc;
+    ngx_uint_t              purge;
     ngx_http_cache_t       *c;
     ngx_http_file_cache_t  *cache;
 
@@ -787,7 +809,21 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     if (c == NULL) {
 
-        if (!(r->method & u->conf->cache_methods)) {
+        switch (ngx_http_test_predicates(r, u->conf->cache_purge)) {
+
+        case NGX_ERROR:
+            return NGX_ERROR;
+
+        case NGX_DECLINED:
+            purge = 1;
+            break;
+
+        default: /* NGX_OK */
+            purge = 0;
+            break;
+        }
+
+        if (!purge && !(r->method & u->conf->cache_methods)) {
             return NGX_DECLINED;
         }
 
@@ -832,6 +868,20 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->min_uses = u->conf->cache_min_uses;
         c->file_cache = cache;
 
+        if (purge) {
+            switch (ngx_http_file_cache_purge(r)) {
+
+            case NGX_ERROR:
+                return NGX_ERROR;
+
+            case NGX_DECLINED:
+                return NGX_HTTP_NOT_FOUND;
+
+            default: /* NGX_OK */
+                return NGX_HTTP_NO_CONTENT;
+            }
+        }
+
         switch (ngx_http_test_predicates(r, u->conf->cache_bypass)) {
 
         case NGX_ERROR:
@@ -1137,6 +1187,12 @@ ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
         goto failed;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto failed;
+    }
+
     ngx_resolve_name_done(ctx);
     ur->ctx = NULL;
 
@@ -2831,6 +2887,12 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
+#if (NGX_HAVE_SPLICE)
+        if (u->splice && ngx_http_upstream_splice_test(r, u) != NGX_OK) {
+            u->splice = 0;
+        }
+#endif
+
         if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
@@ -2871,6 +2933,13 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
                 return;
             }
 
+#if (NGX_HAVE_SPLICE)
+            if (u->splice) {
+                ngx_http_upstream_process_non_buffered_request(r, 1);
+                return;
+            }
+#endif
+
             if (u->peer.connection->read->ready || u->length == 0) {
                 ngx_http_upstream_process_non_buffered_upstream(r, u);
             }
@@ -3267,13 +3336,23 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         }
     }
 
+    if (r->out) {
+
+        /* the response header is still buffered in the write filter */
+
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
     for ( ;; ) {
 
         if (do_write) {
 
             size = b->last - b->pos;
 
-            if (size && dst->write->ready) {
+            if (size && dst->write->ready && !(from_upstream && r->out)) {
 
                 n = dst->send(dst, b->pos, size);
 
@@ -3447,6 +3526,13 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     downstream = r->connection;
     upstream = u->peer.connection;
 
+#if (NGX_HAVE_SPLICE)
+    if (u->splicing) {
+        ngx_http_upstream_process_splice(r, u);
+        return;
+    }
+#endif
+
     b = &u->buffer;
 
     do_write = do_write || u->length == 0;
@@ -3493,6 +3579,18 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
                 b->pos = b->start;
                 b->last = b->start;
+
+#if (NGX_HAVE_SPLICE)
+                if (u->splice && !downstream->buffered) {
+
+                    if (ngx_http_upstream_splice_init(r, u) == NGX_OK) {
+                        ngx_http_upstream_process_splice(r, u);
+                        return;
+                    }
+
+                    u->splice = 0;
+                }
+#endif
             }
         }
 
@@ -3556,6 +3654,263 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_http_upstream_splice_test(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /*
+     * the body is relayed through a pipe bypassing the output filters,
+     * so only a plain copy of a known length to a plain socket is allowed,
+     * and the limits of the write filter are not applied
+     */
+
+    if (r != r->main
+        || r->header_only
+        || r->chunked
+        || r->filter_need_in_memory
+        || r->main_filter_need_in_memory
+        || r->limit_rate
+        || clcf->sendfile_max_chunk
+        || u->length <= 0
+        || r->headers_out.content_length_n != u->length)
+    {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return NGX_DECLINED;
+    }
+#endif
+
+#if (NGX_HTTP_SSL)
+    if (r->connection->ssl || u->peer.connection->ssl) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pipe2(u->splice_pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      "pipe2() failed, splice disabled");
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_splice_cleanup;
+    cln->data = u;
+
+    u->splice_size = 0;
+    u->splicing = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream splice pipe: %d:%d",
+                   u->splice_pipe[0], u->splice_pipe[1]);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_process_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_err_t                  err;
+    ngx_connection_t          *downstream, *upstream;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    for ( ;; ) {
+
+        if (u->splice_size && downstream->write->ready) {
+
+            n = splice(u->splice_pipe[0], NULL, downstream->fd, NULL,
+                       u->splice_size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, downstream->log, 0,
+                           "splice to client: %z of %uz", n, u->splice_size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    downstream->write->ready = 0;
+
+                } else if (err != NGX_EINTR) {
+                    downstream->write->error = 1;
+                    ngx_connection_error(downstream, err,
+                                         "splice() to client failed");
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+
+                continue;
+            }
+
+            u->splice_size -= n;
+            downstream->sent += n;
+
+            continue;
+        }
+
+        if (u->splice_size == 0) {
+
+            if (u->length == 0) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            if (upstream->read->eof) {
+                ngx_log_error(NGX_LOG_ERR, upstream->log, 0,
+                              "upstream prematurely closed connection");
+
+                ngx_http_upstream_finalize_request(r, u,
+                                                   NGX_HTTP_BAD_GATEWAY);
+                return;
+            }
+
+            if (upstream->read->error) {
+                ngx_http_upstream_finalize_request(r, u,
+                                                   NGX_HTTP_BAD_GATEWAY);
+                return;
+            }
+        }
+
+        size = NGX_HTTP_UPSTREAM_SPLICE_SIZE - u->splice_size;
+
+        if ((off_t) size > u->length) {
+            size = (size_t) u->length;
+        }
+
+        if (size && upstream->read->ready && !upstream->read->eof) {
+
+            n = splice(upstream->fd, NULL, u->splice_pipe[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, upstream->log, 0,
+                           "splice from upstream: %z of %uz", n, size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+
+                    /*
+                     * with data in the pipe EAGAIN may mean that the pipe
+                     * is full, the socket is retried once the client
+                     * drains the pipe
+                     */
+
+                    if (u->splice_size == 0) {
+                        upstream->read->ready = 0;
+                    }
+
+                    break;
+                }
+
+                if (err == NGX_EINTR) {
+                    continue;
+                }
+
+                upstream->read->ready = 0;
+                upstream->read->error = 1;
+                ngx_connection_error(upstream, err,
+                                     "splice() from upstream failed");
+                continue;
+            }
+
+            if (n == 0) {
+                upstream->read->ready = 0;
+                upstream->read->eof = 1;
+                continue;
+            }
+
+            u->splice_size += n;
+            u->length -= n;
+
+            u->state->bytes_received += n;
+            u->state->response_length += n;
+
+            if (u->length == 0) {
+                u->keepalive = !u->headers_in.connection_close;
+            }
+
+            continue;
+        }
+
+        break;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(downstream->write, clcf->send_lowat) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (downstream->write->active && !downstream->write->ready) {
+        ngx_add_timer(downstream->write, clcf->send_timeout);
+
+    } else if (downstream->write->timer_set) {
+        ngx_del_timer(downstream->write);
+    }
+
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (upstream->read->active && !upstream->read->ready) {
+        ngx_add_timer(upstream->read, u->conf->read_timeout);
+
+    } else if (upstream->read->timer_set) {
+        ngx_del_timer(upstream->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_splice_cleanup(void *data)
+{
+    ngx_http_upstream_t  *u = data;
+
+    if (close(u->splice_pipe[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() splice pipe failed");
+    }
+
+    if (close(u->splice_pipe[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() splice pipe failed");
+    }
+
+    u->splicing = 0;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_upstream_non_buffered_filter_init(void *data)
 {
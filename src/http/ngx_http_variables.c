@@ -2315,28 +2315,17 @@ ngx_http_map_find(ngx_http_request_t *r, ngx_http_map_t *map, ngx_str_t *match)
 #if (NGX_PCRE)
 
     if (len && map->nregex) {
-        ngx_int_t              n;
-        ngx_uint_t             i;
-        ngx_http_map_regex_t  *reg;
+        ngx_int_t  n;
 
-        reg = map->regex;
+        n = ngx_http_regex_set_exec(r, map->regex_set, match);
 
-        for (i = 0; i < map->nregex; i++) {
-
-            n = ngx_http_regex_exec(r, reg[i].regex, match);
-
-            if (n == NGX_OK) {
-                return reg[i].value;
-            }
-
-            if (n == NGX_DECLINED) {
-                continue;
-            }
+        if (n >= 0) {
+            return map->regex[n].value;
+        }
 
-            /* NGX_ERROR */
+        /* NGX_DECLINED or NGX_ERROR */
 
-            return NULL;
-        }
+        return NULL;
     }
 
 #endif
@@ -2496,6 +2485,145 @@ ngx_http_regex_exec(ngx_http_request_t *r, ngx_http_regex_t *re, ngx_str_t *s)
     return NGX_OK;
 }
 
+
+ngx_http_regex_set_t *
+ngx_http_regex_set_create(ngx_conf_t *cf, ngx_http_regex_t **regex,
+    ngx_uint_t n)
+{
+    u_char                 errstr[NGX_MAX_CONF_ERRSTR];
+    ngx_uint_t             i;
+    ngx_regex_elt_t       *elts;
+    ngx_regex_compile_t    rc;
+    ngx_http_regex_set_t  *set;
+
+    set = ngx_palloc(cf->pool, sizeof(ngx_http_regex_set_t));
+    if (set == NULL) {
+        return NULL;
+    }
+
+    set->set = NULL;
+    set->regex = regex;
+    set->nelts = n;
+
+    if (n < 2) {
+        return set;
+    }
+
+    elts = ngx_palloc(cf->temp_pool, n * sizeof(ngx_regex_elt_t));
+    if (elts == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        elts[i].regex = regex[i]->regex;
+        elts[i].name = regex[i]->name.data;
+    }
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pool = cf->pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+
+    set->set = ngx_regex_set_compile(&rc, elts, n);
+
+    if (set->set == NULL) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "%V, regular expressions will be tested one by one",
+                           &rc.err);
+    }
+
+    return set;
+}
+
+
+ngx_int_t
+ngx_http_regex_set_exec(ngx_http_request_t *r, ngx_http_regex_set_t *set,
+    ngx_str_t *s)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  i, n, first;
+
+    /* the regexes preceding the first one in the set are tested first */
+
+    for (i = 0; i < set->nelts; i++) {
+
+        if (set->set && set->set->combined[i]) {
+            break;
+        }
+
+        rc = ngx_http_regex_exec(r, set->regex[i], s);
+
+        if (rc == NGX_OK) {
+            return i;
+        }
+
+        if (rc == NGX_DECLINED) {
+            continue;
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (i == set->nelts) {
+        return NGX_DECLINED;
+    }
+
+    first = i;
+
+    rc = ngx_regex_set_exec(set->set, s);
+
+    if (rc >= 0) {
+        n = rc;
+
+    } else if (rc == NGX_REGEX_NO_MATCHED) {
+        n = set->nelts;
+
+    } else {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      ngx_regex_exec_n " failed: %i on \"%V\" using "
+                      "regex set of \"%V\"", rc, s, &set->regex[first]->name);
+        return NGX_ERROR;
+    }
+
+    /* test the regexes not in the set which precede the match */
+
+    for (i = first; i < n; i++) {
+
+        if (set->set->combined[i]) {
+            continue;
+        }
+
+        rc = ngx_http_regex_exec(r, set->regex[i], s);
+
+        if (rc == NGX_OK) {
+            return i;
+        }
+
+        if (rc == NGX_DECLINED) {
+            continue;
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (n == set->nelts) {
+        return NGX_DECLINED;
+    }
+
+    /* the set does not capture, match the regex again if needed */
+
+    if (set->regex[n]->ncaptures) {
+        rc = ngx_http_regex_exec(r, set->regex[n], s);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return n;
+}
+
 #endif
 
 
@@ -80,10 +80,21 @@ typedef struct {
 } ngx_http_map_regex_t;
 
 
+typedef struct {
+    ngx_regex_set_t              *set;
+    ngx_http_regex_t            **regex;
+    ngx_uint_t                    nelts;
+} ngx_http_regex_set_t;
+
+
 ngx_http_regex_t *ngx_http_regex_compile(ngx_conf_t *cf,
     ngx_regex_compile_t *rc);
 ngx_int_t ngx_http_regex_exec(ngx_http_request_t *r, ngx_http_regex_t *re,
     ngx_str_t *s);
+ngx_http_regex_set_t *ngx_http_regex_set_create(ngx_conf_t *cf,
+    ngx_http_regex_t **regex, ngx_uint_t n);
+ngx_int_t ngx_http_regex_set_exec(ngx_http_request_t *r,
+    ngx_http_regex_set_t *set, ngx_str_t *s);
 
 #endif
 
@@ -93,6 +104,7 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_http_map_regex_t         *regex;
     ngx_uint_t                    nregex;
+    ngx_http_regex_set_t         *regex_set;
 #endif
 } ngx_http_map_t;
 
@@ -48,6 +48,8 @@
 
 #define NGX_HTTP_V2_DEFAULT_FRAME_SIZE           (1 << 14)
 
+#define NGX_HTTP_V2_OUTPUT_LIMIT                 (256 * 1024)
+
 #define NGX_HTTP_V2_ROOT                         (void *) -1
 
 
@@ -165,6 +167,9 @@ static void ngx_http_v2_run_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_process_request_body(ngx_http_request_t *r,
     u_char *pos, size_t size, ngx_uint_t last);
 static ngx_int_t ngx_http_v2_filter_request_body(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_switch_request_body_buffer(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_v2_request_body_buffer_busy(ngx_http_request_t *r,
+    ngx_buf_t *buf);
 static void ngx_http_v2_read_client_request_body_handler(ngx_http_request_t *r);
 
 static ngx_int_t ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
@@ -245,6 +250,9 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
 
+    h2c->hpack_enc.size = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.free = NGX_HTTP_V2_TABLE_SIZE;
+
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
@@ -285,7 +293,11 @@ ngx_http_v2_init(ngx_event_t *rev)
     h2c->state.handler = hc->proxy_protocol ? ngx_http_v2_state_proxy_protocol
                                             : ngx_http_v2_state_preface;
 
-    ngx_queue_init(&h2c->waiting);
+    ngx_rbtree_init(&h2c->waiting, &h2c->waiting_sentinel,
+                    ngx_rbtree_insert_timer_value);
+    ngx_rbtree_init(&h2c->frames, &h2c->frames_sentinel,
+                    ngx_rbtree_insert_timer_value);
+
     ngx_queue_init(&h2c->dependencies);
     ngx_queue_init(&h2c->closed);
 
@@ -396,7 +408,9 @@ ngx_http_v2_read_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_output_queued(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -435,7 +449,7 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
 
-    if (h2c->last_out == NULL && !c->buffered) {
+    if (!ngx_http_v2_output_queued(h2c) && !c->buffered) {
 
         if (wev->timer_set) {
             ngx_del_timer(wev);
@@ -468,10 +482,13 @@ ngx_int_t
 ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
 {
     int                        tcp_nodelay;
-    ngx_chain_t               *cl;
+    size_t                     size;
+    ngx_chain_t               *cl, **ll;
     ngx_event_t               *wev;
     ngx_connection_t          *c;
-    ngx_http_v2_out_frame_t   *out, *frame, *fn;
+    ngx_rbtree_key_t           key;
+    ngx_rbtree_node_t         *node;
+    ngx_http_v2_out_frame_t   *out, *frame, *fn, **ln;
     ngx_http_core_loc_conf_t  *clcf;
 
     c = h2c->connection;
@@ -486,28 +503,112 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
-    cl = NULL;
-    out = NULL;
+    do {
+        /* control, HEADERS and partially sent frames go first */
 
-    for (frame = h2c->last_out; frame; frame = fn) {
-        frame->last->next = cl;
-        cl = frame->first;
+        out = NULL;
+        ln = &out;
 
-        fn = frame->next;
-        frame->next = out;
-        out = frame;
+        for (frame = h2c->last_out; frame; frame = fn) {
+            fn = frame->next;
+            frame->next = out;
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "http2 frame out: %p sid:%ui bl:%d len:%uz",
-                       out, out->stream ? out->stream->node->id : 0,
-                       out->blocked, out->length);
-    }
+            if (out == NULL) {
+                ln = &frame->next;
+            }
 
-    cl = c->send_chain(c, cl, 0);
+            out = frame;
+        }
 
-    if (cl == NGX_CHAIN_ERROR) {
-        goto error;
-    }
+        /*
+         * then DATA frames in the order of their virtual finish time,
+         * a limited number at once to keep the rest of them reorderable
+         */
+
+        size = 0;
+
+        while (h2c->frames.root != h2c->frames.sentinel
+               && size < NGX_HTTP_V2_OUTPUT_LIMIT)
+        {
+            node = ngx_rbtree_min(h2c->frames.root, h2c->frames.sentinel);
+
+            /* the key is reset by ngx_rbtree_delete() */
+
+            key = node->key;
+            ngx_rbtree_delete(&h2c->frames, node);
+            node->key = key;
+
+            frame = (ngx_http_v2_out_frame_t *)
+                        ((u_char *) node
+                         - offsetof(ngx_http_v2_out_frame_t, node));
+
+            size += NGX_HTTP_V2_FRAME_HEADER_SIZE + frame->length;
+
+            *ln = frame;
+            ln = &frame->next;
+        }
+
+        *ln = NULL;
+
+        cl = NULL;
+        ll = &cl;
+
+        for (frame = out; frame; frame = frame->next) {
+            *ll = frame->first;
+            ll = &frame->last->next;
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http2 frame out: %p sid:%ui bl:%d len:%uz",
+                           frame, frame->stream ? frame->stream->node->id : 0,
+                           frame->blocked, frame->length);
+        }
+
+        *ll = NULL;
+
+        cl = c->send_chain(c, cl, 0);
+
+        if (cl == NGX_CHAIN_ERROR) {
+            goto error;
+        }
+
+        for ( /* void */ ; out; out = fn) {
+            fn = out->next;
+
+            if (out->stream && !out->blocked
+                && (ngx_rbtree_key_int_t) (out->node.key - h2c->vtime) > 0)
+            {
+                h2c->vtime = out->node.key;
+            }
+
+            if (out->handler(h2c, out) != NGX_OK) {
+                out->blocked = 1;
+                break;
+            }
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http2 frame sent: %p sid:%ui bl:%d len:%uz",
+                           out, out->stream ? out->stream->node->id : 0,
+                           out->blocked, out->length);
+        }
+
+        frame = NULL;
+
+        for ( /* void */ ; out; out = fn) {
+            fn = out->next;
+
+            if (out->blocked || out->stream == NULL) {
+                out->next = frame;
+                frame = out;
+
+            } else {
+                ngx_rbtree_insert(&h2c->frames, &out->node);
+            }
+        }
+
+        h2c->last_out = frame;
+
+    } while (frame == NULL && wev->ready
+             && h2c->frames.root != h2c->frames.sentinel);
 
     clcf = ngx_http_get_module_loc_conf(h2c->http_connection->conf_ctx,
                                         ngx_http_core_module);
@@ -554,30 +655,6 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         c->tcp_nodelay = NGX_TCP_NODELAY_SET;
     }
 
-    for ( /* void */ ; out; out = fn) {
-        fn = out->next;
-
-        if (out->handler(h2c, out) != NGX_OK) {
-            out->blocked = 1;
-            break;
-        }
-
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "http2 frame sent: %p sid:%ui bl:%d len:%uz",
-                       out, out->stream ? out->stream->node->id : 0,
-                       out->blocked, out->length);
-    }
-
-    frame = NULL;
-
-    for ( /* void */ ; out; out = fn) {
-        fn = out->next;
-        out->next = frame;
-        frame = out;
-    }
-
-    h2c->last_out = frame;
-
     if (!wev->ready) {
         ngx_add_timer(wev, clcf->send_timeout);
         return NGX_AGAIN;
@@ -608,7 +685,7 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_connection_t        *c;
     ngx_http_v2_srv_conf_t  *h2scf;
 
-    if (h2c->last_out || h2c->processing) {
+    if (ngx_http_v2_output_queued(h2c) || h2c->processing) {
         return;
     }
 
@@ -2029,6 +2106,10 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
             h2c->frame_size = value;
             break;
 
+        case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
+            ngx_http_v2_table_settings(h2c, value);
+            break;
+
         default:
             break;
         }
@@ -2136,7 +2217,7 @@ ngx_http_v2_state_window_update(ngx_http_v2_connection_t *h2c, u_char *pos,
 {
     size_t                 window;
     ngx_event_t           *wev;
-    ngx_queue_t           *q;
+    ngx_rbtree_node_t     *rbn;
     ngx_http_v2_node_t    *node;
     ngx_http_v2_stream_t  *stream;
 
@@ -2224,12 +2305,14 @@ ngx_http_v2_state_window_update(ngx_http_v2_connection_t *h2c, u_char *pos,
 
     h2c->send_window += window;
 
-    while (!ngx_queue_empty(&h2c->waiting)) {
-        q = ngx_queue_head(&h2c->waiting);
+    while (h2c->waiting.root != h2c->waiting.sentinel) {
+        rbn = ngx_rbtree_min(h2c->waiting.root, h2c->waiting.sentinel);
 
-        ngx_queue_remove(q);
+        ngx_rbtree_delete(&h2c->waiting, rbn);
 
-        stream = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
+        stream = (ngx_http_v2_stream_t *)
+                     ((u_char *) rbn
+                      - offsetof(ngx_http_v2_stream_t, waiting_node));
 
         stream->waiting = 0;
 
@@ -3546,6 +3629,22 @@ ngx_http_v2_read_request_body(ngx_http_request_t *r,
 
         rb->buf = ngx_create_temp_buf(r->pool, (size_t) len);
 
+        /*
+         * The spare buffer of the same size is filled by the client
+         * while the upstream is still sending the previous one.
+         */
+
+        if ((r->headers_in.content_length_n == -1
+             || r->headers_in.content_length_n > len)
+            && len <= NGX_HTTP_V2_MAX_WINDOW / 2)
+        {
+            stream->spare = ngx_create_temp_buf(r->pool, (size_t) len);
+            if (stream->spare == NULL) {
+                stream->skip_data = 1;
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+
     } else if (len >= 0 && len <= (off_t) clcf->client_body_buffer_size
                && !r->request_body_in_file_only)
     {
@@ -3599,6 +3698,10 @@ ngx_http_v2_read_request_body(ngx_http_request_t *r,
     if (r->request_body_no_buffering) {
         size = (size_t) len - h2scf->preread_size;
 
+        if (stream->spare) {
+            size += (size_t) len;
+        }
+
     } else {
         stream->no_flow_control = 1;
         size = NGX_HTTP_V2_MAX_WINDOW - stream->recv_window;
@@ -3640,6 +3743,7 @@ static ngx_int_t
 ngx_http_v2_process_request_body(ngx_http_request_t *r, u_char *pos,
     size_t size, ngx_uint_t last)
 {
+    size_t                     n;
     ngx_buf_t                 *buf;
     ngx_int_t                  rc;
     ngx_connection_t          *fc;
@@ -3656,6 +3760,23 @@ ngx_http_v2_process_request_body(ngx_http_request_t *r, u_char *pos,
             buf->last = buf->end = pos + size;
 
         } else {
+            n = buf->end - buf->last;
+
+            if (size > n && r->stream->spare) {
+                buf->last = ngx_cpymem(buf->last, pos, n);
+
+                pos += n;
+                size -= n;
+
+                rc = ngx_http_v2_switch_request_body_buffer(r);
+
+                if (rc != NGX_OK && rc != NGX_DECLINED) {
+                    return rc;
+                }
+
+                buf = rb->buf;
+            }
+
             if (size > (size_t) (buf->end - buf->last)) {
                 ngx_log_error(NGX_LOG_INFO, fc->log, 0,
                                 "client intended to send body data "
@@ -3812,6 +3933,57 @@ update:
 }
 
 
+static ngx_int_t
+ngx_http_v2_switch_request_body_buffer(ngx_http_request_t *r)
+{
+    ngx_buf_t                *buf;
+    ngx_int_t                 rc;
+    ngx_http_v2_stream_t     *stream;
+    ngx_http_request_body_t  *rb;
+
+    rc = ngx_http_v2_filter_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    stream = r->stream;
+    buf = stream->spare;
+
+    if (ngx_http_v2_request_body_buffer_busy(r, buf)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 switch request body buffer");
+
+    rb = r->request_body;
+
+    stream->spare = rb->buf;
+    rb->buf = buf;
+
+    buf->pos = buf->start;
+    buf->last = buf->start;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_v2_request_body_buffer_busy(ngx_http_request_t *r, ngx_buf_t *buf)
+{
+    ngx_chain_t  *cl;
+
+    for (cl = r->request_body->busy; cl; cl = cl->next) {
+        if (cl->buf->start >= buf->start && cl->buf->start < buf->end) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
 static void
 ngx_http_v2_read_client_request_body_handler(ngx_http_request_t *r)
 {
@@ -3885,16 +4057,21 @@ ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r)
         return NGX_OK;
     }
 
-    if (r->request_body->busy != NULL) {
-        return NGX_AGAIN;
+    buf = r->request_body->buf;
+
+    if (!ngx_http_v2_request_body_buffer_busy(r, buf)) {
+        buf->pos = buf->start;
+        buf->last = buf->start;
     }
 
-    buf = r->request_body->buf;
+    window = buf->end - buf->last;
 
-    buf->pos = buf->start;
-    buf->last = buf->start;
+    if (stream->spare
+        && !ngx_http_v2_request_body_buffer_busy(r, stream->spare))
+    {
+        window += stream->spare->end - stream->spare->start;
+    }
 
-    window = buf->end - buf->start;
     h2c = stream->connection;
 
     if (h2c->state.stream == stream) {
@@ -4140,7 +4317,9 @@ ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
     c = rev->data;
     h2c = c->data;
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_output_queued(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -4239,6 +4418,11 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
     h2c->last_out = NULL;
 
+    ngx_rbtree_init(&h2c->waiting, &h2c->waiting_sentinel,
+                    ngx_rbtree_insert_timer_value);
+    ngx_rbtree_init(&h2c->frames, &h2c->frames_sentinel,
+                    ngx_rbtree_insert_timer_value);
+
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
 
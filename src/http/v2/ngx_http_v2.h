@@ -49,6 +49,11 @@
 #define NGX_HTTP_V2_MAX_WINDOW           ((1U << 31) - 1)
 #define NGX_HTTP_V2_DEFAULT_WINDOW       65535
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_TABLE_ENTRIES        (NGX_HTTP_V2_TABLE_SIZE / 32)
+
+#define NGX_HTTP_V2_MAX_COST             (1 << 24)
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -110,6 +115,22 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_http_v2_header_t            *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       valid;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           update;
+    size_t                           update_min;
+    u_char                          *storage;
+    u_char                          *pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -122,11 +143,13 @@ struct ngx_http_v2_connection_s {
 
     size_t                           frame_size;
 
-    ngx_queue_t                      waiting;
+    ngx_rbtree_t                     waiting;
+    ngx_rbtree_node_t                waiting_sentinel;
 
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -137,6 +160,10 @@ struct ngx_http_v2_connection_s {
 
     ngx_http_v2_out_frame_t         *last_out;
 
+    ngx_rbtree_t                     frames;
+    ngx_rbtree_node_t                frames_sentinel;
+    ngx_rbtree_key_t                 vtime;
+
     ngx_queue_t                      dependencies;
     ngx_queue_t                      closed;
 
@@ -146,6 +173,7 @@ struct ngx_http_v2_connection_s {
     unsigned                         settings_ack:1;
     unsigned                         blocked:1;
     unsigned                         goaway:1;
+    unsigned                         table_update:1;
 };
 
 
@@ -178,12 +206,16 @@ struct ngx_http_v2_stream_s {
     size_t                           recv_window;
 
     ngx_buf_t                       *preread;
+    ngx_buf_t                       *spare;
 
     ngx_http_v2_out_frame_t         *free_frames;
     ngx_chain_t                     *free_frame_headers;
     ngx_chain_t                     *free_bufs;
 
-    ngx_queue_t                      queue;
+    ngx_rbtree_node_t                waiting_node;
+
+    /* virtual finish time of the last queued DATA frame */
+    ngx_rbtree_key_t                 vtime;
 
     ngx_array_t                     *cookies;
 
@@ -204,6 +236,7 @@ struct ngx_http_v2_stream_s {
 
 struct ngx_http_v2_out_frame_s {
     ngx_http_v2_out_frame_t         *next;
+    ngx_rbtree_node_t                node;
     ngx_chain_t                     *first;
     ngx_chain_t                     *last;
     ngx_int_t                      (*handler)(ngx_http_v2_connection_t *h2c,
@@ -217,29 +250,39 @@ struct ngx_http_v2_out_frame_s {
 };
 
 
+#define ngx_http_v2_output_queued(h2c)                                        \
+    ((h2c)->last_out || (h2c)->frames.root != (h2c)->frames.sentinel)
+
+
+/*
+ * DATA frames are scheduled using self-clocked fair queuing: streams
+ * share the connection in proportion to their relative weights, that is,
+ * a stream gets the share of its parent divided among the siblings
+ * according to their weights.
+ */
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
-
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+    double                 cost;
+    ngx_http_v2_stream_t  *stream;
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
+    stream = frame->stream;
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
-            break;
-        }
+    if ((ngx_rbtree_key_int_t) (stream->vtime - h2c->vtime) < 0) {
+        stream->vtime = h2c->vtime;
     }
 
-    frame->next = *out;
-    *out = frame;
+    cost = (NGX_HTTP_V2_FRAME_HEADER_SIZE + frame->length)
+           / stream->node->rel_weight;
+
+    stream->vtime += (cost < NGX_HTTP_V2_MAX_COST) ? (ngx_rbtree_key_t) cost
+                                                   : NGX_HTTP_V2_MAX_COST;
+
+    frame->node.key = stream->vtime;
+
+    ngx_rbtree_insert(&h2c->frames, &frame->node);
 }
 
 
@@ -247,17 +290,8 @@ static ngx_inline void
 ngx_http_v2_queue_blocked_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
-
-    for (out = &h2c->last_out; *out; out = &(*out)->next)
-    {
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
-    }
-
-    frame->next = *out;
-    *out = frame;
+    frame->next = h2c->last_out;
+    h2c->last_out = frame;
 }
 
 
@@ -279,6 +313,14 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+ngx_int_t ngx_http_v2_table_lookup(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t *index);
+ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value);
+void ngx_http_v2_table_resize(ngx_http_v2_connection_t *h2c, size_t size);
+void ngx_http_v2_table_discard(ngx_http_v2_connection_t *h2c);
+void ngx_http_v2_table_settings(ngx_http_v2_connection_t *h2c, size_t size);
+
 
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
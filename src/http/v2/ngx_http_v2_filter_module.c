@@ -23,7 +23,6 @@
     (ngx_http_v2_integer_octets(sizeof(h) - 1) + sizeof(h) - 1)
 
 #define ngx_http_v2_indexed(i)      (128 + (i))
-#define ngx_http_v2_inc_indexed(i)  (64 + (i))
 
 #define ngx_http_v2_write_name(dst, src, len, tmp)                            \
     ngx_http_v2_string_encode(dst, src, len, tmp, 1)
@@ -33,7 +32,6 @@
 #define NGX_HTTP_V2_ENCODE_RAW            0
 #define NGX_HTTP_V2_ENCODE_HUFF           0x80
 
-#define NGX_HTTP_V2_STATUS_INDEX          8
 #define NGX_HTTP_V2_STATUS_200_INDEX      8
 #define NGX_HTTP_V2_STATUS_204_INDEX      9
 #define NGX_HTTP_V2_STATUS_206_INDEX      10
@@ -42,15 +40,13 @@
 #define NGX_HTTP_V2_STATUS_404_INDEX      13
 #define NGX_HTTP_V2_STATUS_500_INDEX      14
 
-#define NGX_HTTP_V2_CONTENT_LENGTH_INDEX  28
-#define NGX_HTTP_V2_CONTENT_TYPE_INDEX    31
-#define NGX_HTTP_V2_DATE_INDEX            33
-#define NGX_HTTP_V2_LAST_MODIFIED_INDEX   44
-#define NGX_HTTP_V2_LOCATION_INDEX        46
-#define NGX_HTTP_V2_SERVER_INDEX          54
-#define NGX_HTTP_V2_VARY_INDEX            59
-
 
+static u_char *ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c,
+    u_char *pos, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp);
+static u_char *ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size);
+static ngx_uint_t ngx_http_v2_header_indexing(ngx_table_elt_t *header);
 static u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
 static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
@@ -128,25 +124,18 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
-    ngx_uint_t                 i, port;
+    ngx_str_t                  host, location, name, value;
+    ngx_uint_t                 i, port, added, table_update;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
     ngx_connection_t          *fc;
     ngx_http_cleanup_t        *cln;
     ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_connection_t  *h2c;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
-
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
-#if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
-#endif
-
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
 
     if (!r->stream) {
         return ngx_http_next_header_filter(r);
@@ -227,20 +216,26 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = status ? 1 : 1 + ngx_http_v2_literal_size("418");
+    h2c = r->stream->connection;
+
+    /* room for dynamic table size updates */
+
+    len = 2 * NGX_HTTP_V2_INT_OCTETS;
+
+    len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_out.server == NULL) {
-        len += 1 + (clcf->server_tokens ? nginx_ver_len : sizeof(nginx));
+        len += 1 + ngx_http_v2_literal_size(NGINX_VER);
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -252,13 +247,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += 2 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -336,7 +331,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -344,7 +339,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += 2 + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -406,6 +401,23 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     start = pos;
 
+    /* the state of the encoder is restored if the block is not sent */
+
+    added = h2c->hpack_enc.added;
+    table_update = h2c->table_update;
+
+    if (h2c->table_update) {
+        h2c->table_update = 0;
+
+        if (h2c->hpack_enc.update_min < h2c->hpack_enc.update) {
+            pos = ngx_http_v2_write_table_update(h2c, pos,
+                                                 h2c->hpack_enc.update_min);
+        }
+
+        pos = ngx_http_v2_write_table_update(h2c, pos,
+                                             h2c->hpack_enc.update);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 output header: \":status: %03ui\"",
                    r->headers_out.status);
@@ -414,9 +426,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        ngx_str_set(&name, ":status");
+
+        value.len = 3;
+        value.data = ngx_sprintf(buf, "%03ui", r->headers_out.status) - 3;
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, &value, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.server == NULL) {
@@ -424,19 +442,18 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"server: %s\"",
                        clcf->server_tokens ? NGINX_VER : "nginx");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
+        ngx_str_set(&name, "server");
 
         if (clcf->server_tokens) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
+            ngx_str_set(&value, NGINX_VER);
 
         } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
+            ngx_str_set(&value, "nginx");
+        }
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, &value, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
         }
     }
 
@@ -445,13 +462,18 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        ngx_str_set(&name, "date");
+
+        value.len = ngx_cached_http_time.len;
+        value.data = ngx_cached_http_time.data;
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, &value, 0, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -461,7 +483,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
             p = ngx_pnalloc(r->pool, len);
             if (p == NULL) {
-                return NGX_ERROR;
+                goto failed;
             }
 
             p = ngx_cpymem(p, r->headers_out.content_type.data,
@@ -482,8 +504,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        ngx_str_set(&name, "content-type");
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                       &r->headers_out.content_type, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.content_length == NULL
@@ -493,30 +520,35 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        ngx_str_set(&name, "content-length");
+
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_write_header(h2c, pos, &name, &value, 0, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        value.data = buf;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
 
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"",
+                       &value);
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_str_set(&name, "last-modified");
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, &name, &value, 0, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -524,9 +556,14 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        ngx_str_set(&name, "location");
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                       &r->headers_out.location->value, 0,
+                                       tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 
 #if (NGX_HTTP_GZIP)
@@ -534,8 +571,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        ngx_str_set(&name, "vary");
+        ngx_str_set(&value, "Accept-Encoding");
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, &value, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
     }
 #endif
 
@@ -568,27 +610,27 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
-
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, &header[i].key,
+                                       &header[i].value,
+                                       ngx_http_v2_header_indexing(&header[i]),
+                                       tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
+    }
 
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        goto failed;
     }
 
     frame = ngx_http_v2_create_headers_frame(r, start, pos);
     if (frame == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     ngx_http_v2_queue_blocked_frame(r->stream->connection, frame);
 
-    cln = ngx_http_cleanup_add(r, 0);
-    if (cln == NULL) {
-        return NGX_ERROR;
-    }
-
     cln->handler = ngx_http_v2_filter_cleanup;
     cln->data = r->stream;
 
@@ -598,6 +640,103 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     fc->need_last_buf = 1;
 
     return ngx_http_v2_filter_send(fc, r->stream);
+
+failed:
+
+    if (h2c->hpack_enc.added != added) {
+        ngx_http_v2_table_discard(h2c);
+    }
+
+    h2c->table_update = table_update;
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing, u_char *tmp)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  index, prefix;
+
+    rc = ngx_http_v2_table_lookup(h2c, name, value, &index);
+
+    if (rc == NGX_OK) {
+        *pos = 128;
+        return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), index);
+    }
+
+    if (indexing) {
+        rc = ngx_http_v2_table_insert(h2c, name, value);
+
+        if (rc == NGX_ERROR) {
+            return NULL;
+        }
+    }
+
+    if (rc == NGX_OK) {
+        /* literal header field with incremental indexing */
+        *pos = 64;
+        prefix = ngx_http_v2_prefix(6);
+
+    } else {
+        /* literal header field without indexing */
+        *pos = 0;
+        prefix = ngx_http_v2_prefix(4);
+    }
+
+    if (index) {
+        pos = ngx_http_v2_write_int(pos, prefix, index);
+
+    } else {
+        pos++;
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static u_char *
+ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 output hpack table size update: %uz", size);
+
+    ngx_http_v2_table_resize(h2c, size);
+
+    *pos = 32;
+    return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), size);
+}
+
+
+static ngx_uint_t
+ngx_http_v2_header_indexing(ngx_table_elt_t *header)
+{
+    ngx_str_t  *name;
+
+    /* the values of these headers are unlikely to repeat */
+
+    static ngx_str_t  volatile_headers[] = {
+        ngx_string("age"),
+        ngx_string("content-range"),
+        ngx_string("etag"),
+        ngx_string("expires"),
+        ngx_string("set-cookie"),
+        ngx_null_string
+    };
+
+    for (name = volatile_headers; name->len; name++) {
+        if (name->len == header->key.len
+            && ngx_strncasecmp(name->data, header->key.data, name->len) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
 }
 
 
@@ -1103,8 +1242,7 @@ static void
 ngx_http_v2_waiting_queue(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_stream_t *stream)
 {
-    ngx_queue_t           *q;
-    ngx_http_v2_stream_t  *s;
+    ngx_rbtree_key_t  key;
 
     if (stream->waiting) {
         return;
@@ -1112,21 +1250,17 @@ ngx_http_v2_waiting_queue(ngx_http_v2_connection_t *h2c,
 
     stream->waiting = 1;
 
-    for (q = ngx_queue_last(&h2c->waiting);
-         q != ngx_queue_sentinel(&h2c->waiting);
-         q = ngx_queue_prev(q))
-    {
-        s = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
+    /* the least served streams get the connection window first */
 
-        if (s->node->rank < stream->node->rank
-            || (s->node->rank == stream->node->rank
-                && s->node->rel_weight >= stream->node->rel_weight))
-        {
-            break;
-        }
+    key = stream->vtime;
+
+    if ((ngx_rbtree_key_int_t) (key - h2c->vtime) < 0) {
+        key = h2c->vtime;
     }
 
-    ngx_queue_insert_after(q, &stream->queue);
+    stream->waiting_node.key = key;
+
+    ngx_rbtree_insert(&h2c->waiting, &stream->waiting_node);
 }
 
 
@@ -1333,13 +1467,15 @@ ngx_http_v2_filter_cleanup(void *data)
 
     size_t                     window;
     ngx_event_t               *wev;
-    ngx_queue_t               *q;
-    ngx_http_v2_out_frame_t   *frame, **fn;
+    ngx_rbtree_node_t         *node, *next;
+    ngx_http_v2_out_frame_t   *frame;
     ngx_http_v2_connection_t  *h2c;
 
+    h2c = stream->connection;
+
     if (stream->waiting) {
         stream->waiting = 0;
-        ngx_queue_remove(&stream->queue);
+        ngx_rbtree_delete(&h2c->waiting, &stream->waiting_node);
     }
 
     if (stream->queued == 0) {
@@ -1347,39 +1483,43 @@ ngx_http_v2_filter_cleanup(void *data)
     }
 
     window = 0;
-    h2c = stream->connection;
-    fn = &h2c->last_out;
 
-    for ( ;; ) {
-        frame = *fn;
+    if (h2c->frames.root != h2c->frames.sentinel) {
+        node = ngx_rbtree_min(h2c->frames.root, h2c->frames.sentinel);
 
-        if (frame == NULL) {
-            break;
-        }
+    } else {
+        node = NULL;
+    }
+
+    while (node) {
+        next = ngx_rbtree_next(&h2c->frames, node);
 
-        if (frame->stream == stream && !frame->blocked) {
-            *fn = frame->next;
+        frame = (ngx_http_v2_out_frame_t *)
+                    ((u_char *) node - offsetof(ngx_http_v2_out_frame_t, node));
+
+        if (frame->stream == stream) {
+            ngx_rbtree_delete(&h2c->frames, node);
 
             window += frame->length;
 
             if (--stream->queued == 0) {
                 break;
             }
-
-            continue;
         }
 
-        fn = &frame->next;
+        node = next;
     }
 
     if (h2c->send_window == 0 && window) {
 
-        while (!ngx_queue_empty(&h2c->waiting)) {
-            q = ngx_queue_head(&h2c->waiting);
+        while (h2c->waiting.root != h2c->waiting.sentinel) {
+            node = ngx_rbtree_min(h2c->waiting.root, h2c->waiting.sentinel);
 
-            ngx_queue_remove(q);
+            ngx_rbtree_delete(&h2c->waiting, node);
 
-            stream = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
+            stream = (ngx_http_v2_stream_t *)
+                         ((u_char *) node
+                          - offsetof(ngx_http_v2_stream_t, waiting_node));
 
             stream->waiting = 0;
 
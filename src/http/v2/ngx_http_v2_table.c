@@ -10,9 +10,6 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
 
@@ -347,3 +344,253 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+/*
+ * The encoder side table mirrors the dynamic table of the client decoder.
+ * Entries are accounted exactly as the client does, while the data of
+ * the oldest entries may be overwritten earlier, as names and values are
+ * kept contiguous in the storage; such entries are no longer referenced.
+ */
+
+ngx_int_t
+ngx_http_v2_table_lookup(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t *index)
+{
+    ngx_uint_t                  i, name_index;
+    ngx_http_v2_header_t       *entry;
+    ngx_http_v2_hpack_enc_t    *hpack;
+
+    name_index = 0;
+
+    for (i = 0; i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES; i++) {
+        entry = &ngx_http_v2_static_table[i];
+
+        if (entry->name.len != name->len
+            || ngx_strncasecmp(entry->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (entry->value.len == value->len
+            && ngx_strncmp(entry->value.data, value->data, value->len) == 0)
+        {
+            *index = i + 1;
+            return NGX_OK;
+        }
+
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+
+    hpack = &h2c->hpack_enc;
+
+    if (hpack->valid < hpack->deleted) {
+        hpack->valid = hpack->deleted;
+    }
+
+    for (i = hpack->added; i > hpack->valid; /* void */) {
+        entry = &hpack->entries[--i % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->name.data == NULL
+            || entry->name.len != name->len
+            || ngx_strncasecmp(entry->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (entry->value.len == value->len
+            && ngx_strncmp(entry->value.data, value->data, value->len) == 0)
+        {
+            *index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + hpack->added - i;
+            return NGX_OK;
+        }
+
+        if (name_index == 0) {
+            name_index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + hpack->added - i;
+        }
+    }
+
+    *index = name_index;
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    size_t                    size;
+    u_char                   *end;
+    ngx_http_v2_header_t     *entry;
+    ngx_http_v2_hpack_enc_t  *hpack;
+
+    hpack = &h2c->hpack_enc;
+
+    size = name->len + value->len;
+
+    /* large entries would flush the whole table */
+
+    if (32 + size > hpack->size / 4) {
+        return NGX_DECLINED;
+    }
+
+    if (hpack->entries == NULL) {
+        hpack->entries = ngx_palloc(h2c->connection->pool,
+                                    sizeof(ngx_http_v2_header_t)
+                                    * NGX_HTTP_V2_TABLE_ENTRIES);
+        if (hpack->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        hpack->storage = ngx_palloc(h2c->connection->pool,
+                                    NGX_HTTP_V2_TABLE_SIZE);
+        if (hpack->storage == NULL) {
+            return NGX_ERROR;
+        }
+
+        hpack->pos = hpack->storage;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 add header to encoder hpack table: \"%V: %V\"",
+                   name, value);
+
+    while (32 + size > hpack->free) {
+        entry = &hpack->entries[hpack->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+        hpack->free += 32 + entry->name.len + entry->value.len;
+    }
+
+    hpack->free -= 32 + size;
+
+    if (hpack->valid < hpack->deleted) {
+        hpack->valid = hpack->deleted;
+    }
+
+    end = hpack->storage + NGX_HTTP_V2_TABLE_SIZE;
+
+    if ((size_t) (end - hpack->pos) < size) {
+
+        /* the tail is skipped, the entries stored there are the oldest */
+
+        while (hpack->valid < hpack->added) {
+            entry = &hpack->entries[hpack->valid % NGX_HTTP_V2_TABLE_ENTRIES];
+
+            if (entry->name.data && entry->name.data < hpack->pos) {
+                break;
+            }
+
+            entry->name.data = NULL;
+            hpack->valid++;
+        }
+
+        hpack->pos = hpack->storage;
+    }
+
+    while (hpack->valid < hpack->added) {
+        entry = &hpack->entries[hpack->valid % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->name.data
+            && (entry->name.data < hpack->pos
+                || entry->name.data >= hpack->pos + size))
+        {
+            break;
+        }
+
+        entry->name.data = NULL;
+        hpack->valid++;
+    }
+
+    entry = &hpack->entries[hpack->added++ % NGX_HTTP_V2_TABLE_ENTRIES];
+
+    entry->name.len = name->len;
+    entry->name.data = hpack->pos;
+
+    ngx_strlow(hpack->pos, name->data, name->len);
+    hpack->pos += name->len;
+
+    entry->value.len = value->len;
+    entry->value.data = hpack->pos;
+
+    hpack->pos = ngx_cpymem(hpack->pos, value->data, value->len);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_v2_table_resize(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_header_t     *entry;
+    ngx_http_v2_hpack_enc_t  *hpack;
+
+    hpack = &h2c->hpack_enc;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 new encoder hpack table size: %uz was:%uz",
+                   size, hpack->size);
+
+    while (hpack->size - hpack->free > size) {
+        entry = &hpack->entries[hpack->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+        hpack->free += 32 + entry->name.len + entry->value.len;
+    }
+
+    hpack->free = size - (hpack->size - hpack->free);
+    hpack->size = size;
+}
+
+
+/*
+ * If a header block is not sent after entries were inserted, the entries
+ * inserted before are no longer referenced, as their indices differ from
+ * those of the client.  The lost entries are still accounted, so entries
+ * are evicted from the encoder side table no later than from the client's.
+ */
+
+void
+ngx_http_v2_table_discard(ngx_http_v2_connection_t *h2c)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 discard encoder hpack table entries");
+
+    h2c->hpack_enc.valid = h2c->hpack_enc.added;
+}
+
+
+void
+ngx_http_v2_table_settings(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t  *hpack;
+
+    hpack = &h2c->hpack_enc;
+
+    if (size > NGX_HTTP_V2_TABLE_SIZE) {
+        size = NGX_HTTP_V2_TABLE_SIZE;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 client hpack table size: %uz was:%uz",
+                   size, hpack->size);
+
+    /*
+     * the smallest size set since the last header block
+     * and the final size are signalled in the next one
+     */
+
+    if (!h2c->table_update) {
+
+        if (size == hpack->size) {
+            return;
+        }
+
+        h2c->table_update = 1;
+        hpack->update_min = size;
+
+    } else if (size < hpack->update_min) {
+        hpack->update_min = size;
+    }
+
+    hpack->update = size;
+}
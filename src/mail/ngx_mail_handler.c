@@ -188,6 +188,20 @@ ngx_mail_init_connection(ngx_connection_t *c)
         return;
     }
 
+#if (NGX_HAVE_IO_URING)
+
+    /*
+     * STARTTLS hands the socket over to OpenSSL, so the data may not be
+     * read ahead with the recv requests of the uring event method
+     */
+
+    if (sslcf->starttls) {
+        c->recv = ngx_os_io.recv;
+        c->recv_chain = ngx_os_io.recv_chain;
+    }
+
+#endif
+
     }
 #endif
 
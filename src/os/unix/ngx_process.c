@@ -586,6 +586,20 @@ ngx_unlock_mutexes(ngx_pid_t pid)
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
         }
+
+        if (ngx_slab_force_unlock(sp, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "shared memory zone \"%V\" allocator "
+                          "was locked by %P", &shm_zone[i].shm.name, pid);
+        }
+
+        /* the zones may have their own mutexes in addition to the pool one */
+
+        if (shm_zone[i].unlock && shm_zone[i].unlock(&shm_zone[i], pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "shared memory zone \"%V\" was partially locked "
+                          "by %P", &shm_zone[i].shm.name, pid);
+        }
     }
 }
 